@@ -0,0 +1,149 @@
+/*
+ * HVE Hardware Video Encoder library benchmark of per-frame overhead with batch submission
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <stdio.h> //printf, fprintf
+#include <stdlib.h> //atoi
+#include <string.h> //memset
+#include <inttypes.h> //uint8_t
+#include <time.h> //clock_gettime
+
+#include "../hve.h"
+
+const int WIDTH=64; //small frames so that per-frame overhead dominates
+const int HEIGHT=64;
+const int FRAMERATE=30;
+const char *PIXEL_FORMAT="nv12";
+
+#define MAX_BATCH 256
+
+int FRAMES=10000;
+int BATCH=32;
+const char *ENCODER="rawvideo"; //near null encoder isolates library overhead, or e.g. "libx264", "h264_vaapi"
+const char *DEVICE=NULL; //NULL for default or device e.g. "/dev/dri/renderD128"
+
+double encoding_loop(int batch, double *allocs);
+double now_ms();
+int process_user_input(int argc, char* argv[]);
+
+int main(int argc, char* argv[])
+{
+	if( process_user_input(argc, argv) < 0 )
+		return -1;
+
+	double single_allocs, batch_allocs;
+	double single_ms = encoding_loop(1, &single_allocs);
+	double batch_ms = encoding_loop(BATCH, &batch_allocs);
+
+	if(single_ms < 0 || batch_ms < 0)
+		return fprintf(stderr, "benchmark failed\n");
+
+	printf("%-20s %12s %14s\n", "mode", "us/frame", "allocs/frame");
+	printf("%-20s %12.3f %14.3f\n", "hve_send_frame", single_ms * 1000.0 / FRAMES, single_allocs);
+	printf("batch %-14d %12.3f %14.3f\n", BATCH, batch_ms * 1000.0 / FRAMES, batch_allocs);
+
+	return 0;
+}
+
+// returns time spent in ms or negative on failure, allocs are HVE allocations per frame
+double encoding_loop(int batch, double *allocs)
+{
+	struct hve_config config = {0};
+	struct hve_stats before, after;
+	struct hve_frame frames[MAX_BATCH] = { {{0}} };
+	static uint8_t data[64*64*3/2];
+	struct hve *h;
+	AVPacket *packet;
+	int f, failed = HVE_OK;
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.device = DEVICE;
+	config.encoder = ENCODER;
+	config.pixel_format = PIXEL_FORMAT;
+
+	if( (h = hve_init(&config)) == NULL )
+		return -1;
+
+	memset(data, 128, sizeof(data));
+
+	for(int i = 0; i < batch; ++i)
+	{
+		frames[i].linesize[0] = frames[i].linesize[1] = WIDTH;
+		frames[i].data[0] = data;
+		frames[i].data[1] = data + WIDTH * HEIGHT;
+	}
+
+	hve_get_stats(h, &before);
+	double start = now_ms();
+
+	for(f = 0; f < FRAMES && !failed; f += batch)
+	{
+		int n = FRAMES - f < batch ? FRAMES - f : batch;
+
+		if(batch == 1 && hve_send_frame(h, frames) != HVE_OK)
+			break;
+
+		if(batch > 1 && hve_send_frames(h, frames, n) != n)
+			break;
+
+		while( (packet=hve_receive_packet(h, &failed)) )
+			;
+	}
+
+	double elapsed = now_ms() - start;
+
+	hve_get_stats(h, &after);
+	*allocs = (double)(after.allocs_upload + after.allocs_filter + after.allocs_encode + after.allocs_queue -
+	          before.allocs_upload - before.allocs_filter - before.allocs_encode - before.allocs_queue) / FRAMES;
+
+	hve_send_frame(h, NULL);
+	while( (packet=hve_receive_packet(h, &failed)) )
+		;
+
+	hve_close(h);
+
+	return f >= FRAMES ? elapsed : -1;
+}
+
+double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int process_user_input(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <frames> [batch] [encoder] [device]\n", argv[0]);
+		fprintf(stderr, "\nexamples:\n");
+		fprintf(stderr, "%s 10000\n", argv[0]);
+		fprintf(stderr, "%s 10000 64 rawvideo\n", argv[0]);
+		fprintf(stderr, "%s 10000 32 libx264\n", argv[0]);
+		fprintf(stderr, "%s 10000 32 h264_vaapi /dev/dri/renderD128\n", argv[0]);
+		return -1;
+	}
+
+	FRAMES = atoi(argv[1]);
+	BATCH = argc > 2 ? atoi(argv[2]) : BATCH;
+	ENCODER = argc > 3 ? argv[3] : ENCODER;
+	DEVICE = argc > 4 ? argv[4] : DEVICE;
+
+	if(BATCH < 2 || BATCH > MAX_BATCH)
+	{
+		fprintf(stderr, "batch should be between 2 and %d\n", MAX_BATCH);
+		return -1;
+	}
+
+	return 0;
+}
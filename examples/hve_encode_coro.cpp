@@ -0,0 +1,271 @@
+/*
+ * HVE Hardware Video Encoder library example of C++20 coroutines multiplexing sessions on thread pool
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstdio> //printf, fprintf
+#include <cstdlib> //atoi
+#include <algorithm> //std::fill
+#include <atomic> //std::atomic
+#include <condition_variable> //std::condition_variable
+#include <deque> //std::deque
+#include <exception> //std::terminate
+#include <latch> //std::latch
+#include <mutex> //std::mutex
+#include <string> //std::to_string
+#include <thread> //std::thread
+#include <vector> //std::vector
+
+#include "../hve.hpp"
+
+const int WIDTH=640;
+const int HEIGHT=360;
+const int FRAMERATE=30;
+const char *PIXEL_FORMAT="nv12";
+const int MAX_SESSIONS=64;
+
+int SECONDS=10;
+int SESSIONS=8;
+int THREADS=2; //executor threads shared by all the sessions
+const char *ENCODER="libx264"; //or e.g. "h264_vaapi", "h264_nvenc"
+const char *DEVICE=NULL; //NULL for default or device e.g. "/dev/dri/renderD128"
+
+// minimal executor, in real code e.g. asio::thread_pool or io_uring based one
+class ThreadPool
+{
+public:
+	explicit ThreadPool(int threads)
+	{
+		for(int i = 0; i < threads; ++i)
+			workers.emplace_back([this] { run(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		cond.notify_all();
+
+		for(auto &worker : workers)
+			worker.join();
+	}
+
+	void post(hvepp::AsyncEncoder::Job job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(std::move(job));
+		}
+		cond.notify_one();
+	}
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		while(true)
+		{
+			cond.wait(lock, [this] { return stop || !jobs.empty(); });
+
+			if(jobs.empty())
+				return;
+
+			auto job = std::move(jobs.front());
+			jobs.pop_front();
+
+			lock.unlock();
+			job();
+			lock.lock();
+		}
+	}
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<hvepp::AsyncEncoder::Job> jobs;
+	std::vector<std::thread> workers;
+	bool stop = false;
+};
+
+// fire and forget coroutine
+struct Task
+{
+	struct promise_type
+	{
+		Task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+// continues coroutine on pool thread (start and yield between frames)
+struct Reschedule
+{
+	ThreadPool &pool;
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> handle) { pool.post([handle] { handle.resume(); }); }
+	void await_resume() const noexcept {}
+};
+
+Task produce(hvepp::AsyncEncoder &encoder, ThreadPool &pool, std::latch &finished, std::atomic<int> &failures);
+Task consume(hvepp::AsyncEncoder &encoder, ThreadPool &pool, FILE *output_file, std::latch &finished, std::atomic<int> &failures);
+int process_user_input(int argc, char* argv[]);
+
+int main(int argc, char* argv[])
+{
+	struct hve_config config = {};
+	std::vector<FILE*> files;
+	std::atomic<int> failures{0};
+
+	if( process_user_input(argc, argv) < 0 )
+		return -1;
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.device = DEVICE;
+	config.encoder = ENCODER;
+	config.pixel_format = PIXEL_FORMAT;
+
+	//declared before encoders to outlive them, library may still post jobs while sessions close
+	ThreadPool pool(THREADS);
+	std::vector<hvepp::AsyncEncoder> encoders;
+
+	for(int i = 0; i < SESSIONS; ++i)
+	{
+		auto encoder = hvepp::AsyncEncoder::create(config, [&pool](hvepp::AsyncEncoder::Job job) { pool.post(std::move(job)); });
+
+		if(!encoder)
+			return fprintf(stderr, "unable to initalize encoder %d (%s)\n", i, encoder.error().what);
+
+		std::string name = "output" + std::to_string(i) + ".h264";
+		FILE *output_file = fopen(name.c_str(), "w+b");
+
+		if(output_file == NULL)
+			return fprintf(stderr, "unable to open file %s for output\n", name.c_str());
+
+		encoders.push_back(std::move(*encoder));
+		files.push_back(output_file);
+	}
+
+	std::latch finished(2 * SESSIONS);
+
+	//no thread per session, everything runs on the pool
+	for(int i = 0; i < SESSIONS; ++i)
+	{
+		consume(encoders[i], pool, files[i], finished, failures);
+		produce(encoders[i], pool, finished, failures);
+	}
+
+	finished.wait();
+
+	for(FILE *output_file : files)
+		fclose(output_file);
+
+	if(failures)
+		return fprintf(stderr, "%d coroutines failed\n", failures.load());
+
+	printf("output written to \"output0.h264\" ... \"output%d.h264\" files\n", SESSIONS - 1);
+
+	return 0;
+}
+
+Task produce(hvepp::AsyncEncoder &encoder, ThreadPool &pool, std::latch &finished, std::atomic<int> &failures)
+{
+	co_await Reschedule{pool};
+
+	std::vector<uint8_t> Y(WIDTH * HEIGHT), color(WIDTH * HEIGHT / 2, 128);
+	hvepp::Frame frame;
+
+	frame.planes[0] = Y;
+	frame.planes[1] = color;
+	frame.linesize[0] = frame.linesize[1] = WIDTH;
+
+	for(int f = 0; f < SECONDS * FRAMERATE; ++f)
+	{
+		//moving through gray
+		std::fill(Y.begin(), Y.end(), (uint8_t)(f % 255));
+
+		auto sent = co_await encoder.send(frame);
+
+		if(!sent)
+		{
+			fprintf(stderr, "%s failed\n", sent.error().what);
+			++failures;
+			break;
+		}
+
+		//let other sessions use this thread
+		co_await Reschedule{pool};
+	}
+
+	//consumer is waiting for the end of stream in any case
+	if(!co_await encoder.flush())
+		++failures;
+
+	finished.count_down();
+}
+
+Task consume(hvepp::AsyncEncoder &encoder, ThreadPool &pool, FILE *output_file, std::latch &finished, std::atomic<int> &failures)
+{
+	co_await Reschedule{pool};
+
+	while(true)
+	{
+		auto packet = co_await encoder.next_packet();
+
+		if(!packet)
+		{
+			fprintf(stderr, "%s failed\n", packet.error().what);
+			++failures;
+			break;
+		}
+
+		//flushed encoder drained
+		if(!*packet)
+			break;
+
+		fwrite((*packet)->data().data(), (*packet)->data().size(), 1, output_file);
+	}
+
+	finished.count_down();
+}
+
+int process_user_input(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <seconds> [sessions] [threads] [encoder] [device]\n", argv[0]);
+		fprintf(stderr, "\nexamples:\n");
+		fprintf(stderr, "%s 10\n", argv[0]);
+		fprintf(stderr, "%s 10 16 2 libx264\n", argv[0]);
+		fprintf(stderr, "%s 10 8 2 h264_vaapi /dev/dri/renderD128\n", argv[0]);
+		fprintf(stderr, "%s 10 8 2 h264_nvenc\n", argv[0]);
+		return -1;
+	}
+
+	SECONDS = atoi(argv[1]);
+	SESSIONS = argc > 2 ? atoi(argv[2]) : SESSIONS;
+	THREADS = argc > 3 ? atoi(argv[3]) : THREADS;
+	ENCODER = argc > 4 ? argv[4] : ENCODER;
+	DEVICE = argc > 5 ? argv[5] : DEVICE;
+
+	if(SESSIONS < 1 || SESSIONS > MAX_SESSIONS || THREADS < 1)
+	{
+		fprintf(stderr, "sessions should be between 1 and %d, threads positive\n", MAX_SESSIONS);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * HVE Hardware Video Encoder library example of C++ wrapper with packets handed off to writer thread
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstdio> //printf, fprintf
+#include <algorithm> //std::fill
+#include <cstdlib> //atoi
+#include <condition_variable> //std::condition_variable
+#include <deque> //std::deque
+#include <mutex> //std::mutex
+#include <thread> //std::thread
+#include <vector> //std::vector
+
+#include "../hve.hpp"
+
+const int WIDTH=1280;
+const int HEIGHT=720;
+const int FRAMERATE=30;
+const char *PIXEL_FORMAT="nv12";
+
+int SECONDS=10;
+const char *ENCODER=NULL; //NULL for default (h264_vaapi) or FFmpeg encoder e.g. "h264_vaapi", "h264_nvenc", "libx264"
+const char *DEVICE=NULL; //NULL for default or device e.g. "/dev/dri/renderD128"
+
+// packets moved from encoding thread, written on writer thread without copying payload
+struct PacketChannel
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<hvepp::Packet> packets;
+	bool closed = false;
+};
+
+int encoding_loop(hvepp::Encoder &encoder, PacketChannel &channel);
+void writer_loop(PacketChannel &channel, FILE *output_file);
+int process_user_input(int argc, char* argv[]);
+
+int main(int argc, char* argv[])
+{
+	struct hve_config config = {};
+	PacketChannel channel;
+
+	if( process_user_input(argc, argv) < 0 )
+		return -1;
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.device = DEVICE;
+	config.encoder = ENCODER;
+	config.pixel_format = PIXEL_FORMAT;
+
+	FILE *output_file = fopen("output.h264", "w+b");
+	if(output_file == NULL)
+		return fprintf(stderr, "unable to open file for output\n");
+
+	auto encoder = hvepp::Encoder::create(config);
+
+	if(!encoder)
+	{
+		fclose(output_file);
+		return fprintf(stderr, "unable to initalize encoder (%s)\n", encoder.error().what);
+	}
+
+	std::thread writer(writer_loop, std::ref(channel), output_file);
+
+	int status = encoding_loop(*encoder, channel);
+
+	{
+		std::lock_guard<std::mutex> lock(channel.mutex);
+		channel.closed = true;
+	}
+	channel.cond.notify_one();
+	writer.join();
+
+	fclose(output_file);
+
+	if(status == 0)
+		printf("output written to \"output.h264\" file\n");
+
+	return status;
+}
+
+int encoding_loop(hvepp::Encoder &encoder, PacketChannel &channel)
+{
+	std::vector<uint8_t> Y(WIDTH * HEIGHT), color(WIDTH * HEIGHT / 2, 128);
+	hvepp::Frame frame;
+	int frames = SECONDS * FRAMERATE, f;
+
+	frame.planes[0] = Y;
+	frame.planes[1] = color;
+	frame.linesize[0] = frame.linesize[1] = WIDTH;
+
+	//the same flow as in C, flushing after the last frame
+	for(f = 0; f <= frames; ++f)
+	{
+		//moving through gray
+		std::fill(Y.begin(), Y.end(), (uint8_t)(f % 255));
+
+		auto sent = f < frames ? encoder.send(frame) : encoder.flush();
+
+		if(!sent)
+		{
+			fprintf(stderr, "%s failed\n", sent.error().what);
+			return -1;
+		}
+
+		while(true)
+		{
+			auto packet = encoder.receive();
+
+			if(!packet)
+			{
+				fprintf(stderr, "%s failed\n", packet.error().what);
+				return -1;
+			}
+
+			if(!*packet)
+				break;
+
+			//only the reference changes hands, payload stays where encoder put it
+			std::lock_guard<std::mutex> lock(channel.mutex);
+			channel.packets.push_back(std::move(**packet));
+			channel.cond.notify_one();
+		}
+	}
+
+	return 0;
+}
+
+void writer_loop(PacketChannel &channel, FILE *output_file)
+{
+	std::unique_lock<std::mutex> lock(channel.mutex);
+
+	while(true)
+	{
+		channel.cond.wait(lock, [&channel] { return channel.closed || !channel.packets.empty(); });
+
+		if(channel.packets.empty())
+			break;
+
+		hvepp::Packet packet = std::move(channel.packets.front());
+		channel.packets.pop_front();
+
+		lock.unlock();
+		fwrite(packet.data().data(), packet.data().size(), 1, output_file);
+		lock.lock();
+	}
+}
+
+int process_user_input(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <seconds> [encoder] [device]\n", argv[0]);
+		fprintf(stderr, "\nexamples:\n");
+		fprintf(stderr, "%s 10\n", argv[0]);
+		fprintf(stderr, "%s 10 h264_vaapi /dev/dri/renderD128\n", argv[0]);
+		fprintf(stderr, "%s 10 h264_nvenc\n", argv[0]);
+		fprintf(stderr, "%s 10 libx264\n", argv[0]);
+		return -1;
+	}
+
+	SECONDS = atoi(argv[1]);
+	ENCODER = argc > 2 ? argv[2] : ENCODER;
+	DEVICE = argc > 3 ? argv[3] : DEVICE;
+
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * HVE Hardware Video Encoder library example of closed-loop quality target encoding
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <stdio.h> //printf, fprintf
+#include <stdlib.h> //atoi
+#include <inttypes.h> //uint8_t, PRId64
+
+#include "../hve.h"
+
+const int WIDTH=1280;
+const int HEIGHT=720;
+const int FRAMERATE=30;
+const char *PIXEL_FORMAT="nv12";
+const int GOP_SIZE=30; //reopening encoders (other than x264) apply new rate control at keyframe period boundary
+
+int SECONDS=10;
+int QUALITY_TARGET=970; //SSIM in thousandths
+int QP=18; //starting point, high quality (use bit_rate instead for VBR)
+const char *ENCODER="libx264"; //reconfigured live, or e.g. "h264_vaapi", "h264_nvenc"
+const char *DEVICE=NULL; //NULL for default or device e.g. "/dev/dri/renderD128"
+
+int encoding_loop(struct hve *h, FILE *output_file);
+int process_user_input(int argc, char* argv[]);
+
+int main(int argc, char* argv[])
+{
+	struct hve_config config = {0};
+	struct hve *h;
+
+	if( process_user_input(argc, argv) < 0 )
+		return -1;
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.device = DEVICE;
+	config.encoder = ENCODER;
+	config.pixel_format = PIXEL_FORMAT;
+	config.gop_size = GOP_SIZE;
+	config.qp = QP;
+	config.quality_target = QUALITY_TARGET;
+
+	FILE *output_file = fopen("output.h264", "w+b");
+	if(output_file == NULL)
+		return fprintf(stderr, "unable to open file for output\n");
+
+	if( (h = hve_init(&config)) == NULL )
+	{
+		fclose(output_file);
+		return fprintf(stderr, "unable to initalize encoder\n");
+	}
+
+	int status = encoding_loop(h, output_file);
+
+	hve_close(h);
+	fclose(output_file);
+
+	if(status == 0)
+		printf("output written to \"output.h264\" file\n");
+
+	return status;
+}
+
+int encoding_loop(struct hve *h, FILE *output_file)
+{
+	struct hve_frame frame = { 0 };
+	struct hve_stats stats;
+	int frames = SECONDS * FRAMERATE, f, failed;
+	static uint8_t Y[1280*720], color[1280*720/2];
+	AVPacket *packet;
+
+	frame.linesize[0] = frame.linesize[1] = WIDTH;
+	frame.data[0] = Y;
+	frame.data[1] = color;
+
+	printf("%8s %8s %6s %10s\n", "second", "ssim", "qp", "saved kB");
+
+	for(f = 0; f < frames; ++f)
+	{
+		//moving diagonal pattern, something for the encoder to work on
+		for(int y = 0; y < HEIGHT; ++y)
+			for(int x = 0; x < WIDTH; ++x)
+				Y[y * WIDTH + x] = (uint8_t)((x + y + 4 * f) ^ (x * y >> 6));
+		for(int i = 0; i < WIDTH * HEIGHT / 2; ++i)
+			color[i] = (uint8_t)(128 + (i + f) % 32);
+
+		if( hve_send_frame(h, &frame) != HVE_OK)
+			break;
+
+		while( (packet=hve_receive_packet(h, &failed)) )
+			fwrite(packet->data, packet->size, 1, output_file);
+
+		if(failed)
+			break;
+
+		if((f + 1) % FRAMERATE == 0 && hve_get_stats(h, &stats) == HVE_OK)
+			printf("%8d %8.4f %6d %10" PRId64 "\n", (f + 1) / FRAMERATE, stats.quality_ssim, stats.quality_qp, stats.quality_bits_saved / 8000);
+	}
+
+	hve_send_frame(h, NULL);
+	while( (packet=hve_receive_packet(h, &failed)) )
+		fwrite(packet->data, packet->size, 1, output_file);
+
+	if(hve_get_stats(h, &stats) == HVE_OK)
+	{
+		printf("\nconverged after %d ms (0 if not yet)\n", stats.quality_converged_ms);
+		printf("saved %" PRId64 " kB versus fixed qp %d (estimated)\n", stats.quality_bits_saved / 8000, QP);
+	}
+
+	return f == frames ? 0 : -1;
+}
+
+int process_user_input(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <seconds> [ssim target in thousandths] [encoder] [device]\n", argv[0]);
+		fprintf(stderr, "\nexamples:\n");
+		fprintf(stderr, "%s 10\n", argv[0]);
+		fprintf(stderr, "%s 10 950 libx264\n", argv[0]);
+		fprintf(stderr, "%s 10 970 h264_vaapi /dev/dri/renderD128\n", argv[0]);
+		fprintf(stderr, "%s 10 970 h264_nvenc\n", argv[0]);
+		return -1;
+	}
+
+	SECONDS = atoi(argv[1]);
+	QUALITY_TARGET = argc > 2 ? atoi(argv[2]) : QUALITY_TARGET;
+	ENCODER = argc > 3 ? argv[3] : ENCODER;
+	DEVICE = argc > 4 ? argv[4] : DEVICE;
+
+	if(QUALITY_TARGET <= 0 || QUALITY_TARGET >= 1000)
+	{
+		fprintf(stderr, "ssim target should be between 1 and 999\n");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * HVE Hardware Video Encoder library example of tile-parallel encoding of very large frames
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <stdio.h> //printf, fprintf
+#include <stdlib.h> //atoi, malloc
+#include <string.h> //memset
+#include <inttypes.h> //uint8_t
+#include <time.h> //clock_gettime
+
+#include "../hve.h"
+
+const int WIDTH=7680; //8K, beyond single session limit of many encoders
+const int HEIGHT=4320;
+const int FRAMERATE=30;
+const char *PIXEL_FORMAT="nv12";
+const int GOP_SIZE=30; //IDRs are aligned across tiles
+
+#define MAX_TILES 16
+
+int FRAMES=300;
+int COLUMNS=4;
+int ROWS=4;
+const char *ENCODER=NULL; //NULL for default (h264_vaapi) or FFmpeg encoder e.g. "h264_nvenc", "libx264"
+const char *DEVICE=NULL; //NULL for default or device e.g. "/dev/dri/renderD128"
+
+double encoding_loop(struct hve *h, uint8_t *data, int columns, int rows, FILE **outputs);
+double now_ms();
+int process_user_input(int argc, char* argv[]);
+
+int main(int argc, char* argv[])
+{
+	struct hve_config config = {0};
+	struct hve *h;
+	FILE *outputs[MAX_TILES] = {0};
+	char name[64];
+	int status = 0;
+
+	if( process_user_input(argc, argv) < 0 )
+		return -1;
+
+	//dummy NV12 data for the whole large frame
+	uint8_t *data = (uint8_t*)malloc(WIDTH * HEIGHT * 3 / 2);
+
+	if(data == NULL)
+		return fprintf(stderr, "not enough memory for frame\n");
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.device = DEVICE;
+	config.encoder = ENCODER;
+	config.pixel_format = PIXEL_FORMAT;
+	config.gop_size = GOP_SIZE;
+	config.tile_columns = COLUMNS;
+	config.tile_rows = ROWS;
+
+	for(int i = 0; i < COLUMNS * ROWS && status == 0; ++i)
+	{
+		snprintf(name, sizeof(name), "output_tile_%d.h264", i);
+		if( (outputs[i] = fopen(name, "w+b")) == NULL )
+			status = fprintf(stderr, "unable to open file for output\n");
+	}
+
+	//all tiles in parallel
+	if(status == 0 && (h = hve_init(&config)) != NULL)
+	{
+		double tiles_ms = encoding_loop(h, data, COLUMNS, ROWS, outputs);
+		hve_close(h);
+
+		//single session encoding one tile for reference
+		config.width = WIDTH / COLUMNS;
+		config.height = HEIGHT / ROWS;
+		config.tile_columns = config.tile_rows = 0;
+
+		if(tiles_ms > 0 && (h = hve_init(&config)) != NULL)
+		{
+			double single_ms = encoding_loop(h, data, 1, 1, NULL);
+			hve_close(h);
+
+			double tiles_mpix = (double)WIDTH * HEIGHT * FRAMES / tiles_ms / 1000.0;
+			double single_mpix = (double)config.width * config.height * FRAMES / single_ms / 1000.0;
+
+			printf("tiles %dx%d: %.1f fps %.1f Mpix/s\n", COLUMNS, ROWS, FRAMES * 1000.0 / tiles_ms, tiles_mpix);
+			printf("single session: %.1f fps %.1f Mpix/s\n", FRAMES * 1000.0 / single_ms, single_mpix);
+			printf("aggregate throughput %.2fx single session\n", tiles_mpix / single_mpix);
+			printf("tile streams written to \"output_tile_<n>.h264\" files\n");
+		}
+		else
+			status = fprintf(stderr, "encoding failed\n");
+	}
+	else if(status == 0)
+		status = fprintf(stderr, "unable to initalize tile encoders\n");
+
+	for(int i = 0; i < COLUMNS * ROWS; ++i)
+		if(outputs[i])
+			fclose(outputs[i]);
+
+	free(data);
+
+	return status;
+}
+
+// returns time spent in ms or negative on failure
+double encoding_loop(struct hve *h, uint8_t *data, int columns, int rows, FILE **outputs)
+{
+	struct hve_frame frame = { 0 };
+	AVPacket *packets[MAX_TILES];
+	int f, count, failed;
+	double start = now_ms();
+
+	//stride of the large frame, single session reads only top-left tile
+	frame.linesize[0] = frame.linesize[1] = WIDTH;
+	frame.data[0] = data;
+	frame.data[1] = data + WIDTH * HEIGHT;
+
+	for(f = 0; f < FRAMES; ++f)
+	{
+		//ride through greyscale
+		memset(data, f % 255, WIDTH * HEIGHT);
+		memset(data + WIDTH * HEIGHT, 128, WIDTH * HEIGHT / 2);
+
+		if( hve_send_frame(h, &frame) != HVE_OK)
+			break;
+
+		//bundle of packets with the same timestamp, one per tile
+		while( (count = hve_receive_packets(h, packets, &failed)) )
+			for(int i = 0; outputs && i < count; ++i)
+				fwrite(packets[i]->data, packets[i]->size, 1, outputs[i]);
+
+		if(failed)
+			break;
+	}
+
+	hve_send_frame(h, NULL);
+	while( (count = hve_receive_packets(h, packets, &failed)) )
+		for(int i = 0; outputs && i < count; ++i)
+			fwrite(packets[i]->data, packets[i]->size, 1, outputs[i]);
+
+	return f == FRAMES ? now_ms() - start : -1;
+}
+
+double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int process_user_input(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <frames> [encoder] [columns] [rows] [device]\n", argv[0]);
+		fprintf(stderr, "\nexamples:\n");
+		fprintf(stderr, "%s 300\n", argv[0]);
+		fprintf(stderr, "%s 300 h264_vaapi 2 2 /dev/dri/renderD128\n", argv[0]);
+		fprintf(stderr, "%s 300 h264_nvenc 2 2\n", argv[0]);
+		fprintf(stderr, "%s 300 libx264 4 4 # (software encoder)\n", argv[0]);
+		return -1;
+	}
+
+	FRAMES = atoi(argv[1]);
+	ENCODER = argc > 2 ? argv[2] : ENCODER;
+	COLUMNS = argc > 3 ? atoi(argv[3]) : COLUMNS;
+	ROWS = argc > 4 ? atoi(argv[4]) : ROWS;
+	DEVICE = argc > 5 ? argv[5] : DEVICE;
+
+	if(COLUMNS < 1 || ROWS < 1 || COLUMNS * ROWS > MAX_TILES)
+	{
+		fprintf(stderr, "columns * rows should be between 1 and %d\n", MAX_TILES);
+		return -1;
+	}
+
+	return 0;
+}
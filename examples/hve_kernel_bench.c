@@ -0,0 +1,144 @@
+/*
+ * HVE Hardware Video Encoder library benchmark and validation of SIMD pixel kernels
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <stdio.h> //printf, fprintf
+#include <stdlib.h> //atoi, rand, malloc
+#include <string.h> //memcmp
+#include <inttypes.h> //uint8_t
+#include <time.h> //clock_gettime
+
+#include "../hve.h"
+
+const int WIDTH=1917; //odd width exercises scalar tails of SIMD variants
+const int HEIGHT=1080;
+const char *LEVELS[]={"scalar", "neon", "sse2", "avx2", "avx512"};
+const int LEVELS_COUNT=5;
+
+int ITERATIONS=100;
+
+struct kernel_buffers
+{
+	uint16_t *depth; //input
+	uint8_t *hi, *lo; //split output
+	uint16_t *merged; //merge output
+	uint8_t *ref_hi, *ref_lo; //scalar reference
+	uint16_t *ref_merged;
+};
+
+int bench_level(const char *level, struct kernel_buffers *b);
+double now_ms();
+int process_user_input(int argc, char* argv[]);
+
+int main(int argc, char* argv[])
+{
+	struct kernel_buffers b;
+	const size_t pixels = (size_t)WIDTH * HEIGHT;
+	int status = 0;
+
+	if( process_user_input(argc, argv) < 0 )
+		return -1;
+
+	b.depth = (uint16_t*)malloc(pixels * sizeof(uint16_t));
+	b.merged = (uint16_t*)malloc(pixels * sizeof(uint16_t));
+	b.ref_merged = (uint16_t*)malloc(pixels * sizeof(uint16_t));
+	b.hi = (uint8_t*)malloc(pixels);
+	b.lo = (uint8_t*)malloc(pixels);
+	b.ref_hi = (uint8_t*)malloc(pixels);
+	b.ref_lo = (uint8_t*)malloc(pixels);
+
+	if(!b.depth || !b.merged || !b.ref_merged || !b.hi || !b.lo || !b.ref_hi || !b.ref_lo)
+		return fprintf(stderr, "not enough memory for buffers\n");
+
+	for(size_t i = 0; i < pixels; ++i)
+		b.depth[i] = (uint16_t)rand();
+
+	printf("automatic SIMD level: %s\n\n", hve_simd_level());
+	printf("%-8s %-12s %12s %8s\n", "level", "kernel", "Mpix/s", "result");
+
+	//scalar first, it is the reference for other variants
+	for(int l = 0; l < LEVELS_COUNT && status == 0; ++l)
+		if(hve_simd_force(LEVELS[l]) == HVE_OK)
+			status = bench_level(LEVELS[l], &b);
+
+	hve_simd_force(NULL);
+
+	free(b.depth); free(b.merged); free(b.ref_merged);
+	free(b.hi); free(b.lo); free(b.ref_hi); free(b.ref_lo);
+
+	return status;
+}
+
+// convention 0 on success, negative on mismatch with scalar reference
+int bench_level(const char *level, struct kernel_buffers *b)
+{
+	const size_t pixels = (size_t)WIDTH * HEIGHT;
+	int reference = strcmp(level, "scalar") == 0;
+	int ok;
+
+	double start = now_ms();
+	for(int i = 0; i < ITERATIONS; ++i)
+		hve_depth_split(b->depth, WIDTH * 2, b->hi, WIDTH, b->lo, WIDTH, WIDTH, HEIGHT);
+	double split_ms = now_ms() - start;
+
+	start = now_ms();
+	for(int i = 0; i < ITERATIONS; ++i)
+		hve_depth_merge(b->hi, WIDTH, b->lo, WIDTH, b->merged, WIDTH * 2, WIDTH, HEIGHT);
+	double merge_ms = now_ms() - start;
+
+	if(reference)
+	{
+		memcpy(b->ref_hi, b->hi, pixels);
+		memcpy(b->ref_lo, b->lo, pixels);
+		memcpy(b->ref_merged, b->merged, pixels * sizeof(uint16_t));
+	}
+
+	ok = !memcmp(b->hi, b->ref_hi, pixels) && !memcmp(b->lo, b->ref_lo, pixels);
+	printf("%-8s %-12s %12.1f %8s\n", level, "depth_split", pixels * ITERATIONS / split_ms / 1000.0, ok ? "OK" : "MISMATCH");
+
+	if(!ok)
+		return -1;
+
+	//merge has to invert split exactly
+	ok = !memcmp(b->merged, b->depth, pixels * sizeof(uint16_t)) &&
+	     !memcmp(b->merged, b->ref_merged, pixels * sizeof(uint16_t));
+	printf("%-8s %-12s %12.1f %8s\n", level, "depth_merge", pixels * ITERATIONS / merge_ms / 1000.0, ok ? "OK" : "MISMATCH");
+
+	return ok ? 0 : -1;
+}
+
+double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int process_user_input(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <iterations>\n", argv[0]);
+		fprintf(stderr, "\nexamples:\n");
+		fprintf(stderr, "%s 100\n", argv[0]);
+		fprintf(stderr, "HVE_SIMD=sse2 %s 100 # cap automatic level\n", argv[0]);
+		return -1;
+	}
+
+	ITERATIONS = atoi(argv[1]);
+
+	if(ITERATIONS < 1)
+	{
+		fprintf(stderr, "iterations should be positive\n");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * HVE Hardware Video Encoder library benchmark of single pass pyramid downscaler
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <stdio.h> //printf, fprintf
+#include <stdlib.h> //atoi, rand, malloc
+#include <string.h> //memcmp
+#include <inttypes.h> //uint8_t
+#include <time.h> //clock_gettime
+
+#include <libswscale/swscale.h> //only the benchmark uses swscale, as baseline
+
+#include "../hve.h"
+
+const int WIDTH=3840; //4K source for 1080p, 540p and 270p simulcast
+const int HEIGHT=2160;
+const int LEVELS=3;
+const char *SIMD_LEVELS[]={"scalar", "neon", "sse2", "avx2", "avx512"};
+const int SIMD_LEVELS_COUNT=5;
+
+int ITERATIONS=100;
+int THREADS=4;
+
+double bench_pyramid(const struct hve_frame *frame, int threads, AVFrame **levels);
+double bench_swscale(const struct hve_frame *frame, AVFrame **levels);
+int levels_equal(AVFrame **a, AVFrame **b);
+double now_ms();
+int process_user_input(int argc, char* argv[]);
+
+int main(int argc, char* argv[])
+{
+	struct hve_frame frame = { {0} };
+	AVFrame *levels[3], *reference[3];
+	uint8_t *data;
+	int status = 0;
+
+	if( process_user_input(argc, argv) < 0 )
+		return -1;
+
+	if( (data = (uint8_t*)malloc(WIDTH * HEIGHT * 3 / 2)) == NULL )
+		return fprintf(stderr, "not enough memory for frame\n");
+
+	for(int i = 0; i < WIDTH * HEIGHT * 3 / 2; ++i)
+		data[i] = (uint8_t)rand();
+
+	frame.linesize[0] = frame.linesize[1] = WIDTH;
+	frame.data[0] = data;
+	frame.data[1] = data + WIDTH * HEIGHT;
+
+	for(int l = 0; l < LEVELS; ++l)
+	{
+		levels[l] = av_frame_alloc();
+		reference[l] = av_frame_alloc();
+	}
+
+	printf("automatic SIMD level: %s\n\n", hve_simd_level());
+	printf("%-28s %12s %8s\n", "mode", "ms/frame", "result");
+
+	//scalar first, it is the reference for other variants
+	for(int s = 0; s < SIMD_LEVELS_COUNT && status == 0; ++s)
+	{
+		if(hve_simd_force(SIMD_LEVELS[s]) != HVE_OK)
+			continue;
+
+		double ms = bench_pyramid(&frame, 1, s == 0 ? reference : levels);
+		int ok = ms >= 0 && (s == 0 || levels_equal(levels, reference));
+
+		printf("pyramid %-20s %12.3f %8s\n", SIMD_LEVELS[s], ms, ok ? "OK" : "MISMATCH");
+		status = ok ? 0 : -1;
+	}
+
+	hve_simd_force(NULL);
+
+	if(status == 0)
+	{
+		double ms = bench_pyramid(&frame, THREADS, levels);
+		int ok = ms >= 0 && levels_equal(levels, reference);
+
+		printf("pyramid %-2d threads %-9s %12.3f %8s\n", THREADS, hve_simd_level(), ms, ok ? "OK" : "MISMATCH");
+		status = ok ? 0 : -1;
+	}
+
+	if(status == 0)
+	{
+		//different filter, not bit exact, only timing is compared
+		double ms = bench_swscale(&frame, levels);
+		printf("swscale %d x fast bilinear    %12.3f %8s\n", LEVELS, ms, ms >= 0 ? "-" : "FAILED");
+		status = ms >= 0 ? 0 : -1;
+	}
+
+	for(int l = 0; l < LEVELS; ++l)
+	{
+		av_frame_free(&levels[l]);
+		av_frame_free(&reference[l]);
+	}
+
+	free(data);
+
+	return status;
+}
+
+// returns ms per frame or negative on failure
+double bench_pyramid(const struct hve_frame *frame, int threads, AVFrame **levels)
+{
+	struct hve_pyramid_config config = {0};
+	struct hve_pyramid *p;
+	int i;
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.levels = LEVELS;
+	config.threads = threads;
+
+	if( (p = hve_pyramid_init(&config)) == NULL )
+		return -1;
+
+	double start = now_ms();
+
+	//levels are passed back each time so pooled buffers are reused
+	for(i = 0; i < ITERATIONS; ++i)
+		if(hve_pyramid_scale(p, frame, levels) != HVE_OK)
+			break;
+
+	double elapsed = now_ms() - start;
+
+	hve_pyramid_close(p);
+
+	return i == ITERATIONS ? elapsed / ITERATIONS : -1;
+}
+
+// N independent full resolution passes, the usual way of feeding simulcast encoders
+double bench_swscale(const struct hve_frame *frame, AVFrame **levels)
+{
+	struct SwsContext *sws[3] = {0};
+	int l, i, failed = 0;
+
+	for(l = 0; l < LEVELS && !failed; ++l)
+		failed = (sws[l] = sws_getContext(WIDTH, HEIGHT, AV_PIX_FMT_NV12, WIDTH >> (l + 1), HEIGHT >> (l + 1),
+		                                  AV_PIX_FMT_NV12, SWS_FAST_BILINEAR, NULL, NULL, NULL)) == NULL;
+
+	double start = now_ms();
+
+	for(i = 0; i < ITERATIONS && !failed; ++i)
+		for(l = 0; l < LEVELS; ++l)
+			sws_scale(sws[l], (const uint8_t * const*)frame->data, frame->linesize, 0, HEIGHT, levels[l]->data, levels[l]->linesize);
+
+	double elapsed = now_ms() - start;
+
+	for(l = 0; l < LEVELS; ++l)
+		sws_freeContext(sws[l]);
+
+	return failed ? -1 : elapsed / ITERATIONS;
+}
+
+int levels_equal(AVFrame **a, AVFrame **b)
+{
+	for(int l = 0; l < LEVELS; ++l)
+		for(int plane = 0; plane < 2; ++plane)
+			for(int y = 0; y < (HEIGHT >> (l + 1)) / (plane ? 2 : 1); ++y)
+				if(memcmp(a[l]->data[plane] + y * a[l]->linesize[plane], b[l]->data[plane] + y * b[l]->linesize[plane], WIDTH >> (l + 1)))
+					return 0;
+	return 1;
+}
+
+double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int process_user_input(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <iterations> [threads]\n", argv[0]);
+		fprintf(stderr, "\nexamples:\n");
+		fprintf(stderr, "%s 100\n", argv[0]);
+		fprintf(stderr, "%s 100 8\n", argv[0]);
+		fprintf(stderr, "HVE_SIMD=sse2 %s 100 # cap automatic level\n", argv[0]);
+		return -1;
+	}
+
+	ITERATIONS = atoi(argv[1]);
+	THREADS = argc > 2 ? atoi(argv[2]) : THREADS;
+
+	if(ITERATIONS < 1)
+	{
+		fprintf(stderr, "iterations should be positive\n");
+		return -1;
+	}
+
+	if(THREADS < 1 || THREADS > 16)
+	{
+		fprintf(stderr, "threads should be between 1 and 16\n");
+		return -1;
+	}
+
+	return 0;
+}
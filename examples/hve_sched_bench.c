@@ -0,0 +1,256 @@
+/*
+ * HVE Hardware Video Encoder library benchmark of latency isolation with shared scheduler
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <stdio.h> //printf, fprintf
+#include <stdlib.h> //atoi, malloc, qsort
+#include <string.h> //memset
+#include <inttypes.h> //uint8_t
+#include <time.h> //clock_gettime
+#include <unistd.h> //usleep
+#include <pthread.h> //pthread_create
+
+#include "../hve.h"
+
+const int BULK_WIDTH=1280; //recording streams, sent as fast as possible
+const int BULK_HEIGHT=720;
+const int WIDTH=640; //latency critical stream (e.g. teleoperation) paced at FRAMERATE
+const int HEIGHT=360;
+const int FRAMERATE=30;
+const int DEADLINE_MS=5; //priority session deadline in EDF mode
+const char *PIXEL_FORMAT="nv12";
+
+#define MAX_BULK 32
+#define MAX_FRAMES 100000
+
+int SECONDS=5;
+int BULK=4;
+const char *ENCODER="libx264"; //or e.g. "h264_vaapi" (shared engine), "h264_nvenc"
+const char *DEVICE=NULL; //NULL for default or device e.g. "/dev/dri/renderD128"
+
+enum sched_mode {NO_SCHEDULER, WFQ, EDF, MODES};
+const char *MODE_NAMES[MODES] = {"none", "wfq", "wfq+edf"};
+
+struct bulk_session
+{
+	struct hve *h;
+	pthread_t thread;
+	volatile int *stop;
+	uint8_t *data;
+	int frames;
+	int failed;
+};
+
+int benchmark(enum sched_mode mode, uint8_t *data);
+void *bulk_thread(void *arg);
+int encode_frame(struct hve *h, uint8_t *data, int width, int height);
+struct hve *init_session(struct hve_scheduler *s, int width, int height, int deadline_ms);
+double now_ms();
+int compare_double(const void *a, const void *b);
+int process_user_input(int argc, char* argv[]);
+
+int main(int argc, char* argv[])
+{
+	if( process_user_input(argc, argv) < 0 )
+		return -1;
+
+	//dummy NV12 data for the largest frame
+	uint8_t *data = (uint8_t*)malloc(BULK_WIDTH * BULK_HEIGHT * 3 / 2);
+
+	if(data == NULL)
+		return fprintf(stderr, "not enough memory for frame\n");
+
+	memset(data, 128, BULK_WIDTH * BULK_HEIGHT * 3 / 2);
+
+	printf("%d bulk %dx%d sessions, priority %dx%d at %d fps, send latency of priority session\n\n",
+	       BULK, BULK_WIDTH, BULK_HEIGHT, WIDTH, HEIGHT, FRAMERATE);
+	printf("%-10s %10s %10s %10s %12s %10s\n", "scheduler", "p50 ms", "p99 ms", "max ms", "sched max ms", "bulk fps");
+
+	int status = 0;
+
+	for(int mode = NO_SCHEDULER; mode < MODES && status == 0; ++mode)
+		status = benchmark(mode, data);
+
+	free(data);
+
+	return status;
+}
+
+// convention 0 on success, negative on failure
+int benchmark(enum sched_mode mode, uint8_t *data)
+{
+	struct bulk_session bulk[MAX_BULK] = { {0} };
+	struct hve_scheduler *s = NULL;
+	struct hve_stats stats;
+	struct hve *h;
+	static double send_ms[MAX_FRAMES];
+	volatile int stop = 0;
+	int frames = SECONDS * FRAMERATE, f, started = 0, bulk_frames = 0, failed = 0;
+
+	//one slot, e.g. single hardware engine
+	if(mode != NO_SCHEDULER && (s = hve_scheduler_init(1)) == NULL)
+		return fprintf(stderr, "failed to initialize scheduler\n");
+
+	//without deadline priority session is just a smaller stream with weight like others
+	if( (h = init_session(s, WIDTH, HEIGHT, mode == EDF ? DEADLINE_MS : 0)) == NULL )
+	{
+		hve_scheduler_close(s);
+		return -1;
+	}
+
+	for(started = 0; started < BULK; ++started)
+	{
+		struct bulk_session *b = &bulk[started];
+
+		b->stop = &stop;
+		b->data = data;
+
+		if( (b->h = init_session(s, BULK_WIDTH, BULK_HEIGHT, 0)) == NULL )
+			break;
+
+		if(pthread_create(&b->thread, NULL, bulk_thread, b) != 0)
+		{
+			hve_close(b->h);
+			break;
+		}
+	}
+
+	double start = now_ms();
+
+	for(f = 0; f < frames && started == BULK; ++f)
+	{
+		double send = now_ms();
+
+		if(encode_frame(h, data, WIDTH, HEIGHT) != 0)
+			break;
+
+		send_ms[f] = now_ms() - send;
+
+		//pace at framerate
+		double next = start + (f + 1) * 1000.0 / FRAMERATE - now_ms();
+
+		if(next > 0)
+			usleep((useconds_t)(next * 1000));
+	}
+
+	double elapsed = now_ms() - start;
+
+	stop = 1;
+
+	for(int i = 0; i < started; ++i)
+	{
+		pthread_join(bulk[i].thread, NULL);
+		bulk_frames += bulk[i].frames;
+		failed |= bulk[i].failed;
+		hve_close(bulk[i].h);
+	}
+
+	hve_get_stats(h, &stats);
+	hve_close(h);
+	hve_scheduler_close(s);
+
+	if(f < frames || started < BULK || failed)
+		return fprintf(stderr, "benchmark failed\n");
+
+	qsort(send_ms, frames, sizeof(double), compare_double);
+
+	printf("%-10s %10.2f %10.2f %10.2f %12.2f %10.1f\n", MODE_NAMES[mode], send_ms[frames / 2],
+	       send_ms[frames * 99 / 100], send_ms[frames - 1], stats.sched_wait_max_us / 1000.0, bulk_frames * 1000.0 / elapsed);
+
+	return 0;
+}
+
+void *bulk_thread(void *arg)
+{
+	struct bulk_session *b = (struct bulk_session*)arg;
+
+	while(!*b->stop && !b->failed)
+	{
+		b->failed = encode_frame(b->h, b->data, BULK_WIDTH, BULK_HEIGHT) != 0;
+		++b->frames;
+	}
+
+	return NULL;
+}
+
+// convention 0 on success, packets are discarded
+int encode_frame(struct hve *h, uint8_t *data, int width, int height)
+{
+	struct hve_frame frame = { {0} };
+	AVPacket *packet;
+	int failed;
+
+	frame.linesize[0] = frame.linesize[1] = width;
+	frame.data[0] = data;
+	frame.data[1] = data + width * height;
+
+	if(hve_send_frame(h, &frame) != HVE_OK)
+		return -1;
+
+	while( (packet = hve_receive_packet(h, &failed)) )
+		;
+
+	return failed != HVE_OK ? -1 : 0;
+}
+
+struct hve *init_session(struct hve_scheduler *s, int width, int height, int deadline_ms)
+{
+	struct hve_config config = {0};
+
+	config.width = width;
+	config.height = height;
+	config.framerate = FRAMERATE;
+	config.device = DEVICE;
+	config.encoder = ENCODER;
+	config.pixel_format = PIXEL_FORMAT;
+	config.scheduler = s;
+	config.scheduler_deadline_ms = deadline_ms;
+
+	return hve_init(&config);
+}
+
+double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int compare_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+int process_user_input(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <seconds> [bulk sessions] [encoder] [device]\n", argv[0]);
+		fprintf(stderr, "\nexamples:\n");
+		fprintf(stderr, "%s 5\n", argv[0]);
+		fprintf(stderr, "%s 10 8 libx264\n", argv[0]);
+		fprintf(stderr, "%s 10 4 h264_vaapi /dev/dri/renderD128\n", argv[0]);
+		return -1;
+	}
+
+	SECONDS = atoi(argv[1]);
+	BULK = argc > 2 ? atoi(argv[2]) : BULK;
+	ENCODER = argc > 3 ? argv[3] : ENCODER;
+	DEVICE = argc > 4 ? argv[4] : DEVICE;
+
+	if(SECONDS < 1 || SECONDS * FRAMERATE > MAX_FRAMES || BULK < 1 || BULK > MAX_BULK)
+	{
+		fprintf(stderr, "seconds should be between 1 and %d, bulk sessions between 1 and %d\n", MAX_FRAMES / FRAMERATE, MAX_BULK);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * HVE Hardware Video Encoder library soak test for memory growth and latency drift
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <stdio.h> //printf, fprintf
+#include <stdlib.h> //atoi, rand, qsort
+#include <string.h> //memset
+#include <inttypes.h> //uint8_t
+#include <time.h> //clock_gettime
+#include <unistd.h> //sysconf
+#include <malloc.h> //mallinfo2
+
+#include "../hve.h"
+
+const int MAX_WIDTH=1280;
+const int MAX_HEIGHT=720;
+const int FRAMERATE=30;
+const int SAMPLES=20; //number of RSS/latency samples over whole run
+const int WARMUP_SAMPLES=2; //samples ignored while caches and pools settle
+const double MAX_RSS_GROWTH=0.05; //fail on monotonic growth larger than that
+const double MAX_LATENCY_DRIFT=2.0; //fail if p99 latency grows more than that
+const char *PIXEL_FORMAT="nv12"; //supported by libx264, rawvideo and VAAPI
+
+#define MAX_SESSIONS 64
+#define MAX_LATENCY_SAMPLES 100000
+
+int SECONDS=60;
+int SESSIONS=4;
+const char *ENCODER="libx264"; //software backend or e.g. "rawvideo" (near null), "h264_vaapi"
+const char *DEVICE=NULL; //NULL for default or device e.g. "/dev/dri/renderD128"
+
+struct soak_sample
+{
+	double rss_mb;
+	double heap_mb;
+	double budget_mb;
+	double p50_ms;
+	double p99_ms;
+};
+
+int soak_loop(struct soak_sample *samples);
+struct hve *random_session();
+int churn(struct hve **session);
+int encode_frame(struct hve *h, uint8_t *data, int width);
+double rss_mb();
+double heap_mb();
+double now_ms();
+int compare_double(const void *a, const void *b);
+int analyze(const struct soak_sample *samples, int count);
+int process_user_input(int argc, char* argv[]);
+
+int main(int argc, char* argv[])
+{
+	struct soak_sample samples[SAMPLES];
+
+	if( process_user_input(argc, argv) < 0 )
+		return -1;
+
+	int count = soak_loop(samples);
+
+	if(count < 0)
+		return fprintf(stderr, "soak failed to run\n");
+
+	return analyze(samples, count);
+}
+
+int soak_loop(struct soak_sample *samples)
+{
+	struct hve *sessions[MAX_SESSIONS] = {0};
+	static double latency[MAX_LATENCY_SAMPLES];
+	static uint8_t data[1280*720*3/2]; //dummy NV12 data for largest resolution
+	int latency_count = 0, sample = 0, frame = 0, status = 0;
+	double start = now_ms(), sample_ms = SECONDS * 1000.0 / SAMPLES;
+
+	printf("%8s %10s %10s %10s %10s %10s\n", "time[s]", "rss[MB]", "heap[MB]", "budget[MB]", "p50[ms]", "p99[ms]");
+
+	while(sample < SAMPLES && status == 0)
+	{
+		for(int s = 0; s < SESSIONS; ++s, ++frame)
+		{
+			//image content changes so that encoder has some work to do
+			memset(data, frame % 255, MAX_WIDTH * MAX_HEIGHT / 4);
+
+			if( !sessions[s] && !(sessions[s] = random_session()) )
+				status = -1;
+
+			if(status == 0 && churn(&sessions[s]) != HVE_OK)
+				status = -1;
+
+			if(status != 0 || !sessions[s])
+				continue;
+
+			double t = now_ms();
+
+			if(encode_frame(sessions[s], data, MAX_WIDTH) != HVE_OK)
+				status = -1;
+
+			if(latency_count < MAX_LATENCY_SAMPLES)
+				latency[latency_count++] = now_ms() - t;
+		}
+
+		if(status != 0 || now_ms() - start < (sample + 1) * sample_ms)
+			continue;
+
+		struct soak_sample *smp = &samples[sample++];
+
+		qsort(latency, latency_count, sizeof(double), compare_double);
+		smp->rss_mb = rss_mb();
+		smp->heap_mb = heap_mb();
+		smp->budget_mb = hve_memory_used() / (1024.0 * 1024.0);
+		smp->p50_ms = latency_count ? latency[latency_count / 2] : 0;
+		smp->p99_ms = latency_count ? latency[latency_count * 99 / 100] : 0;
+		latency_count = 0;
+
+		printf("%8.0f %10.2f %10.2f %10.2f %10.3f %10.3f\n", (now_ms() - start) / 1000.0,
+		       smp->rss_mb, smp->heap_mb, smp->budget_mb, smp->p50_ms, smp->p99_ms);
+		fflush(stdout);
+	}
+
+	for(int s = 0; s < SESSIONS; ++s)
+		hve_close(sessions[s]);
+
+	return status == 0 ? sample : -1;
+}
+
+struct hve *random_session()
+{
+	const int widths[] = {320, 640, 1280};
+	const int heights[] = {240, 360, 720};
+	const int r = rand() % 3;
+
+	struct hve_config config = {0};
+
+	config.width = widths[r];
+	config.height = heights[r];
+	config.framerate = FRAMERATE;
+	config.device = DEVICE;
+	config.encoder = ENCODER;
+	config.pixel_format = PIXEL_FORMAT;
+	config.gop_size = (rand() % 2) ? FRAMERATE : 0;
+
+	if(rand() % 2)
+		config.bit_rate = 500000 + rand() % 4000000;
+	else
+		config.qp = 20 + rand() % 20;
+
+	return hve_init(&config);
+}
+
+// randomly closes, flushes, suspends or forces keyframe
+int churn(struct hve **session)
+{
+	struct hve *h = *session;
+	AVPacket *packet;
+	int failed, r = rand() % 1000;
+
+	if(r < 5) //close in the middle of encoding
+	{
+		hve_close(h);
+		*session = NULL;
+	}
+	else if(r < 10) //flush and close
+	{
+		hve_send_frame(h, NULL);
+		while( (packet=hve_receive_packet(h, &failed)) )
+			;
+		hve_close(h);
+		*session = NULL;
+	}
+	else if(r < 15) //release encoder and bring it back
+	{
+		if(hve_suspend(h) != HVE_OK)
+			return HVE_ERROR;
+		while( (packet=hve_receive_packet(h, &failed)) )
+			;
+		if(hve_resume(h) != HVE_OK)
+			return HVE_ERROR;
+	}
+	else if(r < 35)
+		hve_request_keyframe(h);
+
+	return HVE_OK;
+}
+
+int encode_frame(struct hve *h, uint8_t *data, int width)
+{
+	struct hve_frame frame = { 0 };
+	AVPacket *packet;
+	int failed;
+
+	//we only use top-left part of the buffer for smaller resolutions
+	frame.linesize[0] = frame.linesize[1] = width;
+	frame.data[0] = data;
+	frame.data[1] = data + MAX_WIDTH * MAX_HEIGHT;
+
+	if(hve_send_frame(h, &frame) != HVE_OK)
+		return HVE_ERROR;
+
+	while( (packet=hve_receive_packet(h, &failed)) )
+		;
+
+	return failed;
+}
+
+double rss_mb()
+{
+	long pages = 0, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+
+	if(statm == NULL)
+		return 0;
+
+	if(fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+
+	fclose(statm);
+
+	return resident * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+double heap_mb()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks / (1024.0 * 1024.0);
+#else
+	return 0;
+#endif
+}
+
+double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int compare_double(const void *a, const void *b)
+{
+	double da = *(const double*)a, db = *(const double*)b;
+	return (da > db) - (da < db);
+}
+
+// convention 0 on success, negative on failure
+int analyze(const struct soak_sample *samples, int count)
+{
+	int monotonic = 1;
+
+	if(count <= WARMUP_SAMPLES + 1)
+	{
+		fprintf(stderr, "not enough samples, run longer\n");
+		return -1;
+	}
+
+	const struct soak_sample *first = &samples[WARMUP_SAMPLES], *last = &samples[count - 1];
+
+	for(int i = WARMUP_SAMPLES + 1; i < count; ++i)
+		if(samples[i].rss_mb < samples[i-1].rss_mb)
+			monotonic = 0;
+
+	if(monotonic && last->rss_mb > first->rss_mb * (1.0 + MAX_RSS_GROWTH))
+	{
+		fprintf(stderr, "FAILED: monotonic RSS growth %.2f MB -> %.2f MB\n", first->rss_mb, last->rss_mb);
+		return -1;
+	}
+
+	if(first->p99_ms > 0 && last->p99_ms > first->p99_ms * MAX_LATENCY_DRIFT)
+	{
+		fprintf(stderr, "FAILED: p99 latency drift %.3f ms -> %.3f ms\n", first->p99_ms, last->p99_ms);
+		return -1;
+	}
+
+	printf("PASSED: no monotonic memory growth or latency drift\n");
+	return 0;
+}
+
+int process_user_input(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <seconds> [encoder] [sessions] [device]\n", argv[0]);
+		fprintf(stderr, "\nexamples:\n");
+		fprintf(stderr, "%s 3600\n", argv[0]);
+		fprintf(stderr, "%s 3600 libx264 8\n", argv[0]);
+		fprintf(stderr, "%s 3600 rawvideo 16\n", argv[0]);
+		fprintf(stderr, "%s 3600 h264_vaapi 4 /dev/dri/renderD128\n", argv[0]);
+		return -1;
+	}
+
+	SECONDS = atoi(argv[1]);
+	ENCODER = argc > 2 ? argv[2] : ENCODER;
+	SESSIONS = argc > 3 ? atoi(argv[3]) : SESSIONS;
+	DEVICE = argc > 4 ? argv[4] : DEVICE;
+
+	if(SESSIONS < 1 || SESSIONS > MAX_SESSIONS)
+	{
+		fprintf(stderr, "sessions should be between 1 and %d\n", MAX_SESSIONS);
+		return -1;
+	}
+
+	return 0;
+}
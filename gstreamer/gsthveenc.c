@@ -0,0 +1,472 @@
+/*
+ * HVE Hardware Video Encoder GStreamer element
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+/*
+ * hveenc encodes raw video with HVE (VAAPI, NVENC or software FFmpeg encoders).
+ *
+ * Input GstBuffer memory is mapped in place into hve_frame planes, no intermediate copy
+ * (fd backed memory like dmabuf from v4l2src/libcamerasrc or memfd is mmapped by its allocator).
+ * Video meta is accepted, so upstream may hand over padded or multi-memory buffers
+ * instead of copying them into tightly packed ones. The buffer is mapped while
+ * hve_send_frame runs, after it returns the library doesn't reference frame data.
+ *
+ * Output GstBuffers wrap reference to encoder AVPacket (no copy), freed with the buffer.
+ *
+ * gst-launch-1.0 videotestsrc num-buffers=300 ! video/x-raw,format=NV12,width=1280,height=720,framerate=30/1 !
+ *                hveenc encoder=libx264 ! h264parse ! matroskamux ! filesink location=output.mkv
+ */
+
+#include "gsthveenc.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_hve_enc_debug);
+#define GST_CAT_DEFAULT gst_hve_enc_debug
+
+enum
+{
+	PROP_0,
+	PROP_DEVICE,
+	PROP_ENCODER,
+	PROP_BITRATE,
+	PROP_QP,
+	PROP_GOP_SIZE,
+	PROP_B_FRAMES,
+	PROP_COMPRESSION_LEVEL,
+	PROP_LOW_POWER,
+};
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS,
+	GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("{ NV12, I420, P010_10LE, BGRx, RGBx }")));
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS,
+	GST_STATIC_CAPS("video/x-h264, stream-format = (string) byte-stream, alignment = (string) au; "
+	                "video/x-h265, stream-format = (string) byte-stream, alignment = (string) au"));
+
+G_DEFINE_TYPE(GstHveEnc, gst_hve_enc, GST_TYPE_VIDEO_ENCODER);
+
+static void gst_hve_enc_set_property(GObject *object, guint id, const GValue *value, GParamSpec *pspec);
+static void gst_hve_enc_get_property(GObject *object, guint id, GValue *value, GParamSpec *pspec);
+static void gst_hve_enc_finalize(GObject *object);
+static gboolean gst_hve_enc_stop(GstVideoEncoder *encoder);
+static gboolean gst_hve_enc_set_format(GstVideoEncoder *encoder, GstVideoCodecState *state);
+static GstFlowReturn gst_hve_enc_handle_frame(GstVideoEncoder *encoder, GstVideoCodecFrame *frame);
+static GstFlowReturn gst_hve_enc_finish(GstVideoEncoder *encoder);
+static gboolean gst_hve_enc_flush(GstVideoEncoder *encoder);
+static gboolean gst_hve_enc_propose_allocation(GstVideoEncoder *encoder, GstQuery *query);
+
+static gboolean open_session(GstHveEnc *self, guint32 first_frame);
+static void close_session(GstHveEnc *self);
+static GstFlowReturn drain_session(GstHveEnc *self);
+static GstFlowReturn push_packets(GstHveEnc *self);
+static const char *pixel_format(GstVideoFormat format);
+static gboolean is_hevc(const gchar *encoder);
+static void packet_free(gpointer packet);
+
+static void gst_hve_enc_class_init(GstHveEncClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS(klass);
+	GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+	GstVideoEncoderClass *encoder_class = GST_VIDEO_ENCODER_CLASS(klass);
+	const GParamFlags flags = G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY;
+
+	object_class->set_property = gst_hve_enc_set_property;
+	object_class->get_property = gst_hve_enc_get_property;
+	object_class->finalize = gst_hve_enc_finalize;
+
+	g_object_class_install_property(object_class, PROP_DEVICE,
+		g_param_spec_string("device", "Device", "Device e.g. /dev/dri/renderD128, NULL for default", NULL, flags));
+	g_object_class_install_property(object_class, PROP_ENCODER,
+		g_param_spec_string("encoder", "Encoder", "FFmpeg encoder e.g. h264_vaapi, hevc_nvenc, libx264, NULL for default (h264_vaapi)", NULL, flags));
+	g_object_class_install_property(object_class, PROP_BITRATE,
+		g_param_spec_uint("bitrate", "Bitrate", "Average bitrate in kbit/s (VBR), 0 for default", 0, G_MAXINT / 1000, 0, flags));
+	g_object_class_install_property(object_class, PROP_QP,
+		g_param_spec_uint("qp", "QP", "Quantization parameter (CQP), 0 for default", 0, 51, 0, flags));
+	g_object_class_install_property(object_class, PROP_GOP_SIZE,
+		g_param_spec_int("gop-size", "GOP size", "Group of pictures size, 0 for default, -1 for intra only", -1, G_MAXINT, 0, flags));
+	g_object_class_install_property(object_class, PROP_B_FRAMES,
+		g_param_spec_uint("b-frames", "B-frames", "Maximum number of B-frames between non-B-frames", 0, 16, 0, flags));
+	g_object_class_install_property(object_class, PROP_COMPRESSION_LEVEL,
+		g_param_spec_uint("compression-level", "Compression level", "Encoder dependent, for VAAPI 1-7 (1 highest quality, 7 fastest), 0 for default", 0, 7, 0, flags));
+	g_object_class_install_property(object_class, PROP_LOW_POWER,
+		g_param_spec_boolean("low-power", "Low power", "VAAPI low-power encoding path", FALSE, flags));
+
+	gst_element_class_add_static_pad_template(element_class, &sink_template);
+	gst_element_class_add_static_pad_template(element_class, &src_template);
+
+	gst_element_class_set_static_metadata(element_class, "HVE video encoder", "Codec/Encoder/Video/Hardware",
+		"H.264/HEVC encoding through VAAPI, NVENC or software FFmpeg encoders (HVE library)",
+		"Bartosz Meglicki <meglickib@gmail.com>");
+
+	encoder_class->stop = GST_DEBUG_FUNCPTR(gst_hve_enc_stop);
+	encoder_class->set_format = GST_DEBUG_FUNCPTR(gst_hve_enc_set_format);
+	encoder_class->handle_frame = GST_DEBUG_FUNCPTR(gst_hve_enc_handle_frame);
+	encoder_class->finish = GST_DEBUG_FUNCPTR(gst_hve_enc_finish);
+	encoder_class->flush = GST_DEBUG_FUNCPTR(gst_hve_enc_flush);
+	encoder_class->propose_allocation = GST_DEBUG_FUNCPTR(gst_hve_enc_propose_allocation);
+
+	GST_DEBUG_CATEGORY_INIT(gst_hve_enc_debug, "hveenc", 0, "HVE video encoder");
+}
+
+static void gst_hve_enc_init(GstHveEnc *self)
+{
+	//instance is zeroed, defaults of properties are 0 / NULL / FALSE
+}
+
+static void gst_hve_enc_set_property(GObject *object, guint id, const GValue *value, GParamSpec *pspec)
+{
+	GstHveEnc *self = GST_HVE_ENC(object);
+
+	switch(id)
+	{
+		case PROP_DEVICE:
+			g_free(self->device);
+			self->device = g_value_dup_string(value);
+			break;
+		case PROP_ENCODER:
+			g_free(self->encoder);
+			self->encoder = g_value_dup_string(value);
+			break;
+		case PROP_BITRATE:
+			self->bitrate = g_value_get_uint(value);
+			break;
+		case PROP_QP:
+			self->qp = g_value_get_uint(value);
+			break;
+		case PROP_GOP_SIZE:
+			self->gop_size = g_value_get_int(value);
+			break;
+		case PROP_B_FRAMES:
+			self->b_frames = g_value_get_uint(value);
+			break;
+		case PROP_COMPRESSION_LEVEL:
+			self->compression_level = g_value_get_uint(value);
+			break;
+		case PROP_LOW_POWER:
+			self->low_power = g_value_get_boolean(value);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, id, pspec);
+			break;
+	}
+}
+
+static void gst_hve_enc_get_property(GObject *object, guint id, GValue *value, GParamSpec *pspec)
+{
+	GstHveEnc *self = GST_HVE_ENC(object);
+
+	switch(id)
+	{
+		case PROP_DEVICE:
+			g_value_set_string(value, self->device);
+			break;
+		case PROP_ENCODER:
+			g_value_set_string(value, self->encoder);
+			break;
+		case PROP_BITRATE:
+			g_value_set_uint(value, self->bitrate);
+			break;
+		case PROP_QP:
+			g_value_set_uint(value, self->qp);
+			break;
+		case PROP_GOP_SIZE:
+			g_value_set_int(value, self->gop_size);
+			break;
+		case PROP_B_FRAMES:
+			g_value_set_uint(value, self->b_frames);
+			break;
+		case PROP_COMPRESSION_LEVEL:
+			g_value_set_uint(value, self->compression_level);
+			break;
+		case PROP_LOW_POWER:
+			g_value_set_boolean(value, self->low_power);
+			break;
+		default:
+			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, id, pspec);
+			break;
+	}
+}
+
+static void gst_hve_enc_finalize(GObject *object)
+{
+	GstHveEnc *self = GST_HVE_ENC(object);
+
+	close_session(self);
+
+	g_free(self->device);
+	g_free(self->encoder);
+
+	G_OBJECT_CLASS(gst_hve_enc_parent_class)->finalize(object);
+}
+
+static gboolean gst_hve_enc_stop(GstVideoEncoder *encoder)
+{
+	GstHveEnc *self = GST_HVE_ENC(encoder);
+
+	close_session(self);
+
+	if(self->input_state)
+		gst_video_codec_state_unref(self->input_state);
+	self->input_state = NULL;
+
+	return TRUE;
+}
+
+static gboolean gst_hve_enc_set_format(GstVideoEncoder *encoder, GstVideoCodecState *state)
+{
+	GstHveEnc *self = GST_HVE_ENC(encoder);
+	GstVideoCodecState *output;
+	GstCaps *caps;
+
+	//frames of previous format are encoded with previous session, the next one is opened on first frame
+	if(self->h && drain_session(self) != GST_FLOW_OK)
+		return FALSE;
+
+	if(self->input_state)
+		gst_video_codec_state_unref(self->input_state);
+	self->input_state = gst_video_codec_state_ref(state);
+
+	caps = gst_caps_new_simple(is_hevc(self->encoder) ? "video/x-h265" : "video/x-h264",
+	                           "stream-format", G_TYPE_STRING, "byte-stream",
+	                           "alignment", G_TYPE_STRING, "au", NULL);
+
+	output = gst_video_encoder_set_output_state(encoder, caps, state);
+	gst_video_codec_state_unref(output);
+
+	return gst_video_encoder_negotiate(encoder);
+}
+
+static GstFlowReturn gst_hve_enc_handle_frame(GstVideoEncoder *encoder, GstVideoCodecFrame *frame)
+{
+	GstHveEnc *self = GST_HVE_ENC(encoder);
+	struct hve_frame input = { {0} };
+	GstVideoFrame video;
+	int ret;
+
+	if(self->h == NULL && !open_session(self, frame->system_frame_number))
+	{
+		gst_video_codec_frame_unref(frame);
+		GST_ELEMENT_ERROR(self, LIBRARY, INIT, ("hve_init failed"), ("device %s, encoder %s",
+		                  GST_STR_NULL(self->device), GST_STR_NULL(self->encoder)));
+		return GST_FLOW_ERROR;
+	}
+
+	if(GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME(frame))
+		hve_request_keyframe(self->h);
+
+	//in place, planes of multi-memory buffers are mapped separately using video meta
+	if(!gst_video_frame_map(&video, &self->input_state->info, frame->input_buffer, GST_MAP_READ))
+	{
+		gst_video_codec_frame_unref(frame);
+		GST_ELEMENT_ERROR(self, STREAM, ENCODE, ("failed to map input buffer"), (NULL));
+		return GST_FLOW_ERROR;
+	}
+
+	for(guint i = 0; i < GST_VIDEO_FRAME_N_PLANES(&video); ++i)
+	{
+		input.data[i] = (uint8_t*)GST_VIDEO_FRAME_PLANE_DATA(&video, i);
+		input.linesize[i] = GST_VIDEO_FRAME_PLANE_STRIDE(&video, i);
+	}
+
+	ret = hve_send_frame(self->h, &input);
+
+	gst_video_frame_unmap(&video);
+
+	//data is uploaded/consumed, return the buffer to upstream pool now instead of holding it for encoder latency
+	gst_buffer_replace(&frame->input_buffer, NULL);
+
+	//base class keeps own reference until the packet of this frame is pushed
+	gst_video_codec_frame_unref(frame);
+
+	if(ret != HVE_OK)
+	{
+		GST_ELEMENT_ERROR(self, STREAM, ENCODE, ("hve_send_frame failed"), (NULL));
+		return GST_FLOW_ERROR;
+	}
+
+	return push_packets(self);
+}
+
+static GstFlowReturn gst_hve_enc_finish(GstVideoEncoder *encoder)
+{
+	GstHveEnc *self = GST_HVE_ENC(encoder);
+
+	return self->h ? drain_session(self) : GST_FLOW_OK;
+}
+
+static gboolean gst_hve_enc_flush(GstVideoEncoder *encoder)
+{
+	//pending frames are discarded by base class, the next session starts clean
+	close_session(GST_HVE_ENC(encoder));
+
+	return TRUE;
+}
+
+static gboolean gst_hve_enc_propose_allocation(GstVideoEncoder *encoder, GstQuery *query)
+{
+	//strides and plane offsets are taken from video meta, upstream doesn't have to repack buffers
+	gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+
+	return GST_VIDEO_ENCODER_CLASS(gst_hve_enc_parent_class)->propose_allocation(encoder, query);
+}
+
+static gboolean open_session(GstHveEnc *self, guint32 first_frame)
+{
+	GstVideoInfo *info = &self->input_state->info;
+	struct hve_config config = {0};
+
+	//properties may change in READY, session keeps its own copy of strings
+	self->session_device = g_strdup(self->device);
+	self->session_encoder = g_strdup(self->encoder);
+
+	config.width = GST_VIDEO_INFO_WIDTH(info);
+	config.height = GST_VIDEO_INFO_HEIGHT(info);
+	//variable framerate (0/1) is encoded with nominal 30
+	config.framerate = GST_VIDEO_INFO_FPS_N(info) && GST_VIDEO_INFO_FPS_D(info) ?
+	                   (GST_VIDEO_INFO_FPS_N(info) + GST_VIDEO_INFO_FPS_D(info) / 2) / GST_VIDEO_INFO_FPS_D(info) : 30;
+	config.device = self->session_device;
+	config.encoder = self->session_encoder;
+	config.pixel_format = pixel_format(GST_VIDEO_INFO_FORMAT(info));
+	config.max_b_frames = self->b_frames;
+	config.bit_rate = self->bitrate * 1000;
+	config.qp = self->qp;
+	config.gop_size = self->gop_size;
+	config.compression_level = self->compression_level;
+	config.vaapi_low_power = self->low_power;
+
+	self->frame_offset = first_frame;
+
+	if( (self->h = hve_init(&config)) == NULL )
+	{
+		close_session(self);
+		return FALSE;
+	}
+
+	GST_DEBUG_OBJECT(self, "session %dx%d@%d %s opened", config.width, config.height, config.framerate, config.pixel_format);
+
+	return TRUE;
+}
+
+static void close_session(GstHveEnc *self)
+{
+	hve_close(self->h);
+	self->h = NULL;
+
+	g_free(self->session_device);
+	g_free(self->session_encoder);
+	self->session_device = self->session_encoder = NULL;
+}
+
+// flushed session doesn't accept frames, it is closed and the next one opened on demand
+static GstFlowReturn drain_session(GstHveEnc *self)
+{
+	GstFlowReturn flow;
+
+	if(hve_send_frame(self->h, NULL) != HVE_OK)
+	{
+		GST_ELEMENT_ERROR(self, STREAM, ENCODE, ("failed to flush encoder"), (NULL));
+		return GST_FLOW_ERROR;
+	}
+
+	flow = push_packets(self);
+
+	close_session(self);
+
+	return flow;
+}
+
+static GstFlowReturn push_packets(GstHveEnc *self)
+{
+	GstVideoEncoder *encoder = GST_VIDEO_ENCODER(self);
+	GstFlowReturn flow = GST_FLOW_OK;
+	AVPacket *packet;
+	int error = HVE_OK;
+
+	while(flow == GST_FLOW_OK && (packet = hve_receive_packet(self->h, &error)) )
+	{
+		//packet pts counts frames sent to session, with B-frames it is not the oldest frame
+		GstVideoCodecFrame *frame = gst_video_encoder_get_frame(encoder, self->frame_offset + (guint32)packet->pts);
+		AVPacket *ref;
+
+		if(frame == NULL)
+			frame = gst_video_encoder_get_oldest_frame(encoder);
+
+		if(frame == NULL)
+		{
+			GST_WARNING_OBJECT(self, "no frame pending for packet %" G_GINT64_FORMAT ", dropped", (gint64)packet->pts);
+			continue;
+		}
+
+		//library packet is valid until the next call, take own reference to data instead of copying
+		if( (ref = av_packet_alloc()) == NULL || av_packet_ref(ref, packet) < 0 )
+		{
+			packet_free(ref);
+			gst_video_codec_frame_unref(frame);
+			GST_ELEMENT_ERROR(self, RESOURCE, FAILED, ("not enough memory for packet"), (NULL));
+			return GST_FLOW_ERROR;
+		}
+
+		frame->output_buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, ref->data, ref->size, 0, ref->size, ref, packet_free);
+
+		if(ref->flags & AV_PKT_FLAG_KEY)
+			GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT(frame);
+
+		flow = gst_video_encoder_finish_frame(encoder, frame);
+	}
+
+	if(error != HVE_OK)
+	{
+		GST_ELEMENT_ERROR(self, STREAM, ENCODE, ("hve_receive_packet failed"), (NULL));
+		return GST_FLOW_ERROR;
+	}
+
+	return flow;
+}
+
+static const char *pixel_format(GstVideoFormat format)
+{
+	switch(format)
+	{
+		case GST_VIDEO_FORMAT_NV12:
+			return "nv12";
+		case GST_VIDEO_FORMAT_I420:
+			return "yuv420p";
+		case GST_VIDEO_FORMAT_P010_10LE:
+			return "p010le";
+		case GST_VIDEO_FORMAT_BGRx:
+			return "bgr0";
+		case GST_VIDEO_FORMAT_RGBx:
+			return "rgb0";
+		default:
+			return NULL;
+	}
+}
+
+static gboolean is_hevc(const gchar *encoder)
+{
+	return encoder && (g_strrstr(encoder, "hevc") || g_strrstr(encoder, "265"));
+}
+
+static void packet_free(gpointer packet)
+{
+	AVPacket *p = (AVPacket*)packet;
+	av_packet_free(&p);
+}
+
+static gboolean plugin_init(GstPlugin *plugin)
+{
+	return gst_element_register(plugin, "hveenc", GST_RANK_NONE, GST_TYPE_HVE_ENC);
+}
+
+#ifndef PACKAGE
+#define PACKAGE "hve"
+#endif
+
+GST_PLUGIN_DEFINE(GST_VERSION_MAJOR, GST_VERSION_MINOR, hve, "Hardware Video Encoder (HVE) elements",
+                  plugin_init, "1.0", "MPL", PACKAGE, "https://github.com/bmegli/hardware-video-encoder")
@@ -0,0 +1,59 @@
+/*
+ * HVE Hardware Video Encoder GStreamer element
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef GST_HVE_ENC_H
+#define GST_HVE_ENC_H
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/video/gstvideoencoder.h>
+
+#include "../hve.h"
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_HVE_ENC (gst_hve_enc_get_type())
+#define GST_HVE_ENC(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_HVE_ENC, GstHveEnc))
+
+typedef struct _GstHveEnc GstHveEnc;
+typedef struct _GstHveEncClass GstHveEncClass;
+
+struct _GstHveEnc
+{
+	GstVideoEncoder parent;
+
+	//properties, applied when session is (re)opened
+	gchar *device;
+	gchar *encoder;
+	guint bitrate; //kbit/s
+	guint qp;
+	gint gop_size;
+	guint b_frames;
+	guint compression_level;
+	gboolean low_power;
+
+	struct hve *h; //NULL until the first frame and after drain or flush
+	gchar *session_device; //session keeps pointers to config strings
+	gchar *session_encoder;
+	guint32 frame_offset; //system_frame_number of the first frame in session (packet pts counts from it)
+	GstVideoCodecState *input_state;
+};
+
+struct _GstHveEncClass
+{
+	GstVideoEncoderClass parent_class;
+};
+
+GType gst_hve_enc_get_type(void);
+
+G_END_DECLS
+
+#endif
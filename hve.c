@@ -15,16 +15,358 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/hwcontext.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/cpu.h>
+#include <libavutil/opt.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 
 #include <stdio.h> //fprintf
 #include <stdlib.h> //malloc
 #include <string.h> //strstr
+#include <pthread.h> //pthread_mutex_t, pthread_cond_t
+#include <time.h> //clock_gettime
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HVE_X86 1
+#include <immintrin.h> //SSE2, AVX2, AVX-512 intrinsics (enabled per function with target attribute)
+#elif defined(__aarch64__)
+#define HVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+// ring of send timestamps indexed by frame pts, for latency measurement
+#define HVE_LATENCY_RING 128
+// default encoder latency triggering migration to alternative encoder
+#define HVE_MIGRATE_LATENCY_MS 100
+// maximum number of internal encoders in intra parallel mode
+#define HVE_MAX_WORKERS 16
+// maximum number of distinct configs shared for one source
+#define HVE_MAX_COALESCED 16
+// default and minimal (plus B-frames) number of hardware surfaces
+#define HVE_POOL_SIZE 20
+#define HVE_MIN_POOL_SIZE 4
+// maximum number of conversion paths and dummy frames timed per path with convert_benchmark
+#define HVE_CONVERT_PATHS 3
+#define HVE_CONVERT_BENCHMARK_FRAMES 16
+// negotiated conversion paths remembered process-wide (device type and pixel format combinations)
+#define HVE_CONVERT_CACHE 16
+// maximum number of pyramid downscaler levels
+#define HVE_PYRAMID_LEVELS 4
+
+static const char *HVE_CONVERT_NAMES[] = {"auto", "direct", "scaler", "cpu"};
+
+// quality target mode default frames between samples, sampled frames and packets in flight to decoder
+#define HVE_QUALITY_INTERVAL 15
+#define HVE_QUALITY_SAMPLES 4
+#define HVE_QUALITY_PACKETS 64
+// SSIM band above target where rate control is left alone
+#define HVE_QUALITY_BAND 0.005
+
+// filler slate quantizer if qp is not configured, skip P-frame quantizer (maximum for H.264 and HEVC)
+#define HVE_FILLER_QP 23
+#define HVE_FILLER_SKIP_QP 51
+
+// process-wide memory budget drawn by pools and queues of all sessions
+static pthread_mutex_t hve_budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t hve_budget_bytes; //0 if no budget
+static size_t hve_budget_used;
+static int hve_budget_policy;
+
+// conversion path negotiated for hardware device type and pixel format
+struct hve_convert_cache_entry
+{
+	enum AVHWDeviceType type;
+	enum AVPixelFormat pix_fmt;
+	int benchmark; //picked by benchmark rather than the first feasible
+	int convert;
+};
+
+// process-wide, later sessions reuse negotiated paths instead of probing
+static pthread_mutex_t hve_convert_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hve_convert_cache_entry hve_convert_cache[HVE_CONVERT_CACHE];
+static int hve_convert_cached; //entries added so far, the oldest are replaced
+
+// session waiting for the scheduler slot
+struct hve_sched_waiter
+{
+	struct hve_sched_waiter *next;
+	int64_t deadline; //absolute, INT64_MAX if none
+	double finish; //virtual finish time
+	int granted;
+};
+
+// arbitrates encode submissions of many sessions sharing device or CPU pool
+struct hve_scheduler
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int slots; //free submission slots
+	double virtual_time;
+	struct hve_sched_waiter *waiters;
+};
+
+// calibrated cost of encoding with (encoder, resolution, fps, preset)
+struct hve_admission_entry
+{
+	char *encoder;
+	char *preset;
+	int width;
+	int height;
+	int framerate;
+	int compression_level;
+	double cost; //fraction of host capacity, 1.0 means fully loaded
+};
+
+// per-host capacity model used to admit or reject new sessions
+struct hve_admission
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	double capacity;
+	double used;
+	struct hve_admission_entry *entries;
+	int entries_count;
+};
+
+// device (or simulated device) in device set
+struct hve_device_set_entry
+{
+	char *device; //NULL for default
+	char *encoder; //NULL for session encoder
+	int sessions; //active sessions placed on device
+	int latency_us; //smoothed latency reported by sessions
+};
+
+// several devices sessions are balanced between
+struct hve_device_set
+{
+	pthread_mutex_t mutex;
+	struct hve_device_set_entry *devices;
+	int devices_count;
+};
+
+// FIFO of packets, ring growing as needed
+// packets of the ring are reused, allocated only when it grows
+struct hve_packet_queue
+{
+	AVPacket **packets;
+	int size;
+	int head;
+	int count;
+};
+
+// closed sessions parked for reuse by hve_init with matching config
+struct hve_pool
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int max_parked;
+	int parked_count;
+	struct hve *parked; //suspended sessions ready for reuse
+	struct hve *recycle; //closed sessions waiting for teardown on pool thread
+	int shutdown;
+};
+
+// session shared by handles with the same source and config
+struct hve_shared
+{
+	char *source;
+	struct hve *h;
+	pthread_mutex_t mutex; //encoding and handle queues
+	int refs; //handles and sends in progress (coalescer mutex)
+	int holders; //handles (coalescer mutex)
+	int flushes; //handles that asked for flush (coalescer mutex)
+	int flushed; //every holder asked, no new frames or holders (coalescer mutex)
+	struct hve_handle *handles; //holders packets are fanned out to (shared mutex)
+	AVPacket fanout; //reference for holder, moved to its queue (shared mutex)
+	struct hve_shared *next;
+};
+
+// holder of shared session
+struct hve_handle
+{
+	struct hve_shared *shared;
+	struct hve_coalescer *coalescer;
+	struct hve_packet_queue queue; //packets for this holder
+	AVPacket packet; //last packet returned to user
+	int wait_keyframe; //skip packets until keyframe after joining
+	int flushed; //holder asked for flush (coalescer mutex)
+	int error;
+	struct hve_handle *next;
+};
+
+// sessions shared between identical requests
+struct hve_coalescer
+{
+	pthread_mutex_t mutex;
+	struct hve_shared *shared;
+};
+
+// pyramid thread processing its share of bands
+struct hve_pyramid_slice
+{
+	struct hve_pyramid *pyramid;
+	pthread_t thread;
+	int index;
+};
+
+// multi-scale downscaler, levels produced band by band in one pass over source
+struct hve_pyramid
+{
+	int width;
+	int height;
+	enum AVPixelFormat pix_fmt; //NV12 or YUV420P
+	int levels;
+	int band; //source rows per band, the smallest level gets 2 rows (1 chroma row)
+	AVBufferPool *pools[HVE_PYRAMID_LEVELS]; //buffers of output frames for each level
+	int threads;
+	struct hve_pyramid_slice slices[HVE_MAX_WORKERS]; //slice 0 is calling thread
+	int started; //threads started
+	pthread_mutex_t mutex;
+	pthread_cond_t start; //new job or shutdown
+	pthread_cond_t done; //all slices done
+	const struct hve_frame *src; //job of current hve_pyramid_scale
+	AVFrame **dst;
+	int job; //incremented with each job
+	int pending; //threads still working on job
+	int shutdown;
+};
+
+
+// internal encoder with its own thread (intra parallel mode or tile)
+struct hve_worker
+{
+	struct hve *parent; //user facing session
+	struct hve *h; //internal session
+	pthread_t thread;
+	int thread_started;
+	AVFrame *input; //copy of user frame, owned by worker while busy (intra parallel)
+	struct hve_frame view; //frame for internal session (input copy or tile of user frame)
+	int x_bytes[4]; //tile offset in bytes for each plane
+	int y_rows[4]; //tile offset in rows for each plane
+	AVPacket packet; //last packet returned to user in bundle
+	struct hve_packet_queue queue; //encoded packets in order
+	int busy; //input frame pending
+	int flush; //flush requested
+	int done; //flushed and drained
+	int keyframe; //keyframe requested, applied by worker thread with next frame
+	int error;
+};
+
+// how frames are distributed over internal encoders
+enum hve_workers_mode
+{
+	HVE_WORKERS_ROUND_ROBIN, //intra parallel, each frame to next worker
+	HVE_WORKERS_TILES, //tile of each frame to every worker
+	HVE_WORKERS_STREAMS, //multi-stream, own frame to every worker
+};
+
+// SIMD levels kernels may be specialized for, ascending preference within architecture
+enum hve_simd_level
+{
+	HVE_SIMD_SCALAR,
+	HVE_SIMD_NEON,
+	HVE_SIMD_SSE2,
+	HVE_SIMD_AVX2,
+	HVE_SIMD_AVX512,
+	HVE_SIMD_LEVELS
+};
+
+static const char *HVE_SIMD_NAMES[HVE_SIMD_LEVELS] = {"scalar", "neon", "sse2", "avx2", "avx512"};
+
+// row kernels, variants have the same semantics as scalar reference
+typedef void (*depth_split_row_fn)(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width);
+typedef void (*depth_merge_row_fn)(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width);
+typedef void (*rgb32_nv12_row_fn)(const uint8_t *rgb0, const uint8_t *rgb1, uint8_t *y0, uint8_t *y1, uint8_t *uv, int width, const int order[3]);
+typedef void (*uv_interleave_row_fn)(const uint8_t *u, const uint8_t *v, uint8_t *uv, int width);
+typedef void (*ssim_4x4_row_fn)(const uint8_t *a, int a_linesize, const uint8_t *b, int b_linesize, int blocks, int sums[][4]);
+typedef void (*downscale2_row_fn)(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width);
+
+// kernels bound once to the best variant CPU supports (and HVE_SIMD environment variable allows)
+struct hve_kernels
+{
+	int supported; //mask of levels CPU supports
+	enum hve_simd_level level; //highest level allowed
+	depth_split_row_fn depth_split_row;
+	depth_merge_row_fn depth_merge_row;
+	rgb32_nv12_row_fn rgb32_nv12_row;
+	uv_interleave_row_fn uv_interleave_row;
+	ssim_4x4_row_fn ssim_4x4_row;
+	downscale2_row_fn downscale2_row;
+	downscale2_row_fn downscale2_uv_row;
+};
+
+static struct hve_kernels hve_kernels;
+static pthread_once_t hve_kernels_once = PTHREAD_ONCE_INIT;
+
+// closed-loop quality target mode, decoder and controller run on background thread
+struct hve_quality
+{
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running;
+	int shutdown;
+
+	AVCodecContext *decoder;
+	AVFrame *decoded;
+	AVPacket *decoding; //packet owned by background thread
+
+	//packets in flight to decoder, flush marks restart of decoding at keyframe
+	AVPacket *packets[HVE_QUALITY_PACKETS];
+	int flush[HVE_QUALITY_PACKETS];
+	int head;
+	int count;
+	int resync; //packets were dropped, wait for keyframe (encoding thread only)
+
+	//sampled source luma, busy slot is being compared
+	uint8_t *samples[HVE_QUALITY_SAMPLES];
+	int64_t sample_pts[HVE_QUALITY_SAMPLES];
+	int busy;
+	int interval;
+	int width;
+	int height;
+	int (*sums)[4]; //two rows of 4x4 block sums (background thread only)
+
+	//controller decision is applied by encoding thread
+	double target;
+	double ssim;
+	int fresh; //next sample starts smoothing from scratch
+	int qp;
+	int bit_rate;
+	int base_qp; //configured
+	int base_bit_rate; //configured
+	int pending;
+	int64_t applied_pts; //samples before don't reflect the last decision
+	int64_t converged_pts; //-1 until SSIM reached target
+
+	//output accounting (encoding thread only)
+	double bits;
+	double base_bits; //estimated at configured qp
+};
+
+// pipeline stages HVE allocations are counted for
+enum hve_alloc_stage
+{
+	HVE_ALLOC_UPLOAD, //hardware frames, CPU conversion
+	HVE_ALLOC_FILTER, //hardware scaling filter graph
+	HVE_ALLOC_ENCODE, //encoder context, input frames, internal encoders, quality decoder, filler pre-encoding
+	HVE_ALLOC_QUEUE, //packet queue rings and packet references (quality decoder, filler, coalescer holders)
+	HVE_ALLOC_STAGES
+};
 
 // internal library data passed around by the user
 struct hve
 {
+	struct hve_config config; //copy with library owned strings
+	const char *encoder; //encoder in use (points to config strings)
+	const char *device; //device in use (points to config strings)
+	const char *alt_encoder; //migration target (points to config strings)
+	const char *alt_device; //migration target (points to config strings)
+
 	enum AVPixelFormat sw_pix_fmt;
 	AVBufferRef* hw_device_ctx;
 	AVCodecContext* avctx;
@@ -37,43 +379,410 @@ struct hve
 	AVFrame *sw_frame; //software
 	AVFrame *hw_frame; //hardware
 	AVFrame *fr_frame; //filter
+	AVFrame *cv_frame; //converted on CPU (HVE_CONVERT_CPU)
 	AVPacket enc_pkt;
+	AVPacket queue_pkt; //received by collect_packets, moved to packet queue
+
+	//pixel format conversion path
+	int convert; //path in use (hve_convert_enum)
+	enum AVHWDeviceType convert_type; //device type the path was negotiated for
+
+	//rate control in use, hve_reconfigure may change it
+	int bit_rate;
+	int qp;
+	int reconfigure_pending; //reopen encoder at keyframe boundary
+	struct hve_quality *quality; //quality target mode (optional)
+
+	//filler packets for source loss (optional)
+	AVPacket **filler; //slate IDR and skip P-frame
+	int filler_count;
+	int filler_next; //position of the next filler packet in keyframe period
+	int filler_pending; //queued with hve_send_filler, not returned yet
+	int64_t filler_pts; //timestamp of the next filler packet returned
+	int filling; //source lost, encoder suspended
+	uint64_t filler_packets;
+
+	//readiness signalling for event driven users (optional)
+	hve_ready_callback ready;
+	void *ready_opaque;
+
+	//packets already taken from encoder but not yet returned to the user
+	struct hve_packet_queue queue;
+
+	//latency tracking and migration
+	int64_t frame_number; //pts of the next frame
+	int64_t encoder_frames; //frames sent to encoder since it was opened
+	int64_t encoder_packets; //packets taken from encoder since it was opened
+	int64_t encoder_delay; //frames encoder holds before first output (lookahead, reordering)
+	int64_t send_time[HVE_LATENCY_RING];
+	int latency_us; //smoothed send to packet output latency, without encoder delay
+	int latency_max_us;
+	int migrate_latency_us;
+	int migrate_pending;
+	int migrations;
+	uint64_t packets;
+
+	//shared scheduler (optional)
+	double sched_cost; //cost of single frame divided by weight
+	double sched_finish; //virtual finish time of last submission
+	int sched_wait_us; //smoothed queueing delay
+	int sched_wait_max_us;
+
+	//admission control (optional)
+	double admission_cost; //reserved capacity, returned in hve_close
+
+	//device set (optional)
+	int device_index; //device set entry in use, -1 if none
+
+	int suspended; //encoder released with hve_suspend
+	int flushed; //NULL frame was sent to encoder in use
+	int keyframe_requested; //encode next frame as IDR
+
+	//session pool (optional)
+	struct hve *pool_next; //next in pool list
+	int pool_device_index; //device set entry to restore when taken from pool
+
+	//memory budget accounting
+	size_t pool_bytes; //hardware frame pool
+	size_t queue_bytes; //packets in packet queue
+
+	uint64_t allocs[HVE_ALLOC_STAGES]; //allocations made by HVE per stage
+
+	//intra parallel mode, tiles or multi-stream session (optional)
+	struct hve_worker *workers;
+	int workers_count;
+	enum hve_workers_mode workers_mode;
+	pthread_mutex_t workers_mutex;
+	pthread_cond_t workers_cond;
+	int workers_shutdown;
 };
 
 static struct hve *hve_close_and_return_null(struct hve *h, const char *msg);
+static void close_session(struct hve *h);
+
+static int hve_config_copy(struct hve_config *dst, const struct hve_config *src);
+static void hve_config_free(struct hve_config *config);
 
-static int init_hwframes_context(struct hve* h, const struct hve_config *config, enum AVHWDeviceType device_type);
+static int open_encoder(struct hve *h, const char *encoder, const char *device);
+static int open_encoder_path(struct hve *h, const char *encoder, const char *device);
+static void close_encoder(struct hve *h, int keep_device);
+static int drain_encoder(struct hve *h);
+static int collect_packets(struct hve *h);
+static int migrate_encoder(struct hve *h, const char *encoder, const char *device);
+static int reopen_encoder(struct hve *h);
+static int keyframe_boundary(struct hve *h);
+
+static int init_hwframes_context(struct hve* h, const struct hve_config *config, const char *device, enum AVHWDeviceType device_type);
 static int init_hardware_scaling(struct hve *h, const struct hve_config *config);
 
 static enum AVHWDeviceType hve_hw_device_type(const char *encoder);
 static enum AVPixelFormat hve_hw_pixel_format(enum AVHWDeviceType type);
 static int hve_pixel_format_depth( enum AVPixelFormat pix_fmt, int *depth);
 
+static int convert_paths(struct hve *h, enum AVHWDeviceType device_type, int *paths);
+static int64_t convert_probe(struct hve *h, int frames);
+static int convert_cache_get(enum AVHWDeviceType type, enum AVPixelFormat pix_fmt, int benchmark);
+static void convert_cache_put(enum AVHWDeviceType type, enum AVPixelFormat pix_fmt, int benchmark, int convert);
+static int convert_init(struct hve *h);
+static void convert_frame(struct hve *h, const AVFrame *src);
+static const int *convert_rgb32_order(enum AVPixelFormat pix_fmt);
+
+static int quality_init(struct hve *h);
+static void quality_close(struct hve *h);
+static void quality_sample(struct hve *h, const struct hve_frame *frame);
+static void quality_packet(struct hve *h, const AVPacket *packet);
+static int quality_apply(struct hve *h);
+static void quality_applied(struct hve *h);
+static void *quality_thread(void *arg);
+static void quality_compare(struct hve_quality *q, const AVFrame *frame);
+static void quality_control(struct hve_quality *q, double ssim, int64_t pts);
+static double quality_ssim(struct hve_quality *q, const uint8_t *a, int a_linesize, const uint8_t *b, int b_linesize);
+
+static int filler_init(struct hve *h);
+static void filler_collect(struct hve *h, struct hve *f, int count);
+static int filler_period(const struct hve *h);
+
 static int HVE_ERROR_MSG(const char *msg);
 static int HVE_ERROR_MSG_FILTER(AVFilterInOut *ins, AVFilterInOut *outs, const char *msg);
 
-static int hw_upload(struct hve *h);
+static int send_frame(struct hve *h, struct hve_frame *frame);
+static void notify_ready(struct hve *h, int events);
+static int hw_upload(struct hve *h, AVFrame *src);
 static int scale_encode(struct hve *h);
 static int encode(struct hve *h);
 
+static int packet_queue_push(struct hve *h, struct hve_packet_queue *q, AVPacket *packet);
+static void packet_queue_pop(struct hve *h, struct hve_packet_queue *q, AVPacket *packet);
+static void packet_queue_free(struct hve *h, struct hve_packet_queue *q);
+static void update_latency(struct hve *h, const AVPacket *packet);
+
+static void scheduler_acquire(struct hve *h, int frames);
+static void scheduler_release(struct hve *h);
+
+static const char *hve_config_encoder(const struct hve_config *config);
+static const char *hve_config_preset(const struct hve_config *config);
+static enum AVPixelFormat hve_config_pix_fmt(const struct hve_config *config);
+static int admission_reserve(struct hve *h);
+static void admission_release(struct hve *h);
+static double admission_estimate(struct hve_admission *a, const struct hve_config *config);
+
+static int device_set_place(struct hve *h);
+static int device_set_rebalance(struct hve *h);
+static void device_set_move(struct hve *h, int from, int to);
+
+static int budget_charge_pool(struct hve *h, enum AVPixelFormat sw_format, int width, int height);
+static void budget_charge(size_t bytes);
+static void budget_uncharge(size_t bytes);
+static int budget_exceeded(void);
+
+static int hve_config_tiles(const struct hve_config *config);
+static int init_workers(struct hve *h, const struct hve_config *configs, int n);
+static int init_intra_parallel(struct hve *h);
+static int init_tiles(struct hve *h);
+static void close_workers(struct hve *h);
+static void *worker_thread(void *arg);
+static int worker_encode(struct hve *h, struct hve_worker *w, struct hve_frame *frame);
+static void workers_flush(struct hve *h);
+static int parallel_send_frame(struct hve *h, struct hve_frame *frame);
+static AVPacket *parallel_receive_packet(struct hve *h, int *error);
+static int group_send_frames(struct hve *h, struct hve_frame **frames);
+static int group_receive_packets(struct hve *h, AVPacket **packets, int *error);
+
+static int hve_config_equal(const struct hve_config *a, const struct hve_config *b);
+static struct hve *pool_take(struct hve_pool *pool, const struct hve_config *config);
+static void pool_recycle(struct hve_pool *pool, struct hve *h);
+static void *pool_thread(void *arg);
+static void pool_park(struct hve_pool *pool, struct hve *h);
+
+static void *pyramid_thread(void *arg);
+static void pyramid_slice(struct hve_pyramid *p, int index);
+static void pyramid_plane(struct hve_pyramid *p, int plane, int width, int rows, int band_first, int band_last, downscale2_row_fn row);
+
+static struct hve_kernels *kernels();
+static void kernels_init();
+static void kernels_bind(enum hve_simd_level level);
+static void depth_split_row_c(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width);
+static void depth_merge_row_c(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width);
+static void rgb32_nv12_row_c(const uint8_t *rgb0, const uint8_t *rgb1, uint8_t *y0, uint8_t *y1, uint8_t *uv, int width, const int order[3]);
+static void uv_interleave_row_c(const uint8_t *u, const uint8_t *v, uint8_t *uv, int width);
+static void ssim_4x4_row_c(const uint8_t *a, int a_linesize, const uint8_t *b, int b_linesize, int blocks, int sums[][4]);
+static void downscale2_row_c(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width);
+static void downscale2_uv_row_c(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width);
+#if HVE_X86
+static void depth_split_row_sse2(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width);
+static void depth_split_row_avx2(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width);
+static void depth_split_row_avx512(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width);
+static void depth_merge_row_sse2(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width);
+static void depth_merge_row_avx2(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width);
+static void depth_merge_row_avx512(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width);
+static void uv_interleave_row_sse2(const uint8_t *u, const uint8_t *v, uint8_t *uv, int width);
+static void uv_interleave_row_avx2(const uint8_t *u, const uint8_t *v, uint8_t *uv, int width);
+static void ssim_4x4_row_sse2(const uint8_t *a, int a_linesize, const uint8_t *b, int b_linesize, int blocks, int sums[][4]);
+static void ssim_4x4_row_avx2(const uint8_t *a, int a_linesize, const uint8_t *b, int b_linesize, int blocks, int sums[][4]);
+static void downscale2_row_sse2(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width);
+static void downscale2_row_avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width);
+static void downscale2_uv_row_sse2(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width);
+static void downscale2_uv_row_avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width);
+#elif HVE_NEON
+static void depth_split_row_neon(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width);
+static void depth_merge_row_neon(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width);
+static void uv_interleave_row_neon(const uint8_t *u, const uint8_t *v, uint8_t *uv, int width);
+static void downscale2_row_neon(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width);
+static void downscale2_uv_row_neon(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width);
+#endif
+
+static struct hve_shared *shared_init(const char *source, const struct hve_config *config);
+static void shared_free(struct hve_shared *s);
+static struct hve_shared *shared_find(struct hve_coalescer *c, const char *source, const struct hve_config *config, int *same_source);
+static int shared_flush_last(struct hve_shared *s);
+static void shared_unref(struct hve_coalescer *c, struct hve_shared *s);
+static int shared_send_frame(struct hve_shared *s, struct hve_frame *frame);
+static int shared_encode(struct hve_shared *s, struct hve_frame *frame);
+
 // NULL on error
 struct hve *hve_init(const struct hve_config *config)
 {
 	struct hve *h, zero_hve = {0};
-	int err;
-	AVCodec* codec = NULL;
+
+	//reuse parked session with matching config if possible
+	if(config->pool && (h = pool_take(config->pool, config)) )
+		return h;
 
 	if( ( h = (struct hve*)malloc(sizeof(struct hve))) == NULL )
 		return hve_close_and_return_null(NULL, "not enough memory for hve");
 
 	*h = zero_hve; //set all members of dynamically allocated struct to 0 in a portable way
+	h->device_index = -1;
 
 	avcodec_register_all(); // for compatibility with FFmpeg 3.4 (e.g. Ubuntu 18.04)
 	avfilter_register_all();// for compatibility with FFmpeg 3.4 (e.g. Ubuntu 18.04)
 	av_log_set_level(AV_LOG_VERBOSE);
 
+	if(hve_config_copy(&h->config, config) != HVE_OK)
+		return hve_close_and_return_null(h, "not enough memory for config");
+
+	config = &h->config;
+
+	//these react to wall clock (latency, background decoding), output would depend on timing
+	if(config->deterministic && ((config->migrate_encoder && config->migrate_encoder[0] != '\0') || config->device_set || config->quality_target))
+		return hve_close_and_return_null(h, "migrate_encoder, device_set and quality_target are not supported with deterministic");
+
+	//reject (or wait for capacity) before doing anything expensive
+	if(config->admission && admission_reserve(h) != HVE_OK)
+		return hve_close_and_return_null(h, "session rejected by admission control (not enough capacity)");
+
 	//specified encoder or NULL / empty string for H.264 VAAPI
-	const char *encoder = (config->encoder != NULL && config->encoder[0] != '\0') ? config->encoder : "h264_vaapi";
+	h->encoder = hve_config_encoder(config);
+	//specified device or NULL / empty string for default
+	h->device = (config->device != NULL && config->device[0] != '\0') ? config->device : NULL;
+
+	//least loaded device from device set overrides device (and encoder if set)
+	//in intra parallel and tiles mode internal encoders are placed instead
+	if(config->device_set && config->intra_parallel <= 1 && hve_config_tiles(config) <= 1 && device_set_place(h) != HVE_OK)
+		return hve_close_and_return_null(h, "failed to place session in device set");
+
+	//optional alternative encoder for migration under load
+	if(config->migrate_encoder != NULL && config->migrate_encoder[0] != '\0')
+	{
+		h->alt_encoder = config->migrate_encoder;
+		h->alt_device = (config->migrate_device != NULL && config->migrate_device[0] != '\0') ? config->migrate_device : NULL;
+		h->migrate_latency_us = 1000 * (config->migrate_latency_ms > 0 ? config->migrate_latency_ms : HVE_MIGRATE_LATENCY_MS);
+	}
+
+	h->bit_rate = config->bit_rate;
+	h->qp = config->qp;
+
+	//cost of submission proportional to pixel count, weight is share of device
+	if(config->scheduler)
+		h->sched_cost = (double)config->width * config->height / (config->scheduler_weight > 0 ? config->scheduler_weight : 1);
+
+	//try to find software pixel format that user wants to upload data in
+	if( ( h->sw_pix_fmt = hve_config_pix_fmt(config) ) == AV_PIX_FMT_NONE )
+	{
+		fprintf(stderr, "hve: failed to find pixel format %s\n", config->pixel_format);
+		return hve_close_and_return_null(h, NULL);
+	}
+
+	if((config->quality_target || config->filler) && (hve_config_tiles(config) > 1 || config->intra_parallel > 1))
+		return hve_close_and_return_null(h, "quality target and filler are not supported with internal encoders");
+
+	if(hve_config_tiles(config) > 1)
+	{
+		if(init_tiles(h) != HVE_OK)
+			return hve_close_and_return_null(h, "failed to initialize tile encoders");
+
+		return h;
+	}
+
+	if(config->intra_parallel > 1)
+	{
+		if(init_intra_parallel(h) != HVE_OK)
+			return hve_close_and_return_null(h, "failed to initialize intra parallel encoders");
+
+		return h;
+	}
+
+	if(open_encoder(h, h->encoder, h->device) != HVE_OK)
+		return hve_close_and_return_null(h, NULL);
+
+	if(config->quality_target && quality_init(h) != HVE_OK)
+		return hve_close_and_return_null(h, "failed to initialize quality target mode");
+
+	if(config->filler && filler_init(h) != HVE_OK)
+		return hve_close_and_return_null(h, "failed to pre-encode filler packets");
+
+	if(!(h->sw_frame = av_frame_alloc()))
+		return hve_close_and_return_null(h, "av_frame_alloc not enough memory (software frame");
+	++h->allocs[HVE_ALLOC_ENCODE];
+
+	h->sw_frame->width = config->input_width ? config->input_width : config->width;
+	h->sw_frame->height = config->input_height ? config->input_height : config->height;
+	h->sw_frame->format = h->sw_pix_fmt;
+
+	av_init_packet(&h->enc_pkt);
+	h->enc_pkt.data = NULL;
+	h->enc_pkt.size = 0;
+
+	av_init_packet(&h->queue_pkt);
+	h->queue_pkt.data = NULL;
+	h->queue_pkt.size = 0;
+
+	return h;
+}
+
+// negotiates pixel format conversion path (once per hardware device type and pixel format) and opens encoder with it
+static int open_encoder(struct hve *h, const char *encoder, const char *device)
+{
+	const struct hve_config *config = &h->config;
+	enum AVHWDeviceType device_type = hve_hw_device_type(encoder);
+	int paths[HVE_CONVERT_PATHS], n, best = HVE_CONVERT_AUTO;
+	int64_t time, best_time = INT64_MAX;
+
+	//e.g. resume, pool reuse or migration back to the same kind of hardware
+	if(h->convert != HVE_CONVERT_AUTO && h->convert_type == device_type)
+		return open_encoder_path(h, encoder, device);
+
+	h->convert_type = device_type;
+
+	if( (n = convert_paths(h, device_type, paths)) == 0)
+		return HVE_ERROR_MSG("conversion path not supported for encoder and pixel format");
+
+	//forced, native pixel format or software encoder, nothing to negotiate
+	if(n == 1)
+	{
+		h->convert = paths[0];
+		return open_encoder_path(h, encoder, device);
+	}
+
+	//negotiated already by other session, probe again only if it doesn't work for us
+	if( (h->convert = convert_cache_get(device_type, h->sw_pix_fmt, config->convert_benchmark != 0)) != HVE_CONVERT_AUTO )
+	{
+		if(open_encoder_path(h, encoder, device) == HVE_OK)
+			return HVE_OK;
+
+		close_encoder(h, 1);
+		fprintf(stderr, "hve: cached conversion path %s failed, negotiating again\n", HVE_CONVERT_NAMES[h->convert]);
+	}
+
+	//first working path in order of expected cost or the fastest with benchmark
+	for(int i = 0; i < n && (best == HVE_CONVERT_AUTO || config->convert_benchmark); ++i)
+	{
+		h->convert = paths[i];
+		time = -1;
+
+		if(open_encoder_path(h, encoder, device) == HVE_OK)
+			time = convert_probe(h, config->convert_benchmark ? HVE_CONVERT_BENCHMARK_FRAMES : 1);
+
+		close_encoder(h, 1);
+
+		if(time < 0)
+			fprintf(stderr, "hve: conversion path %s not feasible\n", HVE_CONVERT_NAMES[paths[i]]);
+		else if(config->convert_benchmark)
+			fprintf(stderr, "hve: conversion path %s %d us/frame\n", HVE_CONVERT_NAMES[paths[i]], (int)(time / HVE_CONVERT_BENCHMARK_FRAMES));
+
+		if(time >= 0 && time < best_time)
+		{
+			best = paths[i];
+			best_time = time;
+		}
+	}
+
+	if( (h->convert = best) == HVE_CONVERT_AUTO)
+		return HVE_ERROR_MSG("no feasible conversion path, hint - make sure you are using supported pixel format");
+
+	fprintf(stderr, "hve: using %s conversion path for %s\n", HVE_CONVERT_NAMES[best], av_get_pix_fmt_name(h->sw_pix_fmt));
+
+	convert_cache_put(device_type, h->sw_pix_fmt, config->convert_benchmark != 0, best);
+
+	return open_encoder_path(h, encoder, device);
+}
+
+// opens encoder with conversion path h->convert
+static int open_encoder_path(struct hve *h, const char *encoder, const char *device)
+{
+	const struct hve_config *config = &h->config;
+	AVCodec* codec = NULL;
+	int err;
 
 	enum AVHWDeviceType device_type = hve_hw_device_type(encoder);
 
@@ -81,10 +790,11 @@ struct hve *hve_init(const struct hve_config *config)
 		fprintf(stderr, "hve: not using hardware device type (enoder wrapper, software or hardware not supported by hve)\n");
 
 	if(!(codec = avcodec_find_encoder_by_name(encoder)))
-		return hve_close_and_return_null(h, "could not find encoder");
+		return HVE_ERROR_MSG("could not find encoder");
 
 	if(!(h->avctx = avcodec_alloc_context3(codec)))
-		return hve_close_and_return_null(h, "unable to alloc codec context");
+		return HVE_ERROR_MSG("unable to alloc codec context");
+	++h->allocs[HVE_ALLOC_ENCODE];
 
 	h->avctx->width = config->width;
 	h->avctx->height = config->height;
@@ -100,47 +810,68 @@ struct hve *hve_init(const struct hve_config *config)
 		h->avctx->profile = config->profile;
 
 	h->avctx->max_b_frames = config->max_b_frames;
-	h->avctx->bit_rate = config->bit_rate;
+	h->avctx->bit_rate = h->bit_rate;
 
 	if(config->compression_level)
 		h->avctx->compression_level = config->compression_level;
 
-	//try to find software pixel format that user wants to upload data in
-	if(config->pixel_format == NULL || config->pixel_format[0] == '\0')
-		h->sw_pix_fmt = AV_PIX_FMT_NV12;
-	else if( ( h->sw_pix_fmt = av_get_pix_fmt(config->pixel_format) ) == AV_PIX_FMT_NONE )
+	if(config->threads)
+		h->avctx->thread_count = config->threads;
+
+	//same input, same output - across runs, hosts and library versions
+	if(config->deterministic)
 	{
-		fprintf(stderr, "hve: failed to find pixel format %s\n", config->pixel_format);
-		return hve_close_and_return_null(h, NULL);
+		h->avctx->flags |= AV_CODEC_FLAG_BITEXACT;
+		h->avctx->thread_count = config->threads ? config->threads : 1;
+		h->avctx->slices = 1;
 	}
 
 	h->avctx->pix_fmt = h->sw_pix_fmt;
 
 	if(device_type != AV_HWDEVICE_TYPE_NONE)
-		if((err = init_hwframes_context(h, config, device_type)) < 0)
-			return hve_close_and_return_null(h, "failed to set hwframe context");
+		if((err = init_hwframes_context(h, config, device, device_type)) < 0)
+			return HVE_ERROR_MSG("failed to set hwframe context");
 
 	AVDictionary *opts = NULL;
 
-	if(config->qp && (av_dict_set_int(&opts, "qp", config->qp, 0) < 0))
-		return hve_close_and_return_null(h, "failed to initialize option dictionary (qp)");
+	if(h->qp && (av_dict_set_int(&opts, "qp", h->qp, 0) < 0))
+		return HVE_ERROR_MSG("failed to initialize option dictionary (qp)");
 
 	if(config->vaapi_low_power && (av_dict_set_int(&opts, "low_power", config->vaapi_low_power != 0, 0) < 0))
-		return hve_close_and_return_null(h, "failed to initialize option dictionary (low_power)");
+		return HVE_ERROR_MSG("failed to initialize option dictionary (low_power)");
 
 	if(config->nvenc_preset && config->nvenc_preset[0] != '\0' && (av_dict_set(&opts, "preset", config->nvenc_preset, 0) < 0))
-		return hve_close_and_return_null(h, "failed to initialize option dictionary (NVENC preset)");
+		return HVE_ERROR_MSG("failed to initialize option dictionary (NVENC preset)");
 
 	if(config->nvenc_delay && (av_dict_set_int(&opts, "delay", (config->nvenc_delay > 0) ? config->nvenc_delay : 0, 0) < 0))
-		return hve_close_and_return_null(h, "failed to initialize option dictionary (NVENC delay)");
+		return HVE_ERROR_MSG("failed to initialize option dictionary (NVENC delay)");
 
 	if(config->nvenc_zerolatency && (av_dict_set_int(&opts, "zerolatency", config->nvenc_zerolatency != 0 , 0) < 0))
-		return hve_close_and_return_null(h, "failed to initialize option dictionary (NVENC zerolatency)");
+		return HVE_ERROR_MSG("failed to initialize option dictionary (NVENC zerolatency)");
+
+	//x264 scene-cut threshold only through x264-params (generic sc_threshold is taken by codec context)
+	if(strstr(encoder, "libx264") && (config->deterministic || config->no_scenecut))
+	{
+		char params[64];
+
+		snprintf(params, sizeof(params), "%s%s%s", config->deterministic ? "deterministic=1:sliced-threads=0" : "",
+		         config->deterministic && config->no_scenecut ? ":" : "", config->no_scenecut ? "scenecut=0" : "");
+
+		if(av_dict_set(&opts, "x264-params", params, 0) < 0)
+			return HVE_ERROR_MSG("failed to initialize option dictionary (x264-params)");
+	}
+
+	if(config->no_scenecut && strstr(encoder, "nvenc") && (av_dict_set_int(&opts, "no-scenecut", 1, 0) < 0))
+		return HVE_ERROR_MSG("failed to initialize option dictionary (NVENC no-scenecut)");
+
+	//make frames forced with hve_request_keyframe IDR (VAAPI does it by default)
+	if((strstr(encoder, "nvenc") || strstr(encoder, "libx264")) && (av_dict_set_int(&opts, "forced-idr", 1, 0) < 0))
+		return HVE_ERROR_MSG("failed to initialize option dictionary (forced-idr)");
 
 	if((err = avcodec_open2(h->avctx, codec, &opts)) < 0)
 	{
 		av_dict_free(&opts);
-		return hve_close_and_return_null(h, "cannot open video encoder codec");
+		return HVE_ERROR_MSG("cannot open video encoder codec");
 	}
 
 	AVDictionaryEntry *de = NULL;
@@ -151,94 +882,327 @@ struct hve *hve_init(const struct hve_config *config)
 	av_dict_free(&opts);
 
 	if( (config->input_width  && config->input_width  != config->width) ||
-	    (config->input_height && config->input_height != config->height) )
+	    (config->input_height && config->input_height != config->height) ||
+	    h->convert == HVE_CONVERT_SCALER )
 		if(init_hardware_scaling(h, config) < 0)
-			return hve_close_and_return_null(h, "failed to initialize hardware scaling");
-	//from now on h->filter_graph may be used to check if scaling was requested
+			return HVE_ERROR_MSG("failed to initialize hardware scaling");
+	//from now on h->filter_graph may be used to check if scaling (or conversion) was requested
 	if(h->filter_graph)
+	{
 		if(!(h->fr_frame = av_frame_alloc()))
-			return hve_close_and_return_null(h, "av_frame_alloc not enough memory (filter frame)");
+			return HVE_ERROR_MSG("av_frame_alloc not enough memory (filter frame)");
+		++h->allocs[HVE_ALLOC_FILTER];
+	}
 
-	if(!(h->sw_frame = av_frame_alloc()))
-		return hve_close_and_return_null(h, "av_frame_alloc not enough memory (software frame");
+	//reused for every frame, only the surface comes from (and returns to) the pool
+	if(h->hw_device_ctx)
+	{
+		if(!(h->hw_frame = av_frame_alloc()))
+			return HVE_ERROR_MSG("av_frame_alloc not enough memory (hardware frame)");
+		++h->allocs[HVE_ALLOC_UPLOAD];
+	}
 
-	h->sw_frame->width = config->input_width ? config->input_width : config->width;
-	h->sw_frame->height = config->input_height ? config->input_height : config->height;
-	h->sw_frame->format = h->sw_pix_fmt;
+	if(h->convert == HVE_CONVERT_CPU && convert_init(h) != HVE_OK)
+		return HVE_ERROR_MSG("failed to initialize CPU conversion");
 
-	av_init_packet(&h->enc_pkt);
-	h->enc_pkt.data = NULL;
-	h->enc_pkt.size = 0;
+	h->encoder_frames = 0;
+	h->encoder_packets = 0;
+	h->flushed = 0;
 
-	return h;
+	//new encoder uses current rate control
+	if(h->quality)
+		quality_applied(h);
+
+	return HVE_OK;
 }
 
-void hve_close(struct hve* h)
+// frees everything related to the encoder in use, leaves user facing state
+// keep_device leaves hardware device context for reopening encoder on it
+static void close_encoder(struct hve *h, int keep_device)
 {
-	if(h==NULL)
-		return;
-
-	av_packet_unref(&h->enc_pkt);
-	av_frame_free(&h->sw_frame);
 	av_frame_free(&h->fr_frame);
 	av_frame_free(&h->hw_frame);
+	av_frame_free(&h->cv_frame);
 
 	avfilter_graph_free(&h->filter_graph);
+	h->buffersrc_ctx = h->buffersink_ctx = NULL;
 
 	avcodec_free_context(&h->avctx);
-	av_buffer_unref(&h->hw_device_ctx);
 
-	free(h);
+	budget_uncharge(h->pool_bytes);
+	h->pool_bytes = 0;
+
+	if(!keep_device)
+		av_buffer_unref(&h->hw_device_ctx);
 }
 
-static struct hve *hve_close_and_return_null(struct hve *h, const char *msg)
+// flushes the encoder in use and moves remaining packets to the packet queue
+// after this the encoder can't be reused
+static int drain_encoder(struct hve *h)
 {
-	if(msg)
-		fprintf(stderr, "hve: %s\n", msg);
+	//user may have already flushed the encoder
+	if(!h->flushed)
+	{
+		if(h->filter_graph)
+			if(av_buffersrc_add_frame_flags(h->buffersrc_ctx, NULL, AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH))
+				fprintf(stderr, "hve: error while marking filter EOF\n");
 
-	hve_close(h);
+		if(avcodec_send_frame(h->avctx, NULL) < 0)
+			return HVE_ERROR_MSG("error while flushing encoder");
 
-	return NULL;
+		h->flushed = 1;
+	}
+
+	if(collect_packets(h) != AVERROR_EOF)
+		return HVE_ERROR_MSG("error while draining encoder");
+
+	return HVE_OK;
 }
 
-static int init_hwframes_context(struct hve* h, const struct hve_config *config, enum AVHWDeviceType device_type)
+// moves packets available from encoder to packet queue
+// returns avcodec_receive_packet result that stopped it (EAGAIN, EOF or error)
+// receives to reused packet, nothing is allocated unless the queue has to grow
+static int collect_packets(struct hve *h)
 {
-	AVBufferRef* hw_frames_ref;
-	AVHWFramesContext* frames_ctx = NULL;
-	int err = 0, depth;
+	int err;
 
-	//specified device or NULL / empty string for default
-	const char *device = (config->device != NULL && config->device[0] != '\0') ? config->device : NULL;
+	while( (err = avcodec_receive_packet(h->avctx, &h->queue_pkt)) == 0 )
+	{
+		update_latency(h, &h->queue_pkt);
 
-	if( (h->avctx->pix_fmt = hve_hw_pixel_format(device_type)) == AV_PIX_FMT_NONE)
-		return HVE_ERROR_MSG("could not find hardware pixel format for encoder");
+		if(h->quality)
+			quality_packet(h, &h->queue_pkt);
 
-	if( av_hwdevice_ctx_create(&h->hw_device_ctx, device_type, device, NULL, 0) < 0)
-		return HVE_ERROR_MSG("failed to create hardware device context");
+		if(packet_queue_push(h, &h->queue, &h->queue_pkt) != HVE_OK)
+		{
+			fprintf(stderr, "hve: not enough memory for packet queue (collect)\n");
+			return AVERROR(ENOMEM);
+		}
+	}
 
-	if(!(hw_frames_ref = av_hwframe_ctx_alloc(h->hw_device_ctx)))
-		return HVE_ERROR_MSG("failed to create hardware frame context");
+	return err;
+}
 
-	frames_ctx = (AVHWFramesContext*)(hw_frames_ref->data);
-	frames_ctx->format = h->avctx->pix_fmt; //e.g. AV_PIX_FMT_VAAPI, AV_PIX_FMT_CUDA
+// drains the encoder in use to the packet queue and switches to encoder on device
+// the new encoder starts with IDR so the output stays one continuous stream
+// if the new encoder fails to open the old one is reopened (h->encoder, h->device unchanged)
+static int migrate_encoder(struct hve *h, const char *encoder, const char *device)
+{
+	const char *old_encoder = h->encoder, *old_device = h->device;
 
-	frames_ctx->width = config->input_width ? config->input_width : config->width;
-	frames_ctx->height = config->input_height ? config->input_height : config->height;
+	if(drain_encoder(h) != HVE_OK)
+		return HVE_ERROR_MSG("failed to drain encoder for migration");
 
-	frames_ctx->initial_pool_size = 20;
+	close_encoder(h, 0);
 
-	frames_ctx->sw_format = h->sw_pix_fmt;
+	fprintf(stderr, "hve: migrating from %s (%s) to %s (%s), latency %d ms\n", old_encoder, old_device ? old_device : "default",
+	        encoder, device ? device : "default", h->latency_us / 1000);
 
-	// Starting from FFmpeg 4.1, avcodec will not fall back to NV12 automatically
-	// when using non 4:2:0 software pixel format not supported by codec with VAAPI.
-	// Here, instead of using h->sw_pix_fmt we always fall to P010LE for 10 bit
-	// input and NV12 otherwise which may possibly lead to some loss of information
+	if(open_encoder(h, encoder, device) != HVE_OK)
+	{
+		close_encoder(h, 0);
+
+		fprintf(stderr, "hve: migration to %s failed, reopening %s\n", encoder, old_encoder);
+
+		if(open_encoder(h, old_encoder, old_device) != HVE_OK)
+			return HVE_ERROR_MSG("failed to reopen encoder after failed migration");
+	}
+	else
+	{
+		h->encoder = encoder;
+		h->device = device;
+		++h->migrations;
+	}
+
+	h->latency_us = 0;
+
+	return HVE_OK;
+}
+
+// drains the encoder in use and opens it again (e.g. with new rate control)
+// the new encoder starts with IDR so the output stays one continuous stream
+static int reopen_encoder(struct hve *h)
+{
+	if(drain_encoder(h) != HVE_OK)
+		return HVE_ERROR_MSG("failed to drain encoder for reopening");
+
+	close_encoder(h, 1);
+
+	if(open_encoder(h, h->encoder, h->device) != HVE_OK)
+		return HVE_ERROR_MSG("failed to reopen encoder");
+
+	return HVE_OK;
+}
+
+// the next frame starts new keyframe period, this is where we may switch encoders
+static int keyframe_boundary(struct hve *h)
+{
+	const char *encoder = h->encoder, *device = h->device;
+	int from = h->device_index, to;
+
+	//migration reopens with new rate control anyway
+	if(h->reconfigure_pending)
+	{
+		h->reconfigure_pending = 0;
+
+		if(!h->migrate_pending && reopen_encoder(h) != HVE_OK)
+			return HVE_ERROR;
+	}
+
+	if(h->migrate_pending)
+	{
+		h->migrate_pending = 0;
+
+		if(migrate_encoder(h, h->alt_encoder, h->alt_device) != HVE_OK)
+			return HVE_ERROR;
+
+		//swap so that we may migrate back when the other side gets saturated
+		if(h->encoder != encoder || h->device != device)
+		{
+			h->alt_encoder = encoder;
+			h->alt_device = device;
+		}
+
+		return HVE_OK;
+	}
+
+	if(h->config.device_set && (to = device_set_rebalance(h)) >= 0)
+	{
+		struct hve_device_set_entry *e = &h->config.device_set->devices[to];
+
+		if(migrate_encoder(h, e->encoder ? e->encoder : hve_config_encoder(&h->config), e->device) != HVE_OK)
+			return HVE_ERROR;
+
+		//failed to open on the other device, move the session back
+		if(h->encoder == encoder && h->device == device)
+			device_set_move(h, to, from);
+	}
+
+	return HVE_OK;
+}
+
+void hve_close(struct hve* h)
+{
+	if(h==NULL)
+		return;
+
+	//park for reuse, teardown happens on pool thread
+	//sessions with internal encoders can't be suspended so they are not parked
+	//quality target sessions are not parked, their rate control adapted to previous content
+	if(h->config.pool && !h->workers && !h->quality)
+	{
+		pool_recycle(h->config.pool, h);
+		return;
+	}
+
+	close_session(h);
+}
+
+static void close_session(struct hve *h)
+{
+	if(h->workers)
+		close_workers(h);
+
+	quality_close(h);
+
+	for(int i = 0; i < h->filler_count; ++i)
+		av_packet_free(&h->filler[i]);
+	av_freep(&h->filler);
+
+	av_packet_unref(&h->enc_pkt);
+	av_packet_unref(&h->queue_pkt);
+	av_frame_free(&h->sw_frame);
+
+	close_encoder(h, 0);
+
+	packet_queue_free(h, &h->queue);
+
+	if(h->config.admission)
+		admission_release(h);
+
+	if(h->device_index >= 0)
+		device_set_move(h, h->device_index, -1);
+
+	hve_config_free(&h->config);
+
+	free(h);
+}
+
+static struct hve *hve_close_and_return_null(struct hve *h, const char *msg)
+{
+	if(msg)
+		fprintf(stderr, "hve: %s\n", msg);
+
+	if(h)
+		close_session(h);
+
+	return NULL;
+}
+
+static int hve_config_copy(struct hve_config *dst, const struct hve_config *src)
+{
+	*dst = *src;
+
+	//make sure we don't point to user memory, NULL the copies first so that free is safe
+	dst->device = dst->encoder = dst->pixel_format = dst->nvenc_preset = NULL;
+	dst->migrate_encoder = dst->migrate_device = NULL;
+
+	if( (src->device && !(dst->device = av_strdup(src->device))) ||
+	    (src->encoder && !(dst->encoder = av_strdup(src->encoder))) ||
+	    (src->pixel_format && !(dst->pixel_format = av_strdup(src->pixel_format))) ||
+	    (src->nvenc_preset && !(dst->nvenc_preset = av_strdup(src->nvenc_preset))) ||
+	    (src->migrate_encoder && !(dst->migrate_encoder = av_strdup(src->migrate_encoder))) ||
+	    (src->migrate_device && !(dst->migrate_device = av_strdup(src->migrate_device))) )
+		return HVE_ERROR;
+
+	return HVE_OK;
+}
+
+static void hve_config_free(struct hve_config *config)
+{
+	av_free((void*)config->device);
+	av_free((void*)config->encoder);
+	av_free((void*)config->pixel_format);
+	av_free((void*)config->nvenc_preset);
+	av_free((void*)config->migrate_encoder);
+	av_free((void*)config->migrate_device);
+}
+
+static int init_hwframes_context(struct hve* h, const struct hve_config *config, const char *device, enum AVHWDeviceType device_type)
+{
+	AVBufferRef* hw_frames_ref;
+	AVHWFramesContext* frames_ctx = NULL;
+	int err = 0, depth;
+
+	if( (h->avctx->pix_fmt = hve_hw_pixel_format(device_type)) == AV_PIX_FMT_NONE)
+		return HVE_ERROR_MSG("could not find hardware pixel format for encoder");
+
+	//device may be kept from before suspend
+	if( !h->hw_device_ctx && av_hwdevice_ctx_create(&h->hw_device_ctx, device_type, device, NULL, 0) < 0)
+		return HVE_ERROR_MSG("failed to create hardware device context");
+
+	if(!(hw_frames_ref = av_hwframe_ctx_alloc(h->hw_device_ctx)))
+		return HVE_ERROR_MSG("failed to create hardware frame context");
+
+	frames_ctx = (AVHWFramesContext*)(hw_frames_ref->data);
+	frames_ctx->format = h->avctx->pix_fmt; //e.g. AV_PIX_FMT_VAAPI, AV_PIX_FMT_CUDA
+
+	frames_ctx->width = config->input_width ? config->input_width : config->width;
+	frames_ctx->height = config->input_height ? config->input_height : config->height;
+
+	frames_ctx->sw_format = h->sw_pix_fmt;
+
+	// Starting from FFmpeg 4.1, avcodec will not fall back to NV12 automatically
+	// when using non 4:2:0 software pixel format not supported by codec with VAAPI.
+	// Here, instead of using h->sw_pix_fmt we always fall to P010LE for 10 bit
+	// input and NV12 otherwise which may possibly lead to some loss of information
 	// on modern hardware supporting 4:2:2 and 4:4:4 chroma subsampling
 	// (e.g. HEVC with >= IceLake)
 	// See:
 	// https://github.com/bmegli/hardware-video-encoder/issues/26
 	// https://github.com/bmegli/hardware-video-encoder/issues/35
-	if(frames_ctx->format == AV_PIX_FMT_VAAPI)
+	// With HVE_CONVERT_SCALER surfaces stay in h->sw_pix_fmt and scaler converts them.
+	if(frames_ctx->format == AV_PIX_FMT_VAAPI && h->convert != HVE_CONVERT_SCALER)
 	{
 		frames_ctx->sw_format = AV_PIX_FMT_NV12;
 
@@ -249,6 +1213,17 @@ static int init_hwframes_context(struct hve* h, const struct hve_config *config,
 			frames_ctx->sw_format = AV_PIX_FMT_P010LE;
 	}
 
+	//data is converted to NV12 on CPU before upload
+	if(h->convert == HVE_CONVERT_CPU)
+		frames_ctx->sw_format = AV_PIX_FMT_NV12;
+
+	//pool of surfaces, possibly limited by memory budget
+	if( (frames_ctx->initial_pool_size = budget_charge_pool(h, frames_ctx->sw_format, frames_ctx->width, frames_ctx->height)) < 0)
+	{
+		av_buffer_unref(&hw_frames_ref);
+		return HVE_ERROR_MSG("hardware frame pool doesn't fit in memory budget");
+	}
+
 	if((err = av_hwframe_ctx_init(hw_frames_ref)) < 0)
 	{
 		fprintf(stderr, "hve: failed to initialize hardware frame context - \"%s\"\n", av_err2str(err));
@@ -269,7 +1244,7 @@ static int init_hardware_scaling(struct hve *h, const struct hve_config *config)
 	const AVFilter *buffersrc, *buffersink;
 	AVFilterInOut *ins, *outs;
 	char temp_str[128];
-	int err = 0;
+	int err = 0, depth = 8;
 
 	if( !(buffersrc = avfilter_get_by_name("buffer")) )
 		return HVE_ERROR_MSG("unable to find filter 'buffer'");
@@ -284,10 +1259,12 @@ static int init_hardware_scaling(struct hve *h, const struct hve_config *config)
 
 	if (!ins || !outs || !h->filter_graph)
 		return HVE_ERROR_MSG_FILTER(ins, outs, "unable to allocate memory for the filter");
+	++h->allocs[HVE_ALLOC_FILTER];
 
 	//prepare filter source
 	snprintf(temp_str, sizeof(temp_str), "video_size=%dx%d:pix_fmt=%d:time_base=1/%d:pixel_aspect=1/1",
-		config->input_width, config->input_height, AV_PIX_FMT_VAAPI, config->framerate);
+		config->input_width ? config->input_width : config->width,
+		config->input_height ? config->input_height : config->height, AV_PIX_FMT_VAAPI, config->framerate);
 
 	if(avfilter_graph_create_filter(&h->buffersrc_ctx, buffersrc, "in", temp_str, NULL, h->filter_graph) < 0)
 		return HVE_ERROR_MSG_FILTER(ins, outs, "cannot create buffer source");
@@ -320,7 +1297,12 @@ static int init_hardware_scaling(struct hve *h, const struct hve_config *config)
 	ins->next       = NULL;
 
 	//the actual description of the graph
-	snprintf(temp_str, sizeof(temp_str), "format=vaapi,scale_vaapi=w=%d:h=%d", config->width, config->height);
+	//scaler also converts surfaces in user pixel format to what encoder takes
+	if(h->convert == HVE_CONVERT_SCALER && hve_pixel_format_depth(h->sw_pix_fmt, &depth) != HVE_OK)
+		return HVE_ERROR_MSG_FILTER(ins, outs, "failed to get pixel format depth");
+
+	snprintf(temp_str, sizeof(temp_str), "format=vaapi,scale_vaapi=w=%d:h=%d%s", config->width, config->height,
+		h->convert != HVE_CONVERT_SCALER ? "" : depth == 10 ? ":format=p010" : ":format=nv12");
 
 	if(avfilter_graph_parse_ptr(h->filter_graph, temp_str, &ins, &outs, NULL) < 0)
 		return HVE_ERROR_MSG_FILTER(ins, outs, "failed to parse filter graph description");
@@ -374,128 +1356,4205 @@ static int hve_pixel_format_depth(enum AVPixelFormat pix_fmt, int *depth)
 	return HVE_OK;
 }
 
-static int HVE_ERROR_MSG(const char *msg)
+// candidate conversion paths in order of expected cost, returns their number
+static int convert_paths(struct hve *h, enum AVHWDeviceType device_type, int *paths)
 {
-	fprintf(stderr, "hve: %s\n", msg);
-	return HVE_ERROR;
+	const struct hve_config *config = &h->config;
+	enum AVPixelFormat fmt = h->sw_pix_fmt;
+	int native = fmt == AV_PIX_FMT_NV12 || fmt == AV_PIX_FMT_P010LE;
+	int cpu = device_type != AV_HWDEVICE_TYPE_NONE && (convert_rgb32_order(fmt) || fmt == AV_PIX_FMT_YUV420P);
+	int scaler = device_type == AV_HWDEVICE_TYPE_VAAPI;
+	int n = 0;
+
+	if(config->convert == HVE_CONVERT_DIRECT || (config->convert == HVE_CONVERT_SCALER && scaler) ||
+	   (config->convert == HVE_CONVERT_CPU && cpu))
+		paths[n++] = config->convert;
+
+	if(config->convert != HVE_CONVERT_AUTO)
+		return n;
+
+	//software encoders convert themselves, NVENC takes many formats directly
+	if(device_type == AV_HWDEVICE_TYPE_NONE || native)
+		paths[n++] = HVE_CONVERT_DIRECT;
+	else if(device_type == AV_HWDEVICE_TYPE_VAAPI)
+	{
+		paths[n++] = HVE_CONVERT_SCALER;
+		if(cpu)
+			paths[n++] = HVE_CONVERT_CPU;
+		paths[n++] = HVE_CONVERT_DIRECT;
+	}
+	else
+	{
+		paths[n++] = HVE_CONVERT_DIRECT;
+		if(cpu)
+			paths[n++] = HVE_CONVERT_CPU;
+	}
+
+	return n;
 }
 
-static int HVE_ERROR_MSG_FILTER(AVFilterInOut *ins, AVFilterInOut *outs, const char *msg)
+// times upload (and conversion) of dummy frames with encoder just opened
+// returns time in microseconds or negative if path doesn't work
+static int64_t convert_probe(struct hve *h, int frames)
 {
-	avfilter_inout_free(&ins);
-	avfilter_inout_free(&outs);
-	//h->filter_graph is fred in reaction to init_hardware_scaling HVE_ERROR return
+	const struct hve_config *config = &h->config;
+	AVFrame *src;
+	int64_t start, time = -1;
+	int f = 0;
 
-	return HVE_ERROR_MSG(msg);
+	if(!h->hw_frame || !(src = av_frame_alloc()))
+		return -1;
+	++h->allocs[HVE_ALLOC_UPLOAD];
+
+	src->format = h->sw_pix_fmt;
+	src->width = config->input_width ? config->input_width : config->width;
+	src->height = config->input_height ? config->input_height : config->height;
+
+	if(av_frame_get_buffer(src, 32) == 0)
+	{
+		for(int i = 0; i < AV_NUM_DATA_POINTERS && src->buf[i]; ++i)
+			memset(src->buf[i]->data, 0, src->buf[i]->size);
+
+		start = av_gettime_relative();
+
+		for(f = 0; f < frames && hw_upload(h, src) == HVE_OK; ++f)
+		{
+			if(h->filter_graph)
+			{
+				if(av_buffersrc_add_frame_flags(h->buffersrc_ctx, h->hw_frame, AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH) < 0 ||
+				   av_buffersink_get_frame(h->buffersink_ctx, h->fr_frame) < 0)
+					break;
+
+				av_frame_unref(h->fr_frame);
+			}
+
+			av_frame_unref(h->hw_frame);
+		}
+
+		if(f == frames)
+			time = av_gettime_relative() - start;
+	}
+
+	av_frame_unref(h->hw_frame);
+	av_frame_free(&src);
+
+	return time;
 }
 
-int hve_send_frame(struct hve *h,struct hve_frame *frame)
+// HVE_CONVERT_AUTO if not negotiated yet
+static int convert_cache_get(enum AVHWDeviceType type, enum AVPixelFormat pix_fmt, int benchmark)
 {
-	//note - in case hardware frame preparation fails, the frame is fred:
-	// - here (this is next user try)
-	// - or in av_close (this is user decision to terminate)
-	av_frame_free(&h->hw_frame);
+	int convert = HVE_CONVERT_AUTO;
 
-	// NULL frame is used for flushing the encoder
-	if(frame == NULL)
-	{
-		if(h->filter_graph)
-			if(av_buffersrc_add_frame_flags(h->buffersrc_ctx, NULL, AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH))
-				fprintf(stderr, "hve: error while marking filter EOF\n");
+	pthread_mutex_lock(&hve_convert_mutex);
 
-		if (avcodec_send_frame(h->avctx, NULL)  < 0)
-			return HVE_ERROR_MSG("error while flushing encoder");
+	int n = hve_convert_cached < HVE_CONVERT_CACHE ? hve_convert_cached : HVE_CONVERT_CACHE;
 
-		return HVE_OK;
+	for(int i = 0; i < n; ++i)
+	{
+		struct hve_convert_cache_entry *e = &hve_convert_cache[i];
+
+		if(e->type == type && e->pix_fmt == pix_fmt && e->benchmark == benchmark)
+		{
+			convert = e->convert;
+			break;
+		}
 	}
 
-	//this just copies a few ints and pointers, not the actual frame data
-	memcpy(h->sw_frame->linesize, frame->linesize, sizeof(frame->linesize));
-	memcpy(h->sw_frame->data, frame->data, sizeof(frame->data));
+	pthread_mutex_unlock(&hve_convert_mutex);
 
-	if(h->hw_device_ctx)
-		if(hw_upload(h) < 0)
-			return HVE_ERROR_MSG("failed to upload frame data to hardware");
+	return convert;
+}
 
-	if(h->filter_graph)
-		return scale_encode(h);
+// replaces existing entry (path no longer working) or the oldest one if full
+static void convert_cache_put(enum AVHWDeviceType type, enum AVPixelFormat pix_fmt, int benchmark, int convert)
+{
+	struct hve_convert_cache_entry *e = NULL;
 
-	return encode(h);
+	pthread_mutex_lock(&hve_convert_mutex);
+
+	int n = hve_convert_cached < HVE_CONVERT_CACHE ? hve_convert_cached : HVE_CONVERT_CACHE;
+
+	for(int i = 0; i < n && !e; ++i)
+		if(hve_convert_cache[i].type == type && hve_convert_cache[i].pix_fmt == pix_fmt && hve_convert_cache[i].benchmark == benchmark)
+			e = &hve_convert_cache[i];
+
+	if(e == NULL)
+		e = &hve_convert_cache[hve_convert_cached++ % HVE_CONVERT_CACHE];
+
+	e->type = type;
+	e->pix_fmt = pix_fmt;
+	e->benchmark = benchmark;
+	e->convert = convert;
+
+	pthread_mutex_unlock(&hve_convert_mutex);
 }
 
-static int hw_upload(struct hve *h)
+// NV12 frame the data is converted to before upload (HVE_CONVERT_CPU)
+static int convert_init(struct hve *h)
 {
-	if(!(h->hw_frame = av_frame_alloc()))
-		return HVE_ERROR_MSG("av_frame_alloc not enough memory for hw_frame");
+	const struct hve_config *config = &h->config;
+	int size;
 
-	if(av_hwframe_get_buffer(h->avctx->hw_frames_ctx, h->hw_frame, 0) < 0)
-		return HVE_ERROR_MSG("av_hwframe_get_buffer error");
+	if(!(h->cv_frame = av_frame_alloc()))
+		return HVE_ERROR_MSG("av_frame_alloc not enough memory (conversion frame)");
+	++h->allocs[HVE_ALLOC_UPLOAD];
 
-	if(!h->hw_frame->hw_frames_ctx)
-		return HVE_ERROR_MSG("hw_frame->hw_frames_ctx not enough memory");
+	h->cv_frame->format = AV_PIX_FMT_NV12;
+	h->cv_frame->width = config->input_width ? config->input_width : config->width;
+	h->cv_frame->height = config->input_height ? config->input_height : config->height;
 
-	if(av_hwframe_transfer_data(h->hw_frame, h->sw_frame, 0) < 0)
-		return HVE_ERROR_MSG("error while transferring frame data to surface");
+	if(av_frame_get_buffer(h->cv_frame, 32) < 0)
+		return HVE_ERROR_MSG("av_frame_get_buffer not enough memory (conversion frame)");
+	++h->allocs[HVE_ALLOC_UPLOAD];
+
+	//accounted like hardware frame pool, released in close_encoder
+	size = av_image_get_buffer_size(AV_PIX_FMT_NV12, h->cv_frame->width, h->cv_frame->height, 32);
+	budget_charge(size);
+	h->pool_bytes += size;
 
 	return HVE_OK;
 }
 
-static int scale_encode(struct hve *h)
+static void convert_frame(struct hve *h, const AVFrame *src)
 {
-	int err, err2;
-
-	if (av_buffersrc_add_frame_flags(h->buffersrc_ctx, h->hw_frame, AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH) < 0)
-		return HVE_ERROR_MSG("failed to push frame to filtergraph");
+	struct hve_kernels *k = kernels();
+	AVFrame *dst = h->cv_frame;
+	const int *order = convert_rgb32_order(h->sw_pix_fmt);
+	const int width = dst->width, height = dst->height;
 
-	while((err = av_buffersink_get_frame(h->buffersink_ctx, h->fr_frame)) >= 0)
+	//two rows at a time, chroma is averaged over 2x2 block
+	if(order)
 	{
-		err2 = avcodec_send_frame(h->avctx, h->fr_frame);
-		av_frame_unref(h->fr_frame);
+		for(int y = 0; y < height; y += 2)
+		{
+			const int next = y + 1 < height;
+			const uint8_t *rgb = src->data[0] + y * src->linesize[0];
+			uint8_t *luma = dst->data[0] + y * dst->linesize[0];
 
-		if(err2 < 0)
-			return HVE_ERROR_MSG("send_frame error (after scaling)");
+			k->rgb32_nv12_row(rgb, rgb + next * src->linesize[0], luma, luma + next * dst->linesize[0],
+			                  dst->data[1] + y / 2 * dst->linesize[1], width, order);
+		}
+		return;
 	}
 
-	if(err == AVERROR(EAGAIN) || err == AVERROR_EOF)
-		return HVE_OK;
+	//yuv420p
+	av_image_copy_plane(dst->data[0], dst->linesize[0], src->data[0], src->linesize[0], width, height);
 
-	if(err < 0)
-		return HVE_ERROR_MSG("failed to get frame from filtergraph");
+	for(int y = 0; y < (height + 1) / 2; ++y)
+		k->uv_interleave_row(src->data[1] + y * src->linesize[1], src->data[2] + y * src->linesize[2],
+		                     dst->data[1] + y * dst->linesize[1], (width + 1) / 2);
+}
 
-	return HVE_OK;
+// byte offsets of R, G, B in packed 4 byte pixel or NULL if format is not such
+static const int *convert_rgb32_order(enum AVPixelFormat pix_fmt)
+{
+	static const int rgb[3] = {0, 1, 2}, bgr[3] = {2, 1, 0};
+
+	if(pix_fmt == AV_PIX_FMT_RGB0 || pix_fmt == AV_PIX_FMT_RGBA)
+		return rgb;
+	if(pix_fmt == AV_PIX_FMT_BGR0 || pix_fmt == AV_PIX_FMT_BGRA)
+		return bgr;
+
+	return NULL;
 }
 
-static int encode(struct hve *h)
+static int quality_init(struct hve *h)
 {
-	AVFrame *frame = h->hw_frame ? h->hw_frame : h->sw_frame;
+	const struct hve_config *config = &h->config;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(h->sw_pix_fmt);
+	struct hve_quality *q, zero_quality = {0};
+	const AVCodec *codec;
+	int depth;
 
-	if(avcodec_send_frame(h->avctx, frame) < 0)
-		return HVE_ERROR_MSG("send_frame error");
+	if(!desc || (desc->flags & AV_PIX_FMT_FLAG_RGB) || hve_pixel_format_depth(h->sw_pix_fmt, &depth) != HVE_OK || depth != 8)
+		return HVE_ERROR_MSG("quality target requires 8 bit pixel format with luma plane (e.g. nv12, yuv420p)");
+
+	if( (config->input_width && config->input_width != config->width) ||
+	    (config->input_height && config->input_height != config->height) )
+		return HVE_ERROR_MSG("quality target is not supported with scaling");
+
+	if(!h->qp && !h->bit_rate)
+		return HVE_ERROR_MSG("quality target needs starting point, set qp or bit_rate");
+
+	if( (q = (struct hve_quality*)malloc(sizeof(struct hve_quality))) == NULL)
+		return HVE_ERROR_MSG("not enough memory for quality target");
+	++h->allocs[HVE_ALLOC_ENCODE];
+
+	*q = zero_quality;
+	h->quality = q;
+
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	q->busy = -1;
+	q->interval = config->quality_interval > 0 ? config->quality_interval : HVE_QUALITY_INTERVAL;
+	q->width = config->width;
+	q->height = config->height;
+	q->target = config->quality_target / 1000.0;
+	q->fresh = 1;
+	q->qp = q->base_qp = h->qp;
+	q->bit_rate = q->base_bit_rate = h->bit_rate;
+	q->converged_pts = -1;
+
+	for(int i = 0; i < HVE_QUALITY_SAMPLES; ++i)
+	{
+		q->sample_pts[i] = -1;
+
+		if(!(q->samples[i] = (uint8_t*)malloc((size_t)q->width * q->height)))
+			return HVE_ERROR_MSG("not enough memory for quality samples");
+		++h->allocs[HVE_ALLOC_ENCODE];
+	}
+
+	if(!(q->sums = malloc(2 * (q->width / 4 + 1) * sizeof(*q->sums))))
+		return HVE_ERROR_MSG("not enough memory for quality sums");
+	++h->allocs[HVE_ALLOC_ENCODE];
+
+	//packets are referenced, not copied, so the structures are allocated once
+	for(int i = 0; i < HVE_QUALITY_PACKETS; ++i)
+	{
+		if(!(q->packets[i] = av_packet_alloc()))
+			return HVE_ERROR_MSG("not enough memory for quality packets");
+		++h->allocs[HVE_ALLOC_ENCODE];
+	}
+
+	if(!(q->decoding = av_packet_alloc()) || !(q->decoded = av_frame_alloc()))
+		return HVE_ERROR_MSG("not enough memory for quality decoder frame");
+	h->allocs[HVE_ALLOC_ENCODE] += 2;
+
+	//software decoder of what the encoder produces
+	if(!(codec = avcodec_find_decoder(h->avctx->codec_id)))
+		return HVE_ERROR_MSG("could not find decoder for quality target");
+
+	if(!(q->decoder = avcodec_alloc_context3(codec)))
+		return HVE_ERROR_MSG("unable to alloc decoder context");
+	++h->allocs[HVE_ALLOC_ENCODE];
+
+	if(avcodec_open2(q->decoder, codec, NULL) < 0)
+		return HVE_ERROR_MSG("cannot open decoder for quality target");
+
+	if(pthread_create(&q->thread, NULL, quality_thread, q) != 0)
+		return HVE_ERROR_MSG("failed to create quality thread");
+
+	q->running = 1;
 
 	return HVE_OK;
 }
 
-// returns:
-// - non NULL on success
-// - NULL and failed == false if more data is needed
-// - NULL and failed == true on error
-// the ownership of returned AVPacket* remains with the library
-AVPacket *hve_receive_packet(struct hve *h, int *error)
+static void quality_close(struct hve *h)
 {
-	//the packed will be unreffed in:
-	//- next call to av_receive_packet through avcodec_receive_packet
-	//- av_close (user decides to finish in the middle of encoding)
-	//whichever happens first
-	int ret = avcodec_receive_packet(h->avctx, &h->enc_pkt);
+	struct hve_quality *q = h->quality;
 
-	*error=HVE_OK;
+	if(q == NULL)
+		return;
 
-	if(ret == 0)
-		return &h->enc_pkt;
+	if(q->running)
+	{
+		pthread_mutex_lock(&q->mutex);
+		q->shutdown = 1;
+		pthread_cond_signal(&q->cond);
+		pthread_mutex_unlock(&q->mutex);
 
-	//EAGAIN means that we need to supply more data
-	//EOF means that we are flushing the decoder and no more data is pending
-	//otherwise we got an error
-	*error = ( ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? HVE_OK : HVE_ERROR;
-	return NULL;
+		pthread_join(q->thread, NULL);
+	}
+
+	for(int i = 0; i < HVE_QUALITY_PACKETS; ++i)
+		av_packet_free(&q->packets[i]);
+
+	for(int i = 0; i < HVE_QUALITY_SAMPLES; ++i)
+		free(q->samples[i]);
+
+	free(q->sums);
+	av_packet_free(&q->decoding);
+	av_frame_free(&q->decoded);
+	avcodec_free_context(&q->decoder);
+
+	pthread_mutex_destroy(&q->mutex);
+	pthread_cond_destroy(&q->cond);
+
+	free(q);
+	h->quality = NULL;
 }
+
+// copies luma of every interval-th frame for comparison with decoded frame
+static void quality_sample(struct hve *h, const struct hve_frame *frame)
+{
+	struct hve_quality *q = h->quality;
+	const int64_t pts = h->frame_number;
+	const int slot = (pts / q->interval) % HVE_QUALITY_SAMPLES;
+
+	if(pts % q->interval)
+		return;
+
+	//decoder lags too much, skip the sample
+	pthread_mutex_lock(&q->mutex);
+	if(q->busy == slot)
+	{
+		pthread_mutex_unlock(&q->mutex);
+		return;
+	}
+	q->sample_pts[slot] = -1;
+	pthread_mutex_unlock(&q->mutex);
+
+	av_image_copy_plane(q->samples[slot], q->width, frame->data[0], frame->linesize[0], q->width, q->height);
+
+	pthread_mutex_lock(&q->mutex);
+	q->sample_pts[slot] = pts;
+	pthread_mutex_unlock(&q->mutex);
+}
+
+// 2^(1/6), about 12% more bits per QP step down
+#define HVE_QP_STEP_BITS 1.122462
+
+// references packet for background decoder, accounts bits
+static void quality_packet(struct hve *h, const AVPacket *packet)
+{
+	struct hve_quality *q = h->quality;
+	const int key = packet->flags & AV_PKT_FLAG_KEY;
+	double scale = 1.0;
+	int i;
+
+	q->bits += 8.0 * packet->size;
+
+	//bits the packet would take at configured qp
+	for(int d = h->qp; d > q->base_qp; --d)
+		scale *= HVE_QP_STEP_BITS;
+	for(int d = h->qp; d < q->base_qp; ++d)
+		scale /= HVE_QP_STEP_BITS;
+
+	q->base_bits += 8.0 * packet->size * scale;
+
+	//after dropping packets decoding restarts at keyframe
+	if(q->resync && !key)
+		return;
+
+	pthread_mutex_lock(&q->mutex);
+
+	if(q->count == HVE_QUALITY_PACKETS || av_packet_ref(q->packets[i = (q->head + q->count) % HVE_QUALITY_PACKETS], packet) < 0)
+		q->resync = 1;
+	else
+	{
+		++h->allocs[HVE_ALLOC_QUEUE];
+		q->flush[i] = q->resync;
+		q->resync = 0;
+		++q->count;
+		pthread_cond_signal(&q->cond);
+	}
+
+	pthread_mutex_unlock(&q->mutex);
+}
+
+// applies decision of quality controller (if any)
+static int quality_apply(struct hve *h)
+{
+	struct hve_quality *q = h->quality;
+	int qp, bit_rate, pending;
+
+	pthread_mutex_lock(&q->mutex);
+	pending = q->pending;
+	qp = q->qp;
+	bit_rate = q->bit_rate;
+	q->pending = 0;
+	pthread_mutex_unlock(&q->mutex);
+
+	if(!pending)
+		return HVE_OK;
+
+	return hve_reconfigure(h, bit_rate, qp);
+}
+
+// samples from now on reflect current rate control
+static void quality_applied(struct hve *h)
+{
+	struct hve_quality *q = h->quality;
+
+	pthread_mutex_lock(&q->mutex);
+	q->applied_pts = h->frame_number;
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static void *quality_thread(void *arg)
+{
+	struct hve_quality *q = (struct hve_quality*)arg;
+	int flush;
+
+	pthread_mutex_lock(&q->mutex);
+
+	while(1)
+	{
+		while(!q->count && !q->shutdown)
+			pthread_cond_wait(&q->cond, &q->mutex);
+
+		if(q->shutdown)
+			break;
+
+		av_packet_move_ref(q->decoding, q->packets[q->head]);
+		flush = q->flush[q->head];
+		q->head = (q->head + 1) % HVE_QUALITY_PACKETS;
+		--q->count;
+
+		pthread_mutex_unlock(&q->mutex);
+
+		if(flush)
+			avcodec_flush_buffers(q->decoder);
+
+		//decoding errors only cost samples
+		if(avcodec_send_packet(q->decoder, q->decoding) == 0)
+			while(avcodec_receive_frame(q->decoder, q->decoded) == 0)
+			{
+				quality_compare(q, q->decoded);
+				av_frame_unref(q->decoded);
+			}
+
+		av_packet_unref(q->decoding);
+
+		pthread_mutex_lock(&q->mutex);
+	}
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return NULL;
+}
+
+// compares decoded frame with source sample if it was sampled
+static void quality_compare(struct hve_quality *q, const AVFrame *frame)
+{
+	const int64_t pts = frame->pts;
+	const int slot = pts >= 0 ? (pts / q->interval) % HVE_QUALITY_SAMPLES : 0;
+	double ssim;
+	int depth;
+
+	if(frame->width != q->width || frame->height != q->height ||
+	   hve_pixel_format_depth(frame->format, &depth) != HVE_OK || depth != 8)
+		return;
+
+	pthread_mutex_lock(&q->mutex);
+
+	if(pts < 0 || q->sample_pts[slot] != pts || pts < q->applied_pts)
+	{
+		pthread_mutex_unlock(&q->mutex);
+		return;
+	}
+
+	q->busy = slot;
+	pthread_mutex_unlock(&q->mutex);
+
+	ssim = quality_ssim(q, q->samples[slot], q->width, frame->data[0], frame->linesize[0]);
+
+	pthread_mutex_lock(&q->mutex);
+	q->busy = -1;
+	q->sample_pts[slot] = -1;
+	quality_control(q, ssim, pts);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+// one step of QP or bitrate towards the lowest rate keeping SSIM above target, called with mutex held
+static void quality_control(struct hve_quality *q, double ssim, int64_t pts)
+{
+	int qp = q->qp, bit_rate = q->bit_rate;
+
+	q->ssim = q->fresh ? ssim : (3 * q->ssim + ssim) / 4;
+	q->fresh = 0;
+
+	if(q->converged_pts < 0 && q->ssim >= q->target)
+		q->converged_pts = pts;
+
+	//previous decision not applied yet
+	if(q->pending)
+		return;
+
+	if(q->ssim < q->target)
+	{
+		qp = FFMAX(qp - 1, 1);
+		bit_rate = (int)FFMIN((int64_t)bit_rate * 9 / 8, (int64_t)q->base_bit_rate * 4);
+	}
+	else if(q->ssim > q->target + HVE_QUALITY_BAND)
+	{
+		qp = FFMIN(qp + 1, 51);
+		bit_rate = (int)FFMAX((int64_t)bit_rate * 15 / 16, (int64_t)q->base_bit_rate / 8);
+	}
+
+	if( (q->base_qp && qp == q->qp) || (!q->base_qp && bit_rate == q->bit_rate) )
+		return;
+
+	//CQP or VBR, the other stays 0
+	if(q->base_qp)
+		q->qp = qp;
+	else
+		q->bit_rate = bit_rate;
+
+	q->pending = 1;
+	q->fresh = 1;
+	q->applied_pts = INT64_MAX;
+}
+
+// mean SSIM of luma over 8x8 windows overlapping by 4 (like x264)
+static double quality_ssim(struct hve_quality *q, const uint8_t *a, int a_linesize, const uint8_t *b, int b_linesize)
+{
+	const double c1 = .01 * .01 * 255 * 255 * 64, c2 = .03 * .03 * 255 * 255 * 64 * 63;
+	ssim_4x4_row_fn sums_row = kernels()->ssim_4x4_row;
+	const int blocks = q->width / 4, rows = q->height / 4;
+	int (*prev)[4] = q->sums, (*cur)[4] = q->sums + blocks, (*tmp)[4];
+	double ssim = 0;
+
+	if(blocks < 2 || rows < 2)
+		return 1.0;
+
+	sums_row(a, a_linesize, b, b_linesize, blocks, prev);
+
+	for(int y = 1; y < rows; ++y)
+	{
+		sums_row(a + 4 * y * a_linesize, a_linesize, b + 4 * y * b_linesize, b_linesize, blocks, cur);
+
+		for(int x = 0; x < blocks - 1; ++x)
+		{
+			const double s1 = prev[x][0] + prev[x + 1][0] + cur[x][0] + cur[x + 1][0];
+			const double s2 = prev[x][1] + prev[x + 1][1] + cur[x][1] + cur[x + 1][1];
+			const double ss = prev[x][2] + prev[x + 1][2] + cur[x][2] + cur[x + 1][2];
+			const double s12 = prev[x][3] + prev[x + 1][3] + cur[x][3] + cur[x + 1][3];
+			const double vars = ss * 64 - s1 * s1 - s2 * s2, covar = s12 * 64 - s1 * s2;
+
+			ssim += (2 * s1 * s2 + c1) * (2 * covar + c2) / ((s1 * s1 + s2 * s2 + c1) * (vars + c2));
+		}
+
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+
+	return ssim / ((blocks - 1) * (rows - 1));
+}
+
+// pre-encodes slate IDR and P-frames of unchanged slate with separate encoder of the same kind
+static int filler_init(struct hve *h)
+{
+	const struct hve_config *config = &h->config;
+	struct hve_config fc = {0};
+	struct hve_frame slate = { {0} };
+	uint8_t *data[4] = {NULL};
+	int linesize[4], size;
+	struct hve *f;
+
+	//IDR and skip P-frame, the P-frame is repeated for the rest of keyframe period
+	const int period = filler_period(h), count = period > 1 ? 2 : 1;
+
+	fc.width = config->width;
+	fc.height = config->height;
+	fc.input_width = config->input_width;
+	fc.input_height = config->input_height;
+	fc.framerate = config->framerate;
+	fc.device = h->device;
+	fc.encoder = h->encoder;
+	fc.pixel_format = config->pixel_format;
+	fc.profile = config->profile;
+	//constant quantizer so that x264 may switch to skip quantizer between frames
+	fc.qp = h->qp ? h->qp : HVE_FILLER_QP;
+	fc.gop_size = period;
+	fc.compression_level = config->compression_level;
+	fc.vaapi_low_power = config->vaapi_low_power;
+	fc.nvenc_preset = config->nvenc_preset;
+	fc.nvenc_delay = config->nvenc_delay;
+	fc.nvenc_zerolatency = config->nvenc_zerolatency;
+	fc.threads = 1; //no frame threads, x264 returns IDR before the next frame is sent
+	fc.deterministic = config->deterministic;
+	fc.convert = h->convert;
+	//no B-frames, packets come in presentation order and dts == pts
+
+	if(!(h->filler = av_mallocz_array(count, sizeof(AVPacket*))))
+		return HVE_ERROR_MSG("not enough memory for filler packets");
+	++h->allocs[HVE_ALLOC_ENCODE];
+
+	if(config->filler_frame)
+		slate = *config->filler_frame;
+	else
+	{
+		//mid grey in YUV formats, grey in RGB formats
+		if( (size = av_image_alloc(data, linesize, config->input_width ? config->input_width : config->width,
+		     config->input_height ? config->input_height : config->height, h->sw_pix_fmt, 32)) < 0)
+			return HVE_ERROR_MSG("not enough memory for filler slate");
+		++h->allocs[HVE_ALLOC_ENCODE];
+
+		memset(data[0], 0x80, size);
+
+		for(int i = 0; i < 4; ++i)
+		{
+			slate.data[i] = data[i];
+			slate.linesize[i] = linesize[i];
+		}
+	}
+
+	if( (f = hve_init(&fc)) == NULL)
+	{
+		av_freep(&data[0]);
+		return HVE_ERROR_MSG("failed to initialize filler encoder");
+	}
+
+	if(hve_send_frame(f, &slate) == HVE_OK)
+		filler_collect(h, f, count);
+
+	//unchanged content at maximum quantizer is skip-only and may be repeated without drift
+	//other encoders can't change it on the fly and encode unchanged content at the same quantizer
+	if(count > 1 && h->filler_count == 1 && strstr(f->encoder, "libx264"))
+		hve_reconfigure(f, 0, HVE_FILLER_SKIP_QP);
+
+	if(count > 1 && hve_send_frame(f, &slate) == HVE_OK)
+		filler_collect(h, f, count);
+
+	hve_send_frame(f, NULL);
+	filler_collect(h, f, count);
+
+	hve_close(f);
+	av_freep(&data[0]);
+
+	for(int i = 0; i < h->filler_count; ++i)
+		if(!h->filler[i])
+			return HVE_ERROR_MSG("not enough memory for filler packet");
+
+	if(h->filler_count != count)
+		return HVE_ERROR_MSG("filler encoder didn't return all packets");
+
+	if(!(h->filler[0]->flags & AV_PKT_FLAG_KEY) || (count > 1 && (h->filler[1]->flags & AV_PKT_FLAG_KEY)))
+		return HVE_ERROR_MSG("filler encoder didn't return keyframe followed by P-frame");
+
+	fprintf(stderr, "hve: pre-encoded %d filler packets\n", h->filler_count);
+
+	return HVE_OK;
+}
+
+static void filler_collect(struct hve *h, struct hve *f, int count)
+{
+	AVPacket *packet;
+	int failed;
+
+	while( (packet = hve_receive_packet(f, &failed)) )
+		if(h->filler_count < count)
+		{
+			h->filler[h->filler_count++] = av_packet_clone(packet);
+			++h->allocs[HVE_ALLOC_ENCODE];
+		}
+}
+
+// keyframe period of filler stream, the decoder sees regular IDR interval
+static int filler_period(const struct hve *h)
+{
+	return h->config.gop_size > 0 ? h->config.gop_size : h->config.framerate;
+}
+
+static int HVE_ERROR_MSG(const char *msg)
+{
+	fprintf(stderr, "hve: %s\n", msg);
+	return HVE_ERROR;
+}
+
+static int HVE_ERROR_MSG_FILTER(AVFilterInOut *ins, AVFilterInOut *outs, const char *msg)
+{
+	avfilter_inout_free(&ins);
+	avfilter_inout_free(&outs);
+	//h->filter_graph is fred in reaction to init_hardware_scaling HVE_ERROR return
+
+	return HVE_ERROR_MSG(msg);
+}
+
+int hve_suspend(struct hve *h)
+{
+	if(h->suspended)
+		return HVE_OK;
+
+	if(h->workers)
+		return HVE_ERROR_MSG("suspend is not supported in intra parallel mode");
+
+	//remaining packets are still available through hve_receive_packet
+	if(drain_encoder(h) != HVE_OK)
+		return HVE_ERROR_MSG("failed to drain encoder before suspend");
+
+	close_encoder(h, 1);
+	h->suspended = 1;
+
+	return HVE_OK;
+}
+
+int hve_resume(struct hve *h)
+{
+	if(!h->suspended)
+		return HVE_OK;
+
+	if(open_encoder(h, h->encoder, h->device) != HVE_OK)
+	{
+		close_encoder(h, 1);
+		return HVE_ERROR_MSG("failed to resume encoder");
+	}
+
+	h->suspended = 0;
+
+	return HVE_OK;
+}
+
+int hve_request_keyframe(struct hve *h)
+{
+	//internal encoders are used by worker threads, keep their IDRs aligned
+	if(h->workers)
+	{
+		pthread_mutex_lock(&h->workers_mutex);
+
+		for(int i = 0; i < h->workers_count; ++i)
+			h->workers[i].keyframe = 1;
+
+		pthread_mutex_unlock(&h->workers_mutex);
+
+		return HVE_OK;
+	}
+
+	h->keyframe_requested = 1;
+	return HVE_OK;
+}
+
+int hve_send_filler(struct hve *h)
+{
+	if(!h->filler)
+		return HVE_ERROR_MSG("filler not enabled in hve_config");
+
+	//packets of frames already sent are drained to packet queue and go first
+	if(!h->filling)
+	{
+		if(hve_suspend(h) != HVE_OK)
+			return HVE_ERROR_MSG("failed to suspend encoder for filler");
+
+		h->filling = 1;
+		//decoder needs IDR first
+		if(!h->filler_pending)
+			h->filler_next = 0;
+	}
+
+	if(!h->filler_pending)
+		h->filler_pts = h->frame_number;
+
+	++h->filler_pending;
+	++h->frame_number;
+
+	notify_ready(h, HVE_READY_PACKET);
+
+	return HVE_OK;
+}
+
+int hve_set_ready_callback(struct hve *h, hve_ready_callback callback, void *opaque)
+{
+	h->ready = callback;
+	h->ready_opaque = opaque;
+
+	return HVE_OK;
+}
+
+int hve_send_ready(struct hve *h)
+{
+	int ready = 1;
+
+	//other sessions send synchronously
+	if(h->workers && h->workers_mode == HVE_WORKERS_ROUND_ROBIN)
+	{
+		pthread_mutex_lock(&h->workers_mutex);
+		ready = !h->workers[h->frame_number % h->workers_count].busy;
+		pthread_mutex_unlock(&h->workers_mutex);
+	}
+
+	return ready;
+}
+
+// call without workers_mutex locked, callback may schedule work that takes it
+static void notify_ready(struct hve *h, int events)
+{
+	if(h->ready)
+		h->ready(h->ready_opaque, events);
+}
+
+int hve_reconfigure(struct hve *h, int bit_rate, int qp)
+{
+	if(h->workers)
+		return HVE_ERROR_MSG("reconfigure is not supported with internal encoders");
+
+	if(bit_rate < 0 || qp < 0)
+		return HVE_ERROR_MSG("bit_rate and qp should be non-negative");
+
+	h->bit_rate = bit_rate ? bit_rate : h->bit_rate;
+	h->qp = qp ? qp : h->qp;
+
+	//hve_resume opens encoder with new rate control
+	if(h->suspended)
+		return HVE_OK;
+
+	//x264 wrapper picks up changes on the next frame
+	if(strstr(h->encoder, "libx264"))
+	{
+		h->avctx->bit_rate = h->bit_rate;
+
+		if(h->qp && av_opt_set_int(h->avctx->priv_data, "qp", h->qp, 0) < 0)
+			return HVE_ERROR_MSG("failed to set qp of running encoder");
+
+		if(h->quality)
+			quality_applied(h);
+
+		return HVE_OK;
+	}
+
+	h->reconfigure_pending = 1;
+
+	return HVE_OK;
+}
+
+int hve_send_frame(struct hve *h,struct hve_frame *frame)
+{
+	int ret;
+
+	//source is back, encoding resumes with IDR (nothing to flush while filling)
+	if(h->filling)
+	{
+		if(frame == NULL)
+			return HVE_OK;
+
+		h->filling = 0;
+
+		if(hve_resume(h) != HVE_OK)
+			return HVE_ERROR_MSG("failed to resume encoder after filler");
+	}
+
+	if(h->suspended)
+		return HVE_ERROR_MSG("encoder is suspended, call hve_resume first");
+
+	//internal encoders take care of scheduling themselves
+	if(h->workers && h->workers_mode == HVE_WORKERS_STREAMS)
+		return HVE_ERROR_MSG("use hve_multi_send_frame with multi-stream session");
+
+	if(h->workers && h->workers_mode == HVE_WORKERS_TILES)
+	{
+		struct hve_frame *frames[HVE_MAX_WORKERS];
+
+		for(int i = 0; i < h->workers_count; ++i)
+			frames[i] = frame;
+
+		ret = group_send_frames(h, frame ? frames : NULL);
+	}
+	else if(h->workers)
+		ret = parallel_send_frame(h, frame);
+	else if(!h->config.scheduler)
+		ret = send_frame(h, frame);
+	else
+	{
+		scheduler_acquire(h, 1);
+		ret = send_frame(h, frame);
+		scheduler_release(h);
+	}
+
+	//encoder may have output now (intra parallel encoders also signal from their threads)
+	if(ret == HVE_OK)
+		notify_ready(h, HVE_READY_PACKET);
+
+	return ret;
+}
+
+int hve_send_frames(struct hve *h, struct hve_frame *frames, int n)
+{
+	int sent = 0;
+
+	if(h->filling && n > 0)
+	{
+		h->filling = 0;
+
+		if(hve_resume(h) != HVE_OK)
+		{
+			fprintf(stderr, "hve: failed to resume encoder after filler\n");
+			return 0;
+		}
+	}
+
+	if(h->suspended)
+	{
+		fprintf(stderr, "hve: encoder is suspended, call hve_resume first\n");
+		return 0;
+	}
+
+	//internal encoders synchronize per frame on their own
+	if(h->workers)
+	{
+		while(sent < n && hve_send_frame(h, &frames[sent]) == HVE_OK)
+			++sent;
+
+		return sent;
+	}
+
+	//single synchronization point for the whole batch
+	if(h->config.scheduler)
+		scheduler_acquire(h, n);
+
+	//encoder output goes to packet queue (send_frame) so that encoder never refuses input in the middle of batch
+	while(sent < n && send_frame(h, &frames[sent]) == HVE_OK)
+		++sent;
+
+	if(h->config.scheduler)
+		scheduler_release(h);
+
+	if(sent)
+		notify_ready(h, HVE_READY_PACKET);
+
+	if(sent < n)
+		fprintf(stderr, "hve: batch stopped after %d of %d frames\n", sent, n);
+
+	return sent;
+}
+
+static int send_frame(struct hve *h, struct hve_frame *frame)
+{
+	//note - in case hardware frame preparation fails, the frame is unreffed:
+	// - here (this is next user try)
+	// - or in av_close (this is user decision to terminate)
+	//the AVFrame itself is reused so there is no allocation per frame
+	if(h->hw_frame)
+		av_frame_unref(h->hw_frame);
+
+	// NULL frame is used for flushing the encoder
+	if(frame == NULL)
+	{
+		if(h->filter_graph)
+			if(av_buffersrc_add_frame_flags(h->buffersrc_ctx, NULL, AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH))
+				fprintf(stderr, "hve: error while marking filter EOF\n");
+
+		if (avcodec_send_frame(h->avctx, NULL)  < 0)
+			return HVE_ERROR_MSG("error while flushing encoder");
+
+		h->flushed = 1;
+
+		return HVE_OK;
+	}
+
+	if(budget_exceeded())
+		return HVE_ERROR_MSG("memory budget exceeded, frame rejected");
+
+	//switch encoder or device at keyframe period boundary
+	if(h->avctx->gop_size <= 1 || h->encoder_frames % h->avctx->gop_size == 0)
+		if(keyframe_boundary(h) != HVE_OK)
+			return HVE_ERROR_MSG("failed to migrate encoder");
+
+	//controller decision from quality thread, sample after possible reopening
+	if(h->quality)
+	{
+		if(quality_apply(h) != HVE_OK)
+			return HVE_ERROR_MSG("failed to apply quality target rate control");
+
+		quality_sample(h, frame);
+	}
+
+	//this just copies a few ints and pointers, not the actual frame data
+	memcpy(h->sw_frame->linesize, frame->linesize, sizeof(frame->linesize));
+	memcpy(h->sw_frame->data, frame->data, sizeof(frame->data));
+
+	h->sw_frame->pict_type = h->keyframe_requested ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+	h->keyframe_requested = 0;
+
+	h->sw_frame->pts = h->frame_number++;
+	h->send_time[h->sw_frame->pts % HVE_LATENCY_RING] = av_gettime_relative();
+	++h->encoder_frames;
+
+	if(h->hw_device_ctx)
+		if(hw_upload(h, h->sw_frame) < 0)
+			return HVE_ERROR_MSG("failed to upload frame data to hardware");
+
+	if( (h->filter_graph ? scale_encode(h) : encode(h)) != HVE_OK )
+		return HVE_ERROR;
+
+	//take output as soon as encoder produces it, latency doesn't depend on hve_receive_packet timing
+	if(collect_packets(h) != AVERROR(EAGAIN))
+		return HVE_ERROR_MSG("failed to collect packets from encoder");
+
+	return HVE_OK;
+}
+
+static int hw_upload(struct hve *h, AVFrame *src)
+{
+	AVFrame *frame = src;
+
+	if(h->cv_frame)
+	{
+		convert_frame(h, src);
+		frame = h->cv_frame;
+	}
+
+	if(av_hwframe_get_buffer(h->avctx->hw_frames_ctx, h->hw_frame, 0) < 0)
+		return HVE_ERROR_MSG("av_hwframe_get_buffer error");
+
+	if(!h->hw_frame->hw_frames_ctx)
+		return HVE_ERROR_MSG("hw_frame->hw_frames_ctx not enough memory");
+
+	if(av_hwframe_transfer_data(h->hw_frame, frame, 0) < 0)
+		return HVE_ERROR_MSG("error while transferring frame data to surface");
+
+	h->hw_frame->pts = src->pts;
+	h->hw_frame->pict_type = src->pict_type;
+
+	return HVE_OK;
+}
+
+static int scale_encode(struct hve *h)
+{
+	int err, err2;
+
+	if (av_buffersrc_add_frame_flags(h->buffersrc_ctx, h->hw_frame, AV_BUFFERSRC_FLAG_KEEP_REF | AV_BUFFERSRC_FLAG_PUSH) < 0)
+		return HVE_ERROR_MSG("failed to push frame to filtergraph");
+
+	while((err = av_buffersink_get_frame(h->buffersink_ctx, h->fr_frame)) >= 0)
+	{
+		err2 = avcodec_send_frame(h->avctx, h->fr_frame);
+		av_frame_unref(h->fr_frame);
+
+		if(err2 < 0)
+			return HVE_ERROR_MSG("send_frame error (after scaling)");
+	}
+
+	if(err == AVERROR(EAGAIN) || err == AVERROR_EOF)
+		return HVE_OK;
+
+	if(err < 0)
+		return HVE_ERROR_MSG("failed to get frame from filtergraph");
+
+	return HVE_OK;
+}
+
+static int encode(struct hve *h)
+{
+	AVFrame *frame = h->hw_device_ctx ? h->hw_frame : h->sw_frame;
+
+	if(avcodec_send_frame(h->avctx, frame) < 0)
+		return HVE_ERROR_MSG("send_frame error");
+
+	return HVE_OK;
+}
+
+// returns:
+// - non NULL on success
+// - NULL and failed == false if more data is needed
+// - NULL and failed == true on error
+// the ownership of returned AVPacket* remains with the library
+AVPacket *hve_receive_packet(struct hve *h, int *error)
+{
+	*error=HVE_OK;
+
+	if(h->workers && h->workers_mode != HVE_WORKERS_ROUND_ROBIN)
+	{
+		*error = HVE_ERROR_MSG("use hve_receive_packets with tiles or multi-stream session");
+		return NULL;
+	}
+
+	if(h->workers)
+		return parallel_receive_packet(h, error);
+
+	//packets drained from previous encoder (migration) go first
+	if(h->queue.count)
+	{
+		packet_queue_pop(h, &h->queue, &h->enc_pkt);
+		++h->packets;
+		return &h->enc_pkt;
+	}
+
+	//cached filler packets with continued timestamps
+	if(h->filler_pending)
+	{
+		av_packet_unref(&h->enc_pkt);
+
+		//IDR at keyframe period start, the same skip P-frame otherwise
+		if(av_packet_ref(&h->enc_pkt, h->filler[h->filler_next ? 1 : 0]) < 0)
+		{
+			*error = HVE_ERROR_MSG("not enough memory for filler packet reference");
+			return NULL;
+		}
+		++h->allocs[HVE_ALLOC_QUEUE];
+
+		h->enc_pkt.pts = h->enc_pkt.dts = h->filler_pts++;
+		h->filler_next = (h->filler_next + 1) % filler_period(h);
+		--h->filler_pending;
+		++h->filler_packets;
+		++h->packets;
+
+		return &h->enc_pkt;
+	}
+
+	if(h->suspended)
+		return NULL;
+
+	//the packed will be unreffed in:
+	//- next call to av_receive_packet through avcodec_receive_packet
+	//- av_close (user decides to finish in the middle of encoding)
+	//whichever happens first
+	int ret = avcodec_receive_packet(h->avctx, &h->enc_pkt);
+
+	if(ret == 0)
+	{
+		update_latency(h, &h->enc_pkt);
+
+		if(h->quality)
+			quality_packet(h, &h->enc_pkt);
+
+		++h->packets;
+		return &h->enc_pkt;
+	}
+
+	//EAGAIN means that we need to supply more data
+	//EOF means that we are flushing the decoder and no more data is pending
+	//otherwise we got an error
+	*error = ( ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? HVE_OK : HVE_ERROR;
+	return NULL;
+}
+
+int hve_receive_packets(struct hve *h, AVPacket **packets, int *error)
+{
+	*error=HVE_OK;
+
+	if(h->workers && h->workers_mode != HVE_WORKERS_ROUND_ROBIN)
+		return group_receive_packets(h, packets, error);
+
+	return (packets[0] = hve_receive_packet(h, error)) != NULL;
+}
+
+struct hve *hve_multi_init(const struct hve_config *configs, int count)
+{
+	struct hve_config streams[HVE_MAX_WORKERS];
+	struct hve *h, zero_hve = {0};
+
+	if(count < 1 || count > HVE_MAX_WORKERS)
+		return hve_close_and_return_null(NULL, "multi-stream session supports 1 to 16 streams");
+
+	//keyframes aligned and packets matched by capture timestamp
+	for(int i = 1; i < count; ++i)
+		if(configs[i].framerate != configs[0].framerate || configs[i].gop_size != configs[0].gop_size)
+			return hve_close_and_return_null(NULL, "multi-stream session needs the same framerate and gop_size");
+
+	//B-frames reorder output (adaptively, per content), bundle can't be in decode order of every stream
+	//delay (lookahead, nvenc_delay) is fine, bundle waits for the slowest stream
+	for(int i = 0; i < count; ++i)
+		if(configs[i].max_b_frames > 0)
+			return hve_close_and_return_null(NULL, "multi-stream session doesn't support B-frames");
+
+	if( ( h = (struct hve*)malloc(sizeof(struct hve))) == NULL )
+		return hve_close_and_return_null(NULL, "not enough memory for hve");
+
+	*h = zero_hve; //set all members of dynamically allocated struct to 0 in a portable way
+	h->device_index = -1;
+
+	if(hve_config_copy(&h->config, &configs[0]) != HVE_OK)
+		return hve_close_and_return_null(h, "not enough memory for config");
+
+	//internal encoders are subject to admission and device set placement themselves
+	h->config.admission = NULL;
+	h->config.device_set = NULL;
+	h->config.pool = NULL;
+
+	h->encoder = hve_config_encoder(&h->config);
+	h->workers_mode = HVE_WORKERS_STREAMS;
+
+	//like in hve_init, streams may differ (e.g. nv12 and p010le), first one is reported
+	if( (h->sw_pix_fmt = hve_config_pix_fmt(&h->config)) == AV_PIX_FMT_NONE )
+	{
+		fprintf(stderr, "hve: failed to find pixel format %s\n", h->config.pixel_format);
+		return hve_close_and_return_null(h, NULL);
+	}
+
+	//IDR of single stream would break keyframe alignment
+	for(int i = 0; i < count; ++i)
+	{
+		streams[i] = configs[i];
+		streams[i].no_scenecut = 1;
+	}
+
+	if(init_workers(h, streams, count) != HVE_OK)
+		return hve_close_and_return_null(h, "failed to initialize multi-stream encoders");
+
+	return h;
+}
+
+int hve_multi_send_frame(struct hve *h, struct hve_frame **frames)
+{
+	if(!h->workers || h->workers_mode != HVE_WORKERS_STREAMS)
+		return HVE_ERROR_MSG("not a multi-stream session");
+
+	return group_send_frames(h, frames);
+}
+
+struct hve *hve_depth_init(const struct hve_config *config)
+{
+	struct hve_config configs[2] = {*config, *config};
+	struct hve *h;
+
+	if( (config->input_width && config->input_width != config->width) ||
+	    (config->input_height && config->input_height != config->height) )
+		return hve_close_and_return_null(NULL, "scaling is not supported for depth");
+
+	//hi and lo 8-bit planes go as NV12 luminance
+	configs[0].pixel_format = configs[1].pixel_format = "nv12";
+
+	if( (h = hve_multi_init(configs, 2)) == NULL)
+		return NULL;
+
+	for(int i = 0; i < 2; ++i)
+	{
+		AVFrame *f;
+
+		if(!(f = h->workers[i].input = av_frame_alloc()))
+			return hve_close_and_return_null(h, "av_frame_alloc not enough memory (depth frame)");
+		++h->allocs[HVE_ALLOC_ENCODE];
+
+		f->format = AV_PIX_FMT_NV12;
+		f->width = config->width;
+		f->height = config->height;
+
+		if(av_frame_get_buffer(f, 32) < 0)
+			return hve_close_and_return_null(h, "not enough memory for depth frame");
+
+		//neutral color, only luminance carries depth
+		memset(f->data[1], 128, f->linesize[1] * ((f->height + 1) / 2));
+	}
+
+	return h;
+}
+
+int hve_depth_send_frame(struct hve *h, struct hve_frame *frame)
+{
+	struct hve_frame planes[2] = { {{0}} };
+	struct hve_frame *frames[2] = {&planes[0], &planes[1]};
+	AVFrame *hi, *lo;
+
+	if(!h->workers || h->workers_mode != HVE_WORKERS_STREAMS || !h->workers[0].input)
+		return HVE_ERROR_MSG("not a depth session");
+
+	if(frame == NULL)
+		return group_send_frames(h, NULL);
+
+	hi = h->workers[0].input;
+	lo = h->workers[1].input;
+
+	hve_depth_split((const uint16_t*)frame->data[0], frame->linesize[0], hi->data[0], hi->linesize[0],
+	                lo->data[0], lo->linesize[0], hi->width, hi->height);
+
+	for(int i = 0; i < 2; ++i)
+	{
+		memcpy(planes[i].data, h->workers[i].input->data, sizeof(planes[i].data));
+		memcpy(planes[i].linesize, h->workers[i].input->linesize, sizeof(planes[i].linesize));
+	}
+
+	return group_send_frames(h, frames);
+}
+
+int hve_get_stats(struct hve *h, struct hve_stats *stats)
+{
+	struct hve_stats zero_stats = {0};
+
+	*stats = zero_stats;
+
+	stats->frames = h->frame_number;
+	stats->packets = h->packets;
+	stats->latency_us = h->latency_us;
+	stats->latency_max_us = h->latency_max_us;
+	stats->migrations = h->migrations;
+	stats->encoder = h->encoder;
+	stats->sched_wait_us = h->sched_wait_us;
+	stats->sched_wait_max_us = h->sched_wait_max_us;
+	stats->memory_bytes = h->pool_bytes + h->queue_bytes;
+	stats->allocs_upload = h->allocs[HVE_ALLOC_UPLOAD];
+	stats->allocs_filter = h->allocs[HVE_ALLOC_FILTER];
+	stats->allocs_encode = h->allocs[HVE_ALLOC_ENCODE];
+	stats->allocs_queue = h->allocs[HVE_ALLOC_QUEUE];
+	stats->convert = h->convert;
+	stats->filler_packets = h->filler_packets;
+	stats->quality_qp = h->qp;
+	stats->quality_bit_rate = h->bit_rate;
+
+	if(h->quality)
+	{
+		struct hve_quality *q = h->quality;
+		//VBR compared with configured bitrate over stream time, CQP with estimate at configured qp
+		double base_bits = q->base_bit_rate ? (double)q->base_bit_rate * h->frame_number / h->config.framerate : q->base_bits;
+
+		pthread_mutex_lock(&q->mutex);
+		stats->quality_ssim = q->ssim;
+		stats->quality_converged_ms = q->converged_pts < 0 ? 0 : (int)(q->converged_pts * 1000 / h->config.framerate);
+		pthread_mutex_unlock(&q->mutex);
+
+		stats->quality_bits_saved = (int64_t)(base_bits - q->bits);
+	}
+
+	//internal encoders are part of this session
+	for(int i = 0; i < h->workers_count; ++i)
+	{
+		struct hve *w = h->workers[i].h;
+
+		stats->memory_bytes += w->pool_bytes + w->queue_bytes;
+		stats->allocs_upload += w->allocs[HVE_ALLOC_UPLOAD];
+		stats->allocs_filter += w->allocs[HVE_ALLOC_FILTER];
+		stats->allocs_encode += w->allocs[HVE_ALLOC_ENCODE];
+		stats->allocs_queue += w->allocs[HVE_ALLOC_QUEUE];
+	}
+
+	return HVE_OK;
+}
+
+// moves packet reference to the queue, packet is left blank (also on failure)
+static int packet_queue_push(struct hve *h, struct hve_packet_queue *q, AVPacket *packet)
+{
+	AVPacket *queued;
+
+	if(q->count == q->size)
+	{
+		int size = q->size ? 2 * q->size : 8;
+		AVPacket **packets = av_malloc_array(size, sizeof(AVPacket*));
+		++h->allocs[HVE_ALLOC_QUEUE];
+
+		if(!packets)
+		{
+			av_packet_unref(packet);
+			return HVE_ERROR;
+		}
+
+		//unwrap the ring (full) to the beginning of new array
+		for(int i = 0; i < q->size; ++i)
+			packets[i] = q->packets[(q->head + i) % q->size];
+
+		av_free(q->packets);
+		q->packets = packets;
+		q->head = 0;
+
+		//q->size counts packets allocated so far if we run out of memory
+		for(; q->size < size; ++q->size)
+		{
+			if(!(packets[q->size] = av_packet_alloc()))
+			{
+				av_packet_unref(packet);
+				return HVE_ERROR;
+			}
+			++h->allocs[HVE_ALLOC_QUEUE];
+		}
+	}
+
+	queued = q->packets[(q->head + q->count) % q->size];
+	av_packet_move_ref(queued, packet);
+	++q->count;
+
+	h->queue_bytes += queued->size;
+	budget_charge(queued->size);
+
+	return HVE_OK;
+}
+
+// moves the oldest packet reference to packet
+static void packet_queue_pop(struct hve *h, struct hve_packet_queue *q, AVPacket *packet)
+{
+	AVPacket *queued = q->packets[q->head];
+
+	h->queue_bytes -= queued->size;
+	budget_uncharge(queued->size);
+
+	av_packet_unref(packet);
+	av_packet_move_ref(packet, queued);
+
+	q->head = (q->head + 1) % q->size;
+	--q->count;
+}
+
+static void packet_queue_free(struct hve *h, struct hve_packet_queue *q)
+{
+	AVPacket *packet;
+
+	while(q->count)
+	{
+		packet = q->packets[q->head];
+		h->queue_bytes -= packet->size;
+		budget_uncharge(packet->size);
+		av_packet_unref(packet);
+
+		q->head = (q->head + 1) % q->size;
+		--q->count;
+	}
+
+	for(int i = 0; i < q->size; ++i)
+		av_packet_free(&q->packets[i]);
+
+	av_freep(&q->packets);
+	q->size = q->head = 0;
+}
+
+// call when packet is taken from encoder
+// latency is measured from sending the frame which submission made encoder output the packet
+// so encoder delay (e.g. x264 rc-lookahead, B-frames) doesn't count as backend latency
+static void update_latency(struct hve *h, const AVPacket *packet)
+{
+	int64_t frame = packet->pts; //internal encoders number packets like frames
+
+	if(!h->workers)
+	{
+		//encoder delay is seen at the first packet, packets come out in submission order
+		if(h->encoder_packets == 0)
+			h->encoder_delay = h->encoder_frames - 1;
+
+		int64_t released = h->encoder_packets++ + h->encoder_delay;
+
+		//flushing encoder outputs held packets without new input
+		if(released >= h->encoder_frames)
+			return;
+
+		frame = h->frame_number - h->encoder_frames + released;
+	}
+
+	if(frame == AV_NOPTS_VALUE || frame < 0 || frame < h->frame_number - HVE_LATENCY_RING)
+		return;
+
+	int latency = (int)(av_gettime_relative() - h->send_time[frame % HVE_LATENCY_RING]);
+
+	//exponential moving average, 1/8 weight of new sample
+	h->latency_us = h->latency_us ? (7 * h->latency_us + latency) / 8 : latency;
+
+	if(latency > h->latency_max_us)
+		h->latency_max_us = latency;
+
+	//don't flip-flop, give encoder at least a second after opening
+	if(h->alt_encoder && h->latency_us > h->migrate_latency_us && h->encoder_frames >= h->config.framerate)
+		h->migrate_pending = 1;
+}
+
+struct hve_scheduler *hve_scheduler_init(int slots)
+{
+	struct hve_scheduler *s, zero_scheduler = {0};
+
+	if( (s = (struct hve_scheduler*)malloc(sizeof(struct hve_scheduler))) == NULL )
+	{
+		fprintf(stderr, "hve: not enough memory for scheduler\n");
+		return NULL;
+	}
+
+	*s = zero_scheduler;
+	s->slots = slots > 0 ? slots : 1;
+
+	if(pthread_mutex_init(&s->mutex, NULL) != 0)
+	{
+		free(s);
+		HVE_ERROR_MSG("failed to initialize scheduler mutex");
+		return NULL;
+	}
+
+	if(pthread_cond_init(&s->cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&s->mutex);
+		free(s);
+		HVE_ERROR_MSG("failed to initialize scheduler condition variable");
+		return NULL;
+	}
+
+	return s;
+}
+
+void hve_scheduler_close(struct hve_scheduler *s)
+{
+	if(s == NULL)
+		return;
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->mutex);
+	free(s);
+}
+
+// blocks until the session gets submission slot
+// frames is number of frames submitted under one acquisition (cost is proportional)
+static void scheduler_acquire(struct hve *h, int frames)
+{
+	struct hve_scheduler *s = h->config.scheduler;
+	struct hve_sched_waiter waiter = {0};
+	int64_t start = av_gettime_relative();
+
+	pthread_mutex_lock(&s->mutex);
+
+	//start of virtual service is the later of now and previous finish of this session
+	waiter.finish = FFMAX(s->virtual_time, h->sched_finish) + h->sched_cost * frames;
+	waiter.deadline = h->config.scheduler_deadline_ms > 0 ? start + 1000 * (int64_t)h->config.scheduler_deadline_ms : INT64_MAX;
+	h->sched_finish = waiter.finish;
+
+	if(s->slots > 0 && s->waiters == NULL)
+	{
+		--s->slots;
+		s->virtual_time = waiter.finish;
+		waiter.granted = 1;
+	}
+	else
+	{
+		waiter.next = s->waiters;
+		s->waiters = &waiter;
+	}
+
+	while(!waiter.granted)
+		pthread_cond_wait(&s->cond, &s->mutex);
+
+	pthread_mutex_unlock(&s->mutex);
+
+	int wait = (int)(av_gettime_relative() - start);
+
+	h->sched_wait_us = h->sched_wait_us ? (7 * h->sched_wait_us + wait) / 8 : wait;
+
+	if(wait > h->sched_wait_max_us)
+		h->sched_wait_max_us = wait;
+}
+
+// passes the slot to the earliest deadline waiter (EDF) or the smallest
+// virtual finish time waiter (WFQ) if nobody has deadline
+static void scheduler_release(struct hve *h)
+{
+	struct hve_scheduler *s = h->config.scheduler;
+	struct hve_sched_waiter **w, **best = NULL;
+
+	pthread_mutex_lock(&s->mutex);
+
+	for(w = &s->waiters; *w; w = &(*w)->next)
+		if( !best || (*w)->deadline < (*best)->deadline ||
+		   ((*w)->deadline == (*best)->deadline && (*w)->finish < (*best)->finish) )
+			best = w;
+
+	if(best)
+	{
+		struct hve_sched_waiter *granted = *best;
+
+		*best = granted->next;
+		s->virtual_time = FFMAX(s->virtual_time, granted->finish);
+		granted->granted = 1;
+		pthread_cond_broadcast(&s->cond);
+	}
+	else
+		++s->slots;
+
+	pthread_mutex_unlock(&s->mutex);
+}
+
+struct hve_admission *hve_admission_init(double capacity)
+{
+	struct hve_admission *a, zero_admission = {0};
+
+	if( (a = (struct hve_admission*)malloc(sizeof(struct hve_admission))) == NULL )
+	{
+		fprintf(stderr, "hve: not enough memory for admission control\n");
+		return NULL;
+	}
+
+	*a = zero_admission;
+	a->capacity = capacity > 0 ? capacity : 1.0;
+
+	if(pthread_mutex_init(&a->mutex, NULL) != 0)
+	{
+		free(a);
+		HVE_ERROR_MSG("failed to initialize admission mutex");
+		return NULL;
+	}
+
+	if(pthread_cond_init(&a->cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&a->mutex);
+		free(a);
+		HVE_ERROR_MSG("failed to initialize admission condition variable");
+		return NULL;
+	}
+
+	return a;
+}
+
+void hve_admission_close(struct hve_admission *a)
+{
+	if(a == NULL)
+		return;
+
+	for(int i = 0; i < a->entries_count; ++i)
+	{
+		av_free(a->entries[i].encoder);
+		av_free(a->entries[i].preset);
+	}
+
+	av_free(a->entries);
+	pthread_cond_destroy(&a->cond);
+	pthread_mutex_destroy(&a->mutex);
+	free(a);
+}
+
+int hve_admission_set_cost(struct hve_admission *a, const struct hve_config *config, double cost)
+{
+	struct hve_admission_entry *e = NULL, *entries;
+	const char *encoder = hve_config_encoder(config), *preset = hve_config_preset(config);
+
+	pthread_mutex_lock(&a->mutex);
+
+	for(int i = 0; i < a->entries_count; ++i)
+		if( !strcmp(a->entries[i].encoder, encoder) && !strcmp(a->entries[i].preset, preset) &&
+		    a->entries[i].width == config->width && a->entries[i].height == config->height &&
+		    a->entries[i].framerate == config->framerate &&
+		    a->entries[i].compression_level == config->compression_level )
+			e = &a->entries[i];
+
+	if(!e)
+	{
+		if(!(entries = av_realloc_array(a->entries, a->entries_count + 1, sizeof(struct hve_admission_entry))))
+		{
+			pthread_mutex_unlock(&a->mutex);
+			return HVE_ERROR_MSG("not enough memory for admission cost entry");
+		}
+
+		a->entries = entries;
+		e = &a->entries[a->entries_count];
+
+		if(!(e->encoder = av_strdup(encoder)) || !(e->preset = av_strdup(preset)))
+		{
+			av_free(e->encoder);
+			pthread_mutex_unlock(&a->mutex);
+			return HVE_ERROR_MSG("not enough memory for admission cost entry");
+		}
+
+		e->width = config->width;
+		e->height = config->height;
+		e->framerate = config->framerate;
+		e->compression_level = config->compression_level;
+		++a->entries_count;
+	}
+
+	e->cost = cost;
+
+	pthread_mutex_unlock(&a->mutex);
+
+	return HVE_OK;
+}
+
+// encodes dummy frames as fast as possible, cost is encoding time relative to real time
+int hve_admission_calibrate(struct hve_admission *a, const struct hve_config *config, int frames, double *cost)
+{
+	struct hve_config calibration_config = *config;
+	struct hve_frame frame = {0};
+	uint8_t *data[4] = {NULL};
+	int linesize[4], failed = HVE_OK, f;
+	int width = config->input_width ? config->input_width : config->width;
+	int height = config->input_height ? config->input_height : config->height;
+	enum AVPixelFormat pix_fmt = hve_config_pix_fmt(config);
+	struct hve *h;
+	int64_t start, elapsed;
+
+	//internal encoders don't have single encoder cost
+	if(config->intra_parallel > 1 || hve_config_tiles(config) > 1)
+		return HVE_ERROR_MSG("calibration of intra_parallel or tiles not supported");
+
+	if(pix_fmt == AV_PIX_FMT_NONE)
+		return HVE_ERROR_MSG("unknown pixel format for calibration");
+
+	//measure bare encoder, don't touch shared state or do extra work
+	calibration_config.admission = NULL; //don't reserve capacity for calibration
+	calibration_config.scheduler = NULL;
+	calibration_config.pool = NULL; //don't take parked session
+	calibration_config.device_set = NULL; //don't load balanced devices
+	calibration_config.migrate_encoder = NULL;
+	calibration_config.quality_target = 0;
+	calibration_config.filler = 0;
+	calibration_config.filler_frame = NULL;
+
+	if( (h = hve_init(&calibration_config)) == NULL )
+		return HVE_ERROR_MSG("failed to initialize encoder for calibration");
+
+	if(av_image_alloc(data, linesize, width, height, pix_fmt, 32) < 0)
+	{
+		hve_close(h);
+		return HVE_ERROR_MSG("not enough memory for calibration frame");
+	}
+
+	memcpy(frame.data, data, sizeof(data));
+	memcpy(frame.linesize, linesize, sizeof(linesize));
+
+	start = av_gettime_relative();
+
+	for(f = 0; f < frames && failed == HVE_OK; ++f)
+	{
+		memset(data[0], f % 255, linesize[0] * height / 2); //vary content a bit
+		if(hve_send_frame(h, &frame) != HVE_OK)
+			break;
+		while(hve_receive_packet(h, &failed))
+			;
+	}
+
+	hve_send_frame(h, NULL);
+	while(hve_receive_packet(h, &failed))
+		;
+
+	elapsed = av_gettime_relative() - start;
+
+	av_freep(&data[0]);
+	hve_close(h);
+
+	if(f != frames || failed != HVE_OK)
+		return HVE_ERROR_MSG("encoding failed during calibration");
+
+	//seconds of encoding per second of video
+	double calibrated = (double)elapsed / frames * config->framerate / 1000000.0;
+
+	fprintf(stderr, "hve: calibrated %s %dx%d@%d cost %.3f\n", hve_config_encoder(config),
+	        config->width, config->height, config->framerate, calibrated);
+
+	if(cost)
+		*cost = calibrated;
+
+	return hve_admission_set_cost(a, config, calibrated);
+}
+
+double hve_admission_headroom(struct hve_admission *a)
+{
+	pthread_mutex_lock(&a->mutex);
+	double headroom = a->capacity - a->used;
+	pthread_mutex_unlock(&a->mutex);
+
+	return headroom;
+}
+
+static const char *hve_config_encoder(const struct hve_config *config)
+{
+	return (config->encoder != NULL && config->encoder[0] != '\0') ? config->encoder : "h264_vaapi";
+}
+
+static const char *hve_config_preset(const struct hve_config *config)
+{
+	return config->nvenc_preset ? config->nvenc_preset : "";
+}
+
+// AV_PIX_FMT_NONE if not found
+static enum AVPixelFormat hve_config_pix_fmt(const struct hve_config *config)
+{
+	return (config->pixel_format != NULL && config->pixel_format[0] != '\0') ? av_get_pix_fmt(config->pixel_format) : AV_PIX_FMT_NV12;
+}
+
+// exact match or cost scaled by pixel rate from nearest entry of the same encoder
+static double admission_estimate(struct hve_admission *a, const struct hve_config *config)
+{
+	const char *encoder = hve_config_encoder(config), *preset = hve_config_preset(config);
+	double pixel_rate = (double)config->width * config->height * config->framerate;
+	double estimate = -1.0, distance = 0;
+
+	for(int i = 0; i < a->entries_count; ++i)
+	{
+		struct hve_admission_entry *e = &a->entries[i];
+		double e_pixel_rate = (double)e->width * e->height * e->framerate;
+
+		if(strcmp(e->encoder, encoder) || e_pixel_rate <= 0)
+			continue;
+
+		//same encoder, penalize different preset so that exact one wins
+		double d = FFMAX(pixel_rate / e_pixel_rate, e_pixel_rate / pixel_rate);
+
+		if(strcmp(e->preset, preset) || e->compression_level != config->compression_level)
+			d *= 2;
+
+		if(estimate < 0 || d < distance)
+		{
+			estimate = e->cost * pixel_rate / e_pixel_rate;
+			distance = d;
+		}
+	}
+
+	return estimate;
+}
+
+static int admission_reserve(struct hve *h)
+{
+	struct hve_admission *a = h->config.admission;
+	struct timespec deadline;
+	int err = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += h->config.admission_wait_ms / 1000;
+	deadline.tv_nsec += (h->config.admission_wait_ms % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L)
+	{
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&a->mutex);
+
+	double cost = admission_estimate(a, &h->config);
+
+	if(cost < 0)
+	{
+		fprintf(stderr, "hve: no calibrated cost for %s, admitting without reservation\n", hve_config_encoder(&h->config));
+		cost = 0;
+	}
+
+	//queue for capacity up to admission_wait_ms
+	while(a->used + cost > a->capacity && h->config.admission_wait_ms > 0 && err == 0)
+		err = pthread_cond_timedwait(&a->cond, &a->mutex, &deadline);
+
+	if(a->used + cost > a->capacity)
+	{
+		fprintf(stderr, "hve: admission cost %.3f, headroom %.3f\n", cost, a->capacity - a->used);
+		pthread_mutex_unlock(&a->mutex);
+		return HVE_ERROR;
+	}
+
+	a->used += cost;
+	h->admission_cost = cost;
+
+	pthread_mutex_unlock(&a->mutex);
+
+	return HVE_OK;
+}
+
+static void admission_release(struct hve *h)
+{
+	struct hve_admission *a = h->config.admission;
+
+	pthread_mutex_lock(&a->mutex);
+	a->used -= h->admission_cost;
+	h->admission_cost = 0;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->mutex);
+}
+
+struct hve_device_set *hve_device_set_init(void)
+{
+	struct hve_device_set *ds, zero_device_set = {0};
+
+	if( (ds = (struct hve_device_set*)malloc(sizeof(struct hve_device_set))) == NULL )
+	{
+		fprintf(stderr, "hve: not enough memory for device set\n");
+		return NULL;
+	}
+
+	*ds = zero_device_set;
+
+	if(pthread_mutex_init(&ds->mutex, NULL) != 0)
+	{
+		free(ds);
+		HVE_ERROR_MSG("failed to initialize device set mutex");
+		return NULL;
+	}
+
+	return ds;
+}
+
+void hve_device_set_close(struct hve_device_set *ds)
+{
+	if(ds == NULL)
+		return;
+
+	for(int i = 0; i < ds->devices_count; ++i)
+	{
+		av_free(ds->devices[i].device);
+		av_free(ds->devices[i].encoder);
+	}
+
+	av_free(ds->devices);
+	pthread_mutex_destroy(&ds->mutex);
+	free(ds);
+}
+
+int hve_device_set_add(struct hve_device_set *ds, const char *device, const char *encoder)
+{
+	struct hve_device_set_entry *devices, zero_entry = {0};
+
+	pthread_mutex_lock(&ds->mutex);
+
+	if(!(devices = av_realloc_array(ds->devices, ds->devices_count + 1, sizeof(struct hve_device_set_entry))))
+	{
+		pthread_mutex_unlock(&ds->mutex);
+		return HVE_ERROR_MSG("not enough memory for device set entry");
+	}
+
+	ds->devices = devices;
+	devices[ds->devices_count] = zero_entry;
+
+	if( (device && device[0] != '\0' && !(devices[ds->devices_count].device = av_strdup(device))) ||
+	    (encoder && encoder[0] != '\0' && !(devices[ds->devices_count].encoder = av_strdup(encoder))) )
+	{
+		av_free(devices[ds->devices_count].device);
+		pthread_mutex_unlock(&ds->mutex);
+		return HVE_ERROR_MSG("not enough memory for device set entry");
+	}
+
+	++ds->devices_count;
+
+	pthread_mutex_unlock(&ds->mutex);
+
+	return HVE_OK;
+}
+
+int hve_device_set_sessions(struct hve_device_set *ds, int index)
+{
+	pthread_mutex_lock(&ds->mutex);
+	int sessions = (index >= 0 && index < ds->devices_count) ? ds->devices[index].sessions : -1;
+	pthread_mutex_unlock(&ds->mutex);
+
+	return sessions;
+}
+
+// least sessions, lower latency breaks ties, -1 if empty
+static int device_set_least_loaded(struct hve_device_set *ds)
+{
+	int best = -1;
+
+	for(int i = 0; i < ds->devices_count; ++i)
+		if( best < 0 || ds->devices[i].sessions < ds->devices[best].sessions ||
+		   (ds->devices[i].sessions == ds->devices[best].sessions && ds->devices[i].latency_us < ds->devices[best].latency_us) )
+			best = i;
+
+	return best;
+}
+
+static int device_set_place(struct hve *h)
+{
+	struct hve_device_set *ds = h->config.device_set;
+
+	pthread_mutex_lock(&ds->mutex);
+
+	if( (h->device_index = device_set_least_loaded(ds)) < 0 )
+	{
+		pthread_mutex_unlock(&ds->mutex);
+		return HVE_ERROR_MSG("device set is empty");
+	}
+
+	struct hve_device_set_entry *e = &ds->devices[h->device_index];
+
+	++e->sessions;
+	h->device = e->device;
+	if(e->encoder)
+		h->encoder = e->encoder;
+
+	pthread_mutex_unlock(&ds->mutex);
+
+	return HVE_OK;
+}
+
+// reports session latency, returns device the session should move to or -1
+// the session is already accounted on the returned device
+static int device_set_rebalance(struct hve *h)
+{
+	struct hve_device_set *ds = h->config.device_set;
+	int to = -1;
+
+	//give encoder at least a second after opening, like with migration
+	if(h->encoder_frames < h->config.framerate)
+		return -1;
+
+	pthread_mutex_lock(&ds->mutex);
+
+	struct hve_device_set_entry *cur = &ds->devices[h->device_index];
+
+	cur->latency_us = cur->latency_us ? (3 * cur->latency_us + h->latency_us) / 4 : h->latency_us;
+
+	int best = device_set_least_loaded(ds);
+	struct hve_device_set_entry *e = &ds->devices[best];
+
+	//move only if it improves balance (not just swaps it) or other device is much faster
+	if(best != h->device_index &&
+	   (e->sessions + 2 <= cur->sessions || (e->sessions < cur->sessions && 2 * e->latency_us < cur->latency_us)) )
+	{
+		--cur->sessions;
+		++e->sessions;
+		h->device_index = to = best;
+	}
+
+	pthread_mutex_unlock(&ds->mutex);
+
+	return to;
+}
+
+// moves session accounting between devices, -1 to remove session
+static void device_set_move(struct hve *h, int from, int to)
+{
+	struct hve_device_set *ds = h->config.device_set;
+
+	pthread_mutex_lock(&ds->mutex);
+
+	if(from >= 0)
+		--ds->devices[from].sessions;
+	if(to >= 0)
+		++ds->devices[to].sessions;
+
+	h->device_index = to;
+
+	pthread_mutex_unlock(&ds->mutex);
+}
+
+struct hve_pool *hve_pool_init(int max_parked)
+{
+	struct hve_pool *pool, zero_pool = {0};
+
+	if( (pool = (struct hve_pool*)malloc(sizeof(struct hve_pool))) == NULL )
+	{
+		fprintf(stderr, "hve: not enough memory for pool\n");
+		return NULL;
+	}
+
+	*pool = zero_pool;
+	pool->max_parked = max_parked > 0 ? max_parked : 4;
+
+	if(pthread_mutex_init(&pool->mutex, NULL) != 0)
+	{
+		free(pool);
+		HVE_ERROR_MSG("failed to initialize pool mutex");
+		return NULL;
+	}
+
+	if(pthread_cond_init(&pool->cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&pool->mutex);
+		free(pool);
+		HVE_ERROR_MSG("failed to initialize pool condition variable");
+		return NULL;
+	}
+
+	if(pthread_create(&pool->thread, NULL, pool_thread, pool) != 0)
+	{
+		pthread_cond_destroy(&pool->cond);
+		pthread_mutex_destroy(&pool->mutex);
+		free(pool);
+		HVE_ERROR_MSG("failed to create pool thread");
+		return NULL;
+	}
+
+	return pool;
+}
+
+void hve_pool_close(struct hve_pool *pool)
+{
+	struct hve *h;
+
+	if(pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->shutdown = 1;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	//the thread tears down remaining recycled sessions before exiting
+	pthread_join(pool->thread, NULL);
+
+	while( (h = pool->parked) )
+	{
+		pool->parked = h->pool_next;
+		close_session(h);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+int hve_pool_parked(struct hve_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	int parked = pool->parked_count;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return parked;
+}
+
+static int hve_config_string_equal(const char *a, const char *b, const char *default_value)
+{
+	a = (a && a[0] != '\0') ? a : default_value;
+	b = (b && b[0] != '\0') ? b : default_value;
+
+	if(a == NULL || b == NULL)
+		return a == b;
+
+	return strcmp(a, b) == 0;
+}
+
+// compares configs normalised for defaults
+static int hve_config_equal(const struct hve_config *a, const struct hve_config *b)
+{
+	return a->width == b->width && a->height == b->height &&
+	       (a->input_width ? a->input_width : a->width) == (b->input_width ? b->input_width : b->width) &&
+	       (a->input_height ? a->input_height : a->height) == (b->input_height ? b->input_height : b->height) &&
+	       a->framerate == b->framerate &&
+	       hve_config_string_equal(a->device, b->device, NULL) &&
+	       hve_config_string_equal(a->encoder, b->encoder, "h264_vaapi") &&
+	       hve_config_string_equal(a->pixel_format, b->pixel_format, "nv12") &&
+	       a->profile == b->profile && a->max_b_frames == b->max_b_frames &&
+	       a->bit_rate == b->bit_rate && a->qp == b->qp &&
+	       a->gop_size == b->gop_size && a->compression_level == b->compression_level &&
+	       (a->vaapi_low_power != 0) == (b->vaapi_low_power != 0) &&
+	       hve_config_string_equal(a->nvenc_preset, b->nvenc_preset, NULL) &&
+	       a->nvenc_delay == b->nvenc_delay && (a->nvenc_zerolatency != 0) == (b->nvenc_zerolatency != 0) &&
+	       hve_config_string_equal(a->migrate_encoder, b->migrate_encoder, NULL) &&
+	       hve_config_string_equal(a->migrate_device, b->migrate_device, NULL) &&
+	       (a->migrate_latency_ms > 0 ? a->migrate_latency_ms : HVE_MIGRATE_LATENCY_MS) ==
+	       (b->migrate_latency_ms > 0 ? b->migrate_latency_ms : HVE_MIGRATE_LATENCY_MS) &&
+	       a->scheduler == b->scheduler &&
+	       (a->scheduler_weight > 0 ? a->scheduler_weight : 1) == (b->scheduler_weight > 0 ? b->scheduler_weight : 1) &&
+	       a->scheduler_deadline_ms == b->scheduler_deadline_ms &&
+	       a->admission == b->admission && a->admission_wait_ms == b->admission_wait_ms &&
+	       a->device_set == b->device_set && a->pool == b->pool &&
+	       a->threads == b->threads && (a->deterministic != 0) == (b->deterministic != 0) &&
+	       (a->intra_parallel > 1 ? a->intra_parallel : 0) == (b->intra_parallel > 1 ? b->intra_parallel : 0) &&
+	       hve_config_tiles(a) == hve_config_tiles(b) &&
+	       (a->tile_columns > 0 ? a->tile_columns : 1) == (b->tile_columns > 0 ? b->tile_columns : 1) &&
+	       a->convert == b->convert && (a->convert_benchmark != 0) == (b->convert_benchmark != 0) &&
+	       a->quality_target == b->quality_target &&
+	       (a->quality_interval > 0 ? a->quality_interval : HVE_QUALITY_INTERVAL) ==
+	       (b->quality_interval > 0 ? b->quality_interval : HVE_QUALITY_INTERVAL) &&
+	       (a->filler != 0) == (b->filler != 0) && a->filler_frame == b->filler_frame &&
+	       (a->no_scenecut != 0) == (b->no_scenecut != 0);
+}
+
+// NULL if there is no matching session or it failed to resume
+static struct hve *pool_take(struct hve_pool *pool, const struct hve_config *config)
+{
+	struct hve **p, *h = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	for(p = &pool->parked; *p; p = &(*p)->pool_next)
+		if(hve_config_equal(&(*p)->config, config))
+		{
+			h = *p;
+			*p = h->pool_next;
+			h->pool_next = NULL;
+			--pool->parked_count;
+			break;
+		}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	if(h == NULL)
+		return NULL;
+
+	if(h->config.admission && admission_reserve(h) != HVE_OK)
+	{
+		//keep it parked for the next try, the caller will be rejected anyway
+		pool_park(pool, h);
+		return NULL;
+	}
+
+	if(h->config.device_set)
+		device_set_move(h, -1, h->pool_device_index);
+
+	if(hve_resume(h) != HVE_OK)
+	{
+		close_session(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+static void pool_recycle(struct hve_pool *pool, struct hve *h)
+{
+	pthread_mutex_lock(&pool->mutex);
+	h->pool_next = pool->recycle;
+	pool->recycle = h;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+// parks session or closes it if pool is full
+static void pool_park(struct hve_pool *pool, struct hve *h)
+{
+	pthread_mutex_lock(&pool->mutex);
+
+	if(pool->parked_count < pool->max_parked && !pool->shutdown)
+	{
+		h->pool_next = pool->parked;
+		pool->parked = h;
+		++pool->parked_count;
+		h = NULL;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	if(h)
+		close_session(h);
+}
+
+// drains, resets and parks closed sessions so that callers never block on teardown
+static void *pool_thread(void *arg)
+{
+	struct hve_pool *pool = (struct hve_pool*)arg;
+	struct hve *h;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while(1)
+	{
+		while(!pool->recycle && !pool->shutdown)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+
+		if(!pool->recycle && pool->shutdown)
+			break;
+
+		h = pool->recycle;
+		pool->recycle = h->pool_next;
+		h->pool_next = NULL;
+
+		pthread_mutex_unlock(&pool->mutex);
+
+		if(hve_suspend(h) != HVE_OK)
+			close_session(h);
+		else
+		{
+			//discard packets user didn't take
+			packet_queue_free(h, &h->queue);
+			av_packet_unref(&h->enc_pkt);
+
+			if(h->config.admission)
+				admission_release(h);
+
+			h->pool_device_index = h->device_index;
+			if(h->device_index >= 0)
+				device_set_move(h, h->device_index, -1);
+
+			//reset what user may observe through hve_get_stats
+			h->frame_number = h->packets = 0;
+			h->latency_us = h->latency_max_us = 0;
+			h->migrate_pending = h->migrations = 0;
+			h->sched_finish = 0;
+			h->sched_wait_us = h->sched_wait_max_us = 0;
+			memset(h->send_time, 0, sizeof(h->send_time));
+
+			//rate control as configured, hve_resume opens encoder with it
+			h->bit_rate = h->config.bit_rate;
+			h->qp = h->config.qp;
+			h->reconfigure_pending = 0;
+
+			h->filling = h->filler_pending = 0;
+			h->filler_packets = 0;
+
+			//the next user sets own callback
+			h->ready = NULL;
+			h->ready_opaque = NULL;
+
+			pool_park(pool, h);
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+int hve_memory_budget(size_t bytes, int policy)
+{
+	if(policy < HVE_BUDGET_SHRINK || policy > HVE_BUDGET_REJECT)
+		return HVE_ERROR_MSG("invalid memory budget policy");
+
+	pthread_mutex_lock(&hve_budget_mutex);
+	hve_budget_bytes = bytes;
+	hve_budget_policy = policy;
+	pthread_mutex_unlock(&hve_budget_mutex);
+
+	return HVE_OK;
+}
+
+size_t hve_memory_used(void)
+{
+	pthread_mutex_lock(&hve_budget_mutex);
+	size_t used = hve_budget_used;
+	pthread_mutex_unlock(&hve_budget_mutex);
+
+	return used;
+}
+
+// returns pool size that fits in budget (and charges it) or -1
+static int budget_charge_pool(struct hve *h, enum AVPixelFormat sw_format, int width, int height)
+{
+	int surface = av_image_get_buffer_size(sw_format, width, height, 1);
+	int pool_size = HVE_POOL_SIZE;
+
+	if(surface < 0)
+		return -1;
+
+	pthread_mutex_lock(&hve_budget_mutex);
+
+	size_t available = hve_budget_used < hve_budget_bytes ? hve_budget_bytes - hve_budget_used : 0;
+
+	if(hve_budget_bytes && (size_t)pool_size * surface > available)
+	{
+		int fit = (int)(available / surface);
+
+		//with degrade policy drop B-frames so that fewer surfaces are in flight
+		if(hve_budget_policy == HVE_BUDGET_DEGRADE && fit < HVE_MIN_POOL_SIZE + h->avctx->max_b_frames)
+			h->avctx->max_b_frames = 0;
+
+		if(hve_budget_policy == HVE_BUDGET_REJECT || fit < HVE_MIN_POOL_SIZE + h->avctx->max_b_frames)
+		{
+			size_t budget = hve_budget_bytes, used = hve_budget_used;
+
+			pthread_mutex_unlock(&hve_budget_mutex);
+			fprintf(stderr, "hve: memory budget %zu, used %zu, pool needs %zu\n", budget, used, (size_t)pool_size * surface);
+			return -1;
+		}
+
+		fprintf(stderr, "hve: memory budget, shrinking frame pool from %d to %d surfaces\n", pool_size, fit);
+		pool_size = fit;
+	}
+
+	h->pool_bytes = (size_t)pool_size * surface;
+	hve_budget_used += h->pool_bytes;
+
+	pthread_mutex_unlock(&hve_budget_mutex);
+
+	return pool_size;
+}
+
+// charges unconditionally, what is already produced can't be refused
+static void budget_charge(size_t bytes)
+{
+	pthread_mutex_lock(&hve_budget_mutex);
+	hve_budget_used += bytes;
+	pthread_mutex_unlock(&hve_budget_mutex);
+}
+
+static void budget_uncharge(size_t bytes)
+{
+	pthread_mutex_lock(&hve_budget_mutex);
+	hve_budget_used -= bytes;
+	pthread_mutex_unlock(&hve_budget_mutex);
+}
+
+// true if new frames should be rejected (HVE_BUDGET_REJECT policy and budget used up)
+static int budget_exceeded(void)
+{
+	pthread_mutex_lock(&hve_budget_mutex);
+	int exceeded = hve_budget_policy == HVE_BUDGET_REJECT && hve_budget_bytes && hve_budget_used > hve_budget_bytes;
+	pthread_mutex_unlock(&hve_budget_mutex);
+
+	return exceeded;
+}
+
+static int hve_config_tiles(const struct hve_config *config)
+{
+	int columns = config->tile_columns > 0 ? config->tile_columns : 1;
+	int rows = config->tile_rows > 0 ? config->tile_rows : 1;
+
+	return columns * rows;
+}
+
+// creates internal session and thread for each config, workers are not yet fed with frames
+static int init_workers(struct hve *h, const struct hve_config *configs, int n)
+{
+	if(n > HVE_MAX_WORKERS)
+		return HVE_ERROR_MSG("too many internal encoders");
+
+	if(pthread_mutex_init(&h->workers_mutex, NULL) != 0)
+		return HVE_ERROR_MSG("failed to initialize internal encoders mutex");
+
+	if(pthread_cond_init(&h->workers_cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&h->workers_mutex);
+		return HVE_ERROR_MSG("failed to initialize internal encoders condition variable");
+	}
+
+	if(!(h->workers = av_mallocz_array(n, sizeof(struct hve_worker))))
+	{
+		pthread_cond_destroy(&h->workers_cond);
+		pthread_mutex_destroy(&h->workers_mutex);
+		return HVE_ERROR_MSG("not enough memory for internal encoders");
+	}
+	h->workers_count = n;
+	++h->allocs[HVE_ALLOC_ENCODE];
+
+	for(int i = 0; i < n; ++i)
+	{
+		struct hve_worker *w = &h->workers[i];
+		struct hve_config config = configs[i];
+
+		//internal encoders are ordinary sessions, not parked in pool
+		config.intra_parallel = config.tile_columns = config.tile_rows = 0;
+		config.pool = NULL;
+
+		w->parent = h;
+
+		if(!(w->h = hve_init(&config)))
+			return HVE_ERROR_MSG("failed to initialize internal encoder");
+
+		if(pthread_create(&w->thread, NULL, worker_thread, w) != 0)
+			return HVE_ERROR_MSG("failed to create internal encoder thread");
+		w->thread_started = 1;
+	}
+
+	return HVE_OK;
+}
+
+static int init_intra_parallel(struct hve *h)
+{
+	struct hve_config configs[HVE_MAX_WORKERS];
+	int n = h->config.intra_parallel;
+
+	if(h->config.gop_size != -1 || h->config.max_b_frames)
+		return HVE_ERROR_MSG("intra parallel mode requires intra only (gop_size -1) and no B-frames");
+
+	if(n > HVE_MAX_WORKERS)
+		return HVE_ERROR_MSG("too many intra parallel encoders");
+
+	//the user facing session owns admission
+	for(int i = 0; i < n; ++i)
+	{
+		configs[i] = h->config;
+		configs[i].admission = NULL;
+	}
+
+	if(init_workers(h, configs, n) != HVE_OK)
+		return HVE_ERROR;
+
+	for(int i = 0; i < n; ++i)
+	{
+		struct hve_worker *w = &h->workers[i];
+
+		if(!(w->input = av_frame_alloc()))
+			return HVE_ERROR_MSG("av_frame_alloc not enough memory (intra parallel frame)");
+		++h->allocs[HVE_ALLOC_ENCODE];
+
+		w->input->format = h->sw_pix_fmt;
+		w->input->width = h->config.input_width ? h->config.input_width : h->config.width;
+		w->input->height = h->config.input_height ? h->config.input_height : h->config.height;
+
+		if(av_frame_get_buffer(w->input, 32) < 0)
+			return HVE_ERROR_MSG("not enough memory for intra parallel frame");
+
+		//internal encoder always reads from the copy
+		memcpy(w->view.data, w->input->data, sizeof(w->view.data));
+		memcpy(w->view.linesize, w->input->linesize, sizeof(w->view.linesize));
+	}
+
+	return HVE_OK;
+}
+
+static int init_tiles(struct hve *h)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(h->sw_pix_fmt);
+	struct hve_config configs[HVE_MAX_WORKERS];
+	int columns = h->config.tile_columns > 0 ? h->config.tile_columns : 1;
+	int rows = h->config.tile_rows > 0 ? h->config.tile_rows : 1;
+	int n = columns * rows;
+	int width = h->config.width / columns, height = h->config.height / rows;
+
+	if(h->config.intra_parallel > 1)
+		return HVE_ERROR_MSG("tiles can't be combined with intra parallel mode");
+
+	if( (h->config.input_width && h->config.input_width != h->config.width) ||
+	    (h->config.input_height && h->config.input_height != h->config.height) )
+		return HVE_ERROR_MSG("scaling is not supported with tiles");
+
+	if(n > HVE_MAX_WORKERS)
+		return HVE_ERROR_MSG("too many tiles");
+
+	//tiles have to start at chroma sample boundary
+	if(h->config.width % columns || h->config.height % rows ||
+	   width % (1 << desc->log2_chroma_w) || height % (1 << desc->log2_chroma_h))
+		return HVE_ERROR_MSG("frame size has to divide into equal tiles (aligned to chroma subsampling)");
+
+	for(int i = 0; i < n; ++i)
+	{
+		configs[i] = h->config;
+		configs[i].width = width;
+		configs[i].height = height;
+		configs[i].input_width = configs[i].input_height = 0;
+		configs[i].admission = NULL;
+		configs[i].no_scenecut = 1; //IDR of single tile would break alignment
+	}
+
+	if(init_workers(h, configs, n) != HVE_OK)
+		return HVE_ERROR;
+
+	h->workers_mode = HVE_WORKERS_TILES;
+
+	//offsets of tile in each plane, tiles are only pointer offsets into user frame
+	for(int i = 0; i < n; ++i)
+	{
+		struct hve_worker *w = &h->workers[i];
+		int x = (i % columns) * width, y = (i / columns) * height;
+
+		if(av_image_fill_linesizes(w->x_bytes, h->sw_pix_fmt, x) < 0)
+			return HVE_ERROR_MSG("failed to compute tile offsets");
+
+		for(int p = 0; p < 4; ++p)
+			w->y_rows[p] = (p == 1 || p == 2) ? y >> desc->log2_chroma_h : y;
+	}
+
+	return HVE_OK;
+}
+
+static void close_workers(struct hve *h)
+{
+	pthread_mutex_lock(&h->workers_mutex);
+	h->workers_shutdown = 1;
+	pthread_cond_broadcast(&h->workers_cond);
+	pthread_mutex_unlock(&h->workers_mutex);
+
+	for(int i = 0; i < h->workers_count; ++i)
+	{
+		struct hve_worker *w = &h->workers[i];
+
+		if(w->thread_started)
+			pthread_join(w->thread, NULL);
+
+		packet_queue_free(h, &w->queue);
+		av_packet_unref(&w->packet);
+		av_frame_free(&w->input);
+
+		if(w->h)
+			close_session(w->h);
+	}
+
+	av_freep(&h->workers);
+	pthread_cond_destroy(&h->workers_cond);
+	pthread_mutex_destroy(&h->workers_mutex);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct hve_worker *w = (struct hve_worker*)arg;
+	struct hve *h = w->parent;
+	int err, events, keyframe;
+
+	pthread_mutex_lock(&h->workers_mutex);
+
+	while(1)
+	{
+		while(!w->busy && !w->flush && !h->workers_shutdown)
+			pthread_cond_wait(&h->workers_cond, &h->workers_mutex);
+
+		if(!w->busy && !w->flush)
+			break; //shutdown
+
+		keyframe = w->busy && w->keyframe;
+
+		if(keyframe)
+			w->keyframe = 0;
+
+		pthread_mutex_unlock(&h->workers_mutex);
+
+		//internal session is touched only by this thread
+		if(keyframe)
+			hve_request_keyframe(w->h);
+
+		err = worker_encode(h, w, w->busy ? &w->view : NULL);
+
+		pthread_mutex_lock(&h->workers_mutex);
+
+		if(err != HVE_OK)
+			w->error = 1;
+
+		//free for the next frame, or flushed (receiver may stop waiting for packets)
+		events = w->busy ? HVE_READY_INPUT : HVE_READY_PACKET;
+		events |= err != HVE_OK ? HVE_READY_PACKET : 0;
+
+		if(w->busy)
+			w->busy = 0;
+		else
+		{
+			w->flush = 0;
+			w->done = 1;
+		}
+
+		pthread_cond_broadcast(&h->workers_cond);
+
+		pthread_mutex_unlock(&h->workers_mutex);
+		notify_ready(h, events);
+		pthread_mutex_lock(&h->workers_mutex);
+	}
+
+	pthread_mutex_unlock(&h->workers_mutex);
+
+	return NULL;
+}
+
+// encodes frame (or flushes if NULL) and moves available packets to worker queue
+static int worker_encode(struct hve *h, struct hve_worker *w, struct hve_frame *frame)
+{
+	AVPacket *packet;
+	int failed;
+
+	if(hve_send_frame(w->h, frame) != HVE_OK)
+		return HVE_ERROR;
+
+	while( (packet = hve_receive_packet(w->h, &failed)) )
+	{
+		//moves reference out of internal session to reused queue packet (no allocation)
+		pthread_mutex_lock(&h->workers_mutex);
+		failed = packet_queue_push(h, &w->queue, packet);
+		pthread_mutex_unlock(&h->workers_mutex);
+
+		if(failed != HVE_OK)
+			return HVE_ERROR_MSG("not enough memory for packet queue (internal encoder)");
+
+		notify_ready(h, HVE_READY_PACKET);
+	}
+
+	return failed;
+}
+
+// call with workers_mutex locked
+static void workers_flush(struct hve *h)
+{
+	for(int i = 0; i < h->workers_count; ++i)
+		h->workers[i].flush = 1;
+
+	h->flushed = 1;
+	pthread_cond_broadcast(&h->workers_cond);
+}
+
+// copies frame for the next worker in round-robin order, waits only if it is still busy
+static int parallel_send_frame(struct hve *h, struct hve_frame *frame)
+{
+	struct hve_worker *w;
+	int err;
+
+	pthread_mutex_lock(&h->workers_mutex);
+
+	if(frame == NULL)
+	{
+		workers_flush(h);
+		pthread_mutex_unlock(&h->workers_mutex);
+
+		return HVE_OK;
+	}
+
+	w = &h->workers[h->frame_number % h->workers_count];
+
+	while(w->busy && !w->error)
+		pthread_cond_wait(&h->workers_cond, &h->workers_mutex);
+
+	err = w->error;
+
+	pthread_mutex_unlock(&h->workers_mutex);
+
+	if(err)
+		return HVE_ERROR_MSG("intra parallel encoder failed");
+
+	//the user may reuse frame data after we return while worker encodes asynchronously
+	//copy to input allocated once with worker, like hardware upload in single session
+	av_image_copy(w->input->data, w->input->linesize, (const uint8_t **)frame->data, frame->linesize,
+	              h->sw_pix_fmt, w->input->width, w->input->height);
+
+	h->send_time[h->frame_number % HVE_LATENCY_RING] = av_gettime_relative();
+	++h->frame_number;
+
+	pthread_mutex_lock(&h->workers_mutex);
+	w->busy = 1;
+	pthread_cond_broadcast(&h->workers_cond);
+	pthread_mutex_unlock(&h->workers_mutex);
+
+	return HVE_OK;
+}
+
+// returns packets in input order, blocks only after flushing
+static AVPacket *parallel_receive_packet(struct hve *h, int *error)
+{
+	struct hve_worker *w = &h->workers[h->packets % h->workers_count];
+
+	if(h->packets == (uint64_t)h->frame_number)
+		return NULL;
+
+	pthread_mutex_lock(&h->workers_mutex);
+
+	while(!w->queue.count && !w->error && h->flushed && !w->done)
+		pthread_cond_wait(&h->workers_cond, &h->workers_mutex);
+
+	if(w->error)
+	{
+		pthread_mutex_unlock(&h->workers_mutex);
+		*error = HVE_ERROR;
+		return NULL;
+	}
+
+	//not encoded yet (or flushed encoder produced nothing more)
+	if(!w->queue.count)
+	{
+		pthread_mutex_unlock(&h->workers_mutex);
+		return NULL;
+	}
+
+	packet_queue_pop(h, &w->queue, &h->enc_pkt);
+
+	pthread_mutex_unlock(&h->workers_mutex);
+
+	//internal encoders count their own frames
+	h->enc_pkt.pts = h->enc_pkt.dts = h->packets++;
+	update_latency(h, &h->enc_pkt);
+
+	return &h->enc_pkt;
+}
+
+// sends frame (or its tile) to every worker in parallel, returns when all are done (no copy)
+static int group_send_frames(struct hve *h, struct hve_frame **frames)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&h->workers_mutex);
+
+	if(frames == NULL)
+	{
+		workers_flush(h);
+		pthread_mutex_unlock(&h->workers_mutex);
+
+		return HVE_OK;
+	}
+
+	h->send_time[h->frame_number % HVE_LATENCY_RING] = av_gettime_relative();
+	++h->frame_number;
+
+	for(int i = 0; i < h->workers_count; ++i)
+	{
+		struct hve_worker *w = &h->workers[i];
+		struct hve_frame *frame = frames[i];
+
+		//tile offsets are 0 for multi-stream
+		for(int p = 0; p < 4; ++p)
+		{
+			w->view.data[p] = frame->data[p] ? frame->data[p] + w->y_rows[p] * frame->linesize[p] + w->x_bytes[p] : NULL;
+			w->view.linesize[p] = frame->linesize[p];
+		}
+
+		w->busy = 1;
+	}
+
+	pthread_cond_broadcast(&h->workers_cond);
+
+	//the user may reuse frame data after we return
+	for(int i = 0; i < h->workers_count; ++i)
+	{
+		while(h->workers[i].busy)
+			pthread_cond_wait(&h->workers_cond, &h->workers_mutex);
+
+		err |= h->workers[i].error;
+	}
+
+	pthread_mutex_unlock(&h->workers_mutex);
+
+	return err ? HVE_ERROR_MSG("internal encoder failed") : HVE_OK;
+}
+
+// returns bundle of packets (one per worker) with the same timestamp, blocks only after flushing
+static int group_receive_packets(struct hve *h, AVPacket **packets, int *error)
+{
+	int64_t pts;
+	int key;
+
+	pthread_mutex_lock(&h->workers_mutex);
+
+	//bundle is complete only when every worker has its packet
+	for(int i = 0; i < h->workers_count; ++i)
+	{
+		struct hve_worker *w = &h->workers[i];
+
+		while(!w->queue.count && !w->error && h->flushed && !w->done)
+			pthread_cond_wait(&h->workers_cond, &h->workers_mutex);
+
+		if(w->error)
+		{
+			pthread_mutex_unlock(&h->workers_mutex);
+			*error = HVE_ERROR;
+			return 0;
+		}
+
+		if(!w->queue.count)
+		{
+			pthread_mutex_unlock(&h->workers_mutex);
+			return 0;
+		}
+	}
+
+	//internal encoders are fed the same frames and don't reorder, oldest packets have the same timestamp
+	//otherwise encoder dropped or reordered frame and the streams can't be matched anymore
+	pts = h->workers[0].queue.packets[h->workers[0].queue.head]->pts;
+	key = h->workers[0].queue.packets[h->workers[0].queue.head]->flags & AV_PKT_FLAG_KEY;
+
+	for(int i = 1; i < h->workers_count; ++i)
+	{
+		struct hve_packet_queue *q = &h->workers[i].queue;
+
+		if(q->packets[q->head]->pts != pts)
+		{
+			pthread_mutex_unlock(&h->workers_mutex);
+			*error = HVE_ERROR_MSG("internal encoders output differs in timestamps (dropped or reordered frames)");
+			return 0;
+		}
+
+		//bundle can be decoded from here only if every stream starts with keyframe
+		if((q->packets[q->head]->flags & AV_PKT_FLAG_KEY) != key)
+		{
+			pthread_mutex_unlock(&h->workers_mutex);
+			*error = HVE_ERROR_MSG("internal encoders keyframes are not aligned (scene-cut keyframe?)");
+			return 0;
+		}
+	}
+
+	for(int i = 0; i < h->workers_count; ++i)
+	{
+		packet_queue_pop(h, &h->workers[i].queue, &h->workers[i].packet);
+		packets[i] = &h->workers[i].packet;
+	}
+
+	pthread_mutex_unlock(&h->workers_mutex);
+
+	++h->packets;
+	update_latency(h, packets[0]);
+
+	return h->workers_count;
+}
+
+struct hve_coalescer *hve_coalescer_init(void)
+{
+	struct hve_coalescer *c, zero_coalescer = {0};
+
+	if( (c = (struct hve_coalescer*)malloc(sizeof(struct hve_coalescer))) == NULL )
+	{
+		fprintf(stderr, "hve: not enough memory for coalescer\n");
+		return NULL;
+	}
+
+	*c = zero_coalescer;
+
+	if(pthread_mutex_init(&c->mutex, NULL) != 0)
+	{
+		free(c);
+		HVE_ERROR_MSG("failed to initialize coalescer mutex");
+		return NULL;
+	}
+
+	return c;
+}
+
+void hve_coalescer_close(struct hve_coalescer *c)
+{
+	struct hve_shared *s;
+	struct hve_handle *handle;
+
+	if(c == NULL)
+		return;
+
+	//handles should be closed by now, release what is left instead of leaking
+	while( (s = c->shared) )
+	{
+		fprintf(stderr, "hve: closing coalescer with %d open handle(s) for \"%s\"\n", s->holders, s->source);
+		c->shared = s->next;
+
+		while( (handle = s->handles) )
+		{
+			s->handles = handle->next;
+			packet_queue_free(s->h, &handle->queue);
+			av_packet_unref(&handle->packet);
+			free(handle);
+		}
+
+		shared_free(s);
+	}
+
+	pthread_mutex_destroy(&c->mutex);
+	free(c);
+}
+
+struct hve_handle *hve_coalescer_open(struct hve_coalescer *c, const char *source, const struct hve_config *config)
+{
+	struct hve_handle *handle, zero_handle = {0};
+	struct hve_shared *s, *created = NULL;
+	int same_source = 0;
+
+	if( (handle = (struct hve_handle*)malloc(sizeof(struct hve_handle))) == NULL )
+	{
+		fprintf(stderr, "hve: not enough memory for handle\n");
+		return NULL;
+	}
+
+	*handle = zero_handle;
+	handle->coalescer = c;
+	handle->wait_keyframe = 1;
+
+	pthread_mutex_lock(&c->mutex);
+
+	s = shared_find(c, source, config, &same_source);
+
+	if(s == NULL && same_source < HVE_MAX_COALESCED)
+	{
+		//hve_init may take long (device, encoder), don't block other holders meanwhile
+		pthread_mutex_unlock(&c->mutex);
+		created = shared_init(source, config);
+		pthread_mutex_lock(&c->mutex);
+
+		//the same session may have been created meanwhile by other holder
+		s = shared_find(c, source, config, &same_source);
+
+		if(s == NULL && created && same_source < HVE_MAX_COALESCED)
+		{
+			s = created;
+			s->next = c->shared;
+			c->shared = s;
+			created = NULL;
+		}
+	}
+
+	if(s)
+	{
+		++s->refs;
+		++s->holders;
+		handle->shared = s;
+	}
+
+	pthread_mutex_unlock(&c->mutex);
+
+	//hve_init prints its own errors
+	if(s == NULL && same_source >= HVE_MAX_COALESCED)
+		HVE_ERROR_MSG("too many distinct configs for source");
+
+	//lost the race, duplicate session is not needed
+	if(created)
+		shared_free(created);
+
+	if(s == NULL)
+	{
+		free(handle);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&s->mutex);
+
+	handle->next = s->handles;
+	s->handles = handle;
+
+	//new holder needs keyframe to start decoding
+	if(s->handles->next)
+		hve_request_keyframe(s->h);
+
+	pthread_mutex_unlock(&s->mutex);
+
+	return handle;
+}
+
+void hve_handle_close(struct hve_handle *handle)
+{
+	struct hve_coalescer *c;
+	struct hve_handle **p;
+	struct hve_shared *s;
+	int flush;
+
+	if(handle == NULL)
+		return;
+
+	s = handle->shared;
+	c = handle->coalescer;
+
+	pthread_mutex_lock(&s->mutex);
+
+	for(p = &s->handles; *p; p = &(*p)->next)
+		if(*p == handle)
+		{
+			*p = handle->next;
+			break;
+		}
+
+	packet_queue_free(s->h, &handle->queue);
+
+	pthread_mutex_unlock(&s->mutex);
+
+	av_packet_unref(&handle->packet);
+
+	pthread_mutex_lock(&c->mutex);
+
+	--s->holders;
+	s->flushes -= handle->flushed;
+
+	//remaining holders may have been waiting only for this one to flush
+	if( (flush = shared_flush_last(s)) )
+		++s->refs;
+
+	shared_unref(c, s);
+
+	pthread_mutex_unlock(&c->mutex);
+
+	if(flush)
+	{
+		pthread_mutex_lock(&s->mutex);
+		shared_encode(s, NULL);
+		pthread_mutex_unlock(&s->mutex);
+
+		pthread_mutex_lock(&c->mutex);
+		shared_unref(c, s);
+		pthread_mutex_unlock(&c->mutex);
+	}
+
+	free(handle);
+}
+
+int hve_handle_flush(struct hve_handle *handle)
+{
+	struct hve_coalescer *c = handle->coalescer;
+	struct hve_shared *s = handle->shared;
+	int flush, err = HVE_OK;
+
+	pthread_mutex_lock(&c->mutex);
+
+	if(!handle->flushed)
+	{
+		handle->flushed = 1;
+		++s->flushes;
+	}
+
+	if( (flush = shared_flush_last(s)) )
+		++s->refs;
+
+	pthread_mutex_unlock(&c->mutex);
+
+	//other holders still use the session
+	if(!flush)
+		return HVE_OK;
+
+	pthread_mutex_lock(&s->mutex);
+	err = shared_encode(s, NULL);
+	pthread_mutex_unlock(&s->mutex);
+
+	pthread_mutex_lock(&c->mutex);
+	shared_unref(c, s);
+	pthread_mutex_unlock(&c->mutex);
+
+	return err;
+}
+
+int hve_coalescer_send_frame(struct hve_coalescer *c, const char *source, struct hve_frame *frame)
+{
+	struct hve_shared *sessions[HVE_MAX_COALESCED], *s;
+	int count = 0, err = HVE_OK;
+
+	//one holder must not end the stream for others
+	if(frame == NULL)
+		return HVE_ERROR_MSG("flush shared sessions with hve_handle_flush");
+
+	//keep sessions alive while encoding without holding coalescer mutex
+	pthread_mutex_lock(&c->mutex);
+
+	for(s = c->shared; s; s = s->next)
+		if(strcmp(s->source, source) == 0 && !s->flushed)
+		{
+			++s->refs;
+			sessions[count++] = s;
+		}
+
+	pthread_mutex_unlock(&c->mutex);
+
+	for(int i = 0; i < count; ++i)
+		if(shared_send_frame(sessions[i], frame) != HVE_OK)
+			err = HVE_ERROR;
+
+	pthread_mutex_lock(&c->mutex);
+
+	for(int i = 0; i < count; ++i)
+		shared_unref(c, sessions[i]);
+
+	pthread_mutex_unlock(&c->mutex);
+
+	return err;
+}
+
+AVPacket *hve_handle_receive_packet(struct hve_handle *handle, int *error)
+{
+	struct hve_shared *s = handle->shared;
+	AVPacket *packet = NULL;
+
+	pthread_mutex_lock(&s->mutex);
+
+	*error = handle->error ? HVE_ERROR : HVE_OK;
+
+	if(handle->queue.count)
+	{
+		packet_queue_pop(s->h, &handle->queue, &handle->packet);
+		packet = &handle->packet;
+	}
+
+	pthread_mutex_unlock(&s->mutex);
+
+	return packet;
+}
+
+int hve_handle_get_stats(struct hve_handle *handle, struct hve_stats *stats)
+{
+	int ret;
+
+	pthread_mutex_lock(&handle->shared->mutex);
+	ret = hve_get_stats(handle->shared->h, stats);
+	pthread_mutex_unlock(&handle->shared->mutex);
+
+	return ret;
+}
+
+// NULL on error
+static struct hve_shared *shared_init(const char *source, const struct hve_config *config)
+{
+	struct hve_shared *s, zero_shared = {0};
+
+	if( (s = (struct hve_shared*)malloc(sizeof(struct hve_shared))) == NULL )
+	{
+		fprintf(stderr, "hve: not enough memory for shared session\n");
+		return NULL;
+	}
+
+	*s = zero_shared;
+
+	av_init_packet(&s->fanout);
+	s->fanout.data = NULL;
+	s->fanout.size = 0;
+
+	if( (s->source = av_strdup(source)) == NULL )
+	{
+		free(s);
+		HVE_ERROR_MSG("not enough memory for source id");
+		return NULL;
+	}
+
+	if(pthread_mutex_init(&s->mutex, NULL) != 0)
+	{
+		av_free(s->source);
+		free(s);
+		HVE_ERROR_MSG("failed to initialize shared session mutex");
+		return NULL;
+	}
+
+	//hve_init prints its own errors
+	if( (s->h = hve_init(config)) == NULL )
+	{
+		pthread_mutex_destroy(&s->mutex);
+		av_free(s->source);
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+static void shared_free(struct hve_shared *s)
+{
+	hve_close(s->h);
+	av_packet_unref(&s->fanout);
+	pthread_mutex_destroy(&s->mutex);
+	av_free(s->source);
+	free(s);
+}
+
+// call with coalescer mutex locked, counts not flushed sessions of the source in same_source
+// config equality is normalized (defaults are equal to explicit values)
+static struct hve_shared *shared_find(struct hve_coalescer *c, const char *source, const struct hve_config *config, int *same_source)
+{
+	struct hve_shared *s;
+
+	*same_source = 0;
+
+	//flushed sessions only drain to their holders
+	for(s = c->shared; s; s = s->next)
+		if(!s->flushed && strcmp(s->source, source) == 0)
+		{
+			++*same_source;
+
+			if(hve_config_equal(&s->h->config, config))
+				return s;
+		}
+
+	return NULL;
+}
+
+// call with coalescer mutex locked, true if caller should flush (every holder asked)
+static int shared_flush_last(struct hve_shared *s)
+{
+	if(s->flushed || s->holders == 0 || s->flushes < s->holders)
+		return 0;
+
+	s->flushed = 1;
+
+	return 1;
+}
+
+// call with coalescer mutex locked, last reference closes the session
+static void shared_unref(struct hve_coalescer *c, struct hve_shared *s)
+{
+	struct hve_shared **p;
+
+	if(--s->refs)
+		return;
+
+	for(p = &c->shared; *p; p = &(*p)->next)
+		if(*p == s)
+		{
+			*p = s->next;
+			break;
+		}
+
+	shared_free(s);
+}
+
+static int shared_send_frame(struct hve_shared *s, struct hve_frame *frame)
+{
+	int err;
+
+	pthread_mutex_lock(&s->mutex);
+	err = shared_encode(s, frame);
+	pthread_mutex_unlock(&s->mutex);
+
+	return err;
+}
+
+// call with shared mutex locked
+// encodes once (or flushes if NULL) and fans out packets (references, not copies) to all holders
+// holder queues reuse their packets, only the reference itself is allocated (by FFmpeg)
+static int shared_encode(struct hve_shared *s, struct hve_frame *frame)
+{
+	struct hve_handle *handle;
+	AVPacket *packet;
+	int failed = HVE_OK;
+
+	//frame raced with the last holder flushing
+	if(frame && s->h->flushed)
+		return HVE_OK;
+
+	if(hve_send_frame(s->h, frame) != HVE_OK)
+		failed = HVE_ERROR;
+
+	while( !failed && (packet = hve_receive_packet(s->h, &failed)) )
+		for(handle = s->handles; handle; handle = handle->next)
+		{
+			if(handle->wait_keyframe && !(packet->flags & AV_PKT_FLAG_KEY))
+				continue;
+
+			handle->wait_keyframe = 0;
+
+			++s->h->allocs[HVE_ALLOC_QUEUE];
+
+			if( av_packet_ref(&s->fanout, packet) < 0 || packet_queue_push(s->h, &handle->queue, &s->fanout) != HVE_OK)
+				handle->error = 1;
+		}
+
+	if(failed)
+		for(handle = s->handles; handle; handle = handle->next)
+			handle->error = 1;
+
+	return failed ? HVE_ERROR_MSG("shared session failed to encode") : HVE_OK;
+}
+
+struct hve_pyramid *hve_pyramid_init(const struct hve_pyramid_config *config)
+{
+	struct hve_pyramid *p, zero_pyramid = {0};
+	enum AVPixelFormat pix_fmt = AV_PIX_FMT_NV12;
+
+	if(config->pixel_format && config->pixel_format[0] != '\0')
+		pix_fmt = av_get_pix_fmt(config->pixel_format);
+
+	if(pix_fmt != AV_PIX_FMT_NV12 && pix_fmt != AV_PIX_FMT_YUV420P)
+	{
+		HVE_ERROR_MSG("pyramid pixel format should be nv12 or yuv420p");
+		return NULL;
+	}
+
+	if(config->levels < 1 || config->levels > HVE_PYRAMID_LEVELS)
+	{
+		fprintf(stderr, "hve: pyramid levels should be between 1 and %d\n", HVE_PYRAMID_LEVELS);
+		return NULL;
+	}
+
+	if(config->width <= 0 || config->height <= 0 ||
+	   config->width % (2 << config->levels) || config->height % (2 << config->levels))
+	{
+		fprintf(stderr, "hve: pyramid width and height should be divisible by %d for %d levels\n", 2 << config->levels, config->levels);
+		return NULL;
+	}
+
+	if(config->threads < 0 || config->threads > HVE_MAX_WORKERS)
+	{
+		fprintf(stderr, "hve: pyramid threads should be between 0 and %d\n", HVE_MAX_WORKERS);
+		return NULL;
+	}
+
+	if( (p = (struct hve_pyramid*)malloc(sizeof(struct hve_pyramid))) == NULL )
+	{
+		fprintf(stderr, "hve: not enough memory for pyramid\n");
+		return NULL;
+	}
+
+	*p = zero_pyramid;
+	p->width = config->width;
+	p->height = config->height;
+	p->pix_fmt = pix_fmt;
+	p->levels = config->levels;
+	p->band = 2 << config->levels;
+	p->threads = config->threads ? config->threads : 1;
+
+	if(pthread_mutex_init(&p->mutex, NULL) != 0)
+	{
+		free(p);
+		HVE_ERROR_MSG("failed to initialize pyramid mutex");
+		return NULL;
+	}
+
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	for(int l = 0; l < p->levels; ++l)
+	{
+		int size = av_image_get_buffer_size(pix_fmt, p->width >> (l + 1), p->height >> (l + 1), 32);
+
+		if( (p->pools[l] = av_buffer_pool_init(size, av_buffer_alloc)) == NULL )
+		{
+			hve_pyramid_close(p);
+			HVE_ERROR_MSG("failed to initialize pyramid buffer pool");
+			return NULL;
+		}
+	}
+
+	for(int i = 0; i < p->threads; ++i)
+	{
+		p->slices[i].pyramid = p;
+		p->slices[i].index = i;
+	}
+
+	//slice 0 is processed by calling thread
+	for(p->started = 1; p->started < p->threads; ++p->started)
+		if(pthread_create(&p->slices[p->started].thread, NULL, pyramid_thread, &p->slices[p->started]) != 0)
+		{
+			hve_pyramid_close(p);
+			HVE_ERROR_MSG("failed to create pyramid thread");
+			return NULL;
+		}
+
+	return p;
+}
+
+void hve_pyramid_close(struct hve_pyramid *p)
+{
+	if(p == NULL)
+		return;
+
+	pthread_mutex_lock(&p->mutex);
+	p->shutdown = 1;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->mutex);
+
+	for(int i = 1; i < p->started; ++i)
+		pthread_join(p->slices[i].thread, NULL);
+
+	//buffers still referenced by user frames are freed when unreferenced
+	for(int l = 0; l < p->levels; ++l)
+		av_buffer_pool_uninit(&p->pools[l]);
+
+	pthread_cond_destroy(&p->start);
+	pthread_cond_destroy(&p->done);
+	pthread_mutex_destroy(&p->mutex);
+
+	free(p);
+}
+
+int hve_pyramid_scale(struct hve_pyramid *p, const struct hve_frame *frame, AVFrame **levels)
+{
+	for(int l = 0; l < p->levels; ++l)
+	{
+		AVFrame *f = levels[l];
+
+		av_frame_unref(f);
+
+		if( (f->buf[0] = av_buffer_pool_get(p->pools[l])) == NULL )
+		{
+			while(l >= 0)
+				av_frame_unref(levels[l--]);
+			return HVE_ERROR_MSG("failed to get pyramid buffer from pool");
+		}
+
+		f->format = p->pix_fmt;
+		f->width = p->width >> (l + 1);
+		f->height = p->height >> (l + 1);
+		av_image_fill_arrays(f->data, f->linesize, f->buf[0]->data, p->pix_fmt, f->width, f->height, 32);
+	}
+
+	if(p->threads == 1)
+	{
+		p->src = frame;
+		p->dst = levels;
+		pyramid_slice(p, 0);
+		return HVE_OK;
+	}
+
+	pthread_mutex_lock(&p->mutex);
+	p->src = frame;
+	p->dst = levels;
+	p->pending = p->threads - 1;
+	++p->job;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->mutex);
+
+	pyramid_slice(p, 0);
+
+	pthread_mutex_lock(&p->mutex);
+	while(p->pending)
+		pthread_cond_wait(&p->done, &p->mutex);
+	pthread_mutex_unlock(&p->mutex);
+
+	return HVE_OK;
+}
+
+static void *pyramid_thread(void *arg)
+{
+	struct hve_pyramid_slice *slice = (struct hve_pyramid_slice*)arg;
+	struct hve_pyramid *p = slice->pyramid;
+	int job = 0;
+
+	pthread_mutex_lock(&p->mutex);
+
+	while(1)
+	{
+		while(!p->shutdown && p->job == job)
+			pthread_cond_wait(&p->start, &p->mutex);
+
+		if(p->shutdown)
+			break;
+
+		job = p->job;
+		pthread_mutex_unlock(&p->mutex);
+
+		pyramid_slice(p, slice->index);
+
+		pthread_mutex_lock(&p->mutex);
+		if(--p->pending == 0)
+			pthread_cond_signal(&p->done);
+	}
+
+	pthread_mutex_unlock(&p->mutex);
+
+	return NULL;
+}
+
+// contiguous share of bands, every plane carried through all the levels band by band
+static void pyramid_slice(struct hve_pyramid *p, int index)
+{
+	struct hve_kernels *k = kernels();
+	const int bands = p->height / p->band;
+	const int first = bands * index / p->threads, last = bands * (index + 1) / p->threads;
+
+	pyramid_plane(p, 0, p->width, p->band, first, last, k->downscale2_row);
+
+	if(p->pix_fmt == AV_PIX_FMT_NV12)
+		pyramid_plane(p, 1, p->width / 2, p->band / 2, first, last, k->downscale2_uv_row);
+	else
+	{
+		pyramid_plane(p, 1, p->width / 2, p->band / 2, first, last, k->downscale2_row);
+		pyramid_plane(p, 2, p->width / 2, p->band / 2, first, last, k->downscale2_row);
+	}
+}
+
+// width in kernel units (pixels or UV pairs) and rows per band of source plane
+static void pyramid_plane(struct hve_pyramid *p, int plane, int width, int rows, int band_first, int band_last, downscale2_row_fn row)
+{
+	for(int b = band_first; b < band_last; ++b)
+	{
+		//each level is made from rows of previous level just written and still in cache
+		const uint8_t *src = p->src->data[plane] + (size_t)b * rows * p->src->linesize[plane];
+		int src_linesize = p->src->linesize[plane], w = width, r = rows;
+
+		for(int l = 0; l < p->levels; ++l)
+		{
+			w /= 2;
+			r /= 2;
+
+			const int dst_linesize = p->dst[l]->linesize[plane];
+			uint8_t *dst = p->dst[l]->data[plane] + (size_t)b * r * dst_linesize;
+
+			for(int y = 0; y < r; ++y)
+				row(src + 2 * y * src_linesize, src + (2 * y + 1) * src_linesize, dst + y * dst_linesize, w);
+
+			src = dst;
+			src_linesize = dst_linesize;
+		}
+	}
+}
+
+static struct hve_kernels *kernels()
+{
+	pthread_once(&hve_kernels_once, kernels_init);
+	return &hve_kernels;
+}
+
+static void kernels_init()
+{
+	int flags = av_get_cpu_flags();
+	const char *env = getenv("HVE_SIMD");
+	enum hve_simd_level level = HVE_SIMD_LEVELS - 1;
+
+	hve_kernels.supported = 1 << HVE_SIMD_SCALAR;
+
+#if HVE_X86
+	if(flags & AV_CPU_FLAG_SSE2)
+		hve_kernels.supported |= 1 << HVE_SIMD_SSE2;
+	if(flags & AV_CPU_FLAG_AVX2)
+		hve_kernels.supported |= 1 << HVE_SIMD_AVX2;
+#ifdef AV_CPU_FLAG_AVX512
+	if(flags & AV_CPU_FLAG_AVX512)
+		hve_kernels.supported |= 1 << HVE_SIMD_AVX512;
+#endif
+#elif HVE_NEON
+	if(flags & AV_CPU_FLAG_NEON)
+		hve_kernels.supported |= 1 << HVE_SIMD_NEON;
+#endif
+
+	//e.g. HVE_SIMD=scalar or HVE_SIMD=sse2 caps the level (troubleshooting, benchmarking)
+	if(env && env[0] != '\0')
+	{
+		for(level = HVE_SIMD_SCALAR; level < HVE_SIMD_LEVELS; ++level)
+			if(strcmp(env, HVE_SIMD_NAMES[level]) == 0)
+				break;
+
+		if(level == HVE_SIMD_LEVELS)
+		{
+			fprintf(stderr, "hve: ignoring unknown HVE_SIMD=%s\n", env);
+			level = HVE_SIMD_LEVELS - 1;
+		}
+	}
+
+	kernels_bind(level);
+}
+
+// binds kernel to the highest variant available, supported by CPU and allowed
+#define HVE_KERNEL_BIND(kernel) \
+	for(int l = level; l >= HVE_SIMD_SCALAR; --l) \
+		if(kernel##_variants[l] && (hve_kernels.supported & (1 << l))) \
+		{ \
+			hve_kernels.kernel = kernel##_variants[l]; \
+			break; \
+		}
+
+#if HVE_X86
+static const depth_split_row_fn depth_split_row_variants[HVE_SIMD_LEVELS] =
+	{depth_split_row_c, NULL, depth_split_row_sse2, depth_split_row_avx2, depth_split_row_avx512};
+static const depth_merge_row_fn depth_merge_row_variants[HVE_SIMD_LEVELS] =
+	{depth_merge_row_c, NULL, depth_merge_row_sse2, depth_merge_row_avx2, depth_merge_row_avx512};
+static const uv_interleave_row_fn uv_interleave_row_variants[HVE_SIMD_LEVELS] =
+	{uv_interleave_row_c, NULL, uv_interleave_row_sse2, uv_interleave_row_avx2};
+static const ssim_4x4_row_fn ssim_4x4_row_variants[HVE_SIMD_LEVELS] =
+	{ssim_4x4_row_c, NULL, ssim_4x4_row_sse2, ssim_4x4_row_avx2};
+static const downscale2_row_fn downscale2_row_variants[HVE_SIMD_LEVELS] =
+	{downscale2_row_c, NULL, downscale2_row_sse2, downscale2_row_avx2};
+static const downscale2_row_fn downscale2_uv_row_variants[HVE_SIMD_LEVELS] =
+	{downscale2_uv_row_c, NULL, downscale2_uv_row_sse2, downscale2_uv_row_avx2};
+#elif HVE_NEON
+static const depth_split_row_fn depth_split_row_variants[HVE_SIMD_LEVELS] = {depth_split_row_c, depth_split_row_neon};
+static const depth_merge_row_fn depth_merge_row_variants[HVE_SIMD_LEVELS] = {depth_merge_row_c, depth_merge_row_neon};
+static const uv_interleave_row_fn uv_interleave_row_variants[HVE_SIMD_LEVELS] = {uv_interleave_row_c, uv_interleave_row_neon};
+static const ssim_4x4_row_fn ssim_4x4_row_variants[HVE_SIMD_LEVELS] = {ssim_4x4_row_c};
+static const downscale2_row_fn downscale2_row_variants[HVE_SIMD_LEVELS] = {downscale2_row_c, downscale2_row_neon};
+static const downscale2_row_fn downscale2_uv_row_variants[HVE_SIMD_LEVELS] = {downscale2_uv_row_c, downscale2_uv_row_neon};
+#else
+static const depth_split_row_fn depth_split_row_variants[HVE_SIMD_LEVELS] = {depth_split_row_c};
+static const depth_merge_row_fn depth_merge_row_variants[HVE_SIMD_LEVELS] = {depth_merge_row_c};
+static const uv_interleave_row_fn uv_interleave_row_variants[HVE_SIMD_LEVELS] = {uv_interleave_row_c};
+static const ssim_4x4_row_fn ssim_4x4_row_variants[HVE_SIMD_LEVELS] = {ssim_4x4_row_c};
+static const downscale2_row_fn downscale2_row_variants[HVE_SIMD_LEVELS] = {downscale2_row_c};
+static const downscale2_row_fn downscale2_uv_row_variants[HVE_SIMD_LEVELS] = {downscale2_uv_row_c};
+#endif
+//scalar only, packed 4 byte pixels with runtime channel order don't map well to fixed shuffles
+static const rgb32_nv12_row_fn rgb32_nv12_row_variants[HVE_SIMD_LEVELS] = {rgb32_nv12_row_c};
+
+static void kernels_bind(enum hve_simd_level level)
+{
+	hve_kernels.level = level;
+
+	HVE_KERNEL_BIND(depth_split_row);
+	HVE_KERNEL_BIND(depth_merge_row);
+	HVE_KERNEL_BIND(rgb32_nv12_row);
+	HVE_KERNEL_BIND(uv_interleave_row);
+	HVE_KERNEL_BIND(ssim_4x4_row);
+	HVE_KERNEL_BIND(downscale2_row);
+	HVE_KERNEL_BIND(downscale2_uv_row);
+}
+
+const char *hve_simd_level(void)
+{
+	struct hve_kernels *k = kernels();
+	int level = k->level;
+
+	//report what is actually used, not just allowed
+	while(level > HVE_SIMD_SCALAR && !(k->supported & (1 << level)))
+		--level;
+
+	return HVE_SIMD_NAMES[level];
+}
+
+int hve_simd_force(const char *level)
+{
+	struct hve_kernels *k = kernels();
+
+	if(level == NULL || level[0] == '\0')
+	{
+		kernels_bind(HVE_SIMD_LEVELS - 1);
+		return HVE_OK;
+	}
+
+	for(int l = HVE_SIMD_SCALAR; l < HVE_SIMD_LEVELS; ++l)
+		if(strcmp(level, HVE_SIMD_NAMES[l]) == 0)
+		{
+			if(!(k->supported & (1 << l)))
+				return HVE_ERROR_MSG("SIMD level not supported by CPU");
+
+			kernels_bind(l);
+			return HVE_OK;
+		}
+
+	return HVE_ERROR_MSG("unknown SIMD level");
+}
+
+void hve_depth_split(const uint16_t *depth, int depth_linesize, uint8_t *hi, int hi_linesize,
+                     uint8_t *lo, int lo_linesize, int width, int height)
+{
+	depth_split_row_fn split = kernels()->depth_split_row;
+
+	for(int y = 0; y < height; ++y)
+		split((const uint16_t*)((const uint8_t*)depth + y * depth_linesize), hi + y * hi_linesize, lo + y * lo_linesize, width);
+}
+
+void hve_depth_merge(const uint8_t *hi, int hi_linesize, const uint8_t *lo, int lo_linesize,
+                     uint16_t *depth, int depth_linesize, int width, int height)
+{
+	depth_merge_row_fn merge = kernels()->depth_merge_row;
+
+	for(int y = 0; y < height; ++y)
+		merge(hi + y * hi_linesize, lo + y * lo_linesize, (uint16_t*)((uint8_t*)depth + y * depth_linesize), width);
+}
+
+// hi = d >> 8, lo = d & 0xFF reflected on odd hi (triangle wave, continuous across hi steps)
+static void depth_split_row_c(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width)
+{
+	for(int x = 0; x < width; ++x)
+	{
+		uint8_t high = depth[x] >> 8;
+
+		hi[x] = high;
+		lo[x] = (uint8_t)depth[x] ^ (uint8_t)-(high & 1);
+	}
+}
+
+static void depth_merge_row_c(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width)
+{
+	for(int x = 0; x < width; ++x)
+		depth[x] = (uint16_t)(hi[x] << 8) | (uint8_t)(lo[x] ^ (uint8_t)-(hi[x] & 1));
+}
+
+// BT.601 limited range, 8 bit fixed point
+#define HVE_RGB_Y(r, g, b) ((( 66 * (r) + 129 * (g) +  25 * (b) + 128) >> 8) + 16)
+#define HVE_RGB_U(r, g, b) (((-38 * (r) -  74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define HVE_RGB_V(r, g, b) (((112 * (r) -  94 * (g) -  18 * (b) + 128) >> 8) + 128)
+
+// two rows of packed 4 byte pixels to two luma rows and one interleaved chroma row
+static void rgb32_nv12_row_c(const uint8_t *rgb0, const uint8_t *rgb1, uint8_t *y0, uint8_t *y1, uint8_t *uv, int width, const int order[3])
+{
+	const int r = order[0], g = order[1], b = order[2];
+
+	for(int x = 0; x < width; x += 2)
+	{
+		const int x1 = x + 1 < width ? x + 1 : x;
+		const uint8_t *p00 = rgb0 + 4 * x, *p01 = rgb0 + 4 * x1, *p10 = rgb1 + 4 * x, *p11 = rgb1 + 4 * x1;
+		const int rs = (p00[r] + p01[r] + p10[r] + p11[r] + 2) >> 2;
+		const int gs = (p00[g] + p01[g] + p10[g] + p11[g] + 2) >> 2;
+		const int bs = (p00[b] + p01[b] + p10[b] + p11[b] + 2) >> 2;
+
+		y0[x] = HVE_RGB_Y(p00[r], p00[g], p00[b]);
+		y0[x1] = HVE_RGB_Y(p01[r], p01[g], p01[b]);
+		y1[x] = HVE_RGB_Y(p10[r], p10[g], p10[b]);
+		y1[x1] = HVE_RGB_Y(p11[r], p11[g], p11[b]);
+
+		uv[x] = HVE_RGB_U(rs, gs, bs);
+		uv[x + 1] = HVE_RGB_V(rs, gs, bs);
+	}
+}
+
+static void uv_interleave_row_c(const uint8_t *u, const uint8_t *v, uint8_t *uv, int width)
+{
+	for(int x = 0; x < width; ++x)
+	{
+		uv[2 * x] = u[x];
+		uv[2 * x + 1] = v[x];
+	}
+}
+
+// sums of a, b, a^2 + b^2 and a*b over consecutive 4x4 blocks
+static void ssim_4x4_row_c(const uint8_t *a, int a_linesize, const uint8_t *b, int b_linesize, int blocks, int sums[][4])
+{
+	for(int z = 0; z < blocks; ++z, a += 4, b += 4)
+	{
+		int s1 = 0, s2 = 0, ss = 0, s12 = 0;
+
+		for(int y = 0; y < 4; ++y)
+			for(int x = 0; x < 4; ++x)
+			{
+				const int pa = a[y * a_linesize + x], pb = b[y * b_linesize + x];
+
+				s1 += pa;
+				s2 += pb;
+				ss += pa * pa + pb * pb;
+				s12 += pa * pb;
+			}
+
+		sums[z][0] = s1;
+		sums[z][1] = s2;
+		sums[z][2] = ss;
+		sums[z][3] = s12;
+	}
+}
+
+// 2x2 box average of two rows, width output pixels
+static void downscale2_row_c(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width)
+{
+	for(int x = 0; x < width; ++x)
+		dst[x] = (src0[2 * x] + src0[2 * x + 1] + src1[2 * x] + src1[2 * x + 1] + 2) >> 2;
+}
+
+// the same for interleaved chroma, width output UV pairs
+static void downscale2_uv_row_c(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width)
+{
+	for(int x = 0; x < 2 * width; ++x)
+	{
+		const int s = 2 * x - (x & 1); //the same component of two neighbouring pairs at s and s + 2
+
+		dst[x] = (src0[s] + src0[s + 2] + src1[s] + src1[s + 2] + 2) >> 2;
+	}
+}
+
+#if HVE_X86
+
+__attribute__((target("sse2")))
+static void depth_split_row_sse2(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width)
+{
+	const __m128i one = _mm_set1_epi16(1), low = _mm_set1_epi16(0xFF);
+	int x = 0;
+
+	for(; x + 16 <= width; x += 16)
+	{
+		__m128i d0 = _mm_loadu_si128((const __m128i*)(depth + x));
+		__m128i d1 = _mm_loadu_si128((const __m128i*)(depth + x + 8));
+		__m128i h0 = _mm_srli_epi16(d0, 8), h1 = _mm_srli_epi16(d1, 8);
+		//0xFF where hi is odd
+		__m128i m0 = _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(h0, one), one), low);
+		__m128i m1 = _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(h1, one), one), low);
+		__m128i l0 = _mm_xor_si128(_mm_and_si128(d0, low), m0);
+		__m128i l1 = _mm_xor_si128(_mm_and_si128(d1, low), m1);
+
+		_mm_storeu_si128((__m128i*)(hi + x), _mm_packus_epi16(h0, h1));
+		_mm_storeu_si128((__m128i*)(lo + x), _mm_packus_epi16(l0, l1));
+	}
+
+	depth_split_row_c(depth + x, hi + x, lo + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void depth_split_row_avx2(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width)
+{
+	const __m256i one = _mm256_set1_epi16(1), low = _mm256_set1_epi16(0xFF);
+	int x = 0;
+
+	for(; x + 32 <= width; x += 32)
+	{
+		__m256i d0 = _mm256_loadu_si256((const __m256i*)(depth + x));
+		__m256i d1 = _mm256_loadu_si256((const __m256i*)(depth + x + 16));
+		__m256i h0 = _mm256_srli_epi16(d0, 8), h1 = _mm256_srli_epi16(d1, 8);
+		__m256i m0 = _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_and_si256(h0, one), one), low);
+		__m256i m1 = _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_and_si256(h1, one), one), low);
+		__m256i l0 = _mm256_xor_si256(_mm256_and_si256(d0, low), m0);
+		__m256i l1 = _mm256_xor_si256(_mm256_and_si256(d1, low), m1);
+
+		//pack works within 128-bit lanes, restore order of 64-bit blocks
+		_mm256_storeu_si256((__m256i*)(hi + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(h0, h1), 0xD8));
+		_mm256_storeu_si256((__m256i*)(lo + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(l0, l1), 0xD8));
+	}
+
+	depth_split_row_c(depth + x, hi + x, lo + x, width - x);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void depth_split_row_avx512(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width)
+{
+	const __m512i one = _mm512_set1_epi16(1), low = _mm512_set1_epi16(0xFF);
+	int x = 0;
+
+	for(; x + 32 <= width; x += 32)
+	{
+		__m512i d = _mm512_loadu_si512((const void*)(depth + x));
+		__m512i h = _mm512_srli_epi16(d, 8);
+		//reflect low byte where hi is odd, truncation below drops the high byte
+		__m512i l = _mm512_mask_mov_epi16(d, _mm512_test_epi16_mask(h, one), _mm512_xor_si512(d, low));
+
+		_mm256_storeu_si256((__m256i*)(hi + x), _mm512_cvtepi16_epi8(h));
+		_mm256_storeu_si256((__m256i*)(lo + x), _mm512_cvtepi16_epi8(l));
+	}
+
+	depth_split_row_c(depth + x, hi + x, lo + x, width - x);
+}
+
+__attribute__((target("sse2")))
+static void depth_merge_row_sse2(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width)
+{
+	const __m128i one = _mm_set1_epi8(1);
+	int x = 0;
+
+	for(; x + 16 <= width; x += 16)
+	{
+		__m128i h = _mm_loadu_si128((const __m128i*)(hi + x));
+		__m128i l = _mm_loadu_si128((const __m128i*)(lo + x));
+
+		l = _mm_xor_si128(l, _mm_cmpeq_epi8(_mm_and_si128(h, one), one));
+
+		//little endian, low byte from lo, high byte from hi
+		_mm_storeu_si128((__m128i*)(depth + x), _mm_unpacklo_epi8(l, h));
+		_mm_storeu_si128((__m128i*)(depth + x + 8), _mm_unpackhi_epi8(l, h));
+	}
+
+	depth_merge_row_c(hi + x, lo + x, depth + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void depth_merge_row_avx2(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width)
+{
+	const __m256i one = _mm256_set1_epi8(1);
+	int x = 0;
+
+	for(; x + 32 <= width; x += 32)
+	{
+		__m256i h = _mm256_loadu_si256((const __m256i*)(hi + x));
+		__m256i l = _mm256_loadu_si256((const __m256i*)(lo + x));
+
+		l = _mm256_xor_si256(l, _mm256_cmpeq_epi8(_mm256_and_si256(h, one), one));
+
+		//unpack works within 128-bit lanes, reorder 64-bit blocks first
+		h = _mm256_permute4x64_epi64(h, 0xD8);
+		l = _mm256_permute4x64_epi64(l, 0xD8);
+
+		_mm256_storeu_si256((__m256i*)(depth + x), _mm256_unpacklo_epi8(l, h));
+		_mm256_storeu_si256((__m256i*)(depth + x + 16), _mm256_unpackhi_epi8(l, h));
+	}
+
+	depth_merge_row_c(hi + x, lo + x, depth + x, width - x);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void depth_merge_row_avx512(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width)
+{
+	const __m512i one = _mm512_set1_epi16(1), low = _mm512_set1_epi16(0xFF);
+	int x = 0;
+
+	for(; x + 32 <= width; x += 32)
+	{
+		__m512i h = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(hi + x)));
+		__m512i l = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(lo + x)));
+
+		l = _mm512_mask_mov_epi16(l, _mm512_test_epi16_mask(h, one), _mm512_xor_si512(l, low));
+
+		_mm512_storeu_si512((void*)(depth + x), _mm512_or_si512(_mm512_slli_epi16(h, 8), l));
+	}
+
+	depth_merge_row_c(hi + x, lo + x, depth + x, width - x);
+}
+
+__attribute__((target("sse2")))
+static void uv_interleave_row_sse2(const uint8_t *u, const uint8_t *v, uint8_t *uv, int width)
+{
+	int x = 0;
+
+	for(; x + 16 <= width; x += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(u + x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(v + x));
+
+		_mm_storeu_si128((__m128i*)(uv + 2 * x), _mm_unpacklo_epi8(a, b));
+		_mm_storeu_si128((__m128i*)(uv + 2 * x + 16), _mm_unpackhi_epi8(a, b));
+	}
+
+	uv_interleave_row_c(u + x, v + x, uv + 2 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void uv_interleave_row_avx2(const uint8_t *u, const uint8_t *v, uint8_t *uv, int width)
+{
+	int x = 0;
+
+	for(; x + 32 <= width; x += 32)
+	{
+		//unpack works within 128-bit lanes, reorder 64-bit blocks first
+		__m256i a = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i*)(u + x)), 0xD8);
+		__m256i b = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i*)(v + x)), 0xD8);
+
+		_mm256_storeu_si256((__m256i*)(uv + 2 * x), _mm256_unpacklo_epi8(a, b));
+		_mm256_storeu_si256((__m256i*)(uv + 2 * x + 32), _mm256_unpackhi_epi8(a, b));
+	}
+
+	uv_interleave_row_c(u + x, v + x, uv + 2 * x, width - x);
+}
+
+__attribute__((target("sse2")))
+static void ssim_4x4_row_sse2(const uint8_t *a, int a_linesize, const uint8_t *b, int b_linesize, int blocks, int sums[][4])
+{
+	const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1);
+	int32_t t[4][4];
+	int z = 0;
+
+	//2 blocks (8 pixels) at a time
+	for(; z + 2 <= blocks; z += 2)
+	{
+		__m128i s1 = zero, s2 = zero, ss = zero, s12 = zero;
+
+		for(int y = 0; y < 4; ++y)
+		{
+			__m128i pa = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(a + y * a_linesize + 4 * z)), zero);
+			__m128i pb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(b + y * b_linesize + 4 * z)), zero);
+
+			s1 = _mm_add_epi16(s1, pa);
+			s2 = _mm_add_epi16(s2, pb);
+			ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(pa, pa), _mm_madd_epi16(pb, pb)));
+			s12 = _mm_add_epi32(s12, _mm_madd_epi16(pa, pb));
+		}
+
+		//pairs of pixels summed, block is two adjacent pairs
+		_mm_storeu_si128((__m128i*)t[0], _mm_madd_epi16(s1, one));
+		_mm_storeu_si128((__m128i*)t[1], _mm_madd_epi16(s2, one));
+		_mm_storeu_si128((__m128i*)t[2], ss);
+		_mm_storeu_si128((__m128i*)t[3], s12);
+
+		for(int i = 0; i < 4; ++i)
+		{
+			sums[z][i] = t[i][0] + t[i][1];
+			sums[z + 1][i] = t[i][2] + t[i][3];
+		}
+	}
+
+	ssim_4x4_row_c(a + 4 * z, a_linesize, b + 4 * z, b_linesize, blocks - z, sums + z);
+}
+
+__attribute__((target("avx2")))
+static void ssim_4x4_row_avx2(const uint8_t *a, int a_linesize, const uint8_t *b, int b_linesize, int blocks, int sums[][4])
+{
+	const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi16(1);
+	int32_t t[4][8];
+	int z = 0;
+
+	//4 blocks (16 pixels) at a time
+	for(; z + 4 <= blocks; z += 4)
+	{
+		__m256i s1 = zero, s2 = zero, ss = zero, s12 = zero;
+
+		for(int y = 0; y < 4; ++y)
+		{
+			__m256i pa = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + y * a_linesize + 4 * z)));
+			__m256i pb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + y * b_linesize + 4 * z)));
+
+			s1 = _mm256_add_epi16(s1, pa);
+			s2 = _mm256_add_epi16(s2, pb);
+			ss = _mm256_add_epi32(ss, _mm256_add_epi32(_mm256_madd_epi16(pa, pa), _mm256_madd_epi16(pb, pb)));
+			s12 = _mm256_add_epi32(s12, _mm256_madd_epi16(pa, pb));
+		}
+
+		_mm256_storeu_si256((__m256i*)t[0], _mm256_madd_epi16(s1, one));
+		_mm256_storeu_si256((__m256i*)t[1], _mm256_madd_epi16(s2, one));
+		_mm256_storeu_si256((__m256i*)t[2], ss);
+		_mm256_storeu_si256((__m256i*)t[3], s12);
+
+		for(int i = 0; i < 4; ++i)
+			for(int k = 0; k < 4; ++k)
+				sums[z + k][i] = t[i][2 * k] + t[i][2 * k + 1];
+	}
+
+	ssim_4x4_row_c(a + 4 * z, a_linesize, b + 4 * z, b_linesize, blocks - z, sums + z);
+}
+
+__attribute__((target("sse2")))
+static void downscale2_row_sse2(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width)
+{
+	const __m128i low = _mm_set1_epi16(0xFF), two = _mm_set1_epi16(2);
+	int x = 0;
+
+	for(; x + 16 <= width; x += 16)
+	{
+		__m128i a0 = _mm_loadu_si128((const __m128i*)(src0 + 2 * x));
+		__m128i a1 = _mm_loadu_si128((const __m128i*)(src0 + 2 * x + 16));
+		__m128i b0 = _mm_loadu_si128((const __m128i*)(src1 + 2 * x));
+		__m128i b1 = _mm_loadu_si128((const __m128i*)(src1 + 2 * x + 16));
+
+		//even + odd pixel of both rows in 16-bit lanes
+		__m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, low), _mm_srli_epi16(a0, 8)),
+		                           _mm_add_epi16(_mm_and_si128(b0, low), _mm_srli_epi16(b0, 8)));
+		__m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, low), _mm_srli_epi16(a1, 8)),
+		                           _mm_add_epi16(_mm_and_si128(b1, low), _mm_srli_epi16(b1, 8)));
+
+		s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+		s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(s0, s1));
+	}
+
+	downscale2_row_c(src0 + 2 * x, src1 + 2 * x, dst + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void downscale2_row_avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width)
+{
+	const __m256i low = _mm256_set1_epi16(0xFF), two = _mm256_set1_epi16(2);
+	int x = 0;
+
+	for(; x + 32 <= width; x += 32)
+	{
+		__m256i a0 = _mm256_loadu_si256((const __m256i*)(src0 + 2 * x));
+		__m256i a1 = _mm256_loadu_si256((const __m256i*)(src0 + 2 * x + 32));
+		__m256i b0 = _mm256_loadu_si256((const __m256i*)(src1 + 2 * x));
+		__m256i b1 = _mm256_loadu_si256((const __m256i*)(src1 + 2 * x + 32));
+
+		__m256i s0 = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a0, low), _mm256_srli_epi16(a0, 8)),
+		                              _mm256_add_epi16(_mm256_and_si256(b0, low), _mm256_srli_epi16(b0, 8)));
+		__m256i s1 = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a1, low), _mm256_srli_epi16(a1, 8)),
+		                              _mm256_add_epi16(_mm256_and_si256(b1, low), _mm256_srli_epi16(b1, 8)));
+
+		s0 = _mm256_srli_epi16(_mm256_add_epi16(s0, two), 2);
+		s1 = _mm256_srli_epi16(_mm256_add_epi16(s1, two), 2);
+
+		//pack works within 128-bit lanes, reorder 64-bit blocks after
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(s0, s1), 0xD8));
+	}
+
+	downscale2_row_c(src0 + 2 * x, src1 + 2 * x, dst + x, width - x);
+}
+
+__attribute__((target("sse2")))
+static void downscale2_uv_row_sse2(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width)
+{
+	const __m128i low = _mm_set1_epi16(0xFF), one = _mm_set1_epi16(1), two = _mm_set1_epi32(2);
+	int x = 0;
+
+	for(; x + 8 <= width; x += 8)
+	{
+		__m128i a0 = _mm_loadu_si128((const __m128i*)(src0 + 4 * x));
+		__m128i a1 = _mm_loadu_si128((const __m128i*)(src0 + 4 * x + 16));
+		__m128i b0 = _mm_loadu_si128((const __m128i*)(src1 + 4 * x));
+		__m128i b1 = _mm_loadu_si128((const __m128i*)(src1 + 4 * x + 16));
+
+		//U and V of both rows in 16-bit lanes, madd sums neighbouring pairs into 32-bit lanes
+		__m128i u0 = _mm_madd_epi16(_mm_add_epi16(_mm_and_si128(a0, low), _mm_and_si128(b0, low)), one);
+		__m128i v0 = _mm_madd_epi16(_mm_add_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(b0, 8)), one);
+		__m128i u1 = _mm_madd_epi16(_mm_add_epi16(_mm_and_si128(a1, low), _mm_and_si128(b1, low)), one);
+		__m128i v1 = _mm_madd_epi16(_mm_add_epi16(_mm_srli_epi16(a1, 8), _mm_srli_epi16(b1, 8)), one);
+
+		u0 = _mm_srli_epi32(_mm_add_epi32(u0, two), 2);
+		v0 = _mm_srli_epi32(_mm_add_epi32(v0, two), 2);
+		u1 = _mm_srli_epi32(_mm_add_epi32(u1, two), 2);
+		v1 = _mm_srli_epi32(_mm_add_epi32(v1, two), 2);
+
+		//U | V << 8 in 16-bit lanes is interleaved UV in memory (packed separately, pack saturates signed)
+		__m128i uv = _mm_or_si128(_mm_packs_epi32(u0, u1), _mm_slli_epi16(_mm_packs_epi32(v0, v1), 8));
+
+		_mm_storeu_si128((__m128i*)(dst + 2 * x), uv);
+	}
+
+	downscale2_uv_row_c(src0 + 4 * x, src1 + 4 * x, dst + 2 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void downscale2_uv_row_avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width)
+{
+	const __m256i low = _mm256_set1_epi16(0xFF), one = _mm256_set1_epi16(1), two = _mm256_set1_epi32(2);
+	int x = 0;
+
+	for(; x + 16 <= width; x += 16)
+	{
+		__m256i a0 = _mm256_loadu_si256((const __m256i*)(src0 + 4 * x));
+		__m256i a1 = _mm256_loadu_si256((const __m256i*)(src0 + 4 * x + 32));
+		__m256i b0 = _mm256_loadu_si256((const __m256i*)(src1 + 4 * x));
+		__m256i b1 = _mm256_loadu_si256((const __m256i*)(src1 + 4 * x + 32));
+
+		__m256i u0 = _mm256_madd_epi16(_mm256_add_epi16(_mm256_and_si256(a0, low), _mm256_and_si256(b0, low)), one);
+		__m256i v0 = _mm256_madd_epi16(_mm256_add_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(b0, 8)), one);
+		__m256i u1 = _mm256_madd_epi16(_mm256_add_epi16(_mm256_and_si256(a1, low), _mm256_and_si256(b1, low)), one);
+		__m256i v1 = _mm256_madd_epi16(_mm256_add_epi16(_mm256_srli_epi16(a1, 8), _mm256_srli_epi16(b1, 8)), one);
+
+		u0 = _mm256_srli_epi32(_mm256_add_epi32(u0, two), 2);
+		v0 = _mm256_srli_epi32(_mm256_add_epi32(v0, two), 2);
+		u1 = _mm256_srli_epi32(_mm256_add_epi32(u1, two), 2);
+		v1 = _mm256_srli_epi32(_mm256_add_epi32(v1, two), 2);
+
+		__m256i uv = _mm256_or_si256(_mm256_packs_epi32(u0, u1), _mm256_slli_epi16(_mm256_packs_epi32(v0, v1), 8));
+
+		_mm256_storeu_si256((__m256i*)(dst + 2 * x), _mm256_permute4x64_epi64(uv, 0xD8));
+	}
+
+	downscale2_uv_row_c(src0 + 4 * x, src1 + 4 * x, dst + 2 * x, width - x);
+}
+
+#elif HVE_NEON
+
+static void depth_split_row_neon(const uint16_t *depth, uint8_t *hi, uint8_t *lo, int width)
+{
+	const uint8x8_t one = vdup_n_u8(1);
+	int x = 0;
+
+	for(; x + 8 <= width; x += 8)
+	{
+		uint16x8_t d = vld1q_u16(depth + x);
+		uint8x8_t h = vshrn_n_u16(d, 8);
+
+		vst1_u8(hi + x, h);
+		//vtst gives 0xFF where hi is odd
+		vst1_u8(lo + x, veor_u8(vmovn_u16(d), vtst_u8(h, one)));
+	}
+
+	depth_split_row_c(depth + x, hi + x, lo + x, width - x);
+}
+
+static void depth_merge_row_neon(const uint8_t *hi, const uint8_t *lo, uint16_t *depth, int width)
+{
+	const uint8x8_t one = vdup_n_u8(1);
+	int x = 0;
+
+	for(; x + 8 <= width; x += 8)
+	{
+		uint8x8_t h = vld1_u8(hi + x);
+		uint8x8_t l = veor_u8(vld1_u8(lo + x), vtst_u8(h, one));
+
+		vst1q_u16(depth + x, vorrq_u16(vshll_n_u8(h, 8), vmovl_u8(l)));
+	}
+
+	depth_merge_row_c(hi + x, lo + x, depth + x, width - x);
+}
+
+static void uv_interleave_row_neon(const uint8_t *u, const uint8_t *v, uint8_t *uv, int width)
+{
+	int x = 0;
+
+	for(; x + 16 <= width; x += 16)
+	{
+		uint8x16x2_t p = { { vld1q_u8(u + x), vld1q_u8(v + x) } };
+
+		vst2q_u8(uv + 2 * x, p);
+	}
+
+	uv_interleave_row_c(u + x, v + x, uv + 2 * x, width - x);
+}
+
+static void downscale2_row_neon(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width)
+{
+	int x = 0;
+
+	for(; x + 16 <= width; x += 16)
+	{
+		//pairwise add long of first row, accumulate pairs of second row, round and narrow
+		uint16x8_t s0 = vpadalq_u8(vpaddlq_u8(vld1q_u8(src0 + 2 * x)), vld1q_u8(src1 + 2 * x));
+		uint16x8_t s1 = vpadalq_u8(vpaddlq_u8(vld1q_u8(src0 + 2 * x + 16)), vld1q_u8(src1 + 2 * x + 16));
+
+		vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(s0, 2), vrshrn_n_u16(s1, 2)));
+	}
+
+	downscale2_row_c(src0 + 2 * x, src1 + 2 * x, dst + x, width - x);
+}
+
+static void downscale2_uv_row_neon(const uint8_t *src0, const uint8_t *src1, uint8_t *dst, int width)
+{
+	int x = 0;
+
+	for(; x + 8 <= width; x += 8)
+	{
+		//U, V of even pairs and U, V of odd pairs
+		uint8x8x4_t a = vld4_u8(src0 + 4 * x);
+		uint8x8x4_t b = vld4_u8(src1 + 4 * x);
+		uint16x8_t u = vaddq_u16(vaddl_u8(a.val[0], a.val[2]), vaddl_u8(b.val[0], b.val[2]));
+		uint16x8_t v = vaddq_u16(vaddl_u8(a.val[1], a.val[3]), vaddl_u8(b.val[1], b.val[3]));
+		uint8x8x2_t uv = { { vrshrn_n_u16(u, 2), vrshrn_n_u16(v, 2) } };
+
+		vst2_u8(dst + 2 * x, uv);
+	}
+
+	downscale2_uv_row_c(src0 + 4 * x, src1 + 4 * x, dst + 2 * x, width - x);
+}
+
+#endif
@@ -42,6 +42,55 @@ extern "C" {
  */
 struct hve;
 
+/**
+ * @struct hve_scheduler
+ * @brief Scheduler shared by sessions encoding on the same device or CPU pool.
+ * @see hve_scheduler_init, hve_scheduler_close
+ */
+struct hve_scheduler;
+
+/**
+ * @struct hve_admission
+ * @brief Per-host capacity model admitting or rejecting new sessions.
+ * @see hve_admission_init, hve_admission_close
+ */
+struct hve_admission;
+
+/**
+ * @struct hve_device_set
+ * @brief Set of devices sessions are load balanced between.
+ * @see hve_device_set_init, hve_device_set_close
+ */
+struct hve_device_set;
+
+/**
+ * @struct hve_pool
+ * @brief Pool of closed sessions parked for reuse.
+ * @see hve_pool_init, hve_pool_close
+ */
+struct hve_pool;
+
+/**
+ * @struct hve_coalescer
+ * @brief Sessions shared between identical requests (same source and config).
+ * @see hve_coalescer_init, hve_coalescer_close, hve_coalescer_open
+ */
+struct hve_coalescer;
+
+/**
+ * @struct hve_handle
+ * @brief Refcounted handle to session shared by coalescer.
+ * @see hve_coalescer_open, hve_handle_flush, hve_handle_close
+ */
+struct hve_handle;
+
+/**
+ * @struct hve_pyramid
+ * @brief Software downscaler producing several halved resolutions in one pass.
+ * @see hve_pyramid_init, hve_pyramid_close, hve_pyramid_scale
+ */
+struct hve_pyramid;
+
 /**
  * @struct hve_config
  * @brief Encoder configuration
@@ -101,7 +150,10 @@ struct hve;
  * ffmpeg -h encoder=libx264
  * @endcode
  *
- * There are no software color conversions in this library.
+ * Formats not accepted natively by hardware encoder are converted on negotiated path (see convert):
+ * uploaded as is (driver converts), VAAPI scaler or CPU conversion to NV12 (HVE_CONVERT_CPU)
+ * with SIMD kernels (RGB32 to NV12 for rgb0, bgr0, rgba, bgra, plane interleave for yuv420p,
+ * see hve_simd_level). Software encoders take pixel_format as is. There is no other color conversion.
  *
  * For pixel format explanation see:
  * <a href="https://ffmpeg.org/doxygen/3.4/pixfmt_8h.html#a9a8e335cf3be472042bc9f0cf80cd4c5">FFmpeg pixel formats</a>
@@ -180,7 +232,92 @@ struct hve;
  * The nvenc_zerolatency is NVENC specific for no reordering delay.
  * Set to non-zero if you need low latency.
  *
- * @see hve_init
+ * The migrate_encoder enables live migration to alternative encoder under load.
+ * The latency from hve_send_frame to encoder output of the packet is monitored.
+ * When it exceeds migrate_latency_ms (default 100 ms) the library drains the encoder
+ * and continues with migrate_encoder on migrate_device at keyframe period boundary.
+ * The new encoder starts with IDR so the output remains one continuous stream.
+ * Migration works both ways, later the library may return to the original encoder.
+ *
+ * Alternative encoder has to accept the same pixel_format, e.g.:
+ * - "h264_vaapi" with "libx264" for "nv12" (hardware saturated -> CPU)
+ * - "h264_vaapi" with "h264_vaapi" on other device (e.g. "/dev/dri/renderD129")
+ *
+ * The library takes packets from encoder right after sending the frame, so measured
+ * latency doesn't depend on when hve_receive_packet is called. Encoder delay (B-frames,
+ * lookahead) seen at the first packet after opening is not counted as latency.
+ *
+ * The scheduler arbitrates hve_send_frame calls of sessions sharing it.
+ * Without scheduler whichever thread calls hve_send_frame first wins.
+ * With scheduler sessions get their share of device proportional to scheduler_weight
+ * (weighted fair queueing, cost proportional to frame pixel count).
+ * Sessions with non-zero scheduler_deadline_ms are served first, earliest deadline first.
+ * Use it for latency critical streams (e.g. teleoperation) sharing device with bulk streams.
+ *
+ * The admission rejects new session in hve_init if its cost would exceed host capacity.
+ * The cost model is kept per (encoder, resolution, framerate, preset) and calibrated on the host.
+ * Set admission_wait_ms to queue for capacity (released by hve_close of other sessions) before rejecting.
+ *
+ * The device_set overrides device (and encoder if specified for device set entry).
+ * The session is placed on the device with least active sessions (lower latency breaks ties).
+ * At keyframe period boundaries sessions are rebalanced if it improves the balance.
+ *
+ * The pool (opt-in) recycles sessions with identical (normalised) configuration.
+ * With pool hve_close returns immediately, the session is drained, reset and parked on pool thread.
+ * Later hve_init with matching configuration resumes parked session instead of full initialization.
+ *
+ * The threads sets encoder thread count (software encoders), 0 for automatic (depends on CPU count).
+ *
+ * The deterministic makes output bit-exact for identical input, e.g. for regression tests
+ * and performance comparisons across library versions. It pins encoder thread count
+ * (to threads or 1), uses single slice, sets FFmpeg bitexact flag (no version strings in stream)
+ * and x264 deterministic mode. Output is repeatable for the same threads, not across thread counts.
+ * Options that react to timing (migrate_encoder, device_set, quality_target) are rejected.
+ * Filler packets are pre-encoded deterministically, but where they appear in the stream depends
+ * on when hve_send_filler is called (make it part of reproduced input). Scheduler only orders submissions.
+ *
+ * The intra_parallel (for intra only gop_size -1 without B-frames, e.g. MJPEG or all-I H.264)
+ * spreads frames round-robin over that many internal encoders with their own threads.
+ * Packets are returned in input order. Throughput scales with cores or hardware engines
+ * at the cost of reordering latency of up to intra_parallel frames. Frame data is copied
+ * (so that you may reuse it after hve_send_frame) and hve_suspend is not supported.
+ *
+ * The tile_columns and tile_rows split large frames (e.g. 8K, panoramic) into grid of equal tiles
+ * (up to 16), each encoded by its own internal encoder in parallel. Use it when frame exceeds
+ * throughput or maximum resolution of single encoder. Tiles are pointer offsets into your frame
+ * (no copy), frame has to divide evenly (with respect to chroma subsampling), scaling is not supported.
+ * Retrieve tile packet bundles with hve_receive_packets. Tiles share timestamps and
+ * IDRs are aligned (same gop_size, hve_request_keyframe goes to all tiles, scene-cut keyframes
+ * are disabled as with no_scenecut). Bundle with keyframes not aligned is reported as error
+ * (e.g. encoder without scene-cut control). hve_suspend is not supported.
+ *
+ * The no_scenecut disables keyframes inserted by encoder on scene change (libx264, NVENC,
+ * VAAPI doesn't insert them) so that keyframes come only from gop_size and hve_request_keyframe.
+ *
+ * The convert selects how pixel_format not accepted natively by hardware (e.g. rgb0 with VAAPI)
+ * reaches the encoder (see hve_convert_enum). With HVE_CONVERT_AUTO feasible paths are
+ * probed when encoder is opened and the first working in order of expected cost is used
+ * (VAAPI scaler, CPU SIMD conversion, direct upload). Set convert_benchmark to time
+ * all feasible paths on dummy frames and pick the fastest instead. The path in use is in hve_stats.
+ * Negotiated path is remembered process-wide per hardware device type and pixel_format,
+ * later sessions use it without probing (and negotiate again only if it fails for them).
+ *
+ * The quality_target enables closed-loop quality mode. Every quality_interval frame luma is sampled,
+ * the encoded stream is decoded back on background thread and SSIM of sampled frames
+ * is compared with the target. QP (qp set) or bitrate (bit_rate set) is adjusted to keep SSIM
+ * just above the target with minimum bits (see hve_reconfigure). Requires 8 bit pixel format
+ * with luma plane (e.g. nv12, yuv420p) and no scaling. Not supported with internal encoders
+ * (intra_parallel, tiles) and sessions are not parked in pool. Convergence time and
+ * bits saved are reported in hve_stats.
+ *
+ * The filler pre-encodes in hve_init a slate (filler_frame or grey if NULL) at constant quantizer
+ * (qp or 23) as IDR and one P-frame of unchanged content (skip-only, maximum quantizer with libx264).
+ * During source loss call hve_send_filler at framerate instead of hve_send_frame. The two cached packets
+ * are returned with continued timestamps at zero encoding cost, the P-frame repeated and the IDR
+ * every keyframe period (gop_size or 1 second), the encoder is suspended meanwhile.
+ * The next hve_send_frame resumes encoding starting with IDR. The filler_frame is used only during hve_init.
+ *
+ * @see hve_init, hve_get_stats, hve_scheduler_init, hve_admission_init, hve_device_set_init
  */
 struct hve_config
 {
@@ -202,6 +339,28 @@ struct hve_config
 	const char *nvenc_preset; //!< NVENC and codec specific, NULL / "" or like "default", "slow", "medium", "fast", "hp", "hq", "bd", "ll", "llhq", "llhp", "lossless", "losslesshp"
 	int nvenc_delay; //NVENC specific delay of frame output, 0 for default, -1 for 0 or positive value, set -1 to minimize latency
 	int nvenc_zerolatency; //NVENC specific no reordering delay if non-zero, enable to minimize latency
+	const char *migrate_encoder; //!< NULL / "" to disable or alternative encoder used under load, e.g. "libx264"
+	const char *migrate_device; //!< NULL / "" or device for migrate_encoder, e.g. "/dev/dri/renderD129"
+	int migrate_latency_ms; //!< encoder latency triggering migration, 0 for default (100 ms)
+	struct hve_scheduler *scheduler; //!< NULL or scheduler shared with other sessions
+	int scheduler_weight; //!< relative share of the scheduler, 0 for default (1)
+	int scheduler_deadline_ms; //!< 0 or submission deadline, sessions with deadline are served first (EDF)
+	struct hve_admission *admission; //!< NULL or admission control shared with other sessions
+	int admission_wait_ms; //!< 0 to reject immediately or time to wait for capacity
+	struct hve_device_set *device_set; //!< NULL or devices to balance between (overrides device)
+	struct hve_pool *pool; //!< NULL or pool recycling closed sessions
+	int threads; //!< encoder threads, 0 for automatic
+	int deterministic; //!< bit-exact output for identical input if non-zero
+	int intra_parallel; //!< 0 / 1 to disable or number of internal encoders (up to 16) for intra only encoding
+	int tile_columns; //!< 0 / 1 to disable or number of tile columns
+	int tile_rows; //!< 0 / 1 to disable or number of tile rows
+	int convert; //!< HVE_CONVERT_AUTO (0) to negotiate or forced conversion path (hve_convert_enum)
+	int convert_benchmark; //!< benchmark feasible conversion paths and pick the fastest if non-zero
+	int quality_target; //!< 0 to disable or target SSIM in thousandths, e.g. 980 for 0.98
+	int quality_interval; //!< frames between quality samples, 0 for default (15)
+	int filler; //!< non-zero to pre-encode filler packets for hve_send_filler
+	const struct hve_frame *filler_frame; //!< NULL for grey slate or slate image in pixel_format (read in hve_init only)
+	int no_scenecut; //!< non-zero to disable scene-cut keyframes (always for tiles and multi-stream)
 };
 
 /**
@@ -223,6 +382,48 @@ struct hve_frame
 	int linesize[AV_NUM_DATA_POINTERS]; //!< array of strides (width + padding) for planar frame formats
 };
 
+/**
+ * @struct hve_stats
+ * @brief Encoding statistics.
+ *
+ * Latency is measured from hve_send_frame to encoder output of the packet (without encoder
+ * delay, see migrate_encoder in hve_config). For internal encoders (intra_parallel, tiles,
+ * multi-stream) it is measured to retrieving packet with hve_receive_packet.
+ *
+ * Allocation counters break down allocations made by HVE itself by pipeline stage
+ * (upload, filter, encode, packet queue). FFmpeg internal allocations (e.g. encoder packet
+ * buffers) can't be hooked from the library and are not counted, see tests/hve_alloc_test.c
+ * for counting all allocations with interposed allocator.
+ * The upload, filter and encode counters grow only when encoder is (re)opened. The queue
+ * counter grows when packet queue has to grow (e.g. encoder drained for migration or suspend)
+ * and per packet for references made for quality decoder, filler and coalescer handle holders.
+ *
+ * @see hve_get_stats
+ */
+struct hve_stats
+{
+	uint64_t frames; //!< number of frames sent for encoding
+	uint64_t packets; //!< number of packets returned to the user
+	int latency_us; //!< smoothed latency in microseconds
+	int latency_max_us; //!< maximum latency in microseconds
+	int migrations; //!< number of migrations between encoders
+	const char *encoder; //!< encoder currently in use, valid until hve_close
+	int sched_wait_us; //!< smoothed scheduler queueing delay in microseconds
+	int sched_wait_max_us; //!< maximum scheduler queueing delay in microseconds
+	size_t memory_bytes; //!< memory drawn from memory budget (frame pool and packet queue)
+	uint64_t allocs_upload; //!< allocations for hardware upload and CPU conversion
+	uint64_t allocs_filter; //!< allocations for hardware scaling filter graph
+	uint64_t allocs_encode; //!< allocations for encoders and their input frames
+	uint64_t allocs_queue; //!< allocations for packet queues and packet references
+	int convert; //!< conversion path in use (hve_convert_enum)
+	double quality_ssim; //!< smoothed SSIM of sampled frames (quality target mode)
+	int quality_qp; //!< QP in use (quality target mode with qp)
+	int quality_bit_rate; //!< bitrate in use (quality target mode with bit_rate)
+	int quality_converged_ms; //!< stream time until SSIM first reached target, 0 if not yet
+	int64_t quality_bits_saved; //!< bits saved versus fixed configured bit_rate (estimated for qp)
+	uint64_t filler_packets; //!< cached filler packets returned during source loss
+};
+
 /**
   * @brief Constants returned by most of library functions
   */
@@ -232,6 +433,68 @@ enum hve_retval_enum
 	HVE_OK=0, //!< succesfull execution
 };
 
+/**
+  * @brief Behaviour when process-wide memory budget is reached
+  * @see hve_memory_budget
+  */
+enum hve_budget_policy_enum
+{
+	HVE_BUDGET_SHRINK=0, //!< shrink hardware frame pools of new sessions to fit, reject if minimum doesn't fit
+	HVE_BUDGET_DEGRADE=1, //!< like HVE_BUDGET_SHRINK but disable B-frames of new sessions if it helps to fit
+	HVE_BUDGET_REJECT=2, //!< reject new sessions and frames with error while budget is exceeded
+};
+
+/**
+  * @brief Paths of pixel format conversion before hardware encoder
+  * @see hve_config
+  */
+enum hve_convert_enum
+{
+	HVE_CONVERT_AUTO=0, //!< negotiate the cheapest feasible path when encoder is opened
+	HVE_CONVERT_DIRECT=1, //!< upload in pixel_format, driver/encoder converts if needed
+	HVE_CONVERT_SCALER=2, //!< upload in pixel_format, convert with VAAPI scaler (VAAPI only)
+	HVE_CONVERT_CPU=3, //!< convert to NV12 with CPU SIMD kernels and upload (rgb0, bgr0, rgba, bgra, yuv420p)
+};
+
+/**
+  * @brief Readiness events passed to hve_ready_callback (bitmask)
+  * @see hve_set_ready_callback
+  */
+enum hve_ready_enum
+{
+	HVE_READY_PACKET=1, //!< packets may be pending (or encoding failed), call hve_receive_packet
+	HVE_READY_INPUT=2, //!< hve_send_frame will not wait for internal encoder (intra parallel)
+};
+
+/**
+  * @brief Readiness callback, see hve_set_ready_callback
+  */
+typedef void (*hve_ready_callback)(void *opaque, int events);
+
+/**
+ * @struct hve_pyramid_config
+ * @brief Pyramid downscaler configuration.
+ *
+ * Level 0 is 1/2 of the source, level 1 is 1/4 and so on.
+ * Width and height have to be divisible by 2^(levels+1) so that every level
+ * keeps even (4:2:0 encodable) dimensions, e.g. 3840x2160 with 3 levels gives
+ * 1920x1080, 960x540 and 480x270.
+ *
+ * The pixel_format can be:
+ * - NULL or empty string for "nv12"
+ * - "yuv420p"
+ *
+ * @see hve_pyramid_init
+ */
+struct hve_pyramid_config
+{
+	int width; //!< width of source frames
+	int height; //!< height of source frames
+	const char *pixel_format; //!< source and output pixel format, NULL / "" for "nv12" or "yuv420p"
+	int levels; //!< number of downscaled levels, 1 to 4
+	int threads; //!< threads sharing the work (calling thread included), 0 / 1 for calling thread only
+};
+
 /**
  * @brief initialize internal library data.
  * @param config encoder configuration
@@ -248,8 +511,12 @@ struct hve *hve_init(const struct hve_config *config);
  *
  * Cleans and frees memory
  *
+ * If the session was initialized with pool it is parked for reuse instead.
+ * The teardown happens on pool thread so this returns immediately.
+ *
  * @param h pointer to internal library data
  *
+ * @see hve_pool_init
  */
 void hve_close(struct hve* h);
 
@@ -297,6 +564,23 @@ void hve_close(struct hve* h);
  */
 int hve_send_frame(struct hve *h,struct hve_frame *frame);
 
+/**
+ * @brief Send batch of frames to hardware.
+ *
+ * Like calling hve_send_frame for each frame but with single synchronization point
+ * (e.g. scheduler) for the whole batch. Use it for file transcoding or burst replays.
+ * Packets are collected internally while encoding the batch, follow with
+ * hve_receive_packet to get them. Don't pass NULL frames, flush with hve_send_frame.
+ *
+ * @param h pointer to internal library data
+ * @param frames array of frames
+ * @param n number of frames
+ * @return number of frames accepted, less than n indicates error (printed to stderr)
+ *
+ * @see hve_send_frame, hve_receive_packet
+ */
+int hve_send_frames(struct hve *h, struct hve_frame *frames, int n);
+
 
 /**
  * @brief Retrieve encoded frame data from hardware.
@@ -335,6 +619,704 @@ int hve_send_frame(struct hve *h,struct hve_frame *frame);
  */
 AVPacket *hve_receive_packet(struct hve *h, int *error);
 
+/**
+ * @brief Retrieve bundle of encoded packets sharing timestamp.
+ *
+ * With tiles you get packet for each tile, in row-major order (tile_columns * tile_rows).
+ * With multi-stream session you get packet for each stream, in hve_multi_init configs order.
+ * Otherwise this works like hve_receive_packet returning at most one packet.
+ * Keep calling this function after hve_send_frame until 0 is returned.
+ * The ownership of returned AVPackets remains with the library (like with hve_receive_packet).
+ *
+ * @param h pointer to internal library data
+ * @param packets array for packets with room for one packet per tile (or stream)
+ * @param error pointer to error code
+ * @return
+ * - number of packets in bundle
+ * - 0 when no more data is pending, query error parameter to check result (HVE_OK on success)
+ *
+ * @see hve_send_frame, hve_receive_packet, hve_config
+ *
+ * Example (in encoding loop):
+ * @code
+ *	while( (count=hve_receive_packets(hardware_encoder, packets, &failed)) )
+ *		for(int i=0;i<count;++i)
+ *			; //do something with packets[i]->data, packets[i]->size
+ * @endcode
+ *
+ */
+int hve_receive_packets(struct hve *h, AVPacket **packets, int *error);
+
+/**
+ * @brief Initialize synchronised multi-stream session (e.g. colour + depth + IR from one sensor).
+ *
+ * Each stream has its own configuration (encoder, pixel format, resolution, ...)
+ * and its own internal encoder with thread. Frames sharing timestamp are encoded in parallel
+ * with hve_multi_send_frame and packets are retrieved grouped per capture timestamp
+ * with hve_receive_packets. Keyframes are aligned (hve_request_keyframe goes to all streams,
+ * scene-cut keyframes are disabled as with no_scenecut), bundle with keyframes not aligned
+ * is reported as error.
+ * There is one set of stats for the whole session (hve_get_stats).
+ *
+ * All streams need the same framerate and gop_size. B-frames (max_b_frames) are not supported,
+ * reordered streams can't be grouped per timestamp in decode order. Encoder delay (e.g. nvenc_delay)
+ * is fine, bundles wait for the slowest stream.
+ * Admission control and device set apply to each stream, session pool is not used.
+ * hve_send_frame and hve_suspend are not supported. Close with hve_close.
+ *
+ * @param configs array of stream configurations
+ * @param count number of streams (up to 16)
+ * @return
+ * - pointer to internal library data
+ * - NULL on error, errors printed to stderr
+ *
+ * @see hve_multi_send_frame, hve_receive_packets, hve_close
+ */
+struct hve *hve_multi_init(const struct hve_config *configs, int count);
+
+/**
+ * @brief Send set of frames sharing timestamp to multi-stream session.
+ *
+ * Frames are encoded in parallel, function returns when all of them are consumed
+ * (no copy is made, you may reuse frame data afterwards).
+ * Follow with hve_receive_packets to get packets grouped per timestamp.
+ *
+ * Flush session by sending NULL frames array.
+ *
+ * @param h pointer to internal library data
+ * @param frames array of frames, one per stream in hve_multi_init configs order, or NULL to flush
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * Example:
+ * @code
+ *	struct hve_frame *frames[2] = {&color, &depth};
+ *
+ *	if( hve_multi_send_frame(session, frames) != HVE_OK)
+ *		break; //break on error
+ *
+ *	while( (count=hve_receive_packets(session, packets, &failed)) )
+ *		; //packets[0] is color, packets[1] is depth, same timestamp
+ * @endcode
+ *
+ * @see hve_multi_init, hve_receive_packets
+ */
+int hve_multi_send_frame(struct hve *h, struct hve_frame **frames);
+
+/**
+ * @brief Initialize 16-bit depth encoding on 8-bit only encoders.
+ *
+ * Use it when encoder doesn't support (or is slow with) P010/Main10 depth path.
+ * Depth is split into two 8-bit planes with triangle-wave coding:
+ * - hi = depth >> 8
+ * - lo = depth & 0xFF, reflected (255 - lo) for odd hi so that lo is continuous across hi steps
+ *
+ * Planes are encoded as luminance of NV12 on two synchronised streams (multi-stream session).
+ * Errors in hi plane are amplified 256 times, use high quality settings (e.g. low qp).
+ *
+ * The config pixel_format is ignored (NV12 is used), scaling is not supported.
+ * Retrieve packets with hve_receive_packets (packets[0] hi, packets[1] lo).
+ * Close with hve_close. Decode both streams and recombine with hve_depth_merge.
+ *
+ * @param config configuration used for both streams, width and height of depth
+ * @return
+ * - pointer to internal library data
+ * - NULL on error, errors printed to stderr
+ *
+ * @see hve_depth_send_frame, hve_depth_merge, hve_multi_init
+ */
+struct hve *hve_depth_init(const struct hve_config *config);
+
+/**
+ * @brief Split 16-bit depth frame and send it to depth session.
+ *
+ * Flush session by sending NULL frame.
+ *
+ * @param h pointer to internal library data
+ * @param frame data[0] with 16-bit little endian depth and linesize[0] in bytes or NULL to flush
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_depth_init
+ */
+int hve_depth_send_frame(struct hve *h, struct hve_frame *frame);
+
+/**
+ * @brief Split 16-bit depth into hi and lo 8-bit planes.
+ *
+ * The same split hve_depth_send_frame does, exposed e.g. for validation and benchmarking.
+ *
+ * @param depth 16-bit depth
+ * @param depth_linesize depth stride in bytes
+ * @param hi output hi plane
+ * @param hi_linesize hi plane stride in bytes
+ * @param lo output lo plane
+ * @param lo_linesize lo plane stride in bytes
+ * @param width width in pixels
+ * @param height height in pixels
+ *
+ * @see hve_depth_init, hve_depth_merge
+ */
+void hve_depth_split(const uint16_t *depth, int depth_linesize, uint8_t *hi, int hi_linesize,
+                     uint8_t *lo, int lo_linesize, int width, int height);
+
+/**
+ * @brief Recombine decoded hi and lo 8-bit planes into 16-bit depth.
+ *
+ * Decoder side helper (e.g. for validation) inverse to hve_depth_send_frame split.
+ *
+ * @param hi decoded hi plane (luminance of hi stream)
+ * @param hi_linesize hi plane stride in bytes
+ * @param lo decoded lo plane (luminance of lo stream)
+ * @param lo_linesize lo plane stride in bytes
+ * @param depth output 16-bit depth
+ * @param depth_linesize depth stride in bytes
+ * @param width width in pixels
+ * @param height height in pixels
+ *
+ * @see hve_depth_init
+ */
+void hve_depth_merge(const uint8_t *hi, int hi_linesize, const uint8_t *lo, int lo_linesize,
+                     uint16_t *depth, int depth_linesize, int width, int height);
+
+/**
+ * @brief SIMD level used by software pixel kernels.
+ *
+ * Kernels (e.g. depth split/merge) are bound once to the best variant CPU supports.
+ * Set HVE_SIMD environment variable (e.g. "scalar", "sse2", "avx2", "avx512", "neon")
+ * to cap the level.
+ *
+ * @return level name, e.g. "avx2"
+ *
+ * @see hve_simd_force
+ */
+const char *hve_simd_level(void);
+
+/**
+ * @brief Rebind software pixel kernels to SIMD level.
+ *
+ * Mainly for benchmarking and comparing variants. Not thread safe,
+ * call it while no sessions are encoding.
+ *
+ * @param level level name (e.g. "scalar", "sse2", "avx2", "avx512", "neon") or NULL / "" for automatic
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR if level is unknown or not supported by CPU
+ *
+ * @see hve_simd_level
+ */
+int hve_simd_force(const char *level);
+
+/**
+ * @brief Request the next frame to be encoded as IDR.
+ *
+ * Use it e.g. when new receiver joins the stream or after packet loss.
+ *
+ * @param h pointer to internal library data
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ */
+int hve_request_keyframe(struct hve *h);
+
+/**
+ * @brief Keep the stream alive during source loss.
+ *
+ * Call instead of hve_send_frame at framerate while there is no source (e.g. camera disconnected).
+ * Queues the next cached filler packet (slate IDR or repeated skip P-frame) with continued timestamp,
+ * retrieve it with hve_receive_packet as usual. The first call drains and suspends the encoder
+ * (packets of frames already sent come first). The next hve_send_frame resumes encoding with IDR.
+ *
+ * Requires filler in hve_config. Not supported with internal encoders (intra_parallel, tiles).
+ *
+ * @param h pointer to internal library data
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_config, hve_send_frame
+ */
+int hve_send_filler(struct hve *h);
+
+/**
+ * @brief Get notified when session is ready instead of polling.
+ *
+ * For event driven users (e.g. coroutines multiplexed on executor) instead of thread per session.
+ *
+ * HVE_READY_PACKET is signalled after frame (or flush) is accepted and by internal encoders
+ * (intra parallel) when they produce packets, finish flushing or fail.
+ * HVE_READY_INPUT is signalled by internal encoders (intra parallel) when they become free.
+ * Events may be spurious, e.g. encoder with latency may have no packet yet after the frame.
+ *
+ * The callback may be called from internal threads and from within hve_send_frame.
+ * Don't call library functions for the session from the callback, just wake up or schedule your work.
+ *
+ * Set it before sending the first frame.
+ *
+ * @param h pointer to internal library data
+ * @param callback function called with events or NULL to disable
+ * @param opaque your data passed to callback
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_send_ready, hve_receive_packet
+ */
+int hve_set_ready_callback(struct hve *h, hve_ready_callback callback, void *opaque);
+
+/**
+ * @brief Check if hve_send_frame would wait for internal encoder.
+ *
+ * Only intra parallel session may wait for busy internal encoder.
+ * Waiting for shared scheduler (hve_config scheduler) is not reported.
+ *
+ * @param h pointer to internal library data
+ * @return
+ * - 1 if frame will be accepted without waiting
+ * - 0 if it would wait, HVE_READY_INPUT is signalled when it wouldn't
+ *
+ * @see hve_set_ready_callback
+ */
+int hve_send_ready(struct hve *h);
+
+/**
+ * @brief Change rate control of running encoder.
+ *
+ * Software x264 is reconfigured live. Other encoders are drained and reopened
+ * with new rate control at the next keyframe period boundary (the stream continues with IDR).
+ *
+ * Quality target mode calls it internally.
+ *
+ * @param h pointer to internal library data
+ * @param bit_rate new bitrate or 0 to keep
+ * @param qp new quantization parameter or 0 to keep
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_config
+ */
+int hve_reconfigure(struct hve *h, int bit_rate, int qp);
+
+/**
+ * @brief Suspend idle encoder keeping cheap state.
+ *
+ * Releases frame pools, scaling filter graph and encoder (with software encoder threads).
+ * Keeps configuration and hardware device so that hve_resume is much faster than hve_init.
+ *
+ * Frames already sent are encoded, keep calling hve_receive_packet
+ * after suspending to get them (hve_receive_packet returns NULL afterwards).
+ *
+ * Don't call hve_send_frame on suspended encoder.
+ *
+ * @param h pointer to internal library data
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_resume
+ */
+int hve_suspend(struct hve *h);
+
+/**
+ * @brief Resume encoder suspended with hve_suspend.
+ *
+ * The first frame sent after resuming is encoded as IDR.
+ *
+ * @param h pointer to internal library data
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error (you may try again later or hve_close)
+ *
+ * @see hve_suspend
+ */
+int hve_resume(struct hve *h);
+
+/**
+ * @brief Retrieve encoding statistics.
+ *
+ * @param h pointer to internal library data
+ * @param stats pointer to statistics to fill
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_stats
+ */
+int hve_get_stats(struct hve *h, struct hve_stats *stats);
+
+/**
+ * @brief Set process-wide memory budget.
+ *
+ * Hardware frame pools (20 surfaces by default) and internal packet queues
+ * of all sessions draw from the budget. Set it before initializing sessions.
+ *
+ * Per-session usage is reported in hve_stats memory_bytes.
+ *
+ * @param bytes budget in bytes, 0 for no budget (default)
+ * @param policy what to do when budget is reached, one of hve_budget_policy_enum
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_memory_used, hve_budget_policy_enum
+ */
+int hve_memory_budget(size_t bytes, int policy);
+
+/**
+ * @brief Memory currently drawn from memory budget by all sessions.
+ *
+ * @return memory in bytes
+ */
+size_t hve_memory_used(void);
+
+/**
+ * @brief Initialize scheduler shared by multiple sessions.
+ *
+ * Pass the scheduler in hve_config of each session sharing the device.
+ * The scheduler has to outlive all the sessions using it.
+ *
+ * @param slots number of concurrent submissions, e.g. 1 for single hardware engine
+ * @return
+ * - pointer to scheduler
+ * - NULL on error, errors printed to stderr
+ *
+ * @see hve_config, hve_scheduler_close
+ */
+struct hve_scheduler *hve_scheduler_init(int slots);
+
+/**
+ * @brief Free scheduler resources.
+ *
+ * Close all the sessions using the scheduler first.
+ *
+ * @param s pointer to scheduler
+ */
+void hve_scheduler_close(struct hve_scheduler *s);
+
+/**
+ * @brief Initialize per-host admission control.
+ *
+ * Pass the admission in hve_config of each session on the host.
+ * The admission has to outlive all the sessions using it.
+ *
+ * Costs are fractions of host capacity, 1.0 encoding takes as long as real time.
+ * For example capacity 2.0 may be reasonable for host with two hardware engines.
+ *
+ * @param capacity host capacity in cost units, 0 for default (1.0)
+ * @return
+ * - pointer to admission control
+ * - NULL on error, errors printed to stderr
+ *
+ * @see hve_admission_calibrate, hve_admission_close
+ */
+struct hve_admission *hve_admission_init(double capacity);
+
+/**
+ * @brief Free admission control resources.
+ *
+ * Close all the sessions using the admission control first.
+ *
+ * @param a pointer to admission control
+ */
+void hve_admission_close(struct hve_admission *a);
+
+/**
+ * @brief Calibrate cost model entry by benchmark on this host.
+ *
+ * Encodes frames dummy frames as fast as possible with config.
+ * Run it on otherwise idle host, e.g. once at service startup.
+ *
+ * Only the encoder itself is measured, pool, device_set, migrate_encoder,
+ * quality_target and filler of config are ignored. Configurations with
+ * intra_parallel or tiles are not supported.
+ *
+ * Costs of configurations not calibrated are estimated by pixel rate
+ * from the nearest calibrated configuration of the same encoder.
+ *
+ * @param a pointer to admission control
+ * @param config configuration to calibrate
+ * @param frames number of frames to encode, e.g. 100
+ * @param cost NULL or pointer to store calibrated cost
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_admission_set_cost
+ */
+int hve_admission_calibrate(struct hve_admission *a, const struct hve_config *config, int frames, double *cost);
+
+/**
+ * @brief Set cost model entry directly (e.g. calibrated earlier).
+ *
+ * @param a pointer to admission control
+ * @param config configuration
+ * @param cost fraction of host capacity used by session with config
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ */
+int hve_admission_set_cost(struct hve_admission *a, const struct hve_config *config, double cost);
+
+/**
+ * @brief Current host headroom.
+ *
+ * @param a pointer to admission control
+ * @return capacity not reserved by currently open sessions
+ */
+double hve_admission_headroom(struct hve_admission *a);
+
+/**
+ * @brief Initialize empty device set.
+ *
+ * Add devices with hve_device_set_add and pass the device set in hve_config.
+ * The device set has to outlive all the sessions using it.
+ *
+ * @return
+ * - pointer to device set
+ * - NULL on error, errors printed to stderr
+ *
+ * @see hve_device_set_add, hve_device_set_close
+ */
+struct hve_device_set *hve_device_set_init(void);
+
+/**
+ * @brief Free device set resources.
+ *
+ * Close all the sessions using the device set first.
+ *
+ * @param ds pointer to device set
+ */
+void hve_device_set_close(struct hve_device_set *ds);
+
+/**
+ * @brief Add device to device set.
+ *
+ * Add devices before initializing sessions.
+ *
+ * Simulate devices with software encoders, e.g.
+ * @code
+ * hve_device_set_add(ds, NULL, "libx264");
+ * hve_device_set_add(ds, NULL, "libx264");
+ * @endcode
+ *
+ * @param ds pointer to device set
+ * @param device NULL / "" for default or device e.g. "/dev/dri/renderD129"
+ * @param encoder NULL / "" for session encoder or encoder used on this device
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ */
+int hve_device_set_add(struct hve_device_set *ds, const char *device, const char *encoder);
+
+/**
+ * @brief Number of active sessions on device.
+ *
+ * @param ds pointer to device set
+ * @param index index of device in order of hve_device_set_add calls
+ * @return number of sessions or -1 for invalid index
+ */
+int hve_device_set_sessions(struct hve_device_set *ds, int index);
+
+/**
+ * @brief Initialize session pool.
+ *
+ * Pass the pool in hve_config of sessions that should be recycled.
+ * The pool has to outlive all the sessions using it.
+ *
+ * @param max_parked maximum number of parked sessions, 0 for default (4)
+ * @return
+ * - pointer to pool
+ * - NULL on error, errors printed to stderr
+ *
+ * @see hve_pool_close
+ */
+struct hve_pool *hve_pool_init(int max_parked);
+
+/**
+ * @brief Close parked sessions and free pool resources.
+ *
+ * Close (hve_close) all the sessions using the pool first.
+ *
+ * @param pool pointer to pool
+ */
+void hve_pool_close(struct hve_pool *pool);
+
+/**
+ * @brief Number of parked sessions ready for reuse.
+ *
+ * Sessions are parked on pool thread some time after hve_close.
+ *
+ * @param pool pointer to pool
+ * @return number of parked sessions
+ */
+int hve_pool_parked(struct hve_pool *pool);
+
+/**
+ * @brief Initialize session coalescer.
+ *
+ * Use it when several subscribers may request the same source with identical encoding parameters.
+ * Instead of encoding the same frames several times one session is shared and its packets
+ * are fanned out (references, not copies) to every handle holder.
+ *
+ * @return
+ * - pointer to coalescer
+ * - NULL on error, errors printed to stderr
+ *
+ * @see hve_coalescer_open, hve_coalescer_send_frame, hve_coalescer_close
+ */
+struct hve_coalescer *hve_coalescer_init(void);
+
+/**
+ * @brief Free coalescer resources.
+ *
+ * Close (hve_handle_close) all the handles first.
+ * Handles left open are reported to stderr and released together with their sessions.
+ *
+ * @param c pointer to coalescer
+ */
+void hve_coalescer_close(struct hve_coalescer *c);
+
+/**
+ * @brief Get handle to session encoding source with config.
+ *
+ * If there is already session for the same source id and config (normalized, defaults equal
+ * explicit values) it is shared and keyframe is requested for the new holder.
+ * The new holder gets packets starting from the next keyframe.
+ * Otherwise new session is initialized (hve_init).
+ *
+ * @param c pointer to coalescer
+ * @param source your id of the source (e.g. camera name)
+ * @param config encoder configuration
+ * @return
+ * - handle
+ * - NULL on error, errors printed to stderr
+ *
+ * @see hve_handle_close, hve_handle_receive_packet
+ */
+struct hve_handle *hve_coalescer_open(struct hve_coalescer *c, const char *source, const struct hve_config *config);
+
+/**
+ * @brief Release handle, the last holder closes the session.
+ *
+ * @param handle handle from hve_coalescer_open
+ */
+void hve_handle_close(struct hve_handle *handle);
+
+/**
+ * @brief Request flush of shared session.
+ *
+ * The session is flushed only when the last of its holders asks (or the others closed handles).
+ * Until then other holders keep getting packets of new frames.
+ * After flush retrieve remaining packets with hve_handle_receive_packet.
+ * New handles for the same source and config get new session.
+ *
+ * @param handle handle from hve_coalescer_open
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_handle_receive_packet
+ */
+int hve_handle_flush(struct hve_handle *handle);
+
+/**
+ * @brief Encode source frame once for each distinct config of the source.
+ *
+ * Packets are fanned out to handle holders, retrieve them with hve_handle_receive_packet.
+ * Flushed sessions are skipped.
+ *
+ * @param c pointer to coalescer
+ * @param source id of the source used with hve_coalescer_open
+ * @param frame frame like in hve_send_frame, NULL is not allowed (flush with hve_handle_flush)
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_send_frame
+ */
+int hve_coalescer_send_frame(struct hve_coalescer *c, const char *source, struct hve_frame *frame);
+
+/**
+ * @brief Retrieve encoded packet for handle holder.
+ *
+ * Keep calling until NULL is returned. Never blocks.
+ * The ownership of returned AVPacket remains with the library (like with hve_receive_packet).
+ *
+ * @param handle handle from hve_coalescer_open
+ * @param error pointer to error code
+ * @return
+ * - AVPacket * pointer to FFMpeg AVPacket
+ * - NULL when no more data is pending, query error parameter to check result (HVE_OK on success)
+ *
+ * @see hve_coalescer_send_frame
+ */
+AVPacket *hve_handle_receive_packet(struct hve_handle *handle, int *error);
+
+/**
+ * @brief Retrieve statistics of shared session.
+ *
+ * @param handle handle from hve_coalescer_open
+ * @param stats pointer to stats to fill
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_get_stats
+ */
+int hve_handle_get_stats(struct hve_handle *handle, struct hve_stats *stats);
+
+/**
+ * @brief Initialize pyramid downscaler.
+ *
+ * Software simulcast - feed several encoders (e.g. hardware encoder per resolution)
+ * from one source frame. All the levels are produced in a single pass over the source.
+ * Source is processed in bands of rows and every band is carried through all the levels
+ * while it is still in cache. Bands are distributed over threads.
+ *
+ * Downscaling is 2x2 box filter done with SIMD kernels (see hve_simd_level).
+ *
+ * @param config pyramid configuration
+ * @return
+ * - pointer to pyramid
+ * - NULL on error, errors printed to stderr
+ *
+ * @see hve_pyramid_scale, hve_pyramid_close
+ */
+struct hve_pyramid *hve_pyramid_init(const struct hve_pyramid_config *config);
+
+/**
+ * @brief Stop pyramid threads and free resources.
+ *
+ * Frames returned by hve_pyramid_scale stay valid until unreferenced.
+ *
+ * @param p pointer to pyramid
+ */
+void hve_pyramid_close(struct hve_pyramid *p);
+
+/**
+ * @brief Downscale source frame to all the pyramid levels.
+ *
+ * Pass array of config.levels frames allocated once with av_frame_alloc.
+ * Each frame is unreferenced and filled with new reference to pooled buffer.
+ * Unreference (av_frame_unref) frames when done and buffers return to pool.
+ * Otherwise they are reused when frames are passed to the next call.
+ *
+ * To encode level copy data and linesize of AVFrame to hve_frame.
+ *
+ * @param p pointer to pyramid
+ * @param frame source frame, like in hve_send_frame
+ * @param levels array of config.levels frames, levels[0] is 1/2 of the source
+ * @return
+ * - HVE_OK on success
+ * - HVE_ERROR indicates error
+ *
+ * @see hve_pyramid_init, hve_send_frame
+ */
+int hve_pyramid_scale(struct hve_pyramid *p, const struct hve_frame *frame, AVFrame **levels);
+
 /** @}*/
 
 #ifdef __cplusplus
@@ -0,0 +1,655 @@
+/*
+ * HVE Hardware Video Encoder C++ wrapper header
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+/**
+ ******************************************************************************
+ *
+ *  \file       hve.hpp
+ *  \brief      Header-only C++20 RAII wrapper of library public interface
+ *
+ ******************************************************************************
+ */
+
+#ifndef HVE_HPP
+#define HVE_HPP
+
+#include "hve.h"
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+
+#include <array> //std::array
+#include <cassert> //assert
+#include <cstdint> //uint8_t
+#include <optional> //std::optional
+#include <span> //std::span
+#include <utility> //std::exchange, std::move
+#include <version> //__cpp_lib_expected
+
+#if defined(__cpp_lib_expected)
+#include <expected> //std::expected
+#endif
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define HVE_HPP_COROUTINES 1
+#include <coroutine> //std::coroutine_handle
+#include <functional> //std::function
+#include <memory> //std::shared_ptr
+#include <mutex> //std::mutex
+#endif
+
+/** \addtogroup interface Public interface
+ *  @{
+ */
+
+// not hve, in C++ struct hve name of C interface would clash with namespace
+namespace hvepp
+{
+
+/**
+ * @brief Error of wrapped call.
+ *
+ * Details are printed by the library to stderr like with C interface.
+ */
+struct Error
+{
+	int code; //!< HVE_ERROR
+	const char *what; //!< failed operation, e.g. "hve_send_frame"
+};
+
+#if defined(__cpp_lib_expected)
+
+/**
+ * @brief Value or Error, std::expected when standard library has it.
+ */
+template<typename T>
+using Expected = std::expected<T, Error>;
+
+inline std::unexpected<Error> fail(const char *what)
+{
+	return std::unexpected<Error>(Error{HVE_ERROR, what});
+}
+
+#else
+
+struct Unexpected
+{
+	Error error;
+};
+
+inline Unexpected fail(const char *what)
+{
+	return Unexpected{Error{HVE_ERROR, what}};
+}
+
+// subset of std::expected interface for standard libraries without it (C++23)
+template<typename T>
+class Expected
+{
+public:
+	Expected(T &&value) : val(std::move(value)) {}
+	Expected(Unexpected unexpected) : err(unexpected.error) {}
+
+	bool has_value() const { return val.has_value(); }
+	explicit operator bool() const { return has_value(); }
+
+	T &value() & { assert(has_value()); return *val; }
+	const T &value() const & { assert(has_value()); return *val; }
+	T &&value() && { assert(has_value()); return std::move(*val); }
+
+	T &operator*() & { return value(); }
+	const T &operator*() const & { return value(); }
+	T &&operator*() && { return std::move(*this).value(); }
+	T *operator->() { return &value(); }
+	const T *operator->() const { return &value(); }
+
+	const Error &error() const { assert(!has_value()); return err; }
+
+private:
+	std::optional<T> val;
+	Error err = {HVE_OK, nullptr};
+};
+
+template<>
+class Expected<void>
+{
+public:
+	Expected() : ok(true) {}
+	Expected(Unexpected unexpected) : ok(false), err(unexpected.error) {}
+
+	bool has_value() const { return ok; }
+	explicit operator bool() const { return ok; }
+	void value() const { assert(ok); }
+
+	const Error &error() const { assert(!ok); return err; }
+
+private:
+	bool ok;
+	Error err = {HVE_OK, nullptr};
+};
+
+#endif
+
+/**
+ * @brief Encoded packet owning reference to library packet data.
+ *
+ * Move-only. Holds av_packet_ref reference so the payload is not copied
+ * and stays valid after the next Encoder::receive, e.g. while handed off
+ * to another thread.
+ */
+class Packet
+{
+public:
+	Packet() = default;
+	Packet(Packet &&other) noexcept : packet(std::exchange(other.packet, nullptr)) {}
+	Packet(const Packet &) = delete;
+	~Packet() { av_packet_free(&packet); }
+
+	Packet &operator=(Packet &&other) noexcept
+	{
+		if(this != &other)
+		{
+			av_packet_free(&packet);
+			packet = std::exchange(other.packet, nullptr);
+		}
+		return *this;
+	}
+
+	Packet &operator=(const Packet &) = delete;
+
+	/**
+	 * @brief Take new reference to packet (e.g. returned by hve_receive_packet).
+	 */
+	static Expected<Packet> ref(const AVPacket *src)
+	{
+		Packet p;
+
+		if( (p.packet = av_packet_alloc()) == nullptr )
+			return fail("av_packet_alloc");
+
+		if(av_packet_ref(p.packet, src) != 0)
+			return fail("av_packet_ref");
+
+		return p;
+	}
+
+	std::span<const uint8_t> data() const { return packet ? std::span<const uint8_t>(packet->data, packet->size) : std::span<const uint8_t>(); }
+	int64_t pts() const { return packet->pts; }
+	int64_t dts() const { return packet->dts; }
+	bool keyframe() const { return packet->flags & AV_PKT_FLAG_KEY; }
+
+	explicit operator bool() const { return packet != nullptr; }
+
+	AVPacket *get() const { return packet; } //!< underlying FFmpeg packet, ownership stays with Packet
+
+private:
+	AVPacket *packet = nullptr;
+};
+
+/**
+ * @brief Frame to encode described by planes, like hve_frame.
+ *
+ * Planes are not copied, they have to stay valid during Encoder::send.
+ * Leave unused planes empty.
+ */
+struct Frame
+{
+	std::array<std::span<const uint8_t>, AV_NUM_DATA_POINTERS> planes; //!< plane data (e.g. Y and UV for NV12)
+	std::array<int, AV_NUM_DATA_POINTERS> linesize = {}; //!< strides (width + padding) in bytes
+};
+
+/**
+ * @brief RAII owner of struct hve session.
+ *
+ * Move-only. Closes the session (hve_close) on destruction.
+ * Like with C interface the session is not thread safe, but packets
+ * returned from receive may be moved to and consumed by any thread.
+ *
+ * Example:
+ * @code
+ *  auto encoder = hvepp::Encoder::create(config);
+ *
+ *  if(!encoder)
+ *  	return; //encoder.error().what
+ *
+ *  if(!encoder->send(frame))
+ *  	return;
+ *
+ *  while(auto packet = encoder->receive())
+ *  {
+ *  	if(!*packet)
+ *  		break; //no more packets pending
+ *
+ *  	//(*packet)->data() or std::move(**packet) to another thread
+ *  }
+ * @endcode
+ */
+class Encoder
+{
+public:
+	Encoder(Encoder &&other) noexcept :
+		h(std::exchange(other.h, nullptr)), pix_fmt(other.pix_fmt), height(other.height) {}
+	Encoder(const Encoder &) = delete;
+	~Encoder() { hve_close(h); }
+
+	Encoder &operator=(Encoder &&other) noexcept
+	{
+		if(this != &other)
+		{
+			hve_close(h);
+			h = std::exchange(other.h, nullptr);
+			pix_fmt = other.pix_fmt;
+			height = other.height;
+		}
+		return *this;
+	}
+
+	Encoder &operator=(const Encoder &) = delete;
+
+	/**
+	 * @brief Initialize session (hve_init).
+	 */
+	static Expected<Encoder> create(const hve_config &config)
+	{
+		struct hve *h = hve_init(&config);
+
+		if(h == nullptr)
+			return fail("hve_init");
+
+		enum AVPixelFormat pix_fmt = AV_PIX_FMT_NV12;
+
+		if(config.pixel_format && config.pixel_format[0] != '\0')
+			pix_fmt = av_get_pix_fmt(config.pixel_format);
+
+		return Encoder(h, pix_fmt, config.input_height ? config.input_height : config.height);
+	}
+
+	/**
+	 * @brief Send frame for encoding (hve_send_frame).
+	 *
+	 * Plane sizes are checked against linesize and height of the session.
+	 */
+	Expected<void> send(const Frame &frame)
+	{
+		struct hve_frame f = {};
+
+		if(!fits(frame))
+			return fail("frame plane smaller than linesize * rows");
+
+		for(int i = 0; i < AV_NUM_DATA_POINTERS; ++i)
+		{
+			//library doesn't modify frame data, hve_frame is not const for C compatibility
+			f.data[i] = const_cast<uint8_t*>(frame.planes[i].data());
+			f.linesize[i] = frame.linesize[i];
+		}
+
+		if(hve_send_frame(h, &f) != HVE_OK)
+			return fail("hve_send_frame");
+
+		return {};
+	}
+
+	/**
+	 * @brief Flush the encoder (hve_send_frame with NULL), follow with receive.
+	 */
+	Expected<void> flush()
+	{
+		if(hve_send_frame(h, nullptr) != HVE_OK)
+			return fail("hve_send_frame");
+
+		return {};
+	}
+
+	/**
+	 * @brief Retrieve encoded packet (hve_receive_packet).
+	 *
+	 * Keep calling until empty optional is returned.
+	 *
+	 * @return
+	 * - packet owning reference to data
+	 * - empty optional when no more data is pending
+	 * - Error on failure
+	 */
+	Expected<std::optional<Packet>> receive()
+	{
+		int error;
+		AVPacket *packet = hve_receive_packet(h, &error);
+
+		if(packet == nullptr)
+		{
+			if(error != HVE_OK)
+				return fail("hve_receive_packet");
+
+			return std::optional<Packet>();
+		}
+
+		auto p = Packet::ref(packet);
+
+		if(!p)
+			return fail(p.error().what);
+
+		return std::optional<Packet>(std::move(*p));
+	}
+
+	/**
+	 * @brief Request IDR (hve_request_keyframe).
+	 */
+	Expected<void> request_keyframe()
+	{
+		if(hve_request_keyframe(h) != HVE_OK)
+			return fail("hve_request_keyframe");
+
+		return {};
+	}
+
+	/**
+	 * @brief Retrieve statistics (hve_get_stats).
+	 */
+	Expected<hve_stats> stats() const
+	{
+		struct hve_stats stats;
+
+		if(hve_get_stats(h, &stats) != HVE_OK)
+			return fail("hve_get_stats");
+
+		return stats;
+	}
+
+	struct hve *get() const { return h; } //!< underlying session for C interface, ownership stays with Encoder
+
+private:
+	Encoder(struct hve *h, enum AVPixelFormat pix_fmt, int height) : h(h), pix_fmt(pix_fmt), height(height) {}
+
+	// spans make it possible to catch too small buffers before library reads past them
+	bool fits(const Frame &frame) const
+	{
+		const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+		const int planes = av_pix_fmt_count_planes(pix_fmt);
+
+		if(desc == nullptr || planes <= 0)
+			return true;
+
+		for(int i = 0; i < planes && i < AV_NUM_DATA_POINTERS; ++i)
+		{
+			//chroma planes are subsampled, alpha (plane 3) is not
+			const int rows = (i == 1 || i == 2) ? -((-height) >> desc->log2_chroma_h) : height;
+
+			if(frame.planes[i].size() < (size_t)frame.linesize[i] * rows)
+				return false;
+		}
+
+		return true;
+	}
+
+	struct hve *h = nullptr;
+	enum AVPixelFormat pix_fmt = AV_PIX_FMT_NV12;
+	int height = 0;
+};
+
+#if HVE_HPP_COROUTINES
+
+/**
+ * @brief Coroutine interface driven by library readiness signalling.
+ *
+ * Many sessions may be multiplexed on small executor thread pool, no thread per session.
+ * Suspended coroutine is resumed on your executor when library signals readiness
+ * (hve_set_ready_callback), internal threads of the library only post to executor.
+ *
+ * Executor is function posting job to your executor (e.g. asio::post),
+ * it must not run the job inline.
+ *
+ * At most one send (or flush) and one next_packet may be awaited at a time,
+ * typically by producer and consumer coroutines. Keep AsyncEncoder alive while they are suspended.
+ * Destruction closes the session synchronously, executor has to outlive AsyncEncoder
+ * and may still run (no-op) jobs afterwards.
+ *
+ * Example:
+ * @code
+ *  //producer
+ *  for(auto &frame : frames)
+ *  	if(!co_await encoder.send(frame))
+ *  		co_return;
+ *
+ *  co_await encoder.flush();
+ *
+ *  //consumer
+ *  while(true)
+ *  {
+ *  	auto packet = co_await encoder.next_packet();
+ *
+ *  	if(!packet || !*packet)
+ *  		break; //error or flushed encoder drained
+ *  	//(*packet)->data()
+ *  }
+ * @endcode
+ */
+class AsyncEncoder
+{
+	struct State;
+
+public:
+	using Job = std::function<void()>;
+	using Executor = std::function<void(Job)>; //!< posts job to your executor
+
+	AsyncEncoder(AsyncEncoder &&other) noexcept = default;
+	AsyncEncoder(const AsyncEncoder &) = delete;
+	~AsyncEncoder() { close(); }
+
+	AsyncEncoder &operator=(AsyncEncoder &&other) noexcept
+	{
+		if(this != &other)
+		{
+			close();
+			state = std::move(other.state);
+		}
+		return *this;
+	}
+
+	AsyncEncoder &operator=(const AsyncEncoder &) = delete;
+
+	/**
+	 * @brief Awaitable frame submission, resumes with Expected<void>.
+	 *
+	 * Suspends only while internal encoder is busy (intra parallel).
+	 * Frame planes have to stay valid until resumed.
+	 */
+	class SendAwaiter
+	{
+	public:
+		bool await_ready() const noexcept { return false; }
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+
+			if(try_send())
+				return false;
+
+			this->handle = handle;
+			state->sender = this;
+			return true;
+		}
+
+		Expected<void> await_resume() { return std::move(*result); }
+
+	private:
+		friend class AsyncEncoder;
+
+		SendAwaiter(State *state, const Frame *frame) : state(state), frame(frame) {}
+
+		// call with state mutex locked, false if send would wait
+		bool try_send()
+		{
+			if(frame && !hve_send_ready(state->encoder->get()))
+				return false;
+
+			result.emplace(frame ? state->encoder->send(*frame) : state->encoder->flush());
+
+			if(!frame && *result)
+				state->flushed = true;
+
+			return true;
+		}
+
+		State *state;
+		const Frame *frame; //nullptr for flush
+		std::coroutine_handle<> handle;
+		std::optional<Expected<void>> result;
+	};
+
+	/**
+	 * @brief Awaitable packet, resumes with Expected<std::optional<Packet>>.
+	 *
+	 * Empty optional means the flushed encoder is drained.
+	 */
+	class PacketAwaiter
+	{
+	public:
+		bool await_ready() const noexcept { return false; }
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+
+			if(try_receive())
+				return false;
+
+			this->handle = handle;
+			state->receiver = this;
+			return true;
+		}
+
+		Expected<std::optional<Packet>> await_resume() { return std::move(*result); }
+
+	private:
+		friend class AsyncEncoder;
+
+		explicit PacketAwaiter(State *state) : state(state) {}
+
+		// call with state mutex locked, false if there is nothing yet
+		bool try_receive()
+		{
+			auto packet = state->encoder->receive();
+
+			//before flush no packet only means encoder needs more input
+			if(packet && !*packet && !state->flushed)
+				return false;
+
+			result.emplace(std::move(packet));
+			return true;
+		}
+
+		State *state;
+		std::coroutine_handle<> handle;
+		std::optional<Expected<std::optional<Packet>>> result;
+	};
+
+	/**
+	 * @brief Initialize session (hve_init) signalling readiness to executor.
+	 */
+	static Expected<AsyncEncoder> create(const hve_config &config, Executor executor)
+	{
+		auto encoder = Encoder::create(config);
+
+		if(!encoder)
+			return fail(encoder.error().what);
+
+		auto state = std::make_shared<State>(std::move(*encoder), std::move(executor));
+		state->self = state;
+
+		if(hve_set_ready_callback(state->encoder->get(), State::ready, state.get()) != HVE_OK)
+			return fail("hve_set_ready_callback");
+
+		return AsyncEncoder(std::move(state));
+	}
+
+	SendAwaiter send(const Frame &frame) { return SendAwaiter(state.get(), &frame); } //!< co_await to send frame
+	SendAwaiter flush() { return SendAwaiter(state.get(), nullptr); } //!< co_await to flush encoder
+	PacketAwaiter next_packet() { return PacketAwaiter(state.get()); } //!< co_await for the next packet
+
+	/**
+	 * @brief Retrieve statistics (hve_get_stats).
+	 */
+	Expected<hve_stats> stats() const
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		return state->encoder->stats();
+	}
+
+private:
+	explicit AsyncEncoder(std::shared_ptr<State> state) : state(std::move(state)) {}
+
+	// closes session here, joining library threads, so that no callback runs later
+	// (callback could otherwise outlive executor or end up owning the last reference)
+	void close()
+	{
+		if(!state)
+			return;
+
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->encoder.reset();
+	}
+
+	struct State
+	{
+		State(Encoder &&encoder, Executor &&executor) : executor(std::move(executor)), encoder(std::move(encoder)) {}
+
+		// called by library (internal thread or within hve_send_frame), only schedules
+		static void ready(void *opaque, int)
+		{
+			State *s = static_cast<State*>(opaque);
+			std::shared_ptr<State> state = s->self.lock();
+
+			//nullptr while session is being closed
+			if(state)
+				s->executor([state] { state->poll(); });
+		}
+
+		// on executor, retries suspended operations and resumes those that completed
+		void poll()
+		{
+			std::coroutine_handle<> resume[2];
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+
+				if(sender && sender->try_send())
+					resume[0] = std::exchange(sender, nullptr)->handle;
+
+				if(receiver && receiver->try_receive())
+					resume[1] = std::exchange(receiver, nullptr)->handle;
+			}
+
+			for(auto handle : resume)
+				if(handle)
+					handle.resume();
+		}
+
+		std::mutex mutex; //session calls and awaiters
+		Executor executor;
+		std::weak_ptr<State> self; //for jobs posted from callback
+		SendAwaiter *sender = nullptr; //suspended send
+		PacketAwaiter *receiver = nullptr; //suspended next_packet
+		bool flushed = false;
+		std::optional<Encoder> encoder; //reset by AsyncEncoder::close, jobs may still be pending
+	};
+
+	std::shared_ptr<State> state; //shared with jobs posted to executor
+};
+
+#endif
+
+} //namespace hvepp
+
+/** @}*/
+
+#endif
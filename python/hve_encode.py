@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+#
+# HVE Hardware Video Encoder Python example of encoding numpy frames through VAAPI or NVENC to H.264
+#
+# Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+
+import sys
+import numpy as np
+
+import hve
+
+WIDTH = 1280
+HEIGHT = 720
+FRAMERATE = 30
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(f'Usage: {sys.argv[0]} <seconds> [encoder] [device]\n', file=sys.stderr)
+        print('examples:', file=sys.stderr)
+        print(f'{sys.argv[0]} 10', file=sys.stderr)
+        print(f'{sys.argv[0]} 10 h264_vaapi /dev/dri/renderD128', file=sys.stderr)
+        print(f'{sys.argv[0]} 10 h264_nvenc', file=sys.stderr)
+        return -1
+
+    seconds = int(sys.argv[1])
+    encoder = sys.argv[2] if len(sys.argv) > 2 else None
+    device = sys.argv[3] if len(sys.argv) > 3 else None
+
+    # NV12 planes, encoder reads them in place (no copy into C buffer)
+    Y = np.empty((HEIGHT, WIDTH), np.uint8)
+    UV = np.full((HEIGHT // 2, WIDTH), 128, np.uint8)
+
+    with hve.Encoder(WIDTH, HEIGHT, framerate=FRAMERATE, encoder=encoder, device=device,
+                     pixel_format='nv12') as enc, open('output.h264', 'wb') as output_file:
+        for f in range(seconds * FRAMERATE + 1):
+            if f < seconds * FRAMERATE:
+                Y.fill(f % 255)  # moving through gray
+                enc.send_frame((Y, UV))
+            else:
+                enc.flush()
+
+            # packets reference encoder output, written without copying to bytes
+            while (packet := enc.receive_packet()) is not None:
+                output_file.write(packet)
+
+    print('output written to "output.h264" file')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
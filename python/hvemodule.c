@@ -0,0 +1,700 @@
+/*
+ * HVE Hardware Video Encoder Python extension
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+/*
+ * Frames are taken from any buffer protocol object (numpy array, bytes, bytearray, memoryview, mmap)
+ * without copying. The buffer is exported (kept alive and locked against resizing) only while
+ * hve_send_frame runs, the library doesn't reference frame data after it returns.
+ *
+ * Packets are new references (not copies) to encoded data and export it through buffer protocol,
+ * e.g. file.write(packet), memoryview(packet), numpy.frombuffer(packet, numpy.uint8).
+ *
+ * The GIL is released for encoding, receiving and closing.
+ * Calls on the same Encoder from different threads are serialized.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "../hve.h"
+
+typedef struct
+{
+	PyObject_HEAD
+	AVPacket *packet; //own reference to encoded data
+} PacketObject;
+
+typedef struct
+{
+	PyObject_HEAD
+	struct hve *h; //NULL when closed
+	PyThread_type_lock lock; //the session is not thread safe
+	enum AVPixelFormat pix_fmt;
+	int width; //input frame dimensions
+	int height;
+	PyObject *config; //arguments, library keeps pointers to config strings
+} EncoderObject;
+
+static PyObject *HveError;
+static PyTypeObject PacketType;
+static PyTypeObject EncoderType;
+
+static PyObject *packet_new(AVPacket *packet);
+static int encoder_acquire(EncoderObject *self);
+static void encoder_release(EncoderObject *self);
+static int frame_from_object(EncoderObject *self, PyObject *obj, PyObject *linesizes, struct hve_frame *frame, Py_buffer *views);
+static int plane_from_buffer(Py_buffer *view, int linesize, int rows, int row_bytes, uint8_t **data, int *out_linesize);
+static int release_views(Py_buffer *views, int count);
+
+/* Packet */
+
+// takes ownership of packet
+static PyObject *packet_new(AVPacket *packet)
+{
+	PacketObject *self = PyObject_New(PacketObject, &PacketType);
+
+	if(self == NULL)
+	{
+		av_packet_free(&packet);
+		return NULL;
+	}
+
+	self->packet = packet;
+
+	return (PyObject*)self;
+}
+
+static void Packet_dealloc(PacketObject *self)
+{
+	av_packet_free(&self->packet);
+	PyObject_Del(self);
+}
+
+// read only view of encoded data, exporter (packet) stays alive as long as the view
+static int Packet_getbuffer(PacketObject *self, Py_buffer *view, int flags)
+{
+	return PyBuffer_FillInfo(view, (PyObject*)self, self->packet->data, self->packet->size, 1, flags);
+}
+
+static Py_ssize_t Packet_length(PacketObject *self)
+{
+	return self->packet->size;
+}
+
+static PyObject *Packet_get_data(PacketObject *self, void *closure)
+{
+	return PyMemoryView_FromObject((PyObject*)self);
+}
+
+static PyObject *Packet_get_pts(PacketObject *self, void *closure)
+{
+	return PyLong_FromLongLong(self->packet->pts);
+}
+
+static PyObject *Packet_get_dts(PacketObject *self, void *closure)
+{
+	return PyLong_FromLongLong(self->packet->dts);
+}
+
+static PyObject *Packet_get_keyframe(PacketObject *self, void *closure)
+{
+	return PyBool_FromLong(self->packet->flags & AV_PKT_FLAG_KEY);
+}
+
+static PyBufferProcs Packet_as_buffer =
+{
+	.bf_getbuffer = (getbufferproc)Packet_getbuffer,
+};
+
+static PySequenceMethods Packet_as_sequence =
+{
+	.sq_length = (lenfunc)Packet_length,
+};
+
+static PyGetSetDef Packet_getset[] =
+{
+	{"data", (getter)Packet_get_data, NULL, "memoryview of encoded data (no copy)", NULL},
+	{"pts", (getter)Packet_get_pts, NULL, "presentation timestamp", NULL},
+	{"dts", (getter)Packet_get_dts, NULL, "decoding timestamp", NULL},
+	{"keyframe", (getter)Packet_get_keyframe, NULL, "True for keyframe", NULL},
+	{NULL}
+};
+
+static PyTypeObject PacketType =
+{
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "hve.Packet",
+	.tp_basicsize = sizeof(PacketObject),
+	.tp_dealloc = (destructor)Packet_dealloc,
+	.tp_as_sequence = &Packet_as_sequence,
+	.tp_as_buffer = &Packet_as_buffer,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Encoded packet, buffer protocol object referencing (not copying) encoder output.",
+	.tp_getset = Packet_getset,
+};
+
+/* Encoder */
+
+static PyObject *Encoder_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	EncoderObject *self = (EncoderObject*)type->tp_alloc(type, 0);
+
+	if(self == NULL)
+		return NULL;
+
+	if( (self->lock = PyThread_allocate_lock()) == NULL )
+	{
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+
+	return (PyObject*)self;
+}
+
+static int Encoder_init(EncoderObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"width", "height", "input_width", "input_height", "framerate",
+	                         "device", "encoder", "pixel_format", "profile", "max_b_frames",
+	                         "bit_rate", "qp", "gop_size", "compression_level", "vaapi_low_power",
+	                         "nvenc_preset", "nvenc_delay", "nvenc_zerolatency",
+	                         "migrate_encoder", "migrate_device", "migrate_latency_ms",
+	                         "threads", "deterministic", "intra_parallel", "convert", "convert_benchmark",
+	                         "quality_target", "quality_interval", "filler", "no_scenecut", NULL};
+	struct hve_config c = {0};
+	struct hve *h;
+
+	if(self->h)
+	{
+		PyErr_SetString(HveError, "encoder already initialized");
+		return -1;
+	}
+
+	//tiles need hve_receive_packets bundles and are not exposed
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "ii|$iiizzziiiiiiiziizziiiiiiiiii", kwlist,
+	                                &c.width, &c.height, &c.input_width, &c.input_height, &c.framerate,
+	                                &c.device, &c.encoder, &c.pixel_format, &c.profile, &c.max_b_frames,
+	                                &c.bit_rate, &c.qp, &c.gop_size, &c.compression_level, &c.vaapi_low_power,
+	                                &c.nvenc_preset, &c.nvenc_delay, &c.nvenc_zerolatency,
+	                                &c.migrate_encoder, &c.migrate_device, &c.migrate_latency_ms,
+	                                &c.threads, &c.deterministic, &c.intra_parallel, &c.convert, &c.convert_benchmark,
+	                                &c.quality_target, &c.quality_interval, &c.filler, &c.no_scenecut))
+		return -1;
+
+	self->pix_fmt = AV_PIX_FMT_NV12;
+
+	if(c.pixel_format && c.pixel_format[0] != '\0')
+		self->pix_fmt = av_get_pix_fmt(c.pixel_format);
+
+	if(self->pix_fmt == AV_PIX_FMT_NONE)
+	{
+		PyErr_Format(PyExc_ValueError, "unknown pixel_format '%s'", c.pixel_format);
+		return -1;
+	}
+
+	self->width = c.input_width ? c.input_width : c.width;
+	self->height = c.input_height ? c.input_height : c.height;
+
+	//strings are UTF-8 buffers of argument objects, keep them for the session lifetime
+	Py_XSETREF(self->config, Py_BuildValue("(OO)", args, kwds ? kwds : Py_None));
+
+	if(self->config == NULL)
+		return -1;
+
+	//may probe hardware and open encoder
+	Py_BEGIN_ALLOW_THREADS
+	h = hve_init(&c);
+	Py_END_ALLOW_THREADS
+
+	if(h == NULL)
+	{
+		PyErr_SetString(HveError, "hve_init failed");
+		return -1;
+	}
+
+	self->h = h;
+
+	return 0;
+}
+
+static void Encoder_dealloc(EncoderObject *self)
+{
+	if(self->h)
+	{
+		Py_BEGIN_ALLOW_THREADS
+		hve_close(self->h);
+		Py_END_ALLOW_THREADS
+	}
+
+	if(self->lock)
+		PyThread_free_lock(self->lock);
+
+	Py_XDECREF(self->config);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// 0 with lock held or -1 with exception set (closed encoder)
+static int encoder_acquire(EncoderObject *self)
+{
+	if(!PyThread_acquire_lock(self->lock, NOWAIT_LOCK))
+	{
+		Py_BEGIN_ALLOW_THREADS
+		PyThread_acquire_lock(self->lock, WAIT_LOCK);
+		Py_END_ALLOW_THREADS
+	}
+
+	if(self->h == NULL)
+	{
+		PyThread_release_lock(self->lock);
+		PyErr_SetString(HveError, "encoder is closed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void encoder_release(EncoderObject *self)
+{
+	PyThread_release_lock(self->lock);
+}
+
+static PyObject *Encoder_send_frame(EncoderObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"frame", "linesizes", NULL};
+	PyObject *obj, *linesizes = NULL;
+	struct hve_frame frame = { {0} };
+	Py_buffer views[AV_NUM_DATA_POINTERS];
+	int count = 0, ret;
+
+	if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &obj, &linesizes))
+		return NULL;
+
+	//None flushes the encoder like NULL frame in C
+	if(obj != Py_None && (count = frame_from_object(self, obj, linesizes, &frame, views)) < 0)
+		return NULL;
+
+	if(encoder_acquire(self) < 0)
+	{
+		release_views(views, count);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = hve_send_frame(self->h, obj != Py_None ? &frame : NULL);
+	Py_END_ALLOW_THREADS
+
+	encoder_release(self);
+
+	//frame data is no longer referenced by the library
+	release_views(views, count);
+
+	if(ret != HVE_OK)
+	{
+		PyErr_SetString(HveError, "hve_send_frame failed");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Encoder_flush(EncoderObject *self, PyObject *unused)
+{
+	int ret;
+
+	if(encoder_acquire(self) < 0)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = hve_send_frame(self->h, NULL);
+	Py_END_ALLOW_THREADS
+
+	encoder_release(self);
+
+	if(ret != HVE_OK)
+	{
+		PyErr_SetString(HveError, "hve_send_frame failed");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Encoder_receive_packet(EncoderObject *self, PyObject *unused)
+{
+	AVPacket *packet, *ref = NULL;
+	int error = HVE_OK, failed = 0;
+
+	if(encoder_acquire(self) < 0)
+		return NULL;
+
+	//may wait for flushing encoder
+	Py_BEGIN_ALLOW_THREADS
+	packet = hve_receive_packet(self->h, &error);
+
+	//library packet is valid until the next call, take own reference instead of copying data
+	if(packet && ( !(ref = av_packet_alloc()) || av_packet_ref(ref, packet) < 0 ) )
+	{
+		av_packet_free(&ref);
+		failed = 1;
+	}
+	Py_END_ALLOW_THREADS
+
+	encoder_release(self);
+
+	if(failed)
+		return PyErr_NoMemory();
+
+	if(packet == NULL && error != HVE_OK)
+	{
+		PyErr_SetString(HveError, "hve_receive_packet failed");
+		return NULL;
+	}
+
+	if(packet == NULL)
+		Py_RETURN_NONE;
+
+	return packet_new(ref);
+}
+
+static PyObject *Encoder_request_keyframe(EncoderObject *self, PyObject *unused)
+{
+	int ret;
+
+	if(encoder_acquire(self) < 0)
+		return NULL;
+
+	ret = hve_request_keyframe(self->h);
+
+	encoder_release(self);
+
+	if(ret != HVE_OK)
+	{
+		PyErr_SetString(HveError, "hve_request_keyframe failed");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Encoder_send_filler(EncoderObject *self, PyObject *unused)
+{
+	int ret;
+
+	if(encoder_acquire(self) < 0)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = hve_send_filler(self->h);
+	Py_END_ALLOW_THREADS
+
+	encoder_release(self);
+
+	if(ret != HVE_OK)
+	{
+		PyErr_SetString(HveError, "hve_send_filler failed");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Encoder_stats(EncoderObject *self, PyObject *unused)
+{
+	struct hve_stats s;
+	PyObject *stats;
+	int ret;
+
+	if(encoder_acquire(self) < 0)
+		return NULL;
+
+	ret = hve_get_stats(self->h, &s);
+
+	//encoder name is valid until hve_close
+	stats = ret != HVE_OK ? NULL : Py_BuildValue("{s:K,s:K,s:i,s:i,s:i,s:s,s:i,s:i,s:n,s:K,s:K,s:K,s:K,s:i,s:d,s:i,s:i,s:i,s:L,s:K}",
+		"frames", (unsigned long long)s.frames, "packets", (unsigned long long)s.packets,
+		"latency_us", s.latency_us, "latency_max_us", s.latency_max_us, "migrations", s.migrations,
+		"encoder", s.encoder, "sched_wait_us", s.sched_wait_us, "sched_wait_max_us", s.sched_wait_max_us,
+		"memory_bytes", (Py_ssize_t)s.memory_bytes,
+		"allocs_upload", (unsigned long long)s.allocs_upload, "allocs_filter", (unsigned long long)s.allocs_filter,
+		"allocs_encode", (unsigned long long)s.allocs_encode, "allocs_queue", (unsigned long long)s.allocs_queue,
+		"convert", s.convert, "quality_ssim", s.quality_ssim, "quality_qp", s.quality_qp,
+		"quality_bit_rate", s.quality_bit_rate, "quality_converged_ms", s.quality_converged_ms,
+		"quality_bits_saved", (long long)s.quality_bits_saved, "filler_packets", (unsigned long long)s.filler_packets);
+
+	encoder_release(self);
+
+	if(ret != HVE_OK)
+		PyErr_SetString(HveError, "hve_get_stats failed");
+
+	return stats;
+}
+
+static PyObject *Encoder_close(EncoderObject *self, PyObject *unused)
+{
+	struct hve *h;
+
+	//closing twice is fine
+	if(encoder_acquire(self) < 0)
+	{
+		PyErr_Clear();
+		Py_RETURN_NONE;
+	}
+
+	h = self->h;
+	self->h = NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	hve_close(h);
+	Py_END_ALLOW_THREADS
+
+	encoder_release(self);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Encoder_enter(EncoderObject *self, PyObject *unused)
+{
+	Py_INCREF(self);
+	return (PyObject*)self;
+}
+
+static PyObject *Encoder_exit(EncoderObject *self, PyObject *args)
+{
+	return Encoder_close(self, NULL);
+}
+
+// number of exported views (release with release_views) or -1 with exception set
+static int frame_from_object(EncoderObject *self, PyObject *obj, PyObject *linesizes, struct hve_frame *frame, Py_buffer *views)
+{
+	int planes = av_pix_fmt_count_planes(self->pix_fmt);
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(self->pix_fmt);
+	int row_bytes[4], count, i, failed = 0;
+	PyObject *seq;
+
+	if(av_image_fill_linesizes(row_bytes, self->pix_fmt, self->width) < 0)
+	{
+		PyErr_SetString(HveError, "unsupported pixel format");
+		return -1;
+	}
+
+	//single contiguous buffer holding all planes packed one after another (e.g. numpy (h * 3 / 2, w) for NV12)
+	if(planes > 1 && PyObject_CheckBuffer(obj))
+	{
+		int size;
+
+		if(linesizes)
+		{
+			PyErr_SetString(PyExc_ValueError, "linesizes apply only to sequence of planes");
+			return -1;
+		}
+
+		if(PyObject_GetBuffer(obj, &views[0], PyBUF_C_CONTIGUOUS) < 0)
+			return -1;
+
+		size = av_image_fill_pointers(frame->data, self->pix_fmt, self->height, (uint8_t*)views[0].buf, row_bytes);
+
+		if(size < 0 || views[0].len < size)
+		{
+			PyErr_Format(PyExc_ValueError, "frame buffer has %zd bytes, %d needed", views[0].len, size);
+			return release_views(views, 1);
+		}
+
+		for(i = 0; i < planes; ++i)
+			frame->linesize[i] = row_bytes[i];
+
+		return 1;
+	}
+
+	//sequence of planes, e.g. (Y, UV) numpy arrays, possibly strided views of larger images
+	if(planes == 1 && PyObject_CheckBuffer(obj))
+		seq = PyTuple_Pack(1, obj); //numpy array is also a sequence (of rows)
+	else
+		seq = PySequence_Fast(obj, "frame should be buffer or sequence of plane buffers");
+
+	if(seq == NULL)
+		return -1;
+
+	if(PySequence_Fast_GET_SIZE(seq) != planes)
+	{
+		PyErr_Format(PyExc_ValueError, "pixel format has %d planes, got %zd", planes, PySequence_Fast_GET_SIZE(seq));
+		Py_DECREF(seq);
+		return -1;
+	}
+
+	if(linesizes && (!PySequence_Check(linesizes) || PySequence_Size(linesizes) != planes))
+	{
+		PyErr_Format(PyExc_ValueError, "linesizes should be sequence of %d values", planes);
+		Py_DECREF(seq);
+		return -1;
+	}
+
+	for(count = 0; count < planes; ++count)
+	{
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, count);
+		//chroma planes are subsampled, alpha (plane 3) is not
+		int rows = (count == 1 || count == 2) ? -((-self->height) >> desc->log2_chroma_h) : self->height;
+		int linesize = 0;
+
+		if(linesizes)
+		{
+			PyObject *value = PySequence_GetItem(linesizes, count);
+
+			linesize = value ? PyLong_AsLong(value) : -1;
+			Py_XDECREF(value);
+
+			if( (failed = linesize < 0 && PyErr_Occurred()) )
+				break;
+		}
+
+		if( (failed = PyObject_GetBuffer(item, &views[count], PyBUF_STRIDED_RO) < 0) )
+			break;
+
+		if(plane_from_buffer(&views[count], linesize, rows, row_bytes[count], &frame->data[count], &frame->linesize[count]) < 0)
+		{
+			PyErr_Format(PyExc_ValueError, "plane %d is not contiguous rows of at least %d x %d bytes (or linesize is invalid)",
+			             count, rows, row_bytes[count]);
+			failed = 1;
+			++count;
+			break;
+		}
+	}
+
+	Py_DECREF(seq);
+
+	if(failed)
+		return release_views(views, count);
+
+	return count;
+}
+
+// rows (outermost dimension) may be strided, each row has to be contiguous, -1 if unusable
+static int plane_from_buffer(Py_buffer *view, int linesize, int rows, int row_bytes, uint8_t **data, int *out_linesize)
+{
+	Py_ssize_t available, contiguous = view->itemsize;
+
+	for(int d = view->ndim - 1; d >= 1; --d)
+	{
+		if(view->strides[d] != contiguous)
+			return -1;
+		contiguous *= view->shape[d];
+	}
+
+	//1D buffer, linesize given or tightly packed
+	if(view->ndim <= 1)
+	{
+		if(view->ndim == 1 && view->strides[0] != view->itemsize)
+			return -1;
+
+		linesize = linesize ? linesize : row_bytes;
+		available = view->len;
+	}
+	else
+	{
+		//the outermost stride is linesize, negative strides (flipped images) are not supported
+		if(linesize && linesize != view->strides[0])
+			return -1;
+
+		linesize = view->strides[0];
+		available = view->shape[0] ? (view->shape[0] - 1) * view->strides[0] + contiguous : 0;
+
+		if(contiguous < row_bytes)
+			return -1;
+	}
+
+	//the last row doesn't need padding
+	if(linesize < row_bytes || linesize > INT_MAX / rows || available < (Py_ssize_t)linesize * (rows - 1) + row_bytes)
+		return -1;
+
+	*data = (uint8_t*)view->buf;
+	*out_linesize = linesize;
+
+	return 0;
+}
+
+// always -1 for error paths
+static int release_views(Py_buffer *views, int count)
+{
+	for(int i = 0; i < count; ++i)
+		PyBuffer_Release(&views[i]);
+
+	return -1;
+}
+
+static PyMethodDef Encoder_methods[] =
+{
+	{"send_frame", (PyCFunction)(void(*)(void))Encoder_send_frame, METH_VARARGS | METH_KEYWORDS,
+	 "send_frame(frame, linesizes=None)\n\n"
+	 "Send frame for encoding (no copy), None flushes the encoder.\n"
+	 "Frame is buffer with planes packed one after another or sequence of plane buffers.\n"
+	 "2D plane rows may be strided (e.g. numpy slice), linesizes apply to 1D planes."},
+	{"flush", (PyCFunction)Encoder_flush, METH_NOARGS, "Flush the encoder, follow with receive_packet until None."},
+	{"receive_packet", (PyCFunction)Encoder_receive_packet, METH_NOARGS,
+	 "Retrieve Packet or None if no more data is pending. Call until None after each send_frame."},
+	{"request_keyframe", (PyCFunction)Encoder_request_keyframe, METH_NOARGS, "Encode the next frame as IDR."},
+	{"send_filler", (PyCFunction)Encoder_send_filler, METH_NOARGS, "Signal source loss (requires filler=1)."},
+	{"stats", (PyCFunction)Encoder_stats, METH_NOARGS, "Encoding statistics as dict."},
+	{"close", (PyCFunction)Encoder_close, METH_NOARGS, "Close the session (also on garbage collection)."},
+	{"__enter__", (PyCFunction)Encoder_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)Encoder_exit, METH_VARARGS, NULL},
+	{NULL}
+};
+
+static PyTypeObject EncoderType =
+{
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "hve.Encoder",
+	.tp_basicsize = sizeof(EncoderObject),
+	.tp_dealloc = (destructor)Encoder_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Encoder(width, height, *, framerate=0, device=None, encoder=None, pixel_format=None, ...)\n\n"
+	          "Hardware video encoder session, keyword arguments are hve_config fields.",
+	.tp_methods = Encoder_methods,
+	.tp_init = (initproc)Encoder_init,
+	.tp_new = Encoder_new,
+};
+
+static struct PyModuleDef hve_module =
+{
+	PyModuleDef_HEAD_INIT,
+	.m_name = "hve",
+	.m_doc = "Hardware Video Encoder with zero-copy buffer protocol frames and packets.",
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_hve(void)
+{
+	PyObject *m;
+
+	if(PyType_Ready(&PacketType) < 0 || PyType_Ready(&EncoderType) < 0)
+		return NULL;
+
+	if( (m = PyModule_Create(&hve_module)) == NULL )
+		return NULL;
+
+	HveError = PyErr_NewException("hve.Error", NULL, NULL);
+
+	Py_XINCREF(HveError);
+	Py_INCREF(&PacketType);
+	Py_INCREF(&EncoderType);
+
+	if(HveError == NULL || PyModule_AddObject(m, "Error", HveError) < 0 ||
+	   PyModule_AddObject(m, "Packet", (PyObject*)&PacketType) < 0 ||
+	   PyModule_AddObject(m, "Encoder", (PyObject*)&EncoderType) < 0)
+	{
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	return m;
+}
@@ -0,0 +1,27 @@
+# HVE Hardware Video Encoder Python extension
+#
+# Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+# python3 setup.py build_ext --inplace   # or: pip3 install .
+
+from setuptools import setup, Extension
+
+# library is compiled in, only FFmpeg is linked dynamically
+hve = Extension(
+    'hve',
+    sources=['hvemodule.c', '../hve.c'],
+    include_dirs=['..'],
+    libraries=['avcodec', 'avutil', 'avfilter', 'pthread'],
+)
+
+setup(
+    name='hve',
+    version='1.0',
+    description='Hardware Video Encoder with zero-copy buffer protocol frames and packets',
+    license='MPL-2.0',
+    ext_modules=[hve],
+)
@@ -0,0 +1,410 @@
+/*
+ * HVE Hardware Video Encoder library test of steady state allocations
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+// All allocations of the process (HVE and FFmpeg) are counted by allocator
+// interposed below (glibc). Encoders allocate on their own (e.g. packet buffers)
+// so steady state HVE encoding is compared with bare FFmpeg encoder fed the same
+// way. HVE may not add a single allocation per frame on top of it.
+
+#include <stdio.h> //printf, fprintf
+#include <stdlib.h> //malloc, calloc, realloc, posix_memalign
+#include <string.h> //memset
+#include <errno.h> //ENOMEM
+#include <inttypes.h> //uint8_t, uint64_t
+
+#include "../hve.h"
+
+const int WIDTH=64;
+const int HEIGHT=64;
+const int FRAMERATE=30;
+const int WARMUP=100; //per encoder, past encoder lookahead, queue rings reach their size
+const int FRAMES=120; //measured frames
+const int BATCH=4; //frames per hve_send_frames
+const int INTRA_PARALLEL=4;
+const int HOLDERS=2; //coalescer handles sharing the source
+const char *PIXEL_FORMAT="nv12";
+const char *REQUIRED_ENCODER="rawvideo"; //always available
+const char *OPTIONAL_ENCODER="libx264"; //skipped if not available
+const char *SOURCE="camera";
+
+enum test_mode {SINGLE, BATCH_MODE, INTRA_PARALLEL_MODE, MODES};
+const char *MODE_NAMES[MODES] = {"hve_send_frame", "hve_send_frames", "intra_parallel"};
+
+//allocations are counted for the stage in progress
+enum count_stage {NOT_COUNTING = -1, SEND, RECEIVE, STAGES};
+
+static int stage = NOT_COUNTING;
+static uint64_t counts[STAGES];
+
+static uint8_t data[64*64*3/2];
+
+int test_encoder(const char *encoder, int required);
+int test_session(const char *encoder, enum test_mode mode, int required);
+int test_coalescer(const char *encoder, int required);
+int baseline(const char *encoder, int intra, uint64_t *allocs);
+int encode(struct hve *h, enum test_mode mode, int frames);
+int drain(struct hve *h);
+uint64_t hve_allocs(const struct hve_stats *stats);
+void count_start();
+uint64_t count_stop();
+void init_config(struct hve_config *config, const char *encoder);
+void init_frame(struct hve_frame *frame);
+
+//glibc allocator entry points
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+static void count_alloc()
+{
+	int s = __atomic_load_n(&stage, __ATOMIC_RELAXED);
+
+	if(s != NOT_COUNTING)
+		__atomic_fetch_add(&counts[s], 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	count_alloc();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	count_alloc();
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	count_alloc();
+	return __libc_realloc(ptr, size);
+}
+
+//av_malloc path
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	count_alloc();
+	return (*ptr = __libc_memalign(alignment, size)) ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	count_alloc();
+	return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	count_alloc();
+	return __libc_memalign(alignment, size);
+}
+
+int main(int argc, char* argv[])
+{
+	int failed = 0;
+
+	memset(data, 128, sizeof(data));
+
+	failed |= test_encoder(REQUIRED_ENCODER, 1);
+	failed |= test_encoder(OPTIONAL_ENCODER, 0);
+
+	printf(failed ? "FAILED\n" : "OK\n");
+
+	return failed ? 1 : 0;
+}
+
+// convention 0 on success (or skip), 1 on failure
+int test_encoder(const char *encoder, int required)
+{
+	int failed = 0;
+
+	for(int mode = SINGLE; mode < MODES; ++mode)
+		failed |= test_session(encoder, mode, required);
+
+	failed |= test_coalescer(encoder, required);
+
+	return failed;
+}
+
+int test_session(const char *encoder, enum test_mode mode, int required)
+{
+	struct hve_config config = {0};
+	struct hve_stats before, after;
+	uint64_t expected, allocs, send, receive;
+	struct hve *h;
+
+	init_config(&config, encoder);
+
+	if(mode == INTRA_PARALLEL_MODE)
+	{
+		config.gop_size = -1;
+		config.intra_parallel = INTRA_PARALLEL;
+	}
+
+	if(baseline(encoder, mode == INTRA_PARALLEL_MODE, &expected) != 0 || (h = hve_init(&config)) == NULL)
+	{
+		fprintf(stderr, "%-10s %-16s %s\n", encoder, MODE_NAMES[mode], required ? "init failed" : "not available, skipping");
+		return required;
+	}
+
+	int failed = encode(h, mode, mode == INTRA_PARALLEL_MODE ? WARMUP * INTRA_PARALLEL : WARMUP) != 0;
+
+	failed |= hve_get_stats(h, &before) != HVE_OK;
+
+	count_start();
+	failed |= encode(h, mode, FRAMES) != 0;
+	send = counts[SEND];
+	receive = counts[RECEIVE];
+	allocs = count_stop();
+
+	failed |= hve_get_stats(h, &after) != HVE_OK;
+
+	//internal encoders may still be busy with frames at the edges of measured window
+	if(mode == INTRA_PARALLEL_MODE)
+		expected += expected * INTRA_PARALLEL / FRAMES;
+
+	//HVE own counters by stage and everything the process allocated
+	failed |= hve_allocs(&after) != hve_allocs(&before) || allocs > expected;
+
+	printf("%-10s %-16s %" PRIu64 " allocations (send %" PRIu64 ", receive %" PRIu64 "), bare encoder %" PRIu64 " in %d frames %s\n",
+	       encoder, MODE_NAMES[mode], allocs, send, receive, expected, FRAMES, failed ? "FAILED" : "ok");
+
+	failed |= hve_send_frame(h, NULL) != HVE_OK || drain(h) != 0;
+	hve_close(h);
+
+	return failed;
+}
+
+// fan-out makes one reference per packet and holder, check they are counted and nothing else allocates
+int test_coalescer(const char *encoder, int required)
+{
+	struct hve_config config = {0};
+	struct hve_coalescer *c;
+	struct hve_handle *handles[2] = {0};
+	struct hve_frame frame = { {0} };
+	struct hve_stats before, after;
+	AVPacket *packet;
+	uint64_t packets = 0, allocs = 0;
+	int failed = 0, error, i, f;
+
+	init_config(&config, encoder);
+	init_frame(&frame);
+
+	if( (c = hve_coalescer_init()) == NULL )
+		return 1;
+
+	for(i = 0; i < HOLDERS; ++i)
+		if( (handles[i] = hve_coalescer_open(c, SOURCE, &config)) == NULL )
+			break;
+
+	if(i < HOLDERS)
+	{
+		for(int j = 0; j < i; ++j)
+			hve_handle_close(handles[j]);
+		hve_coalescer_close(c);
+		fprintf(stderr, "%-10s %-16s %s\n", encoder, "coalescer", required ? "open failed" : "not available, skipping");
+		return required;
+	}
+
+	for(f = 0; f < WARMUP + FRAMES && !failed; ++f)
+	{
+		if(f == WARMUP)
+		{
+			failed |= hve_handle_get_stats(handles[0], &before) != HVE_OK;
+			count_start();
+		}
+
+		stage = f >= WARMUP ? SEND : NOT_COUNTING;
+		failed |= hve_coalescer_send_frame(c, SOURCE, &frame) != HVE_OK;
+		stage = f >= WARMUP ? RECEIVE : NOT_COUNTING;
+
+		for(i = 0; i < HOLDERS; ++i)
+		{
+			while( (packet = hve_handle_receive_packet(handles[i], &error)) )
+				packets += f >= WARMUP;
+
+			failed |= error != HVE_OK;
+		}
+	}
+
+	allocs = count_stop();
+
+	failed |= hve_handle_get_stats(handles[0], &after) != HVE_OK;
+
+	uint64_t delta = hve_allocs(&after) - hve_allocs(&before);
+	uint64_t queue = after.allocs_queue - before.allocs_queue;
+
+	//packets are fanned out while sending frame and all are received before the next one
+	failed |= delta != queue || queue != packets;
+
+	printf("%-10s %-16s %" PRIu64 " allocations, %" PRIu64 " references for %" PRIu64 " packets %s\n",
+	       encoder, "coalescer", allocs, queue, packets, failed ? "FAILED" : "ok");
+
+	for(i = 0; i < HOLDERS; ++i)
+		hve_handle_close(handles[i]);
+
+	hve_coalescer_close(c);
+
+	return failed;
+}
+
+// encoder opened and fed like HVE does for software encoders, counts allocations in measured frames
+// convention 0 on success, -1 if encoder is not available
+int baseline(const char *encoder, int intra, uint64_t *allocs)
+{
+	AVCodec *codec;
+	AVCodecContext *ctx;
+	AVDictionary *opts = NULL;
+	AVFrame *frame;
+	AVPacket *packet;
+	int failed = 0;
+
+	if( !(codec = avcodec_find_encoder_by_name(encoder)) || !(ctx = avcodec_alloc_context3(codec)) )
+		return -1;
+
+	ctx->width = WIDTH;
+	ctx->height = HEIGHT;
+	ctx->time_base = (AVRational){ 1, FRAMERATE };
+	ctx->framerate = (AVRational){ FRAMERATE, 1 };
+	ctx->sample_aspect_ratio = (AVRational){ 1, 1 };
+	ctx->pix_fmt = av_get_pix_fmt(PIXEL_FORMAT);
+	ctx->max_b_frames = 0;
+	ctx->thread_count = 1;
+
+	if(intra)
+		ctx->gop_size = 0;
+
+	if(strstr(encoder, "libx264"))
+		av_dict_set_int(&opts, "forced-idr", 1, 0);
+
+	frame = av_frame_alloc();
+	packet = av_packet_alloc();
+
+	if(avcodec_open2(ctx, codec, &opts) < 0 || !frame || !packet)
+		failed = -1;
+
+	av_dict_free(&opts);
+
+	if(frame)
+	{
+		frame->format = ctx->pix_fmt;
+		frame->width = WIDTH;
+		frame->height = HEIGHT;
+		frame->linesize[0] = frame->linesize[1] = WIDTH;
+		frame->data[0] = data;
+		frame->data[1] = data + WIDTH * HEIGHT;
+	}
+
+	for(int f = 0; f < WARMUP + FRAMES && !failed; ++f)
+	{
+		if(f == WARMUP)
+			count_start();
+
+		//user data, not reference counted, like HVE software frame
+		frame->pts = f;
+		frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+		stage = f >= WARMUP ? SEND : NOT_COUNTING;
+		failed |= avcodec_send_frame(ctx, frame) < 0;
+		stage = f >= WARMUP ? RECEIVE : NOT_COUNTING;
+
+		while(!failed && avcodec_receive_packet(ctx, packet) == 0)
+			;
+	}
+
+	*allocs = count_stop();
+
+	av_packet_free(&packet);
+	av_frame_free(&frame);
+	avcodec_free_context(&ctx);
+
+	return failed ? -1 : 0;
+}
+
+// convention 0 on success, packets are discarded, allocations are counted by stage if counting
+int encode(struct hve *h, enum test_mode mode, int frames)
+{
+	struct hve_frame batch[4];
+	int counting = stage != NOT_COUNTING, failed = 0;
+
+	for(int i = 0; i < BATCH; ++i)
+	{
+		memset(&batch[i], 0, sizeof(batch[i]));
+		init_frame(&batch[i]);
+	}
+
+	for(int f = 0; f < frames && !failed; f += mode == BATCH_MODE ? BATCH : 1)
+	{
+		stage = counting ? SEND : NOT_COUNTING;
+
+		//batch collects packets while sending
+		if(mode == BATCH_MODE)
+			failed = hve_send_frames(h, batch, BATCH) != BATCH;
+		else
+			failed = hve_send_frame(h, &batch[0]) != HVE_OK;
+
+		stage = counting ? RECEIVE : NOT_COUNTING;
+
+		failed |= drain(h) != 0;
+	}
+
+	return failed ? -1 : 0;
+}
+
+// convention 0 on success, packets are discarded
+int drain(struct hve *h)
+{
+	AVPacket *packet;
+	int failed;
+
+	while( (packet = hve_receive_packet(h, &failed)) )
+		;
+
+	return failed != HVE_OK ? -1 : 0;
+}
+
+// allocations made by HVE itself, all stages
+uint64_t hve_allocs(const struct hve_stats *stats)
+{
+	return stats->allocs_upload + stats->allocs_filter + stats->allocs_encode + stats->allocs_queue;
+}
+
+void count_start()
+{
+	memset(counts, 0, sizeof(counts));
+	__atomic_store_n(&stage, SEND, __ATOMIC_RELAXED);
+}
+
+// returns allocations of all stages since count_start
+uint64_t count_stop()
+{
+	__atomic_store_n(&stage, NOT_COUNTING, __ATOMIC_RELAXED);
+	return counts[SEND] + counts[RECEIVE];
+}
+
+void init_config(struct hve_config *config, const char *encoder)
+{
+	config->width = WIDTH;
+	config->height = HEIGHT;
+	config->framerate = FRAMERATE;
+	config->pixel_format = PIXEL_FORMAT;
+	config->encoder = encoder;
+	config->threads = 1; //the same as bare encoder, threads may allocate on their own
+}
+
+void init_frame(struct hve_frame *frame)
+{
+	frame->linesize[0] = frame->linesize[1] = WIDTH;
+	frame->data[0] = data;
+	frame->data[1] = data + WIDTH * HEIGHT;
+}
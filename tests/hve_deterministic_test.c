@@ -0,0 +1,181 @@
+/*
+ * HVE Hardware Video Encoder library test of deterministic (bit-exact) output
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+// Encodes the same synthetic sequence twice for each thread count and compares
+// hashes of the packet streams (data, timestamps, flags).
+
+#include <stdio.h> //printf, fprintf
+#include <string.h> //memset
+#include <inttypes.h> //uint8_t, uint64_t, PRIx64
+
+#include "../hve.h"
+
+const int WIDTH=320;
+const int HEIGHT=240;
+const int FRAMERATE=30;
+const int GOP_SIZE=15;
+const int FRAMES=60;
+const int BIT_RATE=300000; //rate control decisions are part of output too
+const int THREADS[]={1, 4}; //frame threads in libx264
+const char *PIXEL_FORMAT="nv12";
+const char *ENCODER="libx264"; //x264 deterministic mode, skipped if not available
+const int SKIP=77; //ctest SKIP_RETURN_CODE
+
+static uint8_t data[320*240*3/2];
+
+int encode_hash(int threads, uint64_t *hash);
+uint64_t fnv1a(uint64_t hash, const uint8_t *data, int size);
+int test_rejected();
+
+int main(int argc, char* argv[])
+{
+	struct hve_config config = {0};
+	struct hve *h;
+	uint64_t hash[2][2];
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.pixel_format = PIXEL_FORMAT;
+	config.encoder = ENCODER;
+
+	if( (h = hve_init(&config)) == NULL )
+	{
+		fprintf(stderr, "%s not available, skipping\n", ENCODER);
+		return SKIP;
+	}
+
+	hve_close(h);
+
+	for(int t = 0; t < 2; ++t)
+	{
+		for(int run = 0; run < 2; ++run)
+			if(encode_hash(THREADS[t], &hash[t][run]) != 0)
+				return 1;
+
+		if(hash[t][0] != hash[t][1])
+			return fprintf(stderr, "threads %d, runs differ %016" PRIx64 " != %016" PRIx64 "\n", THREADS[t], hash[t][0], hash[t][1]);
+
+		printf("threads %d, two runs bit-exact %016" PRIx64 "\n", THREADS[t], hash[t][0]);
+	}
+
+	//not an error, documented as repeatable only for the same thread count
+	if(hash[0][0] != hash[1][0])
+		printf("threads %d and %d produce different (each repeatable) streams\n", THREADS[0], THREADS[1]);
+
+	if(test_rejected() != 0)
+		return 1;
+
+	printf("OK\n");
+
+	return 0;
+}
+
+// convention 0 on success, hashes packets of deterministic encoding
+int encode_hash(int threads, uint64_t *hash)
+{
+	struct hve_config config = {0};
+	struct hve_frame frame = { {0} };
+	struct hve *h;
+	AVPacket *packet;
+	int failed = HVE_OK, packets = 0;
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.gop_size = GOP_SIZE;
+	config.bit_rate = BIT_RATE;
+	config.pixel_format = PIXEL_FORMAT;
+	config.encoder = ENCODER;
+	config.threads = threads;
+	config.deterministic = 1;
+
+	if( (h = hve_init(&config)) == NULL )
+		return fprintf(stderr, "failed to initialize deterministic encoder\n");
+
+	frame.linesize[0] = frame.linesize[1] = WIDTH;
+	frame.data[0] = data;
+	frame.data[1] = data + WIDTH * HEIGHT;
+
+	*hash = 14695981039346656037ULL; //FNV offset basis
+
+	for(int f = 0; f <= FRAMES && failed == HVE_OK; ++f)
+	{
+		//moving gradient with some texture, the same in every run
+		for(int y = 0; y < HEIGHT; ++y)
+			for(int x = 0; x < WIDTH; ++x)
+				data[y * WIDTH + x] = (uint8_t)(x + 2 * y + 3 * f + ((x * y) & 15));
+
+		memset(data + WIDTH * HEIGHT, 128 + f % 32, WIDTH * HEIGHT / 2);
+
+		//the last iteration flushes the encoder
+		if(hve_send_frame(h, f < FRAMES ? &frame : NULL) != HVE_OK)
+			failed = HVE_ERROR;
+
+		while( failed == HVE_OK && (packet = hve_receive_packet(h, &failed)) )
+		{
+			int64_t meta[3] = {packet->pts, packet->dts, packet->flags & AV_PKT_FLAG_KEY};
+
+			*hash = fnv1a(*hash, packet->data, packet->size);
+			*hash = fnv1a(*hash, (const uint8_t*)meta, sizeof(meta));
+			++packets;
+		}
+	}
+
+	hve_close(h);
+
+	if(failed != HVE_OK || packets != FRAMES)
+		return fprintf(stderr, "encoding failed, %d packets out of %d frames\n", packets, FRAMES);
+
+	return 0;
+}
+
+uint64_t fnv1a(uint64_t hash, const uint8_t *data, int size)
+{
+	for(int i = 0; i < size; ++i)
+		hash = (hash ^ data[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+// convention 0 if timing dependent options are rejected with deterministic
+int test_rejected()
+{
+	struct hve_config config = {0};
+	struct hve *h;
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.pixel_format = PIXEL_FORMAT;
+	config.encoder = ENCODER;
+	config.deterministic = 1;
+	config.migrate_encoder = ENCODER;
+
+	if( (h = hve_init(&config)) != NULL )
+	{
+		hve_close(h);
+		return fprintf(stderr, "deterministic with migrate_encoder was not rejected\n");
+	}
+
+	config.migrate_encoder = NULL;
+	config.quality_target = 980;
+
+	if( (h = hve_init(&config)) != NULL )
+	{
+		hve_close(h);
+		return fprintf(stderr, "deterministic with quality_target was not rejected\n");
+	}
+
+	printf("timing dependent options rejected\n");
+
+	return 0;
+}
@@ -0,0 +1,344 @@
+/*
+ * HVE Hardware Video Encoder library test of device set placement and rebalancing
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+// Devices are simulated with software encoders (device names are only labels).
+// Backend delay of one device is injected by avcodec_send_frame interposed below,
+// it sleeps inside the encode path of sessions placed on that device.
+
+#define _GNU_SOURCE //RTLD_NEXT
+
+#include <stdio.h> //printf, fprintf
+#include <string.h> //memset
+#include <inttypes.h> //uint8_t
+#include <unistd.h> //usleep
+#include <dlfcn.h> //dlsym
+
+#include "../hve.h"
+
+const int WIDTH=64;
+const int HEIGHT=64;
+const int FRAMERATE=10; //rebalancing is considered after a second of frames
+const int GOP_SIZE=10; //rebalancing happens only at keyframe period boundary
+const int FRAMES=120; //libx264 lookahead holds packets for a few dozen frames
+const int DELAY_MS=30; //injected on the slow device
+const int SPREAD_SESSIONS=6;
+const int SPREAD_DEVICES=3;
+const char *SPREAD_ENCODER="rawvideo"; //always available
+const char *ENCODER="libx264"; //keyframes and lookahead, skipped if not available
+const char *BROKEN_ENCODER="libx264rgb"; //comes with libx264, doesn't take nv12
+const int SKIP=77; //ctest SKIP_RETURN_CODE
+
+#define SESSIONS 3
+
+struct session
+{
+	struct hve *h;
+	struct hve_frame frame;
+	int device; //device set entry the session was placed on
+	int migrations;
+	int migrated_at;
+	int64_t next_pts;
+	uint8_t keyframe[120]; //per pts
+};
+
+static volatile int backend_delay_ms;
+static uint8_t data[64*64*4]; //nv12 and bgr0
+
+int test_spread();
+int test_rebalance();
+int test_rollback();
+int open_session(struct session *s, struct hve_device_set *ds, const char *pixel_format);
+int encode(struct session *sessions, int count, int slow_device);
+int receive_packets(struct session *s);
+int check_migration(struct session *s);
+int expect_sessions(struct hve_device_set *ds, const int *expected, int count);
+void close_sessions(struct session *sessions, int count);
+
+typedef int (*send_frame_fn)(AVCodecContext *avctx, const AVFrame *frame);
+
+int avcodec_send_frame(AVCodecContext *avctx, const AVFrame *frame)
+{
+	static send_frame_fn next;
+
+	if(!next)
+		next = (send_frame_fn)dlsym(RTLD_NEXT, "avcodec_send_frame");
+
+	if(frame && backend_delay_ms)
+		usleep(backend_delay_ms * 1000);
+
+	return next(avctx, frame);
+}
+
+int main(int argc, char* argv[])
+{
+	struct hve_config config = {0};
+	struct hve *h;
+
+	memset(data, 128, sizeof(data));
+
+	if(test_spread() != 0)
+		return 1;
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.encoder = ENCODER;
+
+	if( (h = hve_init(&config)) == NULL )
+	{
+		fprintf(stderr, "%s not available, skipping rebalancing\n", ENCODER);
+		return SKIP;
+	}
+
+	hve_close(h);
+
+	if(test_rebalance() != 0 || test_rollback() != 0)
+		return 1;
+
+	printf("OK\n");
+
+	return 0;
+}
+
+// sessions are placed on devices with least sessions, closing removes them
+int test_spread()
+{
+	struct hve_device_set *ds;
+	struct hve_config config = {0};
+	struct hve *h[6] = {0};
+	int expected[3] = {2, 2, 2}, none[3] = {0}, failed = 0;
+
+	if( (ds = hve_device_set_init()) == NULL )
+		return fprintf(stderr, "failed to initialize device set\n");
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.encoder = SPREAD_ENCODER;
+	config.device_set = ds;
+
+	for(int i = 0; i < SPREAD_DEVICES && !failed; ++i)
+		failed = hve_device_set_add(ds, NULL, NULL) != HVE_OK;
+
+	for(int i = 0; i < SPREAD_SESSIONS && !failed; ++i)
+		failed = (h[i] = hve_init(&config)) == NULL;
+
+	failed = failed || expect_sessions(ds, expected, SPREAD_DEVICES) != 0;
+
+	for(int i = 0; i < SPREAD_SESSIONS; ++i)
+		hve_close(h[i]);
+
+	failed = failed || expect_sessions(ds, none, SPREAD_DEVICES) != 0;
+
+	hve_device_set_close(ds);
+
+	if(failed)
+		return fprintf(stderr, "spread failed\n");
+
+	printf("spread %d sessions over %d devices\n", SPREAD_SESSIONS, SPREAD_DEVICES);
+
+	return 0;
+}
+
+// latency of one device moves one of its sessions to the other at keyframe boundary
+int test_rebalance()
+{
+	struct hve_device_set *ds;
+	struct session sessions[SESSIONS] = {0};
+	int expected_before[2] = {2, 1}, expected_after[2] = {1, 2}, migrations = 0, failed = 0;
+
+	if( (ds = hve_device_set_init()) == NULL )
+		return fprintf(stderr, "failed to initialize device set\n");
+
+	failed = hve_device_set_add(ds, "sim0", NULL) != HVE_OK || hve_device_set_add(ds, "sim1", NULL) != HVE_OK;
+
+	//placed on sim0, sim1, sim0
+	for(int i = 0; i < SESSIONS && !failed; ++i)
+		failed = open_session(&sessions[i], ds, "nv12") != 0;
+
+	failed = failed || expect_sessions(ds, expected_before, 2) != 0;
+
+	//sim0 is slow
+	failed = failed || encode(sessions, SESSIONS, 0) != 0;
+
+	for(int i = 0; i < SESSIONS && !failed; ++i)
+	{
+		failed = check_migration(&sessions[i]) != 0 || (sessions[i].migrations && sessions[i].device != 0);
+		migrations += sessions[i].migrations;
+	}
+
+	failed = failed || migrations != 1 || expect_sessions(ds, expected_after, 2) != 0;
+
+	close_sessions(sessions, SESSIONS);
+	hve_device_set_close(ds);
+
+	if(failed)
+		return fprintf(stderr, "rebalance failed (%d migrations)\n", migrations);
+
+	printf("rebalanced one session from slow device, packets in order\n");
+
+	return 0;
+}
+
+// session that fails to open on the target device stays where it was, accounting too
+int test_rollback()
+{
+	struct hve_device_set *ds;
+	struct session sessions[SESSIONS] = {0};
+	int expected[2] = {2, 1}, failed = 0;
+
+	if( (ds = hve_device_set_init()) == NULL )
+		return fprintf(stderr, "failed to initialize device set\n");
+
+	failed = hve_device_set_add(ds, "sim0", NULL) != HVE_OK || hve_device_set_add(ds, "sim1", BROKEN_ENCODER) != HVE_OK;
+
+	//nv12 on sim0, bgr0 on sim1 (the only format there), nv12 on sim0
+	failed = failed || open_session(&sessions[0], ds, "nv12") != 0 || open_session(&sessions[1], ds, "bgr0") != 0 ||
+	         open_session(&sessions[2], ds, "nv12") != 0;
+
+	failed = failed || sessions[1].device != 1 || expect_sessions(ds, expected, 2) != 0;
+
+	//sim0 is slow, nv12 sessions try to move to sim1 and fail to open there
+	failed = failed || encode(sessions, SESSIONS, 0) != 0;
+
+	for(int i = 0; i < SESSIONS && !failed; ++i)
+		failed = sessions[i].migrations != 0;
+
+	failed = failed || expect_sessions(ds, expected, 2) != 0;
+
+	close_sessions(sessions, SESSIONS);
+	hve_device_set_close(ds);
+
+	if(failed)
+		return fprintf(stderr, "rollback failed\n");
+
+	printf("failed move rolled back, packets in order\n");
+
+	return 0;
+}
+
+// convention 0 on success, finds device the session was placed on
+int open_session(struct session *s, struct hve_device_set *ds, const char *pixel_format)
+{
+	struct hve_config config = {0};
+	int before[2] = {hve_device_set_sessions(ds, 0), hve_device_set_sessions(ds, 1)};
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.gop_size = GOP_SIZE;
+	config.encoder = ENCODER;
+	config.pixel_format = pixel_format;
+	config.device_set = ds;
+
+	if( (s->h = hve_init(&config)) == NULL )
+		return fprintf(stderr, "failed to initialize session\n");
+
+	s->device = hve_device_set_sessions(ds, 0) > before[0] ? 0 : 1;
+
+	s->frame.linesize[0] = strcmp(pixel_format, "bgr0") ? WIDTH : 4 * WIDTH;
+	s->frame.linesize[1] = WIDTH;
+	s->frame.data[0] = data;
+	s->frame.data[1] = data + WIDTH * HEIGHT;
+
+	return 0;
+}
+
+// convention 0 on success, sessions placed on slow_device are delayed until they migrate
+int encode(struct session *sessions, int count, int slow_device)
+{
+	struct hve_stats stats;
+
+	for(int f = 0; f < FRAMES; ++f)
+		for(int i = 0; i < count; ++i)
+		{
+			struct session *s = &sessions[i];
+
+			backend_delay_ms = s->migrations == 0 && s->device == slow_device ? DELAY_MS : 0;
+
+			int failed = hve_send_frame(s->h, &s->frame) != HVE_OK;
+
+			backend_delay_ms = 0;
+
+			if(failed || hve_get_stats(s->h, &stats) != HVE_OK)
+				return fprintf(stderr, "encoding failed\n");
+
+			//this frame went to the encoder on the other device
+			if(stats.migrations > s->migrations)
+			{
+				s->migrations = stats.migrations;
+				s->migrated_at = f;
+			}
+
+			if(receive_packets(s) != 0)
+				return -1;
+		}
+
+	for(int i = 0; i < count; ++i)
+	{
+		if(hve_send_frame(sessions[i].h, NULL) != HVE_OK || receive_packets(&sessions[i]) != 0)
+			return fprintf(stderr, "flushing failed\n");
+
+		//drained packets go first, nothing is lost or reordered while switching devices
+		if(sessions[i].next_pts != FRAMES)
+			return fprintf(stderr, "got %d packets out of %d frames\n", (int)sessions[i].next_pts, FRAMES);
+	}
+
+	return 0;
+}
+
+// convention 0 on success, checks that packets are continuous
+int receive_packets(struct session *s)
+{
+	AVPacket *packet;
+	int failed;
+
+	while( (packet = hve_receive_packet(s->h, &failed)) )
+	{
+		if(packet->pts != s->next_pts)
+			return fprintf(stderr, "expected packet %d, got %d\n", (int)s->next_pts, (int)packet->pts);
+
+		s->keyframe[packet->pts] = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+		++s->next_pts;
+	}
+
+	return failed != HVE_OK ? -1 : 0;
+}
+
+// convention 0 on success, the new encoder starts with IDR at keyframe period boundary
+int check_migration(struct session *s)
+{
+	if(!s->migrations)
+		return 0;
+
+	if(s->migrated_at % GOP_SIZE || !s->keyframe[s->migrated_at])
+		return fprintf(stderr, "move at frame %d not at keyframe boundary\n", s->migrated_at);
+
+	printf("moved at frame %d (keyframe)\n", s->migrated_at);
+
+	return 0;
+}
+
+// convention 0 if devices have expected number of sessions
+int expect_sessions(struct hve_device_set *ds, const int *expected, int count)
+{
+	for(int i = 0; i < count; ++i)
+		if(hve_device_set_sessions(ds, i) != expected[i])
+			return fprintf(stderr, "device %d has %d sessions, expected %d\n", i, hve_device_set_sessions(ds, i), expected[i]);
+
+	return 0;
+}
+
+void close_sessions(struct session *sessions, int count)
+{
+	for(int i = 0; i < count; ++i)
+		hve_close(sessions[i].h);
+}
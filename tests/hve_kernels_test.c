@@ -0,0 +1,167 @@
+/*
+ * HVE Hardware Video Encoder library test of SIMD kernel variants against scalar reference
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+// kernels are internal, test is compiled together with the library source
+#include "../hve.c"
+
+#define MAX_WIDTH 1917 //odd width exercises scalar tails of SIMD variants
+#define CANARY 0xA5 //output past width has to stay untouched
+
+const int TAIL_WIDTHS=67; //every width up to that, then MAX_WIDTH
+
+struct test_buffers
+{
+	uint16_t depth[MAX_WIDTH], ref_depth[MAX_WIDTH], out_depth[MAX_WIDTH + 1]; //+1 for canary
+	uint8_t src[4][4 * MAX_WIDTH]; //4 rows, up to 4 bytes per pixel
+	uint8_t ref[3][4 * MAX_WIDTH]; //scalar output
+	uint8_t out[3][4 * MAX_WIDTH]; //variant output
+	int ref_sums[MAX_WIDTH / 4][4], out_sums[MAX_WIDTH / 4][4];
+};
+
+static struct test_buffers b;
+
+int test_level(const char *level);
+int test_width(const char *level, int width);
+void randomize();
+void reset_output();
+int check(const char *level, const char *kernel, int width, int ok);
+
+int main(int argc, char* argv[])
+{
+	const char *levels[HVE_SIMD_LEVELS];
+	int failed = 0, tested = 0;
+
+	for(int l = HVE_SIMD_SCALAR; l < HVE_SIMD_LEVELS; ++l)
+		levels[l] = HVE_SIMD_NAMES[l];
+
+	srand(0);
+
+	for(int l = HVE_SIMD_SCALAR; l < HVE_SIMD_LEVELS; ++l)
+	{
+		//not supported by this CPU (or architecture)
+		if(!(kernels()->supported & (1 << l)))
+			continue;
+
+		if(hve_simd_force(levels[l]) != HVE_OK)
+			return fprintf(stderr, "failed to force SIMD level %s\n", levels[l]);
+
+		++tested;
+		failed |= test_level(levels[l]);
+	}
+
+	hve_simd_force(NULL);
+
+	printf("%d SIMD level(s) tested: %s\n", tested, failed ? "MISMATCH" : "OK");
+
+	return failed;
+}
+
+int test_level(const char *level)
+{
+	for(int width = 1; width <= TAIL_WIDTHS; ++width)
+		if(test_width(level, width) != 0)
+			return -1;
+
+	return test_width(level, MAX_WIDTH);
+}
+
+// convention 0 on success, negative on mismatch with scalar reference
+int test_width(const char *level, int width)
+{
+	struct hve_kernels *k = kernels();
+	const int order[3] = {2, 1, 0}; //bgr0
+	int ok;
+
+	randomize();
+
+	reset_output();
+	depth_split_row_c(b.depth, b.ref[0], b.ref[1], width);
+	k->depth_split_row(b.depth, b.out[0], b.out[1], width);
+	ok = !memcmp(b.ref, b.out, sizeof(b.ref));
+	if(check(level, "depth_split", width, ok))
+		return -1;
+
+	depth_merge_row_c(b.ref[0], b.ref[1], b.ref_depth, width);
+	memset(b.out_depth, CANARY, sizeof(b.out_depth));
+	k->depth_merge_row(b.ref[0], b.ref[1], b.out_depth, width);
+	ok = !memcmp(b.ref_depth, b.depth, width * sizeof(uint16_t)) &&
+	     !memcmp(b.out_depth, b.ref_depth, width * sizeof(uint16_t)) && b.out_depth[width] == (CANARY << 8 | CANARY);
+	if(check(level, "depth_merge", width, ok))
+		return -1;
+
+	reset_output();
+	rgb32_nv12_row_c(b.src[0], b.src[1], b.ref[0], b.ref[1], b.ref[2], width, order);
+	k->rgb32_nv12_row(b.src[0], b.src[1], b.out[0], b.out[1], b.out[2], width, order);
+	ok = !memcmp(b.ref, b.out, sizeof(b.ref));
+	if(check(level, "rgb32_nv12", width, ok))
+		return -1;
+
+	reset_output();
+	uv_interleave_row_c(b.src[0], b.src[1], b.ref[0], width);
+	k->uv_interleave_row(b.src[0], b.src[1], b.out[0], width);
+	ok = !memcmp(b.ref, b.out, sizeof(b.ref));
+	if(check(level, "uv_interleave", width, ok))
+		return -1;
+
+	if(width / 4)
+	{
+		memset(b.ref_sums, 0, sizeof(b.ref_sums));
+		memset(b.out_sums, 0, sizeof(b.out_sums));
+		ssim_4x4_row_c(b.src[0], sizeof(b.src[0]) / 2, b.src[2], sizeof(b.src[0]) / 2, width / 4, b.ref_sums);
+		k->ssim_4x4_row(b.src[0], sizeof(b.src[0]) / 2, b.src[2], sizeof(b.src[0]) / 2, width / 4, b.out_sums);
+		ok = !memcmp(b.ref_sums, b.out_sums, sizeof(b.ref_sums));
+		if(check(level, "ssim_4x4", width, ok))
+			return -1;
+	}
+
+	reset_output();
+	downscale2_row_c(b.src[0], b.src[1], b.ref[0], width);
+	k->downscale2_row(b.src[0], b.src[1], b.out[0], width);
+	ok = !memcmp(b.ref, b.out, sizeof(b.ref));
+	if(check(level, "downscale2", width, ok))
+		return -1;
+
+	reset_output();
+	downscale2_uv_row_c(b.src[0], b.src[1], b.ref[0], width);
+	k->downscale2_uv_row(b.src[0], b.src[1], b.out[0], width);
+	ok = !memcmp(b.ref, b.out, sizeof(b.ref));
+	if(check(level, "downscale2_uv", width, ok))
+		return -1;
+
+	return 0;
+}
+
+void randomize()
+{
+	uint8_t *src = &b.src[0][0];
+
+	for(int i = 0; i < MAX_WIDTH; ++i)
+		b.depth[i] = (uint16_t)rand();
+
+	//extremes make saturation and rounding differences visible
+	for(size_t i = 0; i < sizeof(b.src); ++i)
+		src[i] = rand() % 4 ? (uint8_t)rand() : (rand() % 2 ? 255 : 0);
+}
+
+void reset_output()
+{
+	memset(b.ref, CANARY, sizeof(b.ref));
+	memset(b.out, CANARY, sizeof(b.out));
+}
+
+int check(const char *level, const char *kernel, int width, int ok)
+{
+	if(ok)
+		return 0;
+
+	fprintf(stderr, "%s %s differs from scalar reference for width %d\n", level, kernel, width);
+	return -1;
+}
@@ -0,0 +1,224 @@
+/*
+ * HVE Hardware Video Encoder library test of live migration under injected backend delay
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+// Backend delay is injected by avcodec_send_frame interposed below,
+// it sleeps inside the encode path like saturated encoder would.
+
+#define _GNU_SOURCE //RTLD_NEXT
+
+#include <stdio.h> //printf, fprintf
+#include <string.h> //memset
+#include <inttypes.h> //uint8_t
+#include <unistd.h> //usleep
+#include <dlfcn.h> //dlsym
+
+#include "../hve.h"
+
+const int WIDTH=64;
+const int HEIGHT=64;
+const int FRAMERATE=10; //migration is considered after a second of frames
+const int GOP_SIZE=10; //migration happens only at keyframe period boundary
+const int FRAMES=200;
+const int SLOW_CONSUMER_FRAMES=60;
+const int LATENCY_MS=50; //migrate_latency_ms
+const int DELAY_MS=60; //injected in encoder or consumer
+const char *PIXEL_FORMAT="nv12";
+const char *ENCODER="libx264"; //software, available in most FFmpeg builds, default lookahead
+const char *MIGRATE_ENCODER="libx264"; //the same codec keeps the stream continuous
+const int SKIP=77; //ctest SKIP_RETURN_CODE
+
+static volatile int backend_delay_ms;
+
+int slow_consumer(struct hve_config *config);
+int slow_backend(struct hve_config *config);
+int encode(struct hve *h, int frames, int consumer_delay_ms, int *migrated_at, int *migrations);
+int receive_packets(struct hve *h, int delay_ms, int64_t *next_pts, int64_t *keyframes, int *count);
+
+typedef int (*send_frame_fn)(AVCodecContext *avctx, const AVFrame *frame);
+
+int avcodec_send_frame(AVCodecContext *avctx, const AVFrame *frame)
+{
+	static send_frame_fn next;
+
+	if(!next)
+		next = (send_frame_fn)dlsym(RTLD_NEXT, "avcodec_send_frame");
+
+	if(frame && backend_delay_ms)
+		usleep(backend_delay_ms * 1000);
+
+	return next(avctx, frame);
+}
+
+int main(int argc, char* argv[])
+{
+	struct hve_config config = {0};
+	struct hve *h;
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.gop_size = GOP_SIZE;
+	config.pixel_format = PIXEL_FORMAT;
+	config.encoder = ENCODER;
+	config.migrate_encoder = MIGRATE_ENCODER;
+	config.migrate_latency_ms = LATENCY_MS;
+
+	if( (h = hve_init(&config)) == NULL )
+	{
+		fprintf(stderr, "%s not available, skipping\n", ENCODER);
+		return SKIP;
+	}
+
+	hve_close(h);
+
+	if(slow_consumer(&config) != 0 || slow_backend(&config) != 0)
+		return 1;
+
+	printf("OK\n");
+
+	return 0;
+}
+
+// application polling late and encoder lookahead are not backend latency
+int slow_consumer(struct hve_config *config)
+{
+	int migrated_at[200], migrations = 0;
+	struct hve *h;
+
+	if( (h = hve_init(config)) == NULL )
+		return fprintf(stderr, "failed to initialize encoder\n");
+
+	int failed = encode(h, SLOW_CONSUMER_FRAMES, DELAY_MS, migrated_at, &migrations);
+
+	hve_close(h);
+
+	if(failed)
+		return failed;
+
+	if(migrations)
+		return fprintf(stderr, "slow consumer triggered migration at frame %d\n", migrated_at[0]);
+
+	printf("slow consumer, %d frames without migration\n", SLOW_CONSUMER_FRAMES);
+
+	return 0;
+}
+
+int slow_backend(struct hve_config *config)
+{
+	int migrated_at[200], migrations = 0;
+	struct hve *h;
+
+	if( (h = hve_init(config)) == NULL )
+		return fprintf(stderr, "failed to initialize encoder\n");
+
+	//the first encoder is saturated, delay is lifted once the session migrates
+	backend_delay_ms = DELAY_MS;
+
+	int failed = encode(h, FRAMES, 0, migrated_at, &migrations);
+
+	backend_delay_ms = 0;
+
+	hve_close(h);
+
+	if(failed)
+		return failed;
+
+	if(migrations == 0)
+		return fprintf(stderr, "no migration with backend latency above %d ms\n", LATENCY_MS);
+
+	printf("slow backend, %d packets in order, %d migration(s)\n", FRAMES, migrations);
+
+	return 0;
+}
+
+// convention 0 on success, checks that packets are continuous and migrations happen at IDR
+int encode(struct hve *h, int frames, int consumer_delay_ms, int *migrated_at, int *migrations)
+{
+	struct hve_frame frame = { {0} };
+	struct hve_stats stats;
+	static uint8_t data[64*64*3/2];
+	static int64_t keyframes[200]; //pts of keyframes
+	int64_t next_pts = 0;
+	int keyframes_count = 0, f;
+
+	frame.linesize[0] = frame.linesize[1] = WIDTH;
+	frame.data[0] = data;
+	frame.data[1] = data + WIDTH * HEIGHT;
+
+	for(f = 0; f < frames; ++f)
+	{
+		memset(data, f % 255, WIDTH * HEIGHT);
+
+		if(hve_send_frame(h, &frame) != HVE_OK)
+			break;
+
+		if(hve_get_stats(h, &stats) != HVE_OK)
+			break;
+
+		//migration drained the old encoder and this frame went to the new one
+		if(stats.migrations > *migrations)
+		{
+			migrated_at[(*migrations)++] = f;
+			backend_delay_ms = 0;
+		}
+
+		if(receive_packets(h, consumer_delay_ms, &next_pts, keyframes, &keyframes_count) != 0)
+			break;
+	}
+
+	hve_send_frame(h, NULL);
+
+	if(f < frames || receive_packets(h, 0, &next_pts, keyframes, &keyframes_count) != 0)
+		return fprintf(stderr, "encoding failed\n");
+
+	//drained packets go first, nothing is lost or reordered while switching encoders
+	if(next_pts != frames)
+		return fprintf(stderr, "got %d packets out of %d frames\n", (int)next_pts, frames);
+
+	for(int m = 0; m < *migrations; ++m)
+	{
+		int keyframe = 0;
+
+		for(int k = 0; k < keyframes_count && !keyframe; ++k)
+			keyframe = keyframes[k] == migrated_at[m];
+
+		//the new encoder starts with IDR at keyframe period boundary
+		if(migrated_at[m] % GOP_SIZE || !keyframe)
+			return fprintf(stderr, "migration at frame %d not at keyframe boundary\n", migrated_at[m]);
+
+		printf("migrated at frame %d (keyframe)\n", migrated_at[m]);
+	}
+
+	return 0;
+}
+
+// convention 0 on success, checks that packets are continuous
+int receive_packets(struct hve *h, int delay_ms, int64_t *next_pts, int64_t *keyframes, int *count)
+{
+	AVPacket *packet;
+	int failed;
+
+	if(delay_ms)
+		usleep(delay_ms * 1000);
+
+	while( (packet = hve_receive_packet(h, &failed)) )
+	{
+		if(packet->pts != *next_pts)
+			return fprintf(stderr, "expected packet %d, got %d\n", (int)*next_pts, (int)packet->pts);
+
+		if(packet->flags & AV_PKT_FLAG_KEY)
+			keyframes[(*count)++] = packet->pts;
+
+		++*next_pts;
+	}
+
+	return failed != HVE_OK ? -1 : 0;
+}
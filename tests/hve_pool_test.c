@@ -0,0 +1,278 @@
+/*
+ * HVE Hardware Video Encoder library test of session pool
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+// Encoder contexts are counted by avcodec_alloc_context3/avcodec_free_context interposed below.
+// Draining (flush) is slowed down by interposed avcodec_send_frame so that background
+// teardown is still in progress when hve_pool_close is called.
+
+#define _GNU_SOURCE //RTLD_NEXT
+
+#include <stdio.h> //printf, fprintf
+#include <string.h> //memset
+#include <inttypes.h> //uint8_t
+#include <unistd.h> //usleep
+#include <dlfcn.h> //dlsym
+
+#include "../hve.h"
+
+const int WIDTH=64;
+const int HEIGHT=64;
+const int FRAMERATE=30;
+const int GOP_SIZE=30; //longer than frames encoded, the only IDR is the first one
+const int FRAMES=20;
+const int BIT_RATE=200000;
+const int OTHER_BIT_RATE=400000; //config that doesn't match parked session
+const int TEARDOWN_SESSIONS=3;
+const int TEARDOWN_PARKED=1; //the rest is closed on pool thread
+const int FLUSH_DELAY_MS=100; //injected in draining
+const int PARK_TIMEOUT_MS=5000;
+const char *PIXEL_FORMAT="nv12";
+const char *ENCODER="libx264"; //software with lookahead, skipped if not available
+const int SKIP=77; //ctest SKIP_RETURN_CODE
+
+static volatile int flush_delay_ms;
+static volatile int contexts; //encoder contexts alive
+static uint8_t data[64*64*3/2];
+
+int test_reuse(struct hve_config *config);
+int test_teardown(struct hve_config *config);
+int wait_parked(struct hve_pool *pool, int parked);
+int expect_clean_stats(struct hve *h);
+int encode(struct hve *h, int frames, int receive);
+
+typedef int (*send_frame_fn)(AVCodecContext *avctx, const AVFrame *frame);
+typedef AVCodecContext *(*alloc_context_fn)(const AVCodec *codec);
+typedef void (*free_context_fn)(AVCodecContext **avctx);
+
+int avcodec_send_frame(AVCodecContext *avctx, const AVFrame *frame)
+{
+	static send_frame_fn next;
+
+	if(!next)
+		next = (send_frame_fn)dlsym(RTLD_NEXT, "avcodec_send_frame");
+
+	if(!frame && flush_delay_ms)
+		usleep(flush_delay_ms * 1000);
+
+	return next(avctx, frame);
+}
+
+AVCodecContext *avcodec_alloc_context3(const AVCodec *codec)
+{
+	static alloc_context_fn next;
+	AVCodecContext *avctx;
+
+	if(!next)
+		next = (alloc_context_fn)dlsym(RTLD_NEXT, "avcodec_alloc_context3");
+
+	if( (avctx = next(codec)) )
+		__atomic_add_fetch(&contexts, 1, __ATOMIC_SEQ_CST);
+
+	return avctx;
+}
+
+void avcodec_free_context(AVCodecContext **avctx)
+{
+	static free_context_fn next;
+
+	if(!next)
+		next = (free_context_fn)dlsym(RTLD_NEXT, "avcodec_free_context");
+
+	if(avctx && *avctx)
+		__atomic_sub_fetch(&contexts, 1, __ATOMIC_SEQ_CST);
+
+	next(avctx);
+}
+
+int main(int argc, char* argv[])
+{
+	struct hve_config config = {0};
+	struct hve *h;
+
+	memset(data, 128, sizeof(data));
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.gop_size = GOP_SIZE;
+	config.bit_rate = BIT_RATE;
+	config.pixel_format = PIXEL_FORMAT;
+	config.encoder = ENCODER;
+
+	if( (h = hve_init(&config)) == NULL )
+	{
+		fprintf(stderr, "%s not available, skipping\n", ENCODER);
+		return SKIP;
+	}
+
+	hve_close(h);
+
+	if(test_reuse(&config) != 0 || test_teardown(&config) != 0)
+		return 1;
+
+	printf("OK\n");
+
+	return 0;
+}
+
+// matching config takes parked session, clean as new, mismatched config doesn't
+int test_reuse(struct hve_config *config)
+{
+	struct hve_config other = *config;
+	struct hve *h, *first, *mismatched = NULL;
+	int failed = 0;
+
+	if( (config->pool = hve_pool_init(0)) == NULL )
+		return fprintf(stderr, "failed to initialize pool\n");
+
+	other.pool = config->pool;
+	other.bit_rate = OTHER_BIT_RATE;
+
+	//packets left in session (queued and in encoder) are not seen by the next user
+	failed = (first = hve_init(config)) == NULL || encode(first, FRAMES, 0) != 0;
+
+	if(first)
+		hve_close(first);
+
+	failed = failed || wait_parked(config->pool, 1) != 0;
+
+	if(!failed && (mismatched = hve_init(&other)) != NULL)
+	{
+		if(mismatched == first || hve_pool_parked(config->pool) != 1)
+			failed = fprintf(stderr, "session with other bit_rate was reused\n");
+
+		hve_close(mismatched);
+	}
+
+	failed = failed || mismatched == NULL || wait_parked(config->pool, 2) != 0;
+
+	if(!failed && (h = hve_init(config)) != NULL)
+	{
+		if(h != first || hve_pool_parked(config->pool) != 1)
+			failed = fprintf(stderr, "parked session with matching config was not reused\n");
+
+		failed = failed || expect_clean_stats(h) != 0 || encode(h, FRAMES, 1) != 0;
+
+		hve_close(h);
+	}
+
+	hve_pool_close(config->pool);
+	config->pool = NULL;
+
+	if(failed)
+		return fprintf(stderr, "reuse failed\n");
+
+	printf("reused session starts with IDR at pts 0, mismatched config not reused\n");
+
+	return 0;
+}
+
+// hve_close returns immediately, hve_pool_close waits for background teardown
+int test_teardown(struct hve_config *config)
+{
+	struct hve *h[3] = {0};
+	int failed = 0;
+
+	if( (config->pool = hve_pool_init(TEARDOWN_PARKED)) == NULL )
+		return fprintf(stderr, "failed to initialize pool\n");
+
+	//queued packets are charged to memory budget until discarded
+	for(int i = 0; i < TEARDOWN_SESSIONS && !failed; ++i)
+		failed = (h[i] = hve_init(config)) == NULL || encode(h[i], FRAMES, 0) != 0;
+
+	flush_delay_ms = FLUSH_DELAY_MS;
+
+	for(int i = 0; i < TEARDOWN_SESSIONS; ++i)
+		hve_close(h[i]);
+
+	hve_pool_close(config->pool);
+	config->pool = NULL;
+
+	flush_delay_ms = 0;
+
+	if(failed)
+		return fprintf(stderr, "encoding failed\n");
+
+	if(contexts != 0 || hve_memory_used() != 0)
+		return fprintf(stderr, "teardown not finished, %d encoders and %zu bytes left\n", contexts, hve_memory_used());
+
+	printf("teardown of %d sessions finished before pool close\n", TEARDOWN_SESSIONS);
+
+	return 0;
+}
+
+// convention 0 on success, sessions are parked asynchronously after hve_close
+int wait_parked(struct hve_pool *pool, int parked)
+{
+	for(int ms = 0; ms < PARK_TIMEOUT_MS; ms += 10)
+	{
+		if(hve_pool_parked(pool) == parked)
+			return 0;
+
+		usleep(10 * 1000);
+	}
+
+	return fprintf(stderr, "expected %d parked sessions, got %d\n", parked, hve_pool_parked(pool));
+}
+
+// convention 0 if session looks like new one
+int expect_clean_stats(struct hve *h)
+{
+	struct hve_stats stats;
+
+	if(hve_get_stats(h, &stats) != HVE_OK)
+		return fprintf(stderr, "failed to get stats\n");
+
+	if(stats.frames || stats.packets || stats.latency_us || stats.latency_max_us ||
+	   stats.migrations || stats.sched_wait_us || stats.sched_wait_max_us || stats.filler_packets)
+		return fprintf(stderr, "reused session has stats of previous user\n");
+
+	return 0;
+}
+
+// convention 0 on success, with receive checks continuous packets starting with IDR at pts 0
+int encode(struct hve *h, int frames, int receive)
+{
+	struct hve_frame frame = { {0} };
+	AVPacket *packet;
+	int64_t next_pts = 0;
+	int failed = HVE_OK;
+
+	frame.linesize[0] = frame.linesize[1] = WIDTH;
+	frame.data[0] = data;
+	frame.data[1] = data + WIDTH * HEIGHT;
+
+	for(int f = 0; f < frames; ++f)
+		if(hve_send_frame(h, &frame) != HVE_OK)
+			return fprintf(stderr, "failed to send frame\n");
+
+	if(!receive)
+		return 0;
+
+	if(hve_send_frame(h, NULL) != HVE_OK)
+		return fprintf(stderr, "failed to flush encoder\n");
+
+	while( (packet = hve_receive_packet(h, &failed)) )
+	{
+		if(packet->pts != next_pts)
+			return fprintf(stderr, "expected packet %d, got %d\n", (int)next_pts, (int)packet->pts);
+
+		if(next_pts == 0 && !(packet->flags & AV_PKT_FLAG_KEY))
+			return fprintf(stderr, "first packet is not keyframe\n");
+
+		++next_pts;
+	}
+
+	if(failed != HVE_OK || next_pts != frames)
+		return fprintf(stderr, "got %d packets out of %d frames\n", (int)next_pts, frames);
+
+	return 0;
+}
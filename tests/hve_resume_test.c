@@ -0,0 +1,181 @@
+/*
+ * HVE Hardware Video Encoder library test of suspend and resume
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+// Times hve_init against hve_resume and checks that encoding resumes with IDR.
+// Hardware encoder is used if available, there resume skips device creation.
+// With software encoder timings are only reported (both open the codec).
+
+#include <stdio.h> //printf, fprintf
+#include <string.h> //memset
+#include <inttypes.h> //uint8_t
+
+#include "../hve.h"
+
+#include <libavutil/time.h> //av_gettime_relative
+
+const int WIDTH=640;
+const int HEIGHT=360;
+const int FRAMERATE=30;
+const int GOP_SIZE=300; //longer than frames encoded, IDR after resume is not periodic
+const int FRAMES=30; //per cycle
+const int CYCLES=5;
+const char *PIXEL_FORMAT="nv12";
+const char *HW_ENCODER="h264_vaapi"; //default device
+const char *SW_ENCODER="libx264";
+const int SKIP=77; //ctest SKIP_RETURN_CODE
+
+static uint8_t data[640*360*3/2];
+
+int encode(struct hve *h, int64_t *next_pts);
+int receive_packets(struct hve *h, int64_t first_pts, int64_t *next_pts);
+int64_t median(int64_t *values, int count);
+
+int main(int argc, char* argv[])
+{
+	struct hve_config config = {0};
+	struct hve *h;
+	int64_t init_us[5], resume_us[5], next_pts = 0, start;
+	int hardware = 1, failed = 0;
+
+	memset(data, 128, sizeof(data));
+
+	config.width = WIDTH;
+	config.height = HEIGHT;
+	config.framerate = FRAMERATE;
+	config.gop_size = GOP_SIZE;
+	config.pixel_format = PIXEL_FORMAT;
+	config.encoder = HW_ENCODER;
+
+	if( (h = hve_init(&config)) == NULL )
+	{
+		hardware = 0;
+		config.encoder = SW_ENCODER;
+
+		if( (h = hve_init(&config)) == NULL )
+		{
+			fprintf(stderr, "neither %s nor %s available, skipping\n", HW_ENCODER, SW_ENCODER);
+			return SKIP;
+		}
+	}
+
+	hve_close(h);
+
+	for(int i = 0; i < CYCLES; ++i)
+	{
+		start = av_gettime_relative();
+		h = hve_init(&config);
+		init_us[i] = av_gettime_relative() - start;
+
+		if(h == NULL)
+			return fprintf(stderr, "failed to initialize encoder\n");
+
+		hve_close(h);
+	}
+
+	if( (h = hve_init(&config)) == NULL )
+		return fprintf(stderr, "failed to initialize encoder\n");
+
+	failed = encode(h, &next_pts) != 0;
+
+	for(int i = 0; i < CYCLES && !failed; ++i)
+	{
+		//encode left the encoder suspended
+		start = av_gettime_relative();
+		failed = hve_resume(h) != HVE_OK;
+		resume_us[i] = av_gettime_relative() - start;
+
+		//the first packet after resume continues pts and is IDR
+		failed = failed || encode(h, &next_pts) != 0;
+	}
+
+	hve_close(h);
+
+	if(failed)
+		return fprintf(stderr, "suspend/resume failed\n");
+
+	int64_t init = median(init_us, CYCLES), resume = median(resume_us, CYCLES);
+
+	printf("%s: hve_init %d us, hve_resume %d us (median of %d)\n", config.encoder, (int)init, (int)resume, CYCLES);
+
+	//resume keeps the hardware device, it has to beat full initialization there
+	if(hardware && resume >= init)
+		return fprintf(stderr, "hve_resume is not faster than hve_init\n");
+
+	printf("OK\n");
+
+	return 0;
+}
+
+// convention 0 on success, encodes a cycle checking that it starts with keyframe and suspends
+int encode(struct hve *h, int64_t *next_pts)
+{
+	struct hve_frame frame = { {0} };
+	int64_t first_pts = *next_pts;
+
+	frame.linesize[0] = frame.linesize[1] = WIDTH;
+	frame.data[0] = data;
+	frame.data[1] = data + WIDTH * HEIGHT;
+
+	for(int f = 0; f < FRAMES; ++f)
+	{
+		if(hve_send_frame(h, &frame) != HVE_OK)
+			return fprintf(stderr, "failed to send frame\n");
+
+		if(receive_packets(h, first_pts, next_pts) != 0)
+			return -1;
+	}
+
+	//packets of frames still in encoder come out after suspending
+	if(hve_suspend(h) != HVE_OK)
+		return fprintf(stderr, "failed to suspend encoder\n");
+
+	if(receive_packets(h, first_pts, next_pts) != 0)
+		return -1;
+
+	if(*next_pts != first_pts + FRAMES)
+		return fprintf(stderr, "got %d packets out of %d frames\n", (int)(*next_pts - first_pts), FRAMES);
+
+	return 0;
+}
+
+// convention 0 on success, checks that packets are continuous and the cycle starts with keyframe
+int receive_packets(struct hve *h, int64_t first_pts, int64_t *next_pts)
+{
+	AVPacket *packet;
+	int failed;
+
+	while( (packet = hve_receive_packet(h, &failed)) )
+	{
+		if(packet->pts != *next_pts)
+			return fprintf(stderr, "expected packet %d, got %d\n", (int)*next_pts, (int)packet->pts);
+
+		if(packet->pts == first_pts && !(packet->flags & AV_PKT_FLAG_KEY))
+			return fprintf(stderr, "packet %d (first of cycle) is not keyframe\n", (int)packet->pts);
+
+		++*next_pts;
+	}
+
+	return failed != HVE_OK ? -1 : 0;
+}
+
+int64_t median(int64_t *values, int count)
+{
+	//insertion sort, a few values
+	for(int i = 1; i < count; ++i)
+		for(int j = i; j > 0 && values[j - 1] > values[j]; --j)
+		{
+			int64_t tmp = values[j];
+			values[j] = values[j - 1];
+			values[j - 1] = tmp;
+		}
+
+	return values[count / 2];
+}